@@ -0,0 +1,21 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming state of the XXH64 hash
+typedef struct {
+    uint64_t total_len;
+    uint64_t acc[4];
+    unsigned char buf[32];
+    size_t buf_len;
+    uint64_t seed;
+} Xxh64State;
+
+void xxh64_init(Xxh64State *state, uint64_t seed);
+void xxh64_update(Xxh64State *state, const void *data, size_t len);
+uint64_t xxh64_digest(Xxh64State *state);
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif
@@ -2,6 +2,8 @@
 #define NETWORK_IO_H
 
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define IO_INVALID -3
 #define IO_TIMEOUT -2
@@ -11,5 +13,12 @@
 int read_bytes(int fd, char *buf, int timeout, size_t n_bytes);
 int write_bytes(int fd, char *buf, int timeout, size_t n_bytes);
 int write_file(int fd, char *filepath, int timeout);
+int write_file_fd(int fd, int file, off_t offset, size_t n_bytes, int timeout);
+int write_file_fd_drop(int fd, int file, off_t offset, size_t n_bytes, int timeout, unsigned long long *dropped);
+int write_file_mmap(int fd, int file, off_t offset, size_t n_bytes, int timeout, unsigned long long *dropped);
+int write_iovec(int fd, struct iovec *iov, int iovcnt, int timeout);
+int write_iovec_zerocopy(int fd, struct iovec *iov, int iovcnt, int timeout, int *copied);
+int read_file_fd(int file, char *buf, off_t offset, size_t n_bytes);
+int set_tcp_cork(int fd, int on);
 
 #endif
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <sys/time.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -31,5 +32,7 @@ void str_to_lowercase(char *str);
 int write_to_file(char *buf, char *filepath, size_t len);
 char is_dir_empty(const char *dir_path);
 long ceil_division(long a, long b);
+uint64_t hash_string(const char *str);
+int open_beneath(int dir_fd, const char *path, int flags);
 
 #endif
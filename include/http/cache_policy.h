@@ -0,0 +1,58 @@
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+#include <stdint.h>
+
+#define CP_EXT_BUCKETS 64
+
+/*
+ * How long a response may be cached downstream. The fields are rendered
+ * once, when the policy is loaded.
+ */
+typedef struct {
+    long max_age;
+    int immutable;
+
+    // "Cache-Control: ...\r\n", and an Expires field in the past if the
+    // response must be revalidated
+    char *fields;
+} CacheRule;
+
+// A "*.<ext>" rule, in the extension hash
+typedef struct cp_ext {
+    char *ext;
+    uint64_t hash;
+    CacheRule *rule;
+
+    struct cp_ext *next;
+} CpExt;
+
+// A node of the prefix trie; the rule, if any, is the one of the prefix
+// that ends at the node
+typedef struct cp_node {
+    char c;
+    CacheRule *rule;
+
+    struct cp_node *child;
+    struct cp_node *sibling;
+} CpNode;
+
+/*
+ * Rules mapping paths to caching fields, loaded from a policy file. The
+ * longest matching "/<prefix>" rule wins, then the "*.<ext>" rule of the
+ * file extension, then the "*" rule.
+ */
+typedef struct {
+    CpNode *trie;
+    CpExt *exts[CP_EXT_BUCKETS];
+    CacheRule *fallback;
+
+    int n_rules;
+} CachePolicy;
+
+CachePolicy *cache_policy_load(const char *path);
+const CacheRule *cache_policy_match(const CachePolicy *policy, const char *path);
+const char *cache_rule_fields(const CacheRule *rule);
+void cache_policy_free(CachePolicy *policy);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef CONDITIONAL_H
+#define CONDITIONAL_H
+
+int etag_list_matches(const char *list, const char *etag);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+// Content codings we can serve, in order of preference
+#define ENC_IDENTITY 0
+#define ENC_BR       1
+#define ENC_GZIP     2
+#define ENC_DEFLATE  3
+#define N_ENCODINGS  4
+
+// Bit of an encoding in the mask returned by parse_accept_encoding
+#define ENC_BIT(enc) (1 << (enc))
+
+extern const char * const encoding_names[N_ENCODINGS];
+extern const char * const encoding_suffixes[N_ENCODINGS];
+extern const char * const encoding_headers[N_ENCODINGS];
+
+int parse_accept_encoding(const char *value);
+
+#endif
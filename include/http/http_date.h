@@ -0,0 +1,13 @@
+#ifndef HTTP_DATE_H
+#define HTTP_DATE_H
+
+#include <time.h>
+
+// Length of an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_LEN 29
+
+void format_http_date(time_t t, char *dest);
+void http_date_now(char *dest);
+int parse_http_date(const char *str, time_t *dest);
+
+#endif
@@ -14,6 +14,7 @@ typedef enum {
     NOT_FOUND,
     FORBIDDEN,
     TIMEOUT,
+    SERVICE_UNAVAILABLE,
     
     // Response errors
     BAD_RESPONSE,
@@ -0,0 +1,7 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+const char *mime_type(const char *path);
+int mime_compressible(const char *type);
+
+#endif
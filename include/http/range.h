@@ -0,0 +1,20 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <sys/types.h>
+
+// Requests with more ranges than this are served whole
+#define MAX_RANGES 16
+
+// Returned when none of the requested ranges overlaps the file
+#define RANGE_UNSATISFIABLE -1
+
+// An inclusive range of bytes
+typedef struct {
+    off_t start;
+    off_t end;
+} ByteRange;
+
+int parse_range(const char *value, off_t size, ByteRange *ranges, int max_ranges);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef RESPONSE_MESSAGES_H
+#define RESPONSE_MESSAGES_H
+
+#include <sys/uio.h>
+
+#include "http_types.h"
+
+extern const char * const response_messages[];
+extern const char * const chunked_response;
+extern const char * const partial_response;
+extern const char * const multipart_response;
+extern const char * const multipart_part;
+extern const char * const multipart_end;
+extern const char * const range_not_satisfiable_response;
+extern const char * const not_modified_response;
+
+int err_response_iov(HttpError err, char *date, struct iovec *iov);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef BODY_STORE_H
+#define BODY_STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define BS_SHARDS  16
+#define BS_BUCKETS 1024
+
+struct body_shard;
+
+/*
+ * A file body, held once however many paths have the same content.
+ * Immutable once stored.
+ */
+typedef struct stored_body {
+    char *data;
+    size_t len;
+    uint64_t hash;
+
+    // Cache entries pointing at the body. Changed under the shard lock.
+    int refs;
+
+    // The cached entry the body is charged to (NULL if none), and the
+    // counter it is charged to when its payer left while other entries
+    // still point at it (NULL if none). Changed under the shard lock.
+    const void *payer;
+    size_t *unpaid;
+
+    struct body_shard *shard;
+    struct stored_body *next;
+} StoredBody;
+
+typedef struct body_shard {
+    pthread_mutex_t lock;
+
+    StoredBody *buckets[BS_BUCKETS];
+
+    // Bytes held, and bytes the entries would hold without deduplication
+    size_t bytes;
+    size_t ref_bytes;
+
+    unsigned long long n_bodies;
+    unsigned long long dedup_hits;
+} BodyShard;
+
+/*
+ * Content addressed store of cached bodies. Bodies are found by a hash of
+ * their content, and compared byte by byte before they are shared.
+ */
+typedef struct {
+    BodyShard shards[BS_SHARDS];
+} BodyStore;
+
+typedef struct {
+    unsigned long long n_bodies;
+    unsigned long long dedup_hits;
+
+    size_t bytes;
+    size_t ref_bytes;
+} BodyStoreStats;
+
+BodyStore *body_store_create(void);
+StoredBody *body_store_intern(BodyStore *store, char *data, size_t len);
+int body_store_claim(StoredBody *body, const void *payer);
+void body_store_unclaim(StoredBody *body, const void *payer, size_t *unpaid);
+void body_store_release(StoredBody *body);
+void get_body_store_stats(BodyStore *store, BodyStoreStats *dest);
+void body_store_destroy(BodyStore *store);
+
+#endif
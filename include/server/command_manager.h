@@ -7,6 +7,17 @@
 #define CMD_SHUTDOWN 10
 #define CMD_STATS     9
 #define CMD_UNKNOWN   8
+#define CMD_STAGES   11
+#define CMD_CACHE    12
+#define CMD_FDCACHE  13
+#define CMD_PRECOMPRESS 14
+#define CMD_INDEX    15
+#define CMD_NEGCACHE 16
+#define CMD_RELOADPACK 17
+#define CMD_WARM     18
+#define CMD_LOCALCACHE 19
+#define CMD_RELOADROOT 20
+#define CMD_RATELIMIT 21
 
 int accept_command(int fd, ServerResources *server);
 
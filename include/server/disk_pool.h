@@ -0,0 +1,56 @@
+#ifndef DISK_POOL_H
+#define DISK_POOL_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+// Bytes read ahead of the body to tell if it is in the page cache
+#define DISK_PROBE_SZ (16 * 1024)
+
+/*
+ * Pool of threads for the responses whose file is not in the page cache.
+ * Network workers probe the file without blocking, and only hand the
+ * response over when the read would have to wait for the disk, so they
+ * keep serving cached files while cold reads are in flight.
+ */
+typedef struct {
+    thread_pool *pool;
+
+    // Statistics
+    pthread_mutex_t lock;
+
+    unsigned long long n_processed;
+
+    // Total time responses spent queued in front of, and running in the pool
+    unsigned long long wait_usec;
+    unsigned long long service_usec;
+
+    // Probes that found the file resident, responses handed to the pool,
+    // and cold responses written inline because its queue was full
+    unsigned long long resident;
+    unsigned long long deferred;
+    unsigned long long overflows;
+} DiskPool;
+
+typedef struct {
+    int n_threads;
+    int queued;
+
+    unsigned long long n_processed;
+    unsigned long long wait_usec;
+    unsigned long long service_usec;
+
+    unsigned long long resident;
+    unsigned long long deferred;
+    unsigned long long overflows;
+} DiskPoolStats;
+
+DiskPool *disk_pool_create(int n_threads, int queue_sz);
+int disk_pool_probe(DiskPool *disk, int file, off_t offset, off_t size);
+int disk_pool_submit(DiskPool *disk, void (*handler)(void*), void *arg);
+int get_disk_pool_stats(DiskPool *disk, DiskPoolStats *dest);
+void disk_pool_destroy(DiskPool *disk);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef FD_CACHE_H
+#define FD_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "encoding.h"
+
+#define FDC_SHARDS  16
+#define FDC_BUCKETS 256
+
+/*
+ * An open file, resolved from a request path. The fd stays open for as
+ * long as anyone holds a reference, even after the entry is evicted.
+ */
+typedef struct fd_entry {
+    // Request path, as received
+    char *key;
+    uint64_t hash;
+
+    // Open, read only, file descriptor
+    int fd;
+
+    // Metadata of the file, and its absolute path
+    struct stat f_stats;
+    char *full_path;
+
+    // Version of the root the path was resolved in, and the length of the
+    // root directory at the start of full_path
+    unsigned long root_gen;
+    size_t root_len;
+
+    // Pre-rendered OK response header, with room for the date at date_offset
+    char *header;
+    size_t header_len;
+    size_t date_offset;
+
+    // Precompressed copies of the file, by encoding (NULL if there is none).
+    // They are owned by the entry.
+    struct fd_entry *variants[N_ENCODINGS];
+
+    // When the path was last resolved (monotonic)
+    struct timespec t_resolved;
+
+    // References held by the cache and by requests
+    int refs;
+
+    // Hash chain
+    struct fd_entry *h_next;
+
+    // LRU list, most recently used first
+    struct fd_entry *prev;
+    struct fd_entry *next;
+} FdEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    FdEntry *buckets[FDC_BUCKETS];
+
+    FdEntry *head;
+    FdEntry *tail;
+
+    int n_entries;
+    int max_entries;
+
+    // Statistics
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long expired;
+    unsigned long long evictions;
+} FdShard;
+
+typedef struct {
+    FdShard shards[FDC_SHARDS];
+
+    // Entries older than this are resolved again
+    long ttl_ms;
+} FdCache;
+
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long expired;
+    unsigned long long evictions;
+
+    int n_entries;
+    int max_entries;
+} FdCacheStats;
+
+FdCache *fd_cache_create(int max_entries, long ttl_ms);
+FdEntry *fd_cache_lookup(FdCache *cache, char *key);
+FdEntry *fd_entry_create(char *key, int fd, struct stat *f_stats, char *full_path);
+void fd_cache_insert(FdCache *cache, FdEntry *entry);
+void fd_cache_release(FdEntry *entry);
+void get_fd_cache_stats(FdCache *cache, FdCacheStats *dest);
+void fd_cache_destroy(FdCache *cache);
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "body_store.h"
+
+#define FC_SHARDS        16
+#define FC_BUCKETS       1024
+#define FC_SKETCH_DEPTH  4
+#define FC_SKETCH_WIDTH  4096
+
+// Segments of the W-TinyLFU policy
+#define FC_WINDOW    0
+#define FC_PROBATION 1
+#define FC_PROTECTED 2
+#define FC_SEGMENTS  3
+
+/*
+ * A cached response. The body and the header are immutable once the
+ * entry is published, so they can be sent without holding any lock.
+ */
+typedef struct cache_entry {
+    // Canonical path of the file
+    char *key;
+    uint64_t hash;
+
+    // Version of the file the entry was loaded from
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    // Pre-rendered response header, with room for the date at date_offset
+    char *header;
+    size_t header_len;
+    size_t date_offset;
+
+    // File content
+    char *body;
+    size_t body_len;
+
+    // The body in the body store, if the cache deduplicates (NULL if not).
+    // A body is charged to one cached entry only; shared is set for the
+    // others, and only changes under the shard lock. If the paying entry
+    // leaves first, the body is charged to its shard as unpaid until one
+    // of the others claims it.
+    StoredBody *stored;
+    int shared;
+
+    // References held by the cache and by senders
+    int refs;
+
+    // W-TinyLFU segment the entry lives in
+    int segment;
+
+    // Hash chain
+    struct cache_entry *h_next;
+
+    // Segment LRU list, most recently used first
+    struct cache_entry *prev;
+    struct cache_entry *next;
+} CacheEntry;
+
+typedef struct {
+    CacheEntry *head;
+    CacheEntry *tail;
+
+    size_t bytes;
+    size_t max_bytes;
+} CacheSegment;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    CacheEntry *buckets[FC_BUCKETS];
+    CacheSegment segments[FC_SEGMENTS];
+
+    // Bytes of shared bodies whose paying entry left this shard while other
+    // entries still point at them. They take room from the main area.
+    // Changed atomically, as the body store settles them.
+    size_t unpaid;
+
+    // Count-min sketch estimating the access frequency of every key, seen or not
+    uint8_t sketch[FC_SKETCH_DEPTH][FC_SKETCH_WIDTH];
+    unsigned long sketch_additions;
+
+    // Statistics
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long rejections;
+    unsigned long long invalidations;
+    unsigned long long n_entries;
+} CacheShard;
+
+typedef struct {
+    CacheShard shards[FC_SHARDS];
+
+    // Files larger than this are never cached
+    size_t max_object;
+
+    // Bodies of the entries, held once per content (NULL if disabled)
+    BodyStore *bodies;
+} FileCache;
+
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long rejections;
+    unsigned long long invalidations;
+    unsigned long long n_entries;
+
+    size_t bytes;
+    size_t max_bytes;
+} FileCacheStats;
+
+FileCache *file_cache_create(size_t max_bytes, size_t max_object, int dedup);
+CacheEntry *file_cache_lookup(FileCache *cache, char *key, struct stat *f_stats);
+CacheEntry *file_cache_entry_create(char *key, struct stat *f_stats);
+int file_cache_insert(FileCache *cache, CacheEntry *entry);
+void file_cache_release(CacheEntry *entry);
+int file_cache_cacheable(FileCache *cache, struct stat *f_stats);
+int file_cache_contains(FileCache *cache, char *key, struct stat *f_stats);
+void get_file_cache_stats(FileCache *cache, FileCacheStats *dest);
+void file_cache_destroy(FileCache *cache);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef HASH_CACHE_H
+#define HASH_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HC_SLOTS 4096
+#define HC_LOCKS 16
+
+// Content hash of one version of a file
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    uint64_t hash;
+    int valid;
+} HashSlot;
+
+/*
+ * Direct mapped table of file content hashes, keyed by the file version.
+ * A colliding file simply replaces the slot.
+ */
+typedef struct {
+    pthread_mutex_t locks[HC_LOCKS];
+    HashSlot slots[HC_SLOTS];
+
+    // Statistics
+    unsigned long long hits;
+    unsigned long long misses;
+} HashCache;
+
+HashCache *hash_cache_create(void);
+int hash_cache_lookup(HashCache *cache, struct stat *f_stats, uint64_t *hash);
+void hash_cache_insert(HashCache *cache, struct stat *f_stats, uint64_t hash);
+void hash_cache_destroy(HashCache *cache);
+
+#endif
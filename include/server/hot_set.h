@@ -0,0 +1,109 @@
+#ifndef HOT_SET_H
+#define HOT_SET_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HOT_SHARDS  16
+#define HOT_BUCKETS 256
+
+// Paths tracked by a shard; new paths are ignored while it is full
+#define HOT_SHARD_MAX 1024
+
+// Hottest paths written to the state file
+#define HOT_SAVE_MAX 4096
+
+// Name of the state file, in the state directory
+#define HOT_STATE_FILE "hot_paths"
+
+/*
+ * Warms a path the way a request for it would, returning the bytes
+ * warmed, or -1 if the path cannot be served.
+ */
+typedef long (*HotWarmFn)(void *arg, const char *path);
+
+typedef struct hot_path {
+    uint64_t hash;
+    unsigned long long hits;
+
+    struct hot_path *h_next;
+
+    // The requested path
+    char path[];
+} HotPath;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    HotPath *buckets[HOT_BUCKETS];
+    int n_paths;
+} HotShard;
+
+/*
+ * Counts the requests served per path, saves the hottest paths to a
+ * state file every interval, and on startup warms the paths saved by the
+ * previous run from idle priority threads.
+ */
+typedef struct {
+    HotShard shards[HOT_SHARDS];
+
+    char *state_path;
+    int interval;
+
+    // Periodic saves
+    pthread_t saver;
+    pthread_mutex_t save_lock;
+    pthread_cond_t wake;
+    int saver_started;
+    int stop;
+
+    // Paths of the previous run, hottest first, and the next one to warm
+    char **warm_paths;
+    int n_warm;
+    int next_warm;
+
+    pthread_t *warmers;
+    int n_warmers;
+
+    HotWarmFn warm;
+    void *warm_arg;
+    int warm_stop;
+
+    // Statistics, updated atomically
+    unsigned long long recorded;
+    unsigned long long untracked;
+    unsigned long long saves;
+    int last_saved;
+
+    int warmed;
+    int warm_missing;
+    int warmers_running;
+    unsigned long long warm_bytes;
+    struct timespec warm_start;
+    struct timespec warm_end;
+} HotSet;
+
+typedef struct {
+    int tracked;
+    unsigned long long recorded;
+    unsigned long long untracked;
+    unsigned long long saves;
+    int last_saved;
+
+    int warm_total;
+    int warmed;
+    int warm_missing;
+    int warm_running;
+    unsigned long long warm_bytes;
+    double warm_ms;
+} HotSetStats;
+
+HotSet *hot_set_create(const char *state_dir, int interval);
+void hot_set_record(HotSet *set, const char *path);
+int hot_set_start(HotSet *set, int n_warmers, HotWarmFn warm, void *warm_arg);
+void hot_set_stop_warming(HotSet *set);
+void get_hot_set_stats(HotSet *set, HotSetStats *dest);
+void hot_set_destroy(HotSet *set);
+
+#endif
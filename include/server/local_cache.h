@@ -0,0 +1,122 @@
+#ifndef LOCAL_CACHE_H
+#define LOCAL_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LC_BUCKETS  1024
+#define LC_QUEUE_SZ 256
+#define LC_COPIERS  2
+
+// Prefix of the copies in the cache directory; leftovers of a previous
+// run are removed on startup
+#define LC_PREFIX "myhttpd-"
+
+/*
+ * A file of the root copied to the local cache directory.
+ */
+typedef struct lc_entry {
+    // Normalized request path, and the root relative path of the file it
+    // resolved to (a directory resolves to its index.html)
+    char *key;
+    char *rel;
+    uint64_t hash;
+
+    // The copy on local disk
+    char *local_path;
+
+    // Metadata of the original when it was copied, served with the copy
+    struct stat f_stats;
+
+    // When, and in which version of the root, the original was last
+    // checked against f_stats
+    struct timespec validated;
+    unsigned long root_gen;
+
+    // Hash chain and LRU list
+    struct lc_entry *h_next;
+    struct lc_entry *prev;
+    struct lc_entry *next;
+} LcEntry;
+
+// A copy waiting for a copier thread
+typedef struct {
+    char *key;
+    char *rel;
+    int fd;
+    struct stat f_stats;
+    unsigned long root_gen;
+} LcJob;
+
+/*
+ * Copies of the files of a slow (e.g. network mounted) root on a local
+ * disk. Files served from the root are copied in the background, and
+ * served from the copy on later requests. The original is checked again
+ * once the copy has been trusted for ttl_ms, and the least recently used
+ * copies are removed to stay within the byte budget.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+
+    char *dir;
+
+    size_t max_bytes;
+    size_t bytes;
+    long ttl_ms;
+
+    LcEntry *buckets[LC_BUCKETS];
+    LcEntry *head;
+    LcEntry *tail;
+    int n_entries;
+
+    // Copies queued, and the keys being copied, so a file is copied once
+    LcJob queue[LC_QUEUE_SZ];
+    int q_head;
+    int q_len;
+    char *copying[LC_COPIERS];
+    pthread_cond_t queued;
+    int stop;
+
+    pthread_t copiers[LC_COPIERS];
+    int n_copiers;
+
+    unsigned long long seq;
+
+    // Statistics
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long revalidations;
+    unsigned long long invalidated;
+    unsigned long long copies;
+    unsigned long long copy_failures;
+    unsigned long long dropped;
+    unsigned long long evictions;
+} LocalCache;
+
+typedef struct {
+    int n_entries;
+    size_t bytes;
+    size_t max_bytes;
+    int queued;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long revalidations;
+    unsigned long long invalidated;
+    unsigned long long copies;
+    unsigned long long copy_failures;
+    unsigned long long dropped;
+    unsigned long long evictions;
+} LocalCacheStats;
+
+LocalCache *local_cache_create(const char *dir, size_t max_bytes, long ttl_ms);
+int local_cache_open(LocalCache *cache, int root_fd, unsigned long gen, const char *key, char **rel, int *fd,
+                     struct stat *f_stats);
+void local_cache_fill(LocalCache *cache, unsigned long gen, const char *key, const char *rel, int fd,
+                      struct stat *f_stats);
+void get_local_cache_stats(LocalCache *cache, LocalCacheStats *dest);
+void local_cache_destroy(LocalCache *cache);
+
+#endif
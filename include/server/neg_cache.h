@@ -0,0 +1,89 @@
+#ifndef NEG_CACHE_H
+#define NEG_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define NCC_SHARDS  16
+#define NCC_BUCKETS 256
+
+/*
+ * A request path that was recently found missing. It stays valid until
+ * something is created in one of the directories it was looked up in.
+ */
+typedef struct neg_entry {
+    uint64_t hash;
+
+    // Generation of the cache when the path was found missing
+    unsigned long long generation;
+
+    // Hash chain
+    struct neg_entry *h_next;
+
+    // LRU list, most recently used first
+    struct neg_entry *prev;
+    struct neg_entry *next;
+
+    // Request path, as received
+    char key[];
+} NegEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    NegEntry *buckets[NCC_BUCKETS];
+
+    NegEntry *head;
+    NegEntry *tail;
+
+    int n_entries;
+    int max_entries;
+
+    // Statistics
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidated;
+    unsigned long long evictions;
+} NegShard;
+
+/*
+ * Bounded cache of the request paths that do not exist. Every existing
+ * directory a missing path was looked up through is watched with inotify,
+ * and any entry created, or moved, in one of them advances the generation
+ * of the cache, dropping every entry found missing before.
+ */
+typedef struct {
+    NegShard shards[NCC_SHARDS];
+
+    char *root_dir;
+    int root_fd;
+
+    int inotify_fd;
+
+    // Bumped, under sync_lock, for every batch of inotify events read
+    pthread_mutex_t sync_lock;
+    unsigned long long generation;
+
+    // Misses that were not cached, because a directory could not be watched
+    unsigned long long uncached;
+} NegCache;
+
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidated;
+    unsigned long long evictions;
+    unsigned long long uncached;
+    unsigned long long generation;
+
+    int n_entries;
+    int max_entries;
+} NegCacheStats;
+
+NegCache *neg_cache_create(int max_entries, char *root_dir, int root_fd);
+int neg_cache_lookup(NegCache *cache, const char *key);
+void neg_cache_insert(NegCache *cache, const char *key, const char *rel_path);
+void get_neg_cache_stats(NegCache *cache, NegCacheStats *dest);
+void neg_cache_destroy(NegCache *cache);
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef NS_INDEX_H
+#define NS_INDEX_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "thread_pool.h"
+
+// What the index knows about a root relative path
+#define NS_MISSING   0
+#define NS_FILE      1
+#define NS_DIR       2
+#define NS_FORBIDDEN 3
+#define NS_UNKNOWN   4
+
+// The file served for a directory
+#define NS_DIR_INDEX "index.html"
+
+/*
+ * An entry of the root directory. Symlinks and special files are kept as
+ * NS_UNKNOWN, and so are directories that could not be read, so every
+ * lookup at or beneath them is left to the filesystem.
+ */
+typedef struct ns_node {
+    uint64_t hash;
+    struct ns_node *h_next;
+
+    // NS_FILE, NS_DIR, NS_FORBIDDEN (an unreadable file) or NS_UNKNOWN
+    unsigned char kind;
+
+    // Directories only: an index.html file is there to be served
+    unsigned char has_index;
+
+    // Path relative to the root, "." for the root itself
+    char path[];
+} NsNode;
+
+/*
+ * In-memory index of every file under the root directory. The tree is
+ * scanned once at startup by the thread pool, and kept up to date by a
+ * thread reading inotify events.
+ */
+typedef struct {
+    char *root_dir;
+    int root_fd;
+
+    pthread_rwlock_t lock;
+
+    // Hash table of the nodes, by path
+    NsNode **buckets;
+    size_t n_buckets;
+    size_t n_nodes;
+
+    // Watched directories, by watch descriptor
+    char **watches;
+    int n_watches;
+
+    int inotify_fd;
+
+    // Thread applying the inotify events
+    pthread_t watcher;
+    volatile int running;
+
+    // Set while the index is rebuilt, lookups go to the filesystem
+    volatile int stale;
+
+    // Optional Bloom filters of every path ever indexed, and of the paths
+    // the index does not follow, sized once the root is scanned. Bits are
+    // only ever set, so lookups read them without the lock.
+    uint64_t *bloom;
+    uint64_t *bloom_unknown;
+    size_t bloom_bits;
+
+    // Startup scan, run by the thread pool
+    thread_pool *pool;
+    pthread_mutex_t scan_lock;
+    pthread_cond_t scan_done;
+    int scans_pending;
+
+    // Statistics
+    size_t n_files;
+    size_t n_dirs;
+    size_t bytes;
+    double scan_ms;
+
+    unsigned long long hits;
+    unsigned long long fallbacks;
+    unsigned long long updates;
+    unsigned long long rescans;
+    unsigned long long bloom_rejects;
+} NsIndex;
+
+NsIndex *ns_index_create(thread_pool *pool, char *root_dir, int root_fd, int bloom);
+int ns_index_lookup(NsIndex *index, const char *path, char *dest, size_t dest_sz);
+void ns_index_destroy(NsIndex *index);
+
+#endif
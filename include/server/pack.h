@@ -0,0 +1,131 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A content pack holds a whole document root in a single file, built by
+ * mkpack. It is laid out as:
+ *
+ * - The PackHeader, alone in the first page.
+ * - The file bodies, and their gzip copies. Bodies of a page or more
+ *   start on a page boundary.
+ * - The strings: paths, ETags and pre-rendered OK headers.
+ * - The PackRecords, one per body.
+ * - The PackSlots of a perfect hash of the paths, and the displacement of
+ *   every bucket of the hash.
+ *
+ * Offsets are absolute, from the start of the file. Paths are normalized
+ * and relative to the root, "." being the root itself. A directory with
+ * an index.html has a path of its own, pointing at that file.
+ *
+ * A served pack is mapped, so it must be replaced by renaming a new pack
+ * over it (as mkpack does), never rewritten in place.
+ */
+
+#define PACK_MAGIC   "HTTPDPK1"
+#define PACK_VERSION 1
+#define PACK_ALIGN   4096
+
+// Empty slot, or missing gzip copy
+#define PACK_NONE 0xffffffffU
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+
+    uint32_t n_records;
+    uint32_t n_keys;
+    uint32_t n_slots;
+    uint32_t n_buckets;
+    uint32_t reserved;
+
+    uint64_t strings_off;
+    uint64_t records_off;
+    uint64_t slots_off;
+    uint64_t buckets_off;
+
+    // Size of the whole pack
+    uint64_t size;
+} PackHeader;
+
+typedef struct {
+    uint64_t body_off;
+    uint64_t body_len;
+
+    // Rendered OK header, with room for the date at date_offset
+    uint64_t header_off;
+    uint32_t header_len;
+    uint32_t date_offset;
+
+    // NUL terminated path of the file, and its ETag, quotes included
+    uint64_t path_off;
+    uint64_t etag_off;
+
+    int64_t mtime;
+
+    // ENC_IDENTITY or ENC_GZIP, and whether the response varies with
+    // Accept-Encoding
+    uint32_t encoding;
+    uint32_t vary;
+
+    // Record of the gzip copy (PACK_NONE if there is none)
+    uint32_t gzip;
+    uint32_t reserved;
+} PackRecord;
+
+typedef struct {
+    uint64_t key_off;
+    uint32_t key_len;
+
+    // PACK_NONE for an empty slot
+    uint32_t record;
+} PackSlot;
+
+/*
+ * An open, mapped pack. Requests hold a reference for as long as they
+ * send from it, so a replaced pack stays mapped until they are done.
+ */
+typedef struct {
+    int fd;
+
+    char *map;
+    size_t size;
+
+    PackHeader *header;
+    PackRecord *records;
+    PackSlot *slots;
+    uint32_t *buckets;
+
+    int refs;
+} Pack;
+
+/*
+ * The pack being served, swapped atomically when it is reloaded.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+
+    char *path;
+    Pack *current;
+
+    unsigned long long reloads;
+} PackStore;
+
+uint64_t pack_hash(const char *key, size_t len);
+uint32_t pack_bucket(uint64_t hash, uint32_t n_buckets);
+uint32_t pack_slot(uint64_t hash, uint32_t displacement, uint32_t n_slots);
+
+Pack *pack_open(const char *path);
+PackRecord *pack_lookup(Pack *pack, const char *key);
+void pack_release(Pack *pack);
+
+PackStore *pack_store_create(const char *path);
+Pack *pack_store_acquire(PackStore *store);
+int pack_store_reload(PackStore *store);
+void pack_store_destroy(PackStore *store);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "server_types.h"
+
+typedef struct {
+    int n_threads;
+    int queued;
+
+    unsigned long long n_processed;
+    unsigned long long wait_usec;
+    unsigned long long service_usec;
+} StageStats;
+
+Pipeline *pipeline_create(ServerOptions *options);
+int pipeline_submit(Pipeline *pipeline, AcceptArgs *args);
+int get_stage_stats(PipelineStage *stage, StageStats *dest);
+void pipeline_destroy(Pipeline *pipeline);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef PRECOMPRESS_H
+#define PRECOMPRESS_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+// Files outside these bounds are not worth compressing ahead of time
+#define PRECOMPRESS_MIN_SZ 1024
+#define PRECOMPRESS_MAX_SZ (64L * 1024 * 1024)
+
+/*
+ * Background job that writes a gzip copy (<file>.gz) next to every
+ * compressible file of the root directory. The tree is walked by one task,
+ * and every file is compressed by its own task, so the work spreads over
+ * the whole pool. A new root directory is walked the same way once the
+ * root is reloaded.
+ */
+typedef struct {
+    thread_pool *pool;
+
+    // The root directory walked last, and the one to walk once that walk
+    // ends (NULL if none). Swapped under the lock.
+    pthread_mutex_t lock;
+    char *root_dir;
+    char *next_dir;
+
+    // Set on shutdown, so queued tasks return right away
+    volatile int cancelled;
+
+    // The walk is still running
+    volatile int walking;
+
+    // Statistics
+    unsigned long long queued;
+    unsigned long long compressed;
+    unsigned long long skipped;
+    unsigned long long failed;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+} Precompressor;
+
+Precompressor *precompress_start(thread_pool *pool, char *root_dir);
+int precompress_restart(Precompressor *pre, char *root_dir);
+void precompress_cancel(Precompressor *pre);
+void precompress_free(Precompressor *pre);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "thread_pool.h"
+
+// Largest piece of a body sent against the token buckets
+#define RL_QUANTUM (64 * 1024)
+
+/*
+ * Bandwidth limits of the response bodies, per connection and for all of
+ * them. The first burst bytes of every body are sent as they are. The
+ * limits are read as a body starts, so changes apply to the next bodies.
+ * Shaped responses are written by a pool of their own, so the waits of a
+ * low limit never hold a network worker.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+
+    // Threads writing the shaped responses, and set once they must finish
+    // without waiting
+    thread_pool *pool;
+    int stopping;
+
+    // Bytes per second of each connection and of all of them (0 if
+    // unlimited), and the bytes of a body sent before they apply. Changed
+    // atomically.
+    long conn_rate;
+    long global_rate;
+    long burst;
+
+    // Bucket shared by all the connections, under the lock
+    double tokens;
+    struct timespec last;
+
+    // Statistics, updated atomically. Connections are paced by the kernel
+    // if the socket takes SO_MAX_PACING_RATE, by sleeping otherwise.
+    unsigned long long shaped;
+    unsigned long long paced;
+    unsigned long long sleeps;
+    unsigned long long slept_us;
+
+    // Responses handed to the pool, and refused because its queue was full
+    unsigned long long deferred;
+    unsigned long long refused;
+} RateLimiter;
+
+// The shaping of one body, as it is sent
+typedef struct {
+    RateLimiter *limiter;
+    int fd;
+
+    long conn_rate;
+    long global_rate;
+    long burst;
+    size_t piece;
+
+    // Bytes of the body sent so far
+    size_t sent;
+
+    // The socket paces the connection rate, or the connection bucket does
+    int paced;
+    int bucketed;
+    double tokens;
+    struct timespec last;
+} Shaper;
+
+RateLimiter *rate_limiter_create(long conn_rate, long global_rate, long burst, int n_threads, int queue_sz);
+void rate_limiter_set(RateLimiter *limiter, long conn_rate, long global_rate);
+int rate_limiter_shapes(RateLimiter *limiter, size_t len);
+int rate_limiter_submit(RateLimiter *limiter, void (*handler)(void*), void *arg);
+int shaper_start(Shaper *shaper, RateLimiter *limiter, int fd, size_t len);
+size_t shaper_quota(Shaper *shaper, size_t left);
+void rate_limiter_destroy(RateLimiter *limiter);
+
+#endif
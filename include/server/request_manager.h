@@ -1,6 +1,146 @@
 #ifndef REQUEST_MANAGER_H
 #define REQUEST_MANAGER_H
 
+#include <sys/stat.h>
+
+#include "server_types.h"
+#include "http_types.h"
+#include "request.h"
+#include "range.h"
+#include "cache_policy.h"
+
+// Room for the ETag, "<inode>-<size>-<mtime>" or the content hash, in hex
+#define ETAG_SZ 80
+
+/*
+ * Holds the state of a single HTTP request, as it moves through the
+ * parse, resolve and respond steps.
+ */
+typedef struct {
+    // Connection fd
+    int fd;
+
+    // Versions of the root directory (NULL when serving a pack), and the
+    // version the request holds from start to end
+    RootStore *roots;
+    RootVersion *root;
+
+    // Root directory of that version (and an open fd of it), stats and
+    // caches of the server
+    char *root_dir;
+    int root_fd;
+    ServerStats *stats;
+    FileCache *file_cache;
+    FdCache *fd_cache;
+    HashCache *hash_cache;
+
+    // Loads of files into the file cache in flight (NULL if it is disabled)
+    SingleFlight *flights;
+
+    // Serve precompressed copies of files, when the client accepts them
+    int sidecars;
+
+    // Cache of the responses compressed on the fly (NULL if disabled), and
+    // the smallest file worth compressing
+    FileCache *compress_cache;
+    long compress_min;
+
+    // Pool the response is handed to if the file is not in the page cache
+    // (NULL if disabled)
+    DiskPool *disk_pool;
+
+    // Smallest file dropped from the page cache as it is sent (0 if
+    // disabled), and whether large files are sent from a mapping
+    long drop_behind_min;
+    int mmap_send;
+
+    // Smallest body held in memory sent with MSG_ZEROCOPY (0 if disabled)
+    long zerocopy_min;
+
+    // Index of the root version, and cache of the paths recently found
+    // missing in it (NULL if disabled)
+    NsIndex *ns_index;
+    NegCache *neg_cache;
+
+    // The pack served in place of the root directory (NULL if disabled),
+    // the pack the request holds while it sends from it, and where the
+    // body of the file starts in the pack
+    PackStore *packs;
+    Pack *pack;
+    off_t body_offset;
+
+    // Local copies of the files of a slow root (NULL if disabled)
+    LocalCache *local_cache;
+
+    // Requests served per path (NULL if disabled, or warming)
+    HotSet *hot_set;
+
+    // Bandwidth limits of the body (NULL if disabled)
+    RateLimiter *limiter;
+
+    // References held by the network worker and the disk pool
+    int refs;
+
+    // Parsed request
+    HttpRequest *request;
+
+    // Absolute path of the requested file, and its metadata
+    char *file_full_path;
+    struct stat f_stats;
+
+    // The same path, relative to the root (it points into file_full_path).
+    // The cached contents are keyed by it, so they outlive a root version.
+    char *file_rel_path;
+
+    // The requested file, opened during resolution
+    int file;
+
+    // Rendered OK header of the file, with room for the date at date_offset
+    char *header;
+    size_t header_len;
+    size_t date_offset;
+
+    // Encodings the client accepts
+    int accepted;
+
+    // Caching rules of the server (NULL if there are none), and the rule
+    // of the file
+    const CachePolicy *cache_policy;
+    const CacheRule *cache_rule;
+
+    // Encoding of the file we are sending, if we compress it ourselves,
+    // its media type, and the optional fields that go with it
+    int encoding;
+    int compress;
+    const char *content_type;
+    const char *extra_headers;
+
+    // Strong ETag of the file, computed on first use (empty until then)
+    char etag[ETAG_SZ];
+
+    // The client already holds the current version, answer with 304
+    int not_modified;
+
+    // Requested ranges of the file; 0 sends the whole file, and
+    // RANGE_UNSATISFIABLE answers with 416
+    ByteRange ranges[MAX_RANGES];
+    int n_ranges;
+
+    // The fd cache entry that owns the file, its path and its header (NULL
+    // if we own them)
+    FdEntry *fd_entry;
+
+    // Outcome of the steps run so far
+    HttpError err;
+} RequestCtx;
+
+RequestCtx *request_ctx_create(AcceptArgs *args);
+void request_parse(RequestCtx *ctx);
+void request_resolve(RequestCtx *ctx);
+void request_respond(RequestCtx *ctx);
+void request_ctx_free(RequestCtx *ctx);
+void request_reject(int fd);
 void accept_http(void *arg);
+long request_prewarm(void *arg, const char *path);
 
 #endif
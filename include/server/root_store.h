@@ -0,0 +1,63 @@
+#ifndef ROOT_STORE_H
+#define ROOT_STORE_H
+
+#include <pthread.h>
+
+#include "thread_pool.h"
+#include "ns_index.h"
+#include "neg_cache.h"
+
+/*
+ * A version of the root directory, the directory the root path resolved
+ * to when it was loaded. Requests hold a reference from start to end, so
+ * they finish against the version they started with.
+ */
+typedef struct {
+    // Resolved root directory, and an fd of it
+    char *dir;
+    int fd;
+
+    // Increases by one with every version loaded
+    unsigned long gen;
+
+    // Index and missing paths of this version (NULL if disabled)
+    NsIndex *ns_index;
+    NegCache *neg_cache;
+
+    double load_ms;
+
+    int refs;
+} RootVersion;
+
+/*
+ * The root directory being served, resolved again on reload, so flipping
+ * a symlink to a new release switches every new request to it.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+
+    // The root path, as given (e.g. a symlink to the current release)
+    char *path;
+    RootVersion *current;
+
+    // Settings of the index and the negative cache of every version
+    thread_pool *pool;
+    int index;
+    int bloom;
+    int neg_cache_entries;
+
+    // Statistics, updated atomically. Fd cache entries of an older version
+    // are carried over if their file is unchanged, and replaced otherwise.
+    unsigned long long reloads;
+    unsigned long long carried;
+    unsigned long long replaced;
+} RootStore;
+
+RootStore *root_store_create(const char *path, int neg_cache_entries);
+int root_store_index(RootStore *store, thread_pool *pool, int bloom);
+RootVersion *root_store_acquire(RootStore *store);
+void root_version_release(RootVersion *root);
+int root_store_reload(RootStore *store);
+void root_store_destroy(RootStore *store);
+
+#endif
@@ -3,7 +3,21 @@
 
 #include "server_types.h"
 
-ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_dir);
+#define DEFAULT_STAGE_QUEUE_SZ 256
+#define DEFAULT_CACHE_MAX_OBJECT (1024 * 1024)
+#define DEFAULT_FD_CACHE_TTL_MS  2000
+#define DEFAULT_COMPRESS_MIN     1024
+#define DEFAULT_COMPRESS_CACHE   (16 * 1024 * 1024)
+#define DEFAULT_WARM_INTERVAL    60
+#define DEFAULT_WARM_THREADS     2
+#define DEFAULT_LOCAL_CACHE      (1024UL * 1024 * 1024)
+#define DEFAULT_LOCAL_CACHE_TTL_MS 10000
+#define DEFAULT_ZEROCOPY_MIN     (128 * 1024)
+#define DEFAULT_RATE_BURST       (512 * 1024)
+#define DEFAULT_RATE_THREADS     4
+
+void init_server_options(ServerOptions *options);
+ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_dir, ServerOptions *options);
 char server_run(ServerResources *server);
 void update_stats(ServerStats *stats, unsigned long long bytes);
 int get_stats_instance(ServerStats *src, ServerStats *dest);
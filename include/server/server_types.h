@@ -9,21 +9,192 @@
 #include <time.h>
 
 #include "thread_pool.h"
+#include "file_cache.h"
+#include "fd_cache.h"
+#include "hash_cache.h"
+#include "precompress.h"
+#include "disk_pool.h"
+#include "ns_index.h"
+#include "neg_cache.h"
+#include "single_flight.h"
+#include "pack.h"
+#include "hot_set.h"
+#include "local_cache.h"
+#include "root_store.h"
+#include "cache_policy.h"
+#include "rate_limit.h"
 
 typedef struct {
     pthread_mutex_t lock;
 
     unsigned long long page_count;
     unsigned long long byte_count;
+
+    // Bytes of large files dropped from the page cache once sent (updated
+    // atomically)
+    unsigned long long dropped_bytes;
+
+    // Responses sent from memory with MSG_ZEROCOPY, the body bytes that
+    // were not copied, the sends the kernel copied anyway, and the
+    // responses copied as they were below the threshold or the socket does
+    // not support zero copy (updated atomically)
+    unsigned long long zc_sends;
+    unsigned long long zc_bytes;
+    unsigned long long zc_copied;
+    unsigned long long zc_small;
+    unsigned long long zc_unsupported;
 } ServerStats;
 
+// Stages of the staged (SEDA) request pipeline
+#define STAGE_PARSE   0
+#define STAGE_RESOLVE 1
+#define STAGE_SEND    2
+#define N_STAGES      3
+
+typedef struct {
+    // Worker threads for each pipeline stage. If they are all zero,
+    // requests are handled by a single pool, start to finish.
+    int stage_threads[N_STAGES];
+
+    // Capacity of the queue in front of each stage
+    int stage_queue_sz;
+
+    // Memory budget of the in-memory file cache (0 disables it), the size
+    // of the largest file it will hold, and whether files with the same
+    // content share one body
+    size_t cache_bytes;
+    size_t cache_max_object;
+    int dedup;
+
+    // Number of open files kept by the fd cache (0 disables it), and how
+    // long a resolved path is trusted before it is looked up again
+    int fd_cache_entries;
+    long fd_cache_ttl_ms;
+
+    // Use a hash of the file content as the ETag, instead of its inode,
+    // size and modification time
+    int etag_hash;
+
+    // Serve <file>.br and <file>.gz in place of <file> to clients that
+    // accept them, and optionally create the missing .gz copies at startup
+    int sidecars;
+    int precompress;
+
+    // Compress files without a precompressed copy on the fly, when they are
+    // at least compress_min bytes, keeping the compressed copies in a cache
+    // of compress_cache_bytes
+    int compress;
+    long compress_min;
+    size_t compress_cache_bytes;
+
+    // Threads serving the responses whose file is not in the page cache
+    // (0 serves every response from the network workers)
+    int disk_threads;
+
+    // Drop files of at least drop_behind_min bytes from the page cache as
+    // they are sent (0 disables it), and send large files from a mapping
+    // instead of with sendfile
+    long drop_behind_min;
+    int mmap_send;
+
+    // Send bodies held in memory of at least zerocopy_min bytes with
+    // MSG_ZEROCOPY (0 disables it)
+    long zerocopy_min;
+
+    // Keep an index of the root directory in memory, and answer the
+    // requests for missing files without touching the filesystem
+    int index;
+
+    // Number of missing paths remembered by the negative cache (0 disables
+    // it), and whether the index also keeps Bloom filters of its paths
+    int neg_cache_entries;
+    int bloom;
+
+    // Directory of the hot set saved across restarts (NULL disables it),
+    // seconds between two saves, and threads warming the saved paths on
+    // startup
+    char *state_dir;
+    int warm_interval;
+    int warm_threads;
+
+    // Local directory holding copies of the files of a slow root (NULL
+    // disables it), their byte budget, and how long a copy is trusted
+    // before the original is checked again
+    char *local_cache_dir;
+    size_t local_cache_bytes;
+    long local_cache_ttl_ms;
+
+    // File of the Cache-Control and Expires rules (NULL if disabled)
+    char *cache_policy;
+
+    // Bytes per second of the response bodies of each connection and of
+    // all of them (0 if unlimited), the bytes of every body sent before
+    // the limits apply, and the threads sending the shaped bodies
+    long conn_rate;
+    long global_rate;
+    long rate_burst;
+    int rate_threads;
+} ServerOptions;
+
+typedef struct {
+    const char *name;
+
+    // The pool running this stage, and its bounded queue
+    thread_pool *pool;
+
+    // Stage statistics
+    pthread_mutex_t lock;
+
+    unsigned long long n_processed;
+
+    // Total time requests spent queued in front of, and running in the stage
+    unsigned long long wait_usec;
+    unsigned long long service_usec;
+} PipelineStage;
+
+typedef struct {
+    PipelineStage stages[N_STAGES];
+
+    // Connections turned away because the parse queue was full, changed
+    // atomically
+    unsigned long long shed;
+} Pipeline;
+
+typedef struct {
+    int fd;
+    RootStore *roots;
+    ServerStats *stats;
+    FileCache *file_cache;
+    FdCache *fd_cache;
+    HashCache *hash_cache;
+    int sidecars;
+    FileCache *compress_cache;
+    long compress_min;
+    DiskPool *disk_pool;
+    long drop_behind_min;
+    int mmap_send;
+    long zerocopy_min;
+    SingleFlight *flights;
+    PackStore *packs;
+    HotSet *hot_set;
+    LocalCache *local_cache;
+    CachePolicy *cache_policy;
+    RateLimiter *limiter;
+} AcceptArgs;
+
 typedef struct {
     // HTTP request and command ports
     int serving_port;
     int command_port;
 
-    // Root directory
+    // Root directory, as resolved at startup, and the versions of it served
+    // since (NULL when serving a pack)
     char *root_dir;
+    RootStore *roots;
+
+    // The pack served in place of the root directory, when the root is a
+    // pack file (NULL otherwise)
+    PackStore *packs;
 
     // Server startup time
     struct timeval t_start;
@@ -31,6 +202,46 @@ typedef struct {
     // Thread pool
     thread_pool *thread_pool;
 
+    // Staged pipeline (NULL if disabled)
+    Pipeline *pipeline;
+
+    // Disk I/O pool, for cold files (NULL if disabled)
+    DiskPool *disk_pool;
+
+    // In-memory file cache, and the loads into it in flight (NULL if
+    // disabled)
+    FileCache *file_cache;
+    SingleFlight *flights;
+
+    // Open file descriptor cache (NULL if disabled)
+    FdCache *fd_cache;
+
+    // Content hashes of served files (NULL if ETags are not content based)
+    HashCache *hash_cache;
+
+    // Files compressed on the fly, by version and encoding (NULL if disabled)
+    FileCache *compress_cache;
+
+    // Local copies of the files of the root (NULL if disabled)
+    LocalCache *local_cache;
+
+    // Cache-Control and Expires rules, by path (NULL if disabled)
+    CachePolicy *cache_policy;
+
+    // Bandwidth limits of the response bodies
+    RateLimiter *limiter;
+
+    // Requests served per path, saved for the next run (NULL if disabled),
+    // and the template of the requests warming the saved paths
+    HotSet *hot_set;
+    AcceptArgs *warm_args;
+
+    // Background job creating the .gz copies (NULL if disabled)
+    Precompressor *precompressor;
+
+    // Optional server settings
+    ServerOptions options;
+
     // HTTP socket fd
     int http_socket;
 
@@ -47,10 +258,4 @@ typedef struct {
     ServerStats stats;
 } ServerResources;
 
-typedef struct {
-    int fd;
-    char *root_dir;
-    ServerStats *stats;
-} AcceptArgs;
-
 #endif
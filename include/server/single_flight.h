@@ -0,0 +1,74 @@
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "file_cache.h"
+
+#define SF_BUCKETS 256
+
+/*
+ * A file being loaded into the file cache. Requests for the same version
+ * of the file that miss the cache while it is in flight wait for it,
+ * instead of reading the file again.
+ */
+typedef struct flight {
+    // Canonical path of the file
+    char *key;
+    uint64_t hash;
+
+    // Version of the file being loaded
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    // The loaded entry (NULL if the load failed), set once done
+    CacheEntry *entry;
+    int done;
+
+    pthread_cond_t landed;
+
+    // Requests waiting on the load
+    int followers;
+
+    // References held by the leader and the followers
+    int refs;
+
+    // Hash chain, while in flight
+    struct flight *h_next;
+} Flight;
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    Flight *buckets[SF_BUCKETS];
+
+    // Statistics
+    unsigned long long loads;
+    unsigned long long followers;
+    unsigned long long failures;
+    int max_followers;
+    int in_flight;
+} SingleFlight;
+
+typedef struct {
+    unsigned long long loads;
+    unsigned long long followers;
+    unsigned long long failures;
+    int max_followers;
+    int in_flight;
+} SingleFlightStats;
+
+SingleFlight *single_flight_create(void);
+Flight *single_flight_join(SingleFlight *sf, char *key, struct stat *f_stats, int *leader);
+CacheEntry *single_flight_wait(SingleFlight *sf, Flight *flight);
+void single_flight_land(SingleFlight *sf, Flight *flight, CacheEntry *entry);
+void get_single_flight_stats(SingleFlight *sf, SingleFlightStats *dest);
+void single_flight_destroy(SingleFlight *sf);
+
+#endif
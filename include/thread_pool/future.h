@@ -0,0 +1,44 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <pthread.h>
+
+#include "thread_pool.h"
+#include "task_queue.h"
+
+typedef struct future_cont {
+    // The continuation that will run when the future completes
+    task task;
+
+    // The queue the continuation will be delivered to (NULL runs it inline)
+    task_queue *target;
+
+    // The future that the continuation itself completes
+    struct task_future *future;
+
+    struct future_cont *next;
+} future_cont;
+
+typedef struct task_future {
+    pthread_mutex_t lock;
+    pthread_cond_t  completed;
+
+    // Set once the task behind this future has finished
+    int done;
+
+    // Number of handles referring to this future
+    int refs;
+
+    // Continuations waiting for this future to complete
+    future_cont *conts_head;
+    future_cont *conts_tail;
+} task_future;
+
+task_future *thread_pool_submit(thread_pool *pool, void (*handler)(void*), void (*destructor)(void*), void *args);
+task_future *future_then(task_future *future, thread_pool *pool, void (*handler)(void*), void (*destructor)(void*), void *args);
+task_future *future_then_queue(task_future *future, task_queue *queue, void (*handler)(void*), void (*destructor)(void*), void *args);
+int future_is_done(task_future *future);
+void future_wait(task_future *future);
+void future_release(task_future *future);
+
+#endif
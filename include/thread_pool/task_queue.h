@@ -15,15 +15,20 @@ typedef struct task_q {
 
     int n_tasks;
 
+    // Maximum number of queued tasks (0 means unbounded).
+    int max_tasks;
+
     // Task queue synchronization.
     pthread_mutex_t queue_rwlock;
     pthread_cond_t  queue_available;
+    pthread_cond_t  queue_not_full;
 } task_queue;
 
-int task_queue_init(task_queue *task_queue);
+int task_queue_init(task_queue *task_queue, int max_tasks);
 
 task_q_node *task_queue_get(task_queue *task_queue);
 int task_queue_put(task_queue *task_queue, task *task);
+int task_queue_try_put(task_queue *task_queue, task *task);
 
 void task_queue_free(task_queue *queue);
 #endif
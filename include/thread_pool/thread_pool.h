@@ -16,7 +16,9 @@ typedef struct thread_pool {
 } thread_pool;
 
 thread_pool *thread_pool_create(int n_workers, void (*inactive_callback)(void));
+thread_pool *thread_pool_create_bounded(int n_workers, int max_tasks, void (*inactive_callback)(void));
 int thread_pool_add(thread_pool *threadpool, void (*handler)(void*), void (*destructor)(void*), void *args);
+int thread_pool_try_add(thread_pool *threadpool, void (*handler)(void*), void (*destructor)(void*), void *args);
 void try_revive(thread_pool *pool);
 void thread_pool_destroy(thread_pool *pool);
 #endif
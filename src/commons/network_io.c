@@ -1,18 +1,31 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <poll.h>
+#include <time.h>
 
 #include "network_io.h"
 #include "utils.h"
 
-#define FILE_BUF_SZ 1024
-#define ONE_SECOND  1000
+#define FILE_BUF_SZ   (64 * 1024)
+#define SENDFILE_CHUNK (4 * 1024 * 1024)
+#define ONE_SECOND    1000
+
+// Sent bytes are dropped from the page cache in steps of this size
+#define DROP_WINDOW   (1024 * 1024)
 
 /*
  * Reads n_bytes from the specified file descriptor, and stores
@@ -72,6 +85,36 @@ int read_bytes(int fd, char *buf, int timeout, size_t n_bytes) {
     }
 }
 
+/*
+ * Waits until fd is writable, or timeout seconds have passed.
+ *
+ * Returns:
+ * - IO_OK if fd is writable.
+ * - An appropriate io error code, if an error occured.
+ */
+static
+int wait_writable(int fd, int timeout) {
+    struct pollfd fd_info;
+
+    fd_info.fd     = fd;
+    fd_info.events = POLLOUT;
+
+    for (;;) {
+        int status = poll(&fd_info, 1, timeout * ONE_SECOND);
+
+        if (status == 0) {
+            P_DEBUG("Write timed out\n");
+            return IO_TIMEOUT;
+        }
+
+        if (status > 0)
+            return IO_OK;
+
+        if (errno != EINTR)
+            return IO_UNEXPECTED;
+    }
+}
+
 /*
  * Writes n_bytes from the buffer to the specified file descriptor.
  * If timeout seconds have passed and no read event has been performed
@@ -136,6 +179,519 @@ int write_bytes(int fd, char *buf, int timeout, size_t n_bytes) {
     return IO_OK;
 }
 
+/*
+ * Writes all the buffers described by an iovec array to the file
+ * descriptor, with as few syscalls as possible. The array is modified
+ * to keep track of partial writes.
+ *
+ * Params:
+ * - int fd            : The file descriptor we want to write to.
+ * - struct iovec *iov : The buffers to be written, in order.
+ * - int iovcnt        : The number of buffers.
+ * - int timeout       : The timeout amount. If it is negative,
+ *                       timeout is +infty.
+ *
+ * Returns:
+ * - IO_OK if all went OK.
+ * - An appropriate io error code, if an error occured.
+ */
+int write_iovec(int fd, struct iovec *iov, int iovcnt, int timeout) {
+    // Skip empty buffers
+    while (iovcnt > 0 && iov->iov_len == 0) {
+        iov++;
+        iovcnt--;
+    }
+
+    while (iovcnt > 0) {
+        int status = wait_writable(fd, timeout);
+
+        if (status != IO_OK)
+            return status;
+
+        ssize_t bytes_written = writev(fd, iov, iovcnt);
+
+        if (bytes_written < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+
+            return IO_UNEXPECTED;
+        }
+
+        // Advance past everything that was written
+        while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base  = (char*)iov->iov_base + bytes_written;
+            iov->iov_len  -= bytes_written;
+        }
+    }
+
+    return IO_OK;
+}
+
+/*
+ * Reaps the completion notifications of MSG_ZEROCOPY sends from the error
+ * queue of the socket, until n_sends sends are reported complete. Once
+ * they are, the kernel holds no reference to the buffers sent.
+ *
+ * Params:
+ * - int fd        : The socket.
+ * - int n_sends   : The number of sends to wait for.
+ * - int timeout   : The timeout amount. If it is negative,
+ *                   timeout is +infty.
+ * - int *copied   : Set to 1 if the kernel copied the buffers of a send
+ *                   anyway.
+ *
+ * Returns:
+ * - IO_OK if every send is complete.
+ * - An appropriate io error code, if an error occured.
+ */
+static
+int reap_zerocopy(int fd, int n_sends, int timeout, int *copied) {
+    struct pollfd fd_info;
+
+    // Only errors are polled for, and the notifications are errors
+    fd_info.fd     = fd;
+    fd_info.events = 0;
+
+    // Retries left while the socket hangs up before its notifications
+    // are queued, 1 ms apart
+    long hup_retries = timeout < 0 ? -1 : (long) timeout * ONE_SECOND;
+
+    while (n_sends > 0) {
+        int status = poll(&fd_info, 1, timeout * ONE_SECOND);
+
+        if (status == 0) {
+            P_DEBUG("Zero copy completion timed out\n");
+            return IO_TIMEOUT;
+        }
+
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return IO_UNEXPECTED;
+        }
+
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN)
+                return IO_UNEXPECTED;
+
+            // An error of the connection, not a notification. Clear it,
+            // the notifications follow once the send queue is purged.
+            int err;
+            socklen_t err_len = sizeof(err);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+
+            if (fd_info.revents & POLLHUP) {
+                if (hup_retries-- == 0)
+                    return IO_TIMEOUT;
+
+                struct timespec delay = {0, 1000 * 1000};
+                nanosleep(&delay, NULL);
+            }
+
+            continue;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err *ee = (struct sock_extended_err*) CMSG_DATA(cm);
+
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // A range of sends, numbered from the first one on the socket
+            n_sends -= ee->ee_data - ee->ee_info + 1;
+
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                *copied = 1;
+        }
+    }
+
+    return IO_OK;
+}
+
+/*
+ * Writes all the buffers described by an iovec array to the socket, like
+ * write_iovec, but with MSG_ZEROCOPY: the kernel sends the pages of the
+ * buffers instead of copying them. The function only returns once the
+ * kernel reported it is done with every buffer, so they may be freed or
+ * changed right after. Previous zero copy sends on the socket must all be
+ * complete. If the kernel is short of memory to track a send, that send
+ * is copied instead.
+ *
+ * If the completions time out, the kernel may still hold the buffers. The
+ * socket is then set to be reset on close, which drops its send queue.
+ *
+ * Params:
+ * - int fd            : The socket we want to write to.
+ * - struct iovec *iov : The buffers to be written, in order.
+ * - int iovcnt        : The number of buffers.
+ * - int timeout       : The timeout amount. If it is negative,
+ *                       timeout is +infty.
+ * - int *copied       : Set to 1 if any buffer was copied after all,
+ *                       by the kernel or because of a fallback.
+ *
+ * Returns:
+ * - IO_OK if all went OK.
+ * - IO_INVALID if the socket does not support zero copy. Nothing was
+ *   written.
+ * - An appropriate io error code, if an error occured.
+ */
+int write_iovec_zerocopy(int fd, struct iovec *iov, int iovcnt, int timeout, int *copied) {
+    int on = 1;
+
+    *copied = 0;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+        return IO_INVALID;
+
+    // Skip empty buffers
+    while (iovcnt > 0 && iov->iov_len == 0) {
+        iov++;
+        iovcnt--;
+    }
+
+    int status  = IO_OK;
+    int n_sends = 0;
+
+    while (iovcnt > 0) {
+        if ((status = wait_writable(fd, timeout)) != IO_OK)
+            break;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t bytes_written = sendmsg(fd, &msg, MSG_ZEROCOPY);
+
+        if (bytes_written >= 0) {
+            n_sends++;
+        } else if (errno == ENOBUFS) {
+            // Too many sends in flight, copy this one
+            *copied = 1;
+
+            if ((bytes_written = writev(fd, iov, iovcnt)) < 0 && errno != EINTR && errno != EAGAIN) {
+                status = IO_UNEXPECTED;
+                break;
+            }
+        } else if (errno != EINTR && errno != EAGAIN) {
+            status = IO_UNEXPECTED;
+            break;
+        }
+
+        if (bytes_written < 0)
+            continue;
+
+        // Advance past everything that was written
+        while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base  = (char*)iov->iov_base + bytes_written;
+            iov->iov_len  -= bytes_written;
+        }
+    }
+
+    // The buffers of the sends made must be released even on failure
+    int reaped = reap_zerocopy(fd, n_sends, timeout, copied);
+
+    if (reaped != IO_OK) {
+        struct linger reset = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+
+        if (status == IO_OK)
+            status = reaped;
+    }
+
+    return status;
+}
+
+/*
+ * Reads n_bytes of an open file, starting at offset, into buf. The file
+ * offset of file is not changed.
+ *
+ * Params:
+ * - int file       : The file we are reading.
+ * - char *buf      : The buffer where the data will be stored.
+ * - off_t offset   : The offset of the first byte to read.
+ * - size_t n_bytes : The number of bytes to read.
+ *
+ * Returns:
+ * - IO_OK if exactly n_bytes were read.
+ * - IO_UNEXPECTED otherwise.
+ */
+int read_file_fd(int file, char *buf, off_t offset, size_t n_bytes) {
+    while (n_bytes > 0) {
+        ssize_t bytes_read = pread(file, buf, n_bytes, offset);
+
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return IO_UNEXPECTED;
+        }
+
+        // The file shrunk under us
+        if (bytes_read == 0)
+            return IO_UNEXPECTED;
+
+        buf     += bytes_read;
+        offset  += bytes_read;
+        n_bytes -= bytes_read;
+    }
+
+    return IO_OK;
+}
+
+/*
+ * Fallback for write_file_fd, used when the file cannot be spliced into
+ * the socket. The file is copied through a user space buffer.
+ *
+ * Params: see write_file_fd.
+ *
+ * Returns:
+ * - IO_OK if all went OK.
+ * - An appropriate io error code, if an error occured.
+ */
+static
+int copy_file_fd(int fd, int file, off_t offset, size_t n_bytes, int timeout) {
+    char buf[FILE_BUF_SZ];
+
+    while (n_bytes > 0) {
+        size_t chunk = n_bytes < FILE_BUF_SZ ? n_bytes : FILE_BUF_SZ;
+
+        ssize_t bytes_read = pread(file, buf, chunk, offset);
+
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return IO_UNEXPECTED;
+        }
+
+        // The file shrunk under us
+        if (bytes_read == 0)
+            return IO_UNEXPECTED;
+
+        if (write_bytes(fd, buf, timeout, bytes_read) != IO_OK)
+            return IO_UNEXPECTED;
+
+        offset  += bytes_read;
+        n_bytes -= bytes_read;
+    }
+
+    return IO_OK;
+}
+
+/*
+ * Drops a range of a file that was already sent from the page cache, and
+ * adds its length to the counter.
+ *
+ * Params:
+ * - int file                    : The file.
+ * - off_t offset                : The start of the range.
+ * - off_t len                   : The length of the range.
+ * - unsigned long long *dropped : The counter of dropped bytes.
+ *
+ * Returns: -
+ */
+static
+void drop_sent(int file, off_t offset, off_t len, unsigned long long *dropped) {
+    if (len <= 0)
+        return;
+
+    if (posix_fadvise(file, offset, len, POSIX_FADV_DONTNEED) == 0)
+        __atomic_add_fetch(dropped, len, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sends n_bytes of an open file, starting at offset, to the file
+ * descriptor. The data is moved with sendfile, in large chunks, so it
+ * never passes through user space. If the file does not support
+ * sendfile, it falls back to copying through a buffer. The file offset
+ * of file is not changed.
+ *
+ * Params:
+ * - int fd         : The file descriptor we want to write to.
+ * - int file       : The file we are sending.
+ * - off_t offset   : The offset of the first byte to send.
+ * - size_t n_bytes : The number of bytes to send.
+ * - int timeout    : The timeout amount. If it is negative,
+ *                    timeout is +infty.
+ *
+ * Returns:
+ * - IO_OK if all went OK.
+ * - An appropriate io error code, if an error occured.
+ */
+int write_file_fd(int fd, int file, off_t offset, size_t n_bytes, int timeout) {
+    return write_file_fd_drop(fd, file, offset, n_bytes, timeout, NULL);
+}
+
+/*
+ * Same as write_file_fd, but the part of the file already sent is
+ * dropped from the page cache as the transfer moves on, so a file that
+ * is read once does not push out the rest of the page cache.
+ *
+ * Params:
+ * - See write_file_fd.
+ * - unsigned long long *dropped : The counter of the bytes dropped, updated
+ *                                 atomically. If it is NULL, nothing is
+ *                                 dropped.
+ *
+ * Returns:
+ * - IO_OK if all went OK.
+ * - An appropriate io error code, if an error occured.
+ */
+int write_file_fd_drop(int fd, int file, off_t offset, size_t n_bytes, int timeout, unsigned long long *dropped) {
+    char sent_any = 0;
+
+    off_t dropped_to = offset;
+
+    while (n_bytes > 0) {
+        int status = wait_writable(fd, timeout);
+
+        if (status != IO_OK)
+            return status;
+
+        size_t chunk = n_bytes < SENDFILE_CHUNK ? n_bytes : SENDFILE_CHUNK;
+
+        ssize_t bytes_sent = sendfile(fd, file, &offset, chunk);
+
+        if (bytes_sent < 0) {
+            switch (errno) {
+                case EINTR:
+                case EAGAIN:
+                    continue;
+                case EINVAL:
+                case ENOSYS:
+                case EOPNOTSUPP:
+                    // The filesystem cannot do it, copy instead
+                    if (!sent_any)
+                        return copy_file_fd(fd, file, offset, n_bytes, timeout);
+                    // Fall through
+                default:
+                    return IO_UNEXPECTED;
+            }
+        }
+
+        // The file shrunk under us
+        if (bytes_sent == 0)
+            return IO_UNEXPECTED;
+
+        n_bytes  -= bytes_sent;
+        sent_any  = 1;
+
+        if (dropped != NULL && (offset - dropped_to >= DROP_WINDOW || n_bytes == 0)) {
+            drop_sent(file, dropped_to, offset - dropped_to, dropped);
+            dropped_to = offset;
+        }
+    }
+
+    return IO_OK;
+}
+
+/*
+ * Sends n_bytes of an open file, starting at offset, from a read only
+ * mapping of the file. The mapping is advised as sequential, so the kernel
+ * reads ahead aggressively and frees the pages behind. If the file cannot
+ * be mapped, it is sent with write_file_fd_drop instead. The file must not
+ * shrink while it is sent.
+ *
+ * Params:
+ * - See write_file_fd_drop.
+ *
+ * Returns:
+ * - IO_OK if all went OK.
+ * - An appropriate io error code, if an error occured.
+ */
+int write_file_mmap(int fd, int file, off_t offset, size_t n_bytes, int timeout, unsigned long long *dropped) {
+    if (n_bytes == 0)
+        return IO_OK;
+
+    // Mappings start at a page boundary
+    off_t page  = sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~(page - 1);
+    size_t len  = n_bytes + (offset - start);
+
+    char *map = mmap(NULL, len, PROT_READ, MAP_SHARED, file, start);
+
+    if (map == MAP_FAILED)
+        return write_file_fd_drop(fd, file, offset, n_bytes, timeout, dropped);
+
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    int status       = IO_OK;
+    off_t sent_to    = offset;
+    off_t end        = offset + n_bytes;
+    off_t dropped_to = start;
+
+    while (sent_to < end) {
+        size_t chunk = end - sent_to < DROP_WINDOW ? end - sent_to : DROP_WINDOW;
+
+        if ((status = write_bytes(fd, map + (sent_to - start), timeout, chunk)) != IO_OK)
+            break;
+
+        sent_to += chunk;
+
+        if (dropped == NULL)
+            continue;
+
+        // Unmap the whole pages sent, or the page cache cannot drop them
+        off_t drop_end = sent_to == end ? sent_to : sent_to & ~(page - 1);
+
+        madvise(map + (dropped_to - start), drop_end - dropped_to, MADV_DONTNEED);
+        drop_sent(file, dropped_to, drop_end - dropped_to, dropped);
+
+        dropped_to = drop_end;
+    }
+
+    munmap(map, len);
+
+    return status;
+}
+
+/*
+ * Sets or clears TCP_CORK on a socket. While the socket is corked, partial
+ * frames are held back, so a header and the start of the body can share a
+ * segment. Clearing the cork flushes whatever is pending.
+ *
+ * Params:
+ * - int fd : The socket.
+ * - int on : 1 to cork, 0 to uncork.
+ *
+ * Returns:
+ * -  0 if no error occured.
+ * - -1 otherwise.
+ */
+int set_tcp_cork(int fd, int on) {
+    return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
 /*
  * Reads a file and writes it to the file descriptor.
  * If timeout seconds have passed without and no IO
@@ -143,10 +699,9 @@ int write_bytes(int fd, char *buf, int timeout, size_t n_bytes) {
  *
  * Params:
  * - int fd         : The file descriptor we want to write to.
- * - char *buf      : The buffer where the data will be read from.
+ * - char *filepath : The path of the file we want to send.
  * - int timeout    : The timeout amount. If it is negative, 
  *                    timeout is +infty.
- * - size_t n_bytes : The number of bytes to be written.
  *
  * Returns:
  * - IO_OK if all went OK. 
@@ -158,31 +713,15 @@ int write_file(int fd, char *filepath, int timeout) {
     if (file < 0)
         return IO_UNEXPECTED;
 
-    char buf[FILE_BUF_SZ];
-
-    // Read in chunks and write them to the fd
-    for (;;) {
-        int bytes_read = read_bytes(file, buf, -1, FILE_BUF_SZ);
+    struct stat f_stats;
 
-        // If an error occured, stop writting
-        if (bytes_read < 0) {
-            close(file);
-            return bytes_read;
-        }
-        // We reached EOF
-        else if (bytes_read == 0)
-            break;
+    if (fstat(file, &f_stats) < 0) {
+        close(file);
+        return IO_UNEXPECTED;
+    }
 
-        // Whatever you read above, write it
-        int bytes_written = write_bytes(fd, buf, timeout, bytes_read);
+    int status = write_file_fd(fd, file, 0, f_stats.st_size, timeout);
 
-        // If an error occured during write, stop writting
-        if (bytes_written < 0) {
-            close(file);
-            return IO_UNEXPECTED;
-        }
-    }
-    
     close(file);
-    return IO_OK;
+    return status;
 }
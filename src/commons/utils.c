@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -9,6 +11,7 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <string.h>
+#include <linux/openat2.h>
 
 #include "network_io.h"
 #include "utils.h"
@@ -220,3 +223,50 @@ int write_to_file(char *buf, char *filepath, size_t len) {
 long ceil_division(long a, long b){
     return (a%b == 0) ? a/b : a/b + 1;
 }
+
+// FNV-1a hash of a string.
+uint64_t hash_string(const char *str) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *str != '\0'; ++str) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/*
+ * Opens a path relative to a directory fd, with openat2. The kernel
+ * refuses to resolve the path outside of the directory (through "..",
+ * absolute paths or symlinks), and refuses to follow magic links.
+ *
+ * Params:
+ * - int dir_fd       : The directory the path is resolved in.
+ * - const char *path : The relative path.
+ * - int flags        : The open flags.
+ *
+ * Returns:
+ * - The open file descriptor, if no error occurred.
+ * - -1 otherwise, with errno set. EXDEV means the path escapes dir_fd,
+ *   and ENOSYS that the kernel has no openat2.
+ */
+int open_beneath(int dir_fd, const char *path, int flags) {
+    struct open_how how;
+
+    memset(&how, 0, sizeof(how));
+
+    how.flags   = flags;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    for (;;) {
+        long fd = syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+
+        if (fd >= 0)
+            return fd;
+
+        // openat2 asks to retry when a concurrent rename raced the lookup
+        if (errno != EINTR && errno != EAGAIN)
+            return -1;
+    }
+}
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "cache_policy.h"
+#include "utils.h"
+
+// Longest extension a rule may name
+#define CP_EXT_MAX 16
+
+// A year, the longest max-age worth announcing
+#define CP_MAX_AGE_MAX 31536000L
+
+/*
+ * Lowercases the extension of the last component of a path into dest.
+ *
+ * Params:
+ * - const char *path : The path.
+ * - char *dest       : A buffer of CP_EXT_MAX + 1 bytes.
+ *
+ * Returns:
+ * -  0 if the path has an extension that fits dest.
+ * - -1 otherwise.
+ */
+static
+int path_ext(const char *path, char *dest) {
+    const char *slash = strrchr(path, '/');
+    const char *dot   = strrchr(path, '.');
+
+    // The dot must be in the last path component
+    if (dot == NULL || (slash != NULL && dot < slash) || strlen(dot + 1) > CP_EXT_MAX)
+        return -1;
+
+    size_t i = 0;
+
+    for (const char *c = dot + 1; *c != '\0'; ++c)
+        dest[i++] = tolower((unsigned char) *c);
+
+    dest[i] = '\0';
+
+    return 0;
+}
+
+/*
+ * Renders the fields of a rule. They do not depend on the time of the
+ * response, so headers holding them can be rendered once and sent for as
+ * long as the file does not change.
+ *
+ * Params:
+ * - long max_age  : Seconds the response may be cached for.
+ * - int immutable : The response never changes while it is fresh.
+ *
+ * Returns:
+ * - A new rule if no error occurred.
+ * - NULL otherwise.
+ */
+static
+CacheRule *rule_create(long max_age, int immutable) {
+    CacheRule *rule = (CacheRule*) malloc(sizeof(CacheRule));
+
+    if (rule == NULL)
+        return NULL;
+
+    rule->max_age   = max_age;
+    rule->immutable = immutable;
+
+    // Revalidated on every use, and already expired for HTTP/1.0 caches.
+    // A fresh response gets no Expires: it would have to count from the
+    // time of each response, and max-age overrides it anyway.
+    int n = max_age == 0 ? asprintf(&rule->fields, "Cache-Control: no-cache\r\n"
+                                                   "Expires: Thu, 01 Jan 1970 00:00:00 GMT\r\n") :
+                           asprintf(&rule->fields, "Cache-Control: public, max-age=%ld%s\r\n", max_age,
+                                    immutable ? ", immutable" : "");
+
+    if (n < 0) {
+        free(rule);
+        return NULL;
+    }
+
+    return rule;
+}
+
+// Frees a rule along with its fields
+static
+void rule_free(CacheRule *rule) {
+    if (rule == NULL)
+        return;
+
+    free(rule->fields);
+    free(rule);
+}
+
+/*
+ * Adds a "/<prefix>" rule to the trie, replacing the rule of the same
+ * prefix, if any.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int trie_put(CachePolicy *policy, const char *prefix, CacheRule *rule) {
+    CpNode *node = policy->trie;
+
+    for (const char *c = prefix; *c != '\0'; ++c) {
+        CpNode *child = node->child;
+
+        while (child != NULL && child->c != *c)
+            child = child->sibling;
+
+        if (child == NULL) {
+            if ((child = (CpNode*) calloc(1, sizeof(CpNode))) == NULL)
+                return -1;
+
+            child->c       = *c;
+            child->sibling = node->child;
+            node->child    = child;
+        }
+
+        node = child;
+    }
+
+    rule_free(node->rule);
+    node->rule = rule;
+
+    return 0;
+}
+
+// Frees a node of the trie, its siblings and their subtries
+static
+void trie_free(CpNode *node) {
+    while (node != NULL) {
+        CpNode *sibling = node->sibling;
+
+        trie_free(node->child);
+        rule_free(node->rule);
+        free(node);
+
+        node = sibling;
+    }
+}
+
+/*
+ * Adds a "*.<ext>" rule to the extension hash, replacing the rule of the
+ * same extension, if any.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int ext_put(CachePolicy *policy, const char *ext, CacheRule *rule) {
+    uint64_t hash = hash_string(ext);
+    CpExt **bucket = &policy->exts[hash % CP_EXT_BUCKETS];
+
+    for (CpExt *entry = *bucket; entry != NULL; entry = entry->next)
+        if (entry->hash == hash && !strcmp(entry->ext, ext)) {
+            rule_free(entry->rule);
+            entry->rule = rule;
+            return 0;
+        }
+
+    CpExt *entry = (CpExt*) malloc(sizeof(CpExt));
+
+    if (entry == NULL || (entry->ext = strdup(ext)) == NULL) {
+        free(entry);
+        return -1;
+    }
+
+    entry->hash = hash;
+    entry->rule = rule;
+    entry->next = *bucket;
+    *bucket     = entry;
+
+    return 0;
+}
+
+/*
+ * Parses a line of the policy file, "<pattern> <max-age> [immutable]",
+ * and adds its rule. Blank lines and lines starting with '#' are skipped.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 if the line is malformed, or an allocation failed.
+ */
+static
+int parse_line(CachePolicy *policy, char *line) {
+    char *save = NULL;
+
+    char *pattern = strtok_r(line, " \t\r\n", &save);
+
+    if (pattern == NULL || pattern[0] == '#')
+        return 0;
+
+    char *age = strtok_r(NULL, " \t\r\n", &save);
+    char *opt = strtok_r(NULL, " \t\r\n", &save);
+
+    if (age == NULL || strtok_r(NULL, " \t\r\n", &save) != NULL)
+        return -1;
+
+    char *end;
+    long max_age = strtol(age, &end, 10);
+
+    if (*end != '\0' || max_age < 0 || max_age > CP_MAX_AGE_MAX)
+        return -1;
+
+    int immutable = opt != NULL && !strcmp(opt, "immutable");
+
+    if (opt != NULL && !immutable)
+        return -1;
+
+    // Only ever announced for responses that are cached at all
+    if (immutable && max_age == 0)
+        return -1;
+
+    int is_ext    = !strncmp(pattern, "*.", 2);
+    int is_prefix = pattern[0] == '/';
+
+    if (!is_ext && !is_prefix && strcmp(pattern, "*"))
+        return -1;
+
+    char ext[CP_EXT_MAX + 1];
+
+    if (is_ext && (strchr(pattern + 2, '/') != NULL || path_ext(pattern + 1, ext) < 0 || ext[0] == '\0'))
+        return -1;
+
+    CacheRule *rule = rule_create(max_age, immutable);
+
+    if (rule == NULL)
+        return -1;
+
+    int err = 0;
+
+    if (is_ext)
+        err = ext_put(policy, ext, rule);
+    else if (is_prefix)
+        err = trie_put(policy, pattern, rule);
+    else {
+        rule_free(policy->fallback);
+        policy->fallback = rule;
+    }
+
+    if (err < 0) {
+        rule_free(rule);
+        return -1;
+    }
+
+    policy->n_rules++;
+
+    return 0;
+}
+
+/*
+ * Loads a policy file and compiles it into the prefix trie and the
+ * extension hash. Each line is a rule, "<pattern> <max-age> [immutable]",
+ * where the pattern is "/<prefix>", "*.<ext>" or "*". A max-age of 0 has
+ * responses revalidated on every use. A later rule replaces an earlier one
+ * with the same pattern.
+ *
+ * Params:
+ * - const char *path : The path of the policy file.
+ *
+ * Returns:
+ * - A new policy if no error occurred.
+ * - NULL otherwise.
+ */
+CachePolicy *cache_policy_load(const char *path) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        P_ERR("Could not open the cache policy", errno);
+        return NULL;
+    }
+
+    CachePolicy *policy = (CachePolicy*) calloc(1, sizeof(CachePolicy));
+
+    if (policy == NULL || (policy->trie = (CpNode*) calloc(1, sizeof(CpNode))) == NULL) {
+        ERR("Memory allocation during cache policy creation failed");
+        free(policy);
+        fclose(file);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t line_sz = 0;
+    int line_no = 0;
+
+    while (getline(&line, &line_sz, file) >= 0) {
+        line_no++;
+
+        if (parse_line(policy, line) < 0) {
+            fprintf(stderr, "Invalid cache policy rule, %s line %d\n", path, line_no);
+            cache_policy_free(policy);
+            policy = NULL;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    return policy;
+}
+
+/*
+ * Finds the rule of a path: the longest matching prefix rule, or the rule
+ * of its extension, or the "*" rule.
+ *
+ * Params:
+ * - const CachePolicy *policy : The policy.
+ * - const char *path          : The root relative path of the file,
+ *                               starting with '/'.
+ *
+ * Returns:
+ * - The rule of the path.
+ * - NULL if no rule applies.
+ */
+const CacheRule *cache_policy_match(const CachePolicy *policy, const char *path) {
+    const CpNode *node   = policy->trie;
+    const CacheRule *best = NULL;
+
+    for (const char *c = path; *c != '\0' && node != NULL; ++c) {
+        node = node->child;
+
+        while (node != NULL && node->c != *c)
+            node = node->sibling;
+
+        if (node != NULL && node->rule != NULL)
+            best = node->rule;
+    }
+
+    if (best != NULL)
+        return best;
+
+    char ext[CP_EXT_MAX + 1];
+
+    if (path_ext(path, ext) == 0) {
+        uint64_t hash = hash_string(ext);
+
+        for (CpExt *entry = policy->exts[hash % CP_EXT_BUCKETS]; entry != NULL; entry = entry->next)
+            if (entry->hash == hash && !strcmp(entry->ext, ext))
+                return entry->rule;
+    }
+
+    return policy->fallback;
+}
+
+/*
+ * Gives the caching fields of a response.
+ *
+ * Params:
+ * - const CacheRule *rule : The rule of the file (NULL if none applies).
+ *
+ * Returns: The fields, empty if no rule applies.
+ */
+const char *cache_rule_fields(const CacheRule *rule) {
+    return rule == NULL ? "" : rule->fields;
+}
+
+/*
+ * Destructor for the policy.
+ *
+ * Params:
+ * - CachePolicy *policy : The policy we want to free.
+ *
+ * Returns: -
+ */
+void cache_policy_free(CachePolicy *policy) {
+    if (policy == NULL)
+        return;
+
+    trie_free(policy->trie);
+
+    for (int i = 0; i < CP_EXT_BUCKETS; ++i)
+        while (policy->exts[i] != NULL) {
+            CpExt *entry = policy->exts[i];
+
+            policy->exts[i] = entry->next;
+
+            rule_free(entry->rule);
+            free(entry->ext);
+            free(entry);
+        }
+
+    rule_free(policy->fallback);
+    free(policy);
+}
@@ -0,0 +1,55 @@
+#include <string.h>
+
+#include "conditional.h"
+
+/*
+ * Checks if an entity tag appears in the value of an If-None-Match
+ * header. Tags are compared weakly, as the header requires: a W/ prefix
+ * is ignored on both sides.
+ *
+ * Params:
+ * - const char *list : The value of the header, a list of entity tags or "*".
+ * - const char *etag : The entity tag of the file, quotes included.
+ *
+ * Returns:
+ * - 1 if the tag, or "*", is in the list.
+ * - 0 otherwise, or if the list is malformed.
+ */
+int etag_list_matches(const char *list, const char *etag) {
+    if (!strcmp(list, "*"))
+        return 1;
+
+    // Header values are lowercased by the parser
+    if (!strncmp(etag, "W/", 2) || !strncmp(etag, "w/", 2))
+        etag += 2;
+
+    size_t etag_len = strlen(etag);
+
+    const char *p = list;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+
+        if (*p == '\0')
+            return 0;
+
+        if (!strncmp(p, "w/", 2) || !strncmp(p, "W/", 2))
+            p += 2;
+
+        if (*p != '"')
+            return 0;
+
+        const char *end = strchr(p + 1, '"');
+
+        if (end == NULL)
+            return 0;
+
+        size_t len = end - p + 1;
+
+        if (len == etag_len && !strncmp(p, etag, len))
+            return 1;
+
+        p = end + 1;
+    }
+}
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "encoding.h"
+
+const char * const encoding_names[N_ENCODINGS] = {
+    [ENC_IDENTITY] = "identity",
+    [ENC_BR]       = "br",
+    [ENC_GZIP]     = "gzip",
+    [ENC_DEFLATE]  = "deflate",
+};
+
+// Extension of the precompressed copy of a file, kept next to it (NULL
+// if the encoding is only produced on the fly)
+const char * const encoding_suffixes[N_ENCODINGS] = {
+    [ENC_IDENTITY] = "",
+    [ENC_BR]       = ".br",
+    [ENC_GZIP]     = ".gz",
+    [ENC_DEFLATE]  = NULL,
+};
+
+// Fields sent after the ETag for each encoding, once compressed
+// responses are served
+const char * const encoding_headers[N_ENCODINGS] = {
+    [ENC_IDENTITY] = "Vary: Accept-Encoding\r\n",
+    [ENC_BR]       = "Content-Encoding: br\r\nVary: Accept-Encoding\r\n",
+    [ENC_GZIP]     = "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n",
+    [ENC_DEFLATE]  = "Content-Encoding: deflate\r\nVary: Accept-Encoding\r\n",
+};
+
+/*
+ * Maps a content coding token onto one of our encodings.
+ *
+ * Returns:
+ * - The encoding, or -1 if we do not serve it.
+ */
+static
+int lookup_encoding(const char *token, size_t len) {
+    for (int enc = 0; enc < N_ENCODINGS; ++enc)
+        if (strlen(encoding_names[enc]) == len && !strncmp(token, encoding_names[enc], len))
+            return enc;
+
+    // Old alias of gzip
+    if (len == strlen("x-gzip") && !strncmp(token, "x-gzip", len))
+        return ENC_GZIP;
+
+    return -1;
+}
+
+/*
+ * Parses the value of an Accept-Encoding header (already lowercased).
+ * Codings with q=0 are refused; "*" accepts every coding not listed
+ * explicitly.
+ *
+ * Params:
+ * - const char *value : The value of the header.
+ *
+ * Returns:
+ * - A mask of ENC_BIT() for every encoding, other than identity, the
+ *   client accepts.
+ */
+int parse_accept_encoding(const char *value) {
+    int accepted = 0;
+    int listed   = 0;
+    int wildcard = 0;
+
+    const char *p = value;
+
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+
+        if (*p == '\0')
+            break;
+
+        size_t elem_len  = strcspn(p, ",");
+        size_t token_len = strcspn(p, ",; \t");
+
+        // Look for a quality value among the parameters
+        double q = 1.0;
+        const char *param = memchr(p, ';', elem_len);
+
+        while (param != NULL) {
+            param++;
+
+            while (*param == ' ' || *param == '\t')
+                param++;
+
+            if (!strncmp(param, "q=", 2))
+                q = strtod(param + 2, NULL);
+
+            param = memchr(param, ';', elem_len - (param - p));
+        }
+
+        if (token_len == 1 && *p == '*')
+            wildcard = q > 0 ? 1 : -1;
+        else {
+            int enc = lookup_encoding(p, token_len);
+
+            if (enc > ENC_IDENTITY) {
+                listed |= ENC_BIT(enc);
+
+                if (q > 0)
+                    accepted |= ENC_BIT(enc);
+            }
+        }
+
+        p += elem_len;
+    }
+
+    if (wildcard > 0)
+        for (int enc = ENC_IDENTITY + 1; enc < N_ENCODINGS; ++enc)
+            if (!(listed & ENC_BIT(enc)))
+                accepted |= ENC_BIT(enc);
+
+    return accepted;
+}
@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "http_date.h"
+
+// The date of the current second, shared by all threads. Writers bump the
+// sequence number before and after an update, so readers can detect a
+// torn copy and retry.
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int date_seq     = 0;
+static time_t       date_sec     = (time_t)-1;
+static char         date_buf[HTTP_DATE_LEN + 1];
+
+/*
+ * Formats a point in time as an IMF-fixdate.
+ *
+ * Params:
+ * - time_t t   : The time to format.
+ * - char *dest : A buffer of at least HTTP_DATE_LEN + 1 bytes.
+ *
+ * Returns: -
+ */
+void format_http_date(time_t t, char *dest) {
+    struct tm t_data;
+    gmtime_r(&t, &t_data);
+
+    strftime(dest, HTTP_DATE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT", &t_data);
+}
+
+/*
+ * Copies the current date, as used in the Date header, into dest. The
+ * string is formatted at most once per second, by whichever thread first
+ * notices that the second changed; everyone else just copies it.
+ *
+ * Params:
+ * - char *dest : A buffer of at least HTTP_DATE_LEN + 1 bytes.
+ *
+ * Returns: -
+ */
+void http_date_now(char *dest) {
+    struct timespec t_now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &t_now);
+
+    time_t cached = __atomic_load_n(&date_sec, __ATOMIC_ACQUIRE);
+
+    if (cached != t_now.tv_sec && pthread_mutex_trylock(&refresh_lock) == 0) {
+        if (date_sec != t_now.tv_sec) {
+            char fresh[HTTP_DATE_LEN + 1];
+            format_http_date(t_now.tv_sec, fresh);
+
+            __atomic_add_fetch(&date_seq, 1, __ATOMIC_ACQ_REL);
+            memcpy(date_buf, fresh, sizeof(date_buf));
+            __atomic_store_n(&date_sec, t_now.tv_sec, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&date_seq, 1, __ATOMIC_ACQ_REL);
+        }
+
+        pthread_mutex_unlock(&refresh_lock);
+    }
+    // Nothing was published yet, and someone else is busy publishing it
+    else if (cached == (time_t)-1) {
+        format_http_date(t_now.tv_sec, dest);
+        return;
+    }
+
+    for (;;) {
+        unsigned int seq = __atomic_load_n(&date_seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1)
+            continue;
+
+        memcpy(dest, date_buf, sizeof(date_buf));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&date_seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+}
+
+/*
+ * Parses an IMF-fixdate, as sent in If-Modified-Since. Month and day
+ * names are matched regardless of case.
+ *
+ * Params:
+ * - const char *str : The date string.
+ * - time_t *dest    : Where the parsed time will be stored.
+ *
+ * Returns:
+ * -  0 if the date was parsed.
+ * - -1 if it is malformed.
+ */
+int parse_http_date(const char *str, time_t *dest) {
+    struct tm t_data;
+    memset(&t_data, 0, sizeof(t_data));
+
+    const char *end = strptime(str, "%a, %d %b %Y %H:%M:%S", &t_data);
+
+    if (end == NULL || strcasecmp(end, " GMT"))
+        return -1;
+
+    *dest = timegm(&t_data);
+
+    return 0;
+}
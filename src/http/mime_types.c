@@ -0,0 +1,84 @@
+#include <strings.h>
+#include <string.h>
+
+#include "mime_types.h"
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+
+typedef struct {
+    const char *extension;
+    const char *type;
+} MimeType;
+
+static const MimeType mime_types[] = {
+    {"html",  "text/html"},
+    {"htm",   "text/html"},
+    {"css",   "text/css"},
+    {"js",    "application/javascript"},
+    {"mjs",   "application/javascript"},
+    {"json",  "application/json"},
+    {"txt",   "text/plain"},
+    {"xml",   "application/xml"},
+    {"svg",   "image/svg+xml"},
+    {"png",   "image/png"},
+    {"jpg",   "image/jpeg"},
+    {"jpeg",  "image/jpeg"},
+    {"gif",   "image/gif"},
+    {"webp",  "image/webp"},
+    {"ico",   "image/x-icon"},
+    {"woff",  "font/woff"},
+    {"woff2", "font/woff2"},
+    {"wasm",  "application/wasm"},
+    {"pdf",   "application/pdf"},
+    {"mp4",   "video/mp4"},
+    {"webm",  "video/webm"},
+    {"mp3",   "audio/mpeg"},
+    {"zip",   "application/zip"},
+    {"gz",    "application/gzip"},
+    {"tar",   "application/x-tar"},
+};
+
+/*
+ * Finds the media type of a file from its extension.
+ *
+ * Params:
+ * - const char *path : The path of the file.
+ *
+ * Returns:
+ * - The media type, or application/octet-stream if the extension is
+ *   missing or unknown.
+ */
+const char *mime_type(const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *dot   = strrchr(path, '.');
+
+    // The dot must be in the last path component
+    if (dot == NULL || (slash != NULL && dot < slash))
+        return DEFAULT_MIME_TYPE;
+
+    for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); ++i)
+        if (!strcasecmp(dot + 1, mime_types[i].extension))
+            return mime_types[i].type;
+
+    return DEFAULT_MIME_TYPE;
+}
+
+/*
+ * Checks if a media type is worth compressing. Images, video, audio and
+ * archives are compressed already.
+ *
+ * Params:
+ * - const char *type : The media type.
+ *
+ * Returns:
+ * - 1 if the type is text-like.
+ * - 0 otherwise.
+ */
+int mime_compressible(const char *type) {
+    return !strncmp(type, "text/", strlen("text/"))   ||
+           !strcmp(type, "application/javascript")    ||
+           !strcmp(type, "application/json")          ||
+           !strcmp(type, "application/xml")           ||
+           !strcmp(type, "application/wasm")          ||
+           !strcmp(type, "image/svg+xml");
+}
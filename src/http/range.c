@@ -0,0 +1,186 @@
+#include <strings.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "range.h"
+
+/*
+ * Parses a run of decimal digits.
+ *
+ * Params:
+ * - const char **str : The string; on success it points past the digits.
+ * - off_t *dest      : Where the number will be stored.
+ *
+ * Returns:
+ * -  0 if a number was parsed.
+ * - -1 if there were no digits, or the number overflowed.
+ */
+static
+int parse_offset(const char **str, off_t *dest) {
+    const char *p = *str;
+    off_t val = 0;
+
+    if (!isdigit((unsigned char) *p))
+        return -1;
+
+    for (; isdigit((unsigned char) *p); ++p) {
+        if (val > (INT64_MAX - (*p - '0')) / 10)
+            return -1;
+
+        val = val * 10 + (*p - '0');
+    }
+
+    *dest = val;
+    *str  = p;
+
+    return 0;
+}
+
+/*
+ * Parses a single range spec ("a-b", "a-" or "-n") and clamps it to the
+ * file.
+ *
+ * Params:
+ * - const char *spec : The spec, with no surrounding whitespace.
+ * - size_t len       : The length of the spec.
+ * - off_t size       : The size of the file.
+ * - ByteRange *dest  : Where the clamped range will be stored.
+ *
+ * Returns:
+ * -  1 if the range overlaps the file.
+ * -  0 if it is valid but does not overlap the file.
+ * - -1 if it is malformed.
+ */
+static
+int parse_spec(const char *spec, size_t len, off_t size, ByteRange *dest) {
+    const char *end = spec + len;
+    const char *p   = spec;
+
+    off_t first, last;
+
+    // Suffix range, the last n bytes
+    if (*p == '-') {
+        p++;
+
+        if (parse_offset(&p, &last) < 0 || p != end)
+            return -1;
+
+        if (last == 0 || size == 0)
+            return 0;
+
+        dest->start = last >= size ? 0 : size - last;
+        dest->end   = size - 1;
+
+        return 1;
+    }
+
+    if (parse_offset(&p, &first) < 0 || p == end || *p++ != '-')
+        return -1;
+
+    // Open ended range
+    if (p == end)
+        last = size - 1;
+    else {
+        if (parse_offset(&p, &last) < 0 || p != end || last < first)
+            return -1;
+
+        if (last >= size)
+            last = size - 1;
+    }
+
+    if (first >= size)
+        return 0;
+
+    dest->start = first;
+    dest->end   = last;
+
+    return 1;
+}
+
+/*
+ * Parses the value of a Range header against a file of the given size.
+ * The satisfiable ranges are sorted, and overlapping or adjacent ones are
+ * merged, so a client can never make us send the same bytes twice.
+ *
+ * Params:
+ * - const char *value : The value of the Range header.
+ * - off_t size        : The size of the file.
+ * - ByteRange *ranges : An array of at least max_ranges entries.
+ * - int max_ranges    : The maximum number of ranges we will serve.
+ *
+ * Returns:
+ * - The number of ranges stored, if the header can be served as a
+ *   partial response.
+ * - 0 if the header must be ignored (malformed, not in bytes or with too
+ *   many ranges), and the whole file sent.
+ * - RANGE_UNSATISFIABLE if no range overlaps the file.
+ */
+int parse_range(const char *value, off_t size, ByteRange *ranges, int max_ranges) {
+    if (strncasecmp(value, "bytes=", strlen("bytes=")))
+        return 0;
+
+    const char *p = value + strlen("bytes=");
+
+    int n_ranges = 0;
+    int n_specs  = 0;
+
+    for (;;) {
+        // Skip whitespace and empty list elements
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+
+        if (*p == '\0')
+            break;
+
+        size_t len = strcspn(p, ",");
+
+        // Drop trailing whitespace
+        size_t spec_len = len;
+        while (spec_len > 0 && (p[spec_len - 1] == ' ' || p[spec_len - 1] == '\t'))
+            spec_len--;
+
+        if (++n_specs > max_ranges)
+            return 0;
+
+        ByteRange range;
+        int ret = parse_spec(p, spec_len, size, &range);
+
+        if (ret < 0)
+            return 0;
+
+        if (ret > 0) {
+            // Insertion sort on the start offset
+            int i = n_ranges++;
+
+            while (i > 0 && ranges[i - 1].start > range.start) {
+                ranges[i] = ranges[i - 1];
+                i--;
+            }
+
+            ranges[i] = range;
+        }
+
+        p += len;
+    }
+
+    if (n_specs == 0)
+        return 0;
+
+    if (n_ranges == 0)
+        return RANGE_UNSATISFIABLE;
+
+    // Merge overlapping and adjacent ranges
+    int out = 0;
+
+    for (int i = 1; i < n_ranges; ++i) {
+        if (ranges[i].start <= ranges[out].end + 1) {
+            if (ranges[i].end > ranges[out].end)
+                ranges[out].end = ranges[i].end;
+        }
+        else
+            ranges[++out] = ranges[i];
+    }
+
+    return out + 1;
+}
@@ -1,4 +1,8 @@
-#include "http_types.h"
+#include <pthread.h>
+#include <string.h>
+
+#include "response_messages.h"
+#include "http_date.h"
 
 const char * const response_messages[] =
 {
@@ -20,7 +24,7 @@ const char * const response_messages[] =
     "Content-Type: text/html\r\n"
     "Connection: close\r\n"
     "\r\n"
-    "<html>Not Implemeneted</html>",
+    "<html>Not Implemented</html>",
 
     // Version Not Supported
     [VERSION_NOT_SUPPORTED] = 
@@ -72,12 +76,168 @@ const char * const response_messages[] =
     "\r\n"
     "<html>Request Timeout</html>",
 
-    // OK
+    // Service Unavailable, the server is too busy to take the connection
+    [SERVICE_UNAVAILABLE] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Date: %s\r\n"
+    "Content-Length: 32\r\n"
+    "Content-Type: text/html\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "<html>Service Unavailable</html>",
+
+    // OK, the last %s holds optional fields such as Content-Encoding
     [OK] = 
     "HTTP/1.1 200 OK\r\n"
     "Date: %s\r\n"
     "Content-Length: %ld\r\n"
-    "Content-Type: text/html\r\n"
+    "Content-Type: %s\r\n"
+    "Last-Modified: %s\r\n"
+    "ETag: %s\r\n"
+    "%s"
+    "%s"
+    "Accept-Ranges: bytes\r\n"
     "Connection: close\r\n"
     "\r\n"
 };
+
+// File compressed on the fly, its length is not known up front
+const char * const chunked_response =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: %s\r\n"
+    "Content-Type: %s\r\n"
+    "Last-Modified: %s\r\n"
+    "ETag: %s\r\n"
+    "%s"
+    "%s"
+    "Transfer-Encoding: chunked\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+// Single range of a file
+const char * const partial_response =
+    "HTTP/1.1 206 Partial Content\r\n"
+    "Date: %s\r\n"
+    "Content-Length: %ld\r\n"
+    "Content-Type: %s\r\n"
+    "Content-Range: bytes %ld-%ld/%ld\r\n"
+    "Last-Modified: %s\r\n"
+    "ETag: %s\r\n"
+    "%s"
+    "%s"
+    "Accept-Ranges: bytes\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+// Several ranges of a file, each sent as a part of the body
+const char * const multipart_response =
+    "HTTP/1.1 206 Partial Content\r\n"
+    "Date: %s\r\n"
+    "Content-Length: %ld\r\n"
+    "Content-Type: multipart/byteranges; boundary=%s\r\n"
+    "Last-Modified: %s\r\n"
+    "ETag: %s\r\n"
+    "%s"
+    "%s"
+    "Accept-Ranges: bytes\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+// Header of every part of a multipart/byteranges body
+const char * const multipart_part =
+    "\r\n"
+    "--%s\r\n"
+    "Content-Type: %s\r\n"
+    "Content-Range: bytes %ld-%ld/%ld\r\n"
+    "\r\n";
+
+// Closing delimiter of a multipart/byteranges body
+const char * const multipart_end =
+    "\r\n"
+    "--%s--\r\n";
+
+// The cached copy of the client is still valid
+const char * const not_modified_response =
+    "HTTP/1.1 304 Not Modified\r\n"
+    "Date: %s\r\n"
+    "Last-Modified: %s\r\n"
+    "ETag: %s\r\n"
+    "%s"
+    "%s"
+    "Connection: close\r\n"
+    "\r\n";
+
+// None of the requested ranges overlaps the file
+const char * const range_not_satisfiable_response =
+    "HTTP/1.1 416 Range Not Satisfiable\r\n"
+    "Date: %s\r\n"
+    "Content-Length: 0\r\n"
+    "Content-Range: bytes */%ld\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+// Error responses, split around their date slot
+typedef struct {
+    const char *head;
+    size_t head_len;
+    const char *tail;
+    size_t tail_len;
+} ErrResponse;
+
+static ErrResponse err_responses[OK];
+
+static pthread_once_t err_responses_once = PTHREAD_ONCE_INIT;
+
+// Splits every error template around its "%s" date slot, once.
+static
+void init_err_responses(void) {
+    for (int err = 0; err < OK; ++err) {
+        const char *msg = response_messages[err];
+
+        if (msg == NULL)
+            continue;
+
+        const char *slot = strstr(msg, "%s");
+
+        err_responses[err].head     = msg;
+        err_responses[err].head_len = slot - msg;
+        err_responses[err].tail     = slot + 2;
+        err_responses[err].tail_len = strlen(slot + 2);
+    }
+}
+
+/*
+ * Fills three iovecs with the prebuilt error response for err and the
+ * current date, so that it can be sent with a single writev. Nothing is
+ * formatted or allocated.
+ *
+ * Params:
+ * - HttpError err     : The HTTP error code of the response.
+ * - char *date        : A buffer of at least HTTP_DATE_LEN + 1 bytes, that
+ *                       must live until the response is sent.
+ * - struct iovec *iov : The first of the three iovecs.
+ *
+ * Returns:
+ * -  0 if the iovecs were filled.
+ * - -1 if there is no response for err.
+ */
+int err_response_iov(HttpError err, char *date, struct iovec *iov) {
+    if (err < 0 || err >= OK || response_messages[err] == NULL)
+        return -1;
+
+    pthread_once(&err_responses_once, init_err_responses);
+
+    http_date_now(date);
+
+    ErrResponse *resp = &err_responses[err];
+
+    iov[0].iov_base = (void*) resp->head;
+    iov[0].iov_len  = resp->head_len;
+    iov[1].iov_base = date;
+    iov[1].iov_len  = HTTP_DATE_LEN;
+    iov[2].iov_base = (void*) resp->tail;
+    iov[2].iov_len  = resp->tail_len;
+
+    return 0;
+}
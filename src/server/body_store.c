@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "body_store.h"
+#include "hash.h"
+#include "utils.h"
+
+/*
+ * Creates a new, empty, body store.
+ *
+ * Returns:
+ * - A new store if no error occurred.
+ * - NULL otherwise.
+ */
+BodyStore *body_store_create(void) {
+    BodyStore *store = (BodyStore*) calloc(1, sizeof(BodyStore));
+
+    if (store == NULL) {
+        ERR("Memory allocation during body store creation failed");
+        return NULL;
+    }
+
+    for (int i = 0; i < BS_SHARDS; ++i) {
+        int err;
+        if ((err = pthread_mutex_init(&store->shards[i].lock, NULL))) {
+            P_ERR("Failed to initialize body store mutex", err);
+
+            for (int j = 0; j < i; ++j)
+                pthread_mutex_destroy(&store->shards[j].lock);
+
+            free(store);
+            return NULL;
+        }
+    }
+
+    return store;
+}
+
+/*
+ * Stores a body, or finds a stored body with the same content. The content
+ * is hashed outside of any lock, and a body with the same hash is only
+ * shared if its bytes are the same too.
+ *
+ * Params:
+ * - BodyStore *store : The store.
+ * - char *data       : The body. The store takes ownership of it, and frees
+ *                      it if the same body is already stored.
+ * - size_t len       : The length of the body.
+ *
+ * Returns:
+ * - The stored body, with a reference taken for the caller.
+ * - NULL if it could not be stored. The caller keeps data.
+ */
+StoredBody *body_store_intern(BodyStore *store, char *data, size_t len) {
+    uint64_t hash    = xxh64(data, len, 0);
+    BodyShard *shard = &store->shards[hash % BS_SHARDS];
+    StoredBody **bucket = &shard->buckets[(hash / BS_SHARDS) % BS_BUCKETS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (StoredBody *body = *bucket; body != NULL; body = body->next)
+        if (body->hash == hash && body->len == len && !memcmp(body->data, data, len)) {
+            body->refs++;
+
+            shard->ref_bytes += len;
+            shard->dedup_hits++;
+
+            pthread_mutex_unlock(&shard->lock);
+
+            free(data);
+
+            return body;
+        }
+
+    StoredBody *body = (StoredBody*) malloc(sizeof(StoredBody));
+
+    if (body == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    body->data  = data;
+    body->len   = len;
+    body->hash  = hash;
+    body->refs  = 1;
+    body->payer  = NULL;
+    body->unpaid = NULL;
+    body->shard  = shard;
+    body->next  = *bucket;
+    *bucket     = body;
+
+    shard->bytes     += len;
+    shard->ref_bytes += len;
+    shard->n_bodies++;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return body;
+}
+
+/*
+ * Charges a body to a cached entry, unless another entry pays for it
+ * already. A body nobody paid for stops counting as unpaid.
+ *
+ * Params:
+ * - StoredBody *body  : The body.
+ * - const void *payer : The entry.
+ *
+ * Returns:
+ * - 1 if the body is now charged to the entry.
+ * - 0 if another entry pays for it.
+ */
+int body_store_claim(StoredBody *body, const void *payer) {
+    BodyShard *shard = body->shard;
+
+    pthread_mutex_lock(&shard->lock);
+
+    int claimed = body->payer == NULL;
+
+    if (claimed) {
+        body->payer = payer;
+
+        if (body->unpaid != NULL) {
+            __atomic_sub_fetch(body->unpaid, body->len, __ATOMIC_RELAXED);
+            body->unpaid = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return claimed;
+}
+
+/*
+ * Stops charging a body to an entry leaving the cache, so the next entry
+ * pointing at it can claim it. Until one does, the body is added to the
+ * unpaid counter if other entries still point at it, so the memory it
+ * holds is not lost track of. Does nothing if the entry does not pay for
+ * the body.
+ *
+ * Params:
+ * - StoredBody *body  : The body.
+ * - const void *payer : The entry.
+ * - size_t *unpaid    : The counter of the bytes nobody pays for, updated
+ *                       atomically.
+ *
+ * Returns: -
+ */
+void body_store_unclaim(StoredBody *body, const void *payer, size_t *unpaid) {
+    BodyShard *shard = body->shard;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (body->payer == payer) {
+        body->payer = NULL;
+
+        if (body->refs > 1) {
+            body->unpaid = unpaid;
+            __atomic_add_fetch(unpaid, body->len, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Drops a reference to a stored body, and frees it once no references are
+ * left.
+ *
+ * Params:
+ * - StoredBody *body : The body we are done with.
+ *
+ * Returns: -
+ */
+void body_store_release(StoredBody *body) {
+    if (body == NULL)
+        return;
+
+    BodyShard *shard = body->shard;
+
+    pthread_mutex_lock(&shard->lock);
+
+    shard->ref_bytes -= body->len;
+
+    if (--body->refs > 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    StoredBody **link = &shard->buckets[(body->hash / BS_SHARDS) % BS_BUCKETS];
+
+    while (*link != body)
+        link = &(*link)->next;
+
+    *link = body->next;
+
+    if (body->unpaid != NULL)
+        __atomic_sub_fetch(body->unpaid, body->len, __ATOMIC_RELAXED);
+
+    shard->bytes -= body->len;
+    shard->n_bodies--;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    free(body->data);
+    free(body);
+}
+
+/*
+ * Collects the statistics of all the shards.
+ *
+ * Params:
+ * - BodyStore *store     : The store.
+ * - BodyStoreStats *dest : The struct where the totals will be stored.
+ *
+ * Returns: -
+ */
+void get_body_store_stats(BodyStore *store, BodyStoreStats *dest) {
+    memset(dest, 0, sizeof(BodyStoreStats));
+
+    for (int i = 0; i < BS_SHARDS; ++i) {
+        BodyShard *shard = &store->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        dest->n_bodies   += shard->n_bodies;
+        dest->dedup_hits += shard->dedup_hits;
+        dest->bytes      += shard->bytes;
+        dest->ref_bytes  += shard->ref_bytes;
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/*
+ * Destructor for the store. Must only be called once every body was
+ * released.
+ *
+ * Params:
+ * - BodyStore *store : The store we want to free.
+ *
+ * Returns: -
+ */
+void body_store_destroy(BodyStore *store) {
+    if (store == NULL)
+        return;
+
+    for (int i = 0; i < BS_SHARDS; ++i)
+        pthread_mutex_destroy(&store->shards[i].lock);
+
+    free(store);
+}
@@ -1,11 +1,13 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
 
 #include "command_manager.h"
 #include "server_manager.h"
 #include "server_types.h"
 #include "network_io.h"
+#include "pipeline.h"
 #include "utils.h"
 
 #define CMD_BUF_SZ 512
@@ -151,6 +153,572 @@ EXIT:
     free(msg);
 }
 
+/*
+ * Formats a message and sends it to fd.
+ *
+ * Params:
+ * - int fd          : The file descriptor we will respond to.
+ * - const char *fmt : The printf style format of the message.
+ *
+ * Returns:
+ * - IO_OK if no error occured.
+ * - An appropriate IO error code otherwise.
+ */
+static
+int write_formatted(int fd, const char *fmt, ...) {
+    va_list args;
+
+    // Calculate required buffer length
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        P_DEBUG("vsnprintf failed while formatting message\n");
+        return IO_UNEXPECTED;
+    }
+
+    char *msg = malloc(len + 1);
+
+    if (msg == NULL) {
+        P_ERR("Malloc failed for command response", errno);
+        return IO_UNEXPECTED;
+    }
+
+    va_start(args, fmt);
+    len = vsnprintf(msg, len + 1, fmt, args);
+    va_end(args);
+
+    int status = len < 0 ? IO_UNEXPECTED : write_bytes(fd, msg, CMD_TIMEOUT, len);
+
+    free(msg);
+    return status;
+}
+
+/*
+ * Handler for the STAGES command. Reports the queue depth and the average
+ * queueing and service latency of every pipeline stage, and of the disk
+ * pool, and how many connections the pipeline turned away.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_stages(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "Stage %-7s : %d threads, %d queued, %llu processed, avg wait %.3f ms, avg service %.3f ms\r\n";
+
+    if (server->disk_pool != NULL) {
+        DiskPoolStats stats;
+        if (get_disk_pool_stats(server->disk_pool, &stats) < 0)
+            return;
+
+        double n = stats.n_processed ? (double)stats.n_processed : 1.0;
+
+        if (write_formatted(fd, "Disk pool : %d threads, %d queued, %llu processed, avg wait %.3f ms, "
+                                "avg service %.3f ms, %llu resident, %llu deferred, %llu inline with a full queue\r\n",
+                                stats.n_threads,
+                                stats.queued,
+                                stats.n_processed,
+                                stats.wait_usec / n / 1000.0,
+                                stats.service_usec / n / 1000.0,
+                                stats.resident,
+                                stats.deferred,
+                                stats.overflows) != IO_OK)
+            return;
+    }
+
+    if (server->pipeline == NULL) {
+        write_formatted(fd, "Staged mode disabled\r\n");
+        return;
+    }
+
+    for (int i = 0; i < N_STAGES; ++i) {
+        PipelineStage *stage = &server->pipeline->stages[i];
+
+        StageStats stats;
+        if (get_stage_stats(stage, &stats) < 0)
+            return;
+
+        // Avoid dividing by zero before the first request
+        double n = stats.n_processed ? (double)stats.n_processed : 1.0;
+
+        if (write_formatted(fd, msg_fmt, stage->name,
+                                         stats.n_threads,
+                                         stats.queued,
+                                         stats.n_processed,
+                                         stats.wait_usec / n / 1000.0,
+                                         stats.service_usec / n / 1000.0) != IO_OK)
+            return;
+    }
+
+    write_formatted(fd, "Shed : %llu connections refused with a full parse queue\r\n",
+                    __atomic_load_n(&server->pipeline->shed, __ATOMIC_RELAXED));
+}
+
+/*
+ * Reports the bodies a file cache holds once for several entries, and the
+ * ratio of the bytes its entries point at to the bytes it holds. Nothing
+ * is reported if the cache does not deduplicate.
+ *
+ * Params:
+ * - int fd           : The file descriptor we will respond to.
+ * - const char *name : The name of the cache.
+ * - FileCache *cache : The cache.
+ *
+ * Returns: -
+ */
+static
+void write_dedup(int fd, const char *name, FileCache *cache) {
+    if (cache->bodies == NULL)
+        return;
+
+    BodyStoreStats stats;
+    get_body_store_stats(cache->bodies, &stats);
+
+    write_formatted(fd, "%s : %llu bodies, %zu bytes held for %zu bytes of entries, ratio %.2f, %llu shared\r\n",
+                    name, stats.n_bodies, stats.bytes, stats.ref_bytes,
+                    stats.bytes > 0 ? (double) stats.ref_bytes / stats.bytes : 1.0, stats.dedup_hits);
+}
+
+/*
+ * Handler for the CACHE command. Reports the file cache counters, along
+ * with how many requests waited on a load instead of reading the file,
+ * those of the content hash cache if ETags are content based, those of the
+ * cache of the files compressed on the fly, the bytes of large files
+ * dropped from the page cache, the bodies sent without a copy, and how
+ * much memory deduplicated bodies save.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_cache(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "File cache : %llu entries, %zu/%zu bytes, %llu hits, %llu misses, "
+    "%llu evictions, %llu rejected, %llu invalidated\r\n";
+
+    if (server->hash_cache != NULL)
+        write_formatted(fd, "Hash cache : %llu hits, %llu misses\r\n",
+                        __atomic_load_n(&server->hash_cache->hits, __ATOMIC_RELAXED),
+                        __atomic_load_n(&server->hash_cache->misses, __ATOMIC_RELAXED));
+
+    if (server->options.drop_behind_min > 0)
+        write_formatted(fd, "Page cache : %llu bytes dropped behind large transfers\r\n",
+                        __atomic_load_n(&server->stats.dropped_bytes, __ATOMIC_RELAXED));
+
+    if (server->options.zerocopy_min > 0)
+        write_formatted(fd, "Zero copy : %llu sends, %llu bytes not copied, %llu copied by the kernel, "
+                            "%llu copied below %ld bytes, %llu unsupported\r\n",
+                        __atomic_load_n(&server->stats.zc_sends, __ATOMIC_RELAXED),
+                        __atomic_load_n(&server->stats.zc_bytes, __ATOMIC_RELAXED),
+                        __atomic_load_n(&server->stats.zc_copied, __ATOMIC_RELAXED),
+                        __atomic_load_n(&server->stats.zc_small, __ATOMIC_RELAXED),
+                        server->options.zerocopy_min,
+                        __atomic_load_n(&server->stats.zc_unsupported, __ATOMIC_RELAXED));
+
+    FileCacheStats stats;
+
+    if (server->compress_cache != NULL) {
+        get_file_cache_stats(server->compress_cache, &stats);
+
+        write_formatted(fd, "Compressed cache : %llu entries, %zu/%zu bytes, %llu hits, %llu misses, "
+                            "%llu evictions, %llu rejected, %llu invalidated\r\n",
+                        stats.n_entries, stats.bytes, stats.max_bytes, stats.hits, stats.misses,
+                        stats.evictions, stats.rejections, stats.invalidations);
+        write_dedup(fd, "Compressed dedup", server->compress_cache);
+    }
+
+    if (server->file_cache == NULL) {
+        write_formatted(fd, "File cache disabled\r\n");
+        return;
+    }
+
+    SingleFlightStats sf_stats;
+    get_single_flight_stats(server->flights, &sf_stats);
+
+    write_formatted(fd, "Single flight : %llu loads, %llu followers, %d most followers per load, "
+                        "%llu failed, %d in flight\r\n",
+                    sf_stats.loads, sf_stats.followers, sf_stats.max_followers,
+                    sf_stats.failures, sf_stats.in_flight);
+
+    get_file_cache_stats(server->file_cache, &stats);
+
+    write_formatted(fd, msg_fmt, stats.n_entries,
+                                 stats.bytes,
+                                 stats.max_bytes,
+                                 stats.hits,
+                                 stats.misses,
+                                 stats.evictions,
+                                 stats.rejections,
+                                 stats.invalidations);
+
+    write_dedup(fd, "Dedup", server->file_cache);
+}
+
+/*
+ * Handler for the FDCACHE command. Reports the open file cache counters.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_fd_cache(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "Fd cache : %d/%d files, %llu hits, %llu misses, %llu expired, %llu evictions\r\n";
+
+    if (server->fd_cache == NULL) {
+        write_formatted(fd, "Fd cache disabled\r\n");
+        return;
+    }
+
+    FdCacheStats stats;
+    get_fd_cache_stats(server->fd_cache, &stats);
+
+    write_formatted(fd, msg_fmt, stats.n_entries,
+                                 stats.max_entries,
+                                 stats.hits,
+                                 stats.misses,
+                                 stats.expired,
+                                 stats.evictions);
+}
+
+/*
+ * Handler for the PRECOMPRESS command. Reports the progress of the job
+ * creating the .gz copies.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_precompress(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "Precompress : %s, %llu queued, %llu compressed, %llu skipped, %llu failed, %llu -> %llu bytes\r\n";
+
+    Precompressor *pre = server->precompressor;
+
+    if (pre == NULL) {
+        write_formatted(fd, "Precompress disabled\r\n");
+        return;
+    }
+
+    write_formatted(fd, msg_fmt, pre->walking ? "walking" : "walked",
+                                 __atomic_load_n(&pre->queued, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&pre->compressed, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&pre->skipped, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&pre->failed, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&pre->bytes_in, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&pre->bytes_out, __ATOMIC_RELAXED));
+}
+
+/*
+ * Handler for the INDEX command. Reports the size of the root directory
+ * index, and how often it answered lookups.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_index(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "Index : %zu files, %zu dirs, %zu bytes, scanned in %.3f ms, %llu hits, %llu fallbacks, "
+    "%llu updates, %llu rescans, %llu Bloom rejects\r\n";
+
+    RootVersion *root = server->roots != NULL ? root_store_acquire(server->roots) : NULL;
+    NsIndex *index    = root != NULL ? root->ns_index : NULL;
+
+    if (index == NULL) {
+        write_formatted(fd, "Index disabled\r\n");
+        root_version_release(root);
+        return;
+    }
+
+    // The sizes change with the inotify events
+    pthread_rwlock_rdlock(&index->lock);
+
+    size_t n_files = index->n_files;
+    size_t n_dirs  = index->n_dirs;
+    size_t bytes   = index->bytes;
+
+    pthread_rwlock_unlock(&index->lock);
+
+    write_formatted(fd, msg_fmt, n_files,
+                                 n_dirs,
+                                 bytes,
+                                 index->scan_ms,
+                                 __atomic_load_n(&index->hits, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&index->fallbacks, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&index->updates, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&index->rescans, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&index->bloom_rejects, __ATOMIC_RELAXED));
+
+    root_version_release(root);
+}
+
+/*
+ * Handler for the NEGCACHE command. Reports the negative cache counters.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_neg_cache(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "Negative cache : %d/%d paths, %llu hits, %llu misses, %llu invalidated, %llu evictions, "
+    "%llu uncached, generation %llu\r\n";
+
+    RootVersion *root = server->roots != NULL ? root_store_acquire(server->roots) : NULL;
+
+    if (root == NULL || root->neg_cache == NULL) {
+        write_formatted(fd, "Negative cache disabled\r\n");
+        root_version_release(root);
+        return;
+    }
+
+    NegCacheStats stats;
+    get_neg_cache_stats(root->neg_cache, &stats);
+
+    root_version_release(root);
+
+    write_formatted(fd, msg_fmt, stats.n_entries,
+                                 stats.max_entries,
+                                 stats.hits,
+                                 stats.misses,
+                                 stats.invalidated,
+                                 stats.evictions,
+                                 stats.uncached,
+                                 stats.generation);
+}
+
+/*
+ * Handler for the RELOADPACK command. Opens the pack path again, so a pack
+ * renamed over it is served from now on, and reports the pack served.
+ * Requests already sending from the previous pack finish with it.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_reload_pack(int fd, ServerResources *server) {
+    static const char *msg_fmt = "Pack %s : %u bodies, %u paths, %zu bytes, %llu reloads\r\n";
+
+    if (server->packs == NULL) {
+        write_formatted(fd, "Not serving a pack\r\n");
+        return;
+    }
+
+    int status = pack_store_reload(server->packs);
+
+    Pack *pack = pack_store_acquire(server->packs);
+
+    write_formatted(fd, msg_fmt, status == 0 ? "reloaded" : "kept, the new one could not be opened",
+                                 pack->header->n_records,
+                                 pack->header->n_keys,
+                                 pack->size,
+                                 __atomic_load_n(&server->packs->reloads, __ATOMIC_RELAXED));
+
+    pack_release(pack);
+}
+
+/*
+ * Handler for the RELOADROOT command. Resolves the root path again, so a
+ * symlink flipped to a new release is served from now on, and reports the
+ * version served. Requests already running finish against the previous
+ * version, and the cached files that did not change carry over. A new
+ * release is precompressed too, if the server precompresses its root.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_reload_root(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "Root %s : %s, version %lu, loaded in %.3f ms, %llu reloads, %llu fd cache entries carried over, "
+    "%llu replaced\r\n";
+
+    if (server->roots == NULL) {
+        write_formatted(fd, "Serving a pack\r\n");
+        return;
+    }
+
+    int status = root_store_reload(server->roots);
+
+    RootVersion *root = root_store_acquire(server->roots);
+
+    // Only this thread reads root_dir once the server runs
+    if (status > 0) {
+        char *root_dir = strdup(root->dir);
+
+        if (root_dir != NULL) {
+            free(server->root_dir);
+            server->root_dir = root_dir;
+        }
+
+        if (server->precompressor != NULL && precompress_restart(server->precompressor, root->dir) < 0)
+            ERR("Failed to precompress the new root");
+    }
+
+    write_formatted(fd, msg_fmt, status > 0  ? "reloaded"  :
+                                 status == 0 ? "unchanged" : "kept, the new one could not be opened",
+                                 root->dir,
+                                 root->gen,
+                                 root->load_ms,
+                                 __atomic_load_n(&server->roots->reloads, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&server->roots->carried, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&server->roots->replaced, __ATOMIC_RELAXED));
+
+    root_version_release(root);
+}
+
+/*
+ * Handler for the WARM command. Reports the progress of the warming of
+ * the paths saved by the previous run, and the paths tracked for the
+ * next one.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_warm(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "Prewarm : %d/%d paths, %d missing, %llu bytes, %s %.3f ms\r\n"
+    "Hot set : %d paths tracked, %llu hits, %llu untracked, %llu saves, %d paths last saved\r\n";
+
+    if (server->hot_set == NULL) {
+        write_formatted(fd, "Hot set disabled\r\n");
+        return;
+    }
+
+    HotSetStats stats;
+    get_hot_set_stats(server->hot_set, &stats);
+
+    write_formatted(fd, msg_fmt, stats.warmed + stats.warm_missing,
+                                 stats.warm_total,
+                                 stats.warm_missing,
+                                 stats.warm_bytes,
+                                 stats.warm_running ? "running for" : "done in",
+                                 stats.warm_ms,
+                                 stats.tracked,
+                                 stats.recorded,
+                                 stats.untracked,
+                                 stats.saves,
+                                 stats.last_saved);
+}
+
+/*
+ * Handler for the LOCALCACHE command. Reports the local cache counters.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ *
+ * Returns: -
+ */
+static
+void cmd_local_cache(int fd, ServerResources *server) {
+    static const char *msg_fmt =
+    "Local cache : %d files, %zu/%zu bytes, %llu hits, %llu misses, %llu revalidations, %llu invalidated, "
+    "%llu copies, %llu failed, %d queued, %llu dropped, %llu evictions\r\n";
+
+    if (server->local_cache == NULL) {
+        write_formatted(fd, "Local cache disabled\r\n");
+        return;
+    }
+
+    LocalCacheStats stats;
+    get_local_cache_stats(server->local_cache, &stats);
+
+    write_formatted(fd, msg_fmt, stats.n_entries,
+                                 stats.bytes,
+                                 stats.max_bytes,
+                                 stats.hits,
+                                 stats.misses,
+                                 stats.revalidations,
+                                 stats.invalidated,
+                                 stats.copies,
+                                 stats.copy_failures,
+                                 stats.queued,
+                                 stats.dropped,
+                                 stats.evictions);
+}
+
+/*
+ * Handler for the RATELIMIT command. With "RATELIMIT <conn_kb> <global_kb>",
+ * sets the KB/s of the bodies of each connection and of all of them (0 for
+ * unlimited), from the next bodies sent on. Reports the limits in place
+ * and the shaping counters.
+ *
+ * Params:
+ * - int fd                  : The file descriptor we will respond to.
+ * - ServerResources *server : The struct containing all server resources.
+ * - const char *args        : The arguments of the command (NULL if none).
+ *
+ * Returns: -
+ */
+static
+void cmd_rate_limit(int fd, ServerResources *server, const char *args) {
+    static const char *msg_fmt =
+    "Rate limits : %ld bytes/s per connection, %ld bytes/s in total, after %ld bytes, %llu bodies shaped, "
+    "%llu paced by the kernel, %llu sleeps, %llu ms slept, %llu responses handed to the shaping threads, "
+    "%llu refused with a full queue\r\n";
+
+    RateLimiter *limiter = server->limiter;
+
+    if (limiter == NULL) {
+        write_formatted(fd, "Rate limiter disabled\r\n");
+        return;
+    }
+
+    if (args != NULL) {
+        long conn_kb, global_kb;
+        char end;
+
+        if (sscanf(args, "%ld %ld %c", &conn_kb, &global_kb, &end) != 2 || conn_kb < 0 || global_kb < 0) {
+            write_formatted(fd, "Usage : RATELIMIT [<conn_kb> <global_kb>]\r\n");
+            return;
+        }
+
+        rate_limiter_set(limiter, conn_kb * 1024, global_kb * 1024);
+    }
+
+    write_formatted(fd, msg_fmt, __atomic_load_n(&limiter->conn_rate, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&limiter->global_rate, __ATOMIC_RELAXED),
+                                 limiter->burst,
+                                 __atomic_load_n(&limiter->shaped, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&limiter->paced, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&limiter->sleeps, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&limiter->slept_us, __ATOMIC_RELAXED) / 1000,
+                                 __atomic_load_n(&limiter->deferred, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&limiter->refused, __ATOMIC_RELAXED));
+}
+
 /*
  * Reads the command, analyzes it and calls the appropriate handler.
  *
@@ -174,6 +742,39 @@ int accept_command(int fd, ServerResources *server) {
     } else if (!strcmp(cmd, "STATS")) {
         cmd_stats(fd, server);
         err = CMD_STATS;
+    } else if (!strcmp(cmd, "STAGES")) {
+        cmd_stages(fd, server);
+        err = CMD_STAGES;
+    } else if (!strcmp(cmd, "CACHE")) {
+        cmd_cache(fd, server);
+        err = CMD_CACHE;
+    } else if (!strcmp(cmd, "FDCACHE")) {
+        cmd_fd_cache(fd, server);
+        err = CMD_FDCACHE;
+    } else if (!strcmp(cmd, "PRECOMPRESS")) {
+        cmd_precompress(fd, server);
+        err = CMD_PRECOMPRESS;
+    } else if (!strcmp(cmd, "INDEX")) {
+        cmd_index(fd, server);
+        err = CMD_INDEX;
+    } else if (!strcmp(cmd, "NEGCACHE")) {
+        cmd_neg_cache(fd, server);
+        err = CMD_NEGCACHE;
+    } else if (!strcmp(cmd, "RELOADPACK")) {
+        cmd_reload_pack(fd, server);
+        err = CMD_RELOADPACK;
+    } else if (!strcmp(cmd, "RELOADROOT")) {
+        cmd_reload_root(fd, server);
+        err = CMD_RELOADROOT;
+    } else if (!strcmp(cmd, "WARM")) {
+        cmd_warm(fd, server);
+        err = CMD_WARM;
+    } else if (!strcmp(cmd, "LOCALCACHE")) {
+        cmd_local_cache(fd, server);
+        err = CMD_LOCALCACHE;
+    } else if (!strcmp(cmd, "RATELIMIT") || !strncmp(cmd, "RATELIMIT ", 10)) {
+        cmd_rate_limit(fd, server, cmd[9] == ' ' ? cmd + 10 : NULL);
+        err = CMD_RATELIMIT;
     } else if (!strcmp(cmd, "KILLT")) {
         pthread_cancel(server->thread_pool->threads[0]);
     } else {
@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk_pool.h"
+#include "utils.h"
+
+/*
+ * A response handed to the disk pool, along with the time it was queued.
+ */
+typedef struct {
+    DiskPool *disk;
+
+    void (*handler)(void*);
+    void *arg;
+
+    struct timeval t_ready;
+} DiskJob;
+
+// Microseconds elapsed between two timevals.
+static
+unsigned long long elapsed_usec(struct timeval *t_start, struct timeval *t_end) {
+    return (t_end->tv_sec - t_start->tv_sec) * 1000000ULL + (t_end->tv_usec - t_start->tv_usec);
+}
+
+/*
+ * Runs a response handed to the pool, and accounts the time it spent
+ * waiting in the queue and running.
+ *
+ * Params:
+ * - void *arg : The DiskJob.
+ *
+ * Returns: -
+ */
+static
+void run_disk_job(void *arg) {
+    DiskJob *job   = (DiskJob*) arg;
+    DiskPool *disk = job->disk;
+
+    struct timeval t_start;
+    gettimeofday(&t_start, NULL);
+
+    job->handler(job->arg);
+
+    struct timeval t_end;
+    gettimeofday(&t_end, NULL);
+
+    int err;
+    if ((err = pthread_mutex_lock(&disk->lock))) {
+        P_ERR("Could not acquire lock for disk pool stats", err);
+        return;
+    }
+
+    disk->n_processed++;
+    disk->wait_usec    += elapsed_usec(&job->t_ready, &t_start);
+    disk->service_usec += elapsed_usec(&t_start, &t_end);
+
+    pthread_mutex_unlock(&disk->lock);
+}
+
+/*
+ * Creates the disk I/O pool.
+ *
+ * Params:
+ * - int n_threads : The number of disk threads.
+ * - int queue_sz  : The capacity of the queue in front of them.
+ *
+ * Returns:
+ * - A new pool if no error occurred.
+ * - NULL otherwise.
+ */
+DiskPool *disk_pool_create(int n_threads, int queue_sz) {
+    DiskPool *disk = (DiskPool*) malloc(sizeof(DiskPool));
+
+    if (disk == NULL) {
+        ERR("Memory allocation during disk pool creation failed");
+        return NULL;
+    }
+
+    memset(disk, 0, sizeof(DiskPool));
+
+    int err;
+    if ((err = pthread_mutex_init(&disk->lock, NULL))) {
+        P_ERR("Failed to initialize disk pool stats mutex", err);
+        free(disk);
+        return NULL;
+    }
+
+    if ((disk->pool = thread_pool_create_bounded(n_threads, queue_sz, NULL)) == NULL) {
+        ERR("Disk thread pool creation failed");
+        pthread_mutex_destroy(&disk->lock);
+        free(disk);
+        return NULL;
+    }
+
+    return disk;
+}
+
+/*
+ * Checks, without blocking, if reading a file at offset would wait for
+ * the disk. The first DISK_PROBE_SZ bytes are read with RWF_NOWAIT, which
+ * fails, or comes back short, unless they are in the page cache.
+ *
+ * Params:
+ * - DiskPool *disk : The pool, for its statistics.
+ * - int file       : The file.
+ * - off_t offset   : Where the response starts reading.
+ * - off_t size     : The size of the file.
+ *
+ * Returns:
+ * - 1 if the read would block, and the response belongs to the disk pool.
+ * - 0 otherwise.
+ */
+int disk_pool_probe(DiskPool *disk, int file, off_t offset, off_t size) {
+    char buf[DISK_PROBE_SZ];
+
+    size_t len = size - offset < DISK_PROBE_SZ ? size - offset : DISK_PROBE_SZ;
+
+    int cold = 0;
+
+    if (offset < size) {
+        struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+        ssize_t n = preadv2(file, &iov, 1, offset, RWF_NOWAIT);
+
+        // Filesystems without RWF_NOWAIT cannot tell, keep those inline
+        cold = n < 0 ? errno == EAGAIN : (size_t)n < len;
+    }
+
+    if (!cold)
+        __atomic_add_fetch(&disk->resident, 1, __ATOMIC_RELAXED);
+
+    return cold;
+}
+
+/*
+ * Hands a response over to the disk pool. Never blocks: if the queue is
+ * full, the caller writes the response itself, as it would have without
+ * the pool.
+ *
+ * Params:
+ * - DiskPool *disk         : The pool.
+ * - void (*handler)(void*) : The function writing the response.
+ * - void *arg              : Its argument, owned by the handler.
+ *
+ * Returns:
+ * -  0 if the pool will write the response.
+ * - -1 otherwise, and the caller must write the response itself.
+ */
+int disk_pool_submit(DiskPool *disk, void (*handler)(void*), void *arg) {
+    DiskJob *job = (DiskJob*) malloc(sizeof(DiskJob));
+
+    if (job == NULL) {
+        P_ERR("Malloc failed for disk job", errno);
+        return -1;
+    }
+
+    job->disk    = disk;
+    job->handler = handler;
+    job->arg     = arg;
+
+    gettimeofday(&job->t_ready, NULL);
+
+    // The job is freed by the pool once it ran
+    int status = thread_pool_try_add(disk->pool, run_disk_job, NULL, job);
+
+    if (status != 0) {
+        if (status > 0)
+            __atomic_add_fetch(&disk->overflows, 1, __ATOMIC_RELAXED);
+
+        free(job);
+        return -1;
+    }
+
+    __atomic_add_fetch(&disk->deferred, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * Synchronized getter for the statistics of the disk pool.
+ *
+ * Params:
+ * - DiskPool *disk      : The pool.
+ * - DiskPoolStats *dest : The struct we want to copy to.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+int get_disk_pool_stats(DiskPool *disk, DiskPoolStats *dest) {
+    int err;
+    if ((err = pthread_mutex_lock(&disk->lock))) {
+        P_ERR("Could not acquire lock for disk pool stats", err);
+        return -1;
+    }
+
+    dest->n_processed  = disk->n_processed;
+    dest->wait_usec    = disk->wait_usec;
+    dest->service_usec = disk->service_usec;
+
+    pthread_mutex_unlock(&disk->lock);
+
+    dest->resident  = __atomic_load_n(&disk->resident, __ATOMIC_RELAXED);
+    dest->deferred  = __atomic_load_n(&disk->deferred, __ATOMIC_RELAXED);
+    dest->overflows = __atomic_load_n(&disk->overflows, __ATOMIC_RELAXED);
+
+    // Queue depth is guarded by the queue lock
+    task_queue *queue = &disk->pool->task_queue;
+
+    pthread_mutex_lock(&queue->queue_rwlock);
+    dest->queued = queue->n_tasks;
+    pthread_mutex_unlock(&queue->queue_rwlock);
+
+    dest->n_threads = disk->pool->n_threads;
+
+    return 0;
+}
+
+/*
+ * Destructor for the disk pool. Queued responses are still written
+ * before the threads stop.
+ *
+ * Params:
+ * - DiskPool *disk : The pool we want to free.
+ *
+ * Returns: -
+ */
+void disk_pool_destroy(DiskPool *disk) {
+    if (disk == NULL)
+        return;
+
+    thread_pool_destroy(disk->pool);
+    pthread_mutex_destroy(&disk->lock);
+
+    free(disk);
+}
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fd_cache.h"
+#include "utils.h"
+
+// Milliseconds elapsed between two monotonic timestamps.
+static
+long elapsed_ms(struct timespec *t_start, struct timespec *t_end) {
+    return (t_end->tv_sec - t_start->tv_sec) * 1000L + (t_end->tv_nsec - t_start->tv_nsec) / 1000000L;
+}
+
+/*
+ * Drops a reference to the entry, and closes the file once no references
+ * are left. Must be called once for every entry returned by lookup, and
+ * for every entry created with fd_entry_create.
+ *
+ * Params:
+ * - FdEntry *entry : The entry we are done with.
+ *
+ * Returns: -
+ */
+void fd_cache_release(FdEntry *entry) {
+    if (entry == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    for (int enc = 0; enc < N_ENCODINGS; ++enc)
+        fd_cache_release(entry->variants[enc]);
+
+    close(entry->fd);
+    free(entry->full_path);
+    free(entry->header);
+    free(entry->key);
+    free(entry);
+}
+
+// Inserts the entry at the most recently used end of the LRU list.
+static
+void lru_push(FdShard *shard, FdEntry *entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+
+    if (shard->head != NULL)
+        shard->head->prev = entry;
+    else
+        shard->tail = entry;
+
+    shard->head = entry;
+}
+
+// Removes the entry from the LRU list.
+static
+void lru_unlink(FdShard *shard, FdEntry *entry) {
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        shard->head = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+/*
+ * Unlinks an entry from the shard and drops the reference of the cache.
+ * Requests still holding the entry keep its fd open.
+ * The shard lock must be held.
+ */
+static
+void shard_remove(FdShard *shard, FdEntry *entry) {
+    FdEntry **link = &shard->buckets[entry->hash % FDC_BUCKETS];
+
+    while (*link != entry)
+        link = &(*link)->h_next;
+
+    *link = entry->h_next;
+
+    lru_unlink(shard, entry);
+
+    shard->n_entries--;
+
+    fd_cache_release(entry);
+}
+
+/*
+ * Creates a new open file cache.
+ *
+ * Params:
+ * - int max_entries : The maximum number of open files held.
+ * - long ttl_ms     : How long a resolved path is trusted.
+ *
+ * Returns:
+ * - A new cache if no error occurred.
+ * - NULL otherwise.
+ */
+FdCache *fd_cache_create(int max_entries, long ttl_ms) {
+    FdCache *cache = (FdCache*) malloc(sizeof(FdCache));
+
+    if (cache == NULL) {
+        ERR("Memory allocation during fd cache creation failed");
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(FdCache));
+
+    cache->ttl_ms = ttl_ms;
+
+    for (int i = 0; i < FDC_SHARDS; ++i) {
+        int err;
+        if ((err = pthread_mutex_init(&cache->shards[i].lock, NULL))) {
+            P_ERR("Failed to initialize fd cache mutex", err);
+
+            for (int j = 0; j < i; ++j)
+                pthread_mutex_destroy(&cache->shards[j].lock);
+
+            free(cache);
+            return NULL;
+        }
+
+        // Spread the budget over the shards, rounding up
+        cache->shards[i].max_entries = (max_entries + FDC_SHARDS - 1) / FDC_SHARDS;
+    }
+
+    return cache;
+}
+
+/*
+ * Looks up the open file for a request path. Entries resolved more than
+ * ttl_ms ago are dropped, so the caller resolves the path again.
+ *
+ * Params:
+ * - FdCache *cache : The cache.
+ * - char *key      : The request path.
+ *
+ * Returns:
+ * - The entry, with a reference taken for the caller, on a hit.
+ * - NULL on a miss.
+ */
+FdEntry *fd_cache_lookup(FdCache *cache, char *key) {
+    uint64_t hash  = hash_string(key);
+    FdShard *shard = &cache->shards[hash % FDC_SHARDS];
+
+    struct timespec t_now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t_now);
+
+    pthread_mutex_lock(&shard->lock);
+
+    FdEntry *entry = shard->buckets[hash % FDC_BUCKETS];
+
+    while (entry != NULL && !(entry->hash == hash && !strcmp(entry->key, key)))
+        entry = entry->h_next;
+
+    if (entry != NULL && elapsed_ms(&entry->t_resolved, &t_now) >= cache->ttl_ms) {
+        shard_remove(shard, entry);
+        shard->expired++;
+        entry = NULL;
+    }
+
+    if (entry == NULL) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    shard->hits++;
+
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+
+    lru_unlink(shard, entry);
+    lru_push(shard, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return entry;
+}
+
+/*
+ * Creates a new entry for a resolved request path. The entry takes
+ * ownership of fd and full_path, and the caller owns one reference.
+ * The header and the precompressed copies may be attached by the caller
+ * before the entry is inserted, and are freed along with the entry.
+ *
+ * Params:
+ * - char *key            : The request path. It is copied.
+ * - int fd               : The open file.
+ * - struct stat *f_stats : The metadata of the file.
+ * - char *full_path      : The absolute path of the file.
+ *
+ * Returns:
+ * - A new entry if no error occurred.
+ * - NULL otherwise; fd and full_path are left untouched.
+ */
+FdEntry *fd_entry_create(char *key, int fd, struct stat *f_stats, char *full_path) {
+    FdEntry *entry = (FdEntry*) malloc(sizeof(FdEntry));
+
+    if (entry == NULL) {
+        P_ERR("Malloc failed for fd cache entry", errno);
+        return NULL;
+    }
+
+    if ((entry->key = strdup(key)) == NULL) {
+        P_ERR("Malloc failed for fd cache key", errno);
+        free(entry);
+        return NULL;
+    }
+
+    entry->hash      = hash_string(key);
+    entry->fd        = fd;
+    entry->f_stats   = *f_stats;
+    entry->full_path = full_path;
+    entry->root_gen  = 0;
+    entry->root_len  = 0;
+    entry->header    = NULL;
+    entry->refs      = 1;
+    entry->h_next    = NULL;
+    entry->prev      = NULL;
+    entry->next      = NULL;
+
+    for (int enc = 0; enc < N_ENCODINGS; ++enc)
+        entry->variants[enc] = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &entry->t_resolved);
+
+    return entry;
+}
+
+/*
+ * Publishes an entry, evicting the least recently used ones if the
+ * shard is full. An older entry for the same path is replaced.
+ *
+ * Params:
+ * - FdCache *cache : The cache.
+ * - FdEntry *entry : The entry. The caller keeps its own reference.
+ *
+ * Returns: -
+ */
+void fd_cache_insert(FdCache *cache, FdEntry *entry) {
+    FdShard *shard = &cache->shards[entry->hash % FDC_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    FdEntry *old = shard->buckets[entry->hash % FDC_BUCKETS];
+
+    while (old != NULL && !(old->hash == entry->hash && !strcmp(old->key, entry->key)))
+        old = old->h_next;
+
+    if (old != NULL)
+        shard_remove(shard, old);
+
+    while (shard->n_entries >= shard->max_entries && shard->tail != NULL) {
+        shard_remove(shard, shard->tail);
+        shard->evictions++;
+    }
+
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+
+    entry->h_next = shard->buckets[entry->hash % FDC_BUCKETS];
+    shard->buckets[entry->hash % FDC_BUCKETS] = entry;
+    shard->n_entries++;
+
+    lru_push(shard, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Collects the statistics of all the shards.
+ *
+ * Params:
+ * - FdCache *cache     : The cache.
+ * - FdCacheStats *dest : The struct where the totals will be stored.
+ *
+ * Returns: -
+ */
+void get_fd_cache_stats(FdCache *cache, FdCacheStats *dest) {
+    memset(dest, 0, sizeof(FdCacheStats));
+
+    for (int i = 0; i < FDC_SHARDS; ++i) {
+        FdShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        dest->hits        += shard->hits;
+        dest->misses      += shard->misses;
+        dest->expired     += shard->expired;
+        dest->evictions   += shard->evictions;
+        dest->n_entries   += shard->n_entries;
+        dest->max_entries += shard->max_entries;
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/*
+ * Destructor for the cache. Must only be called once no request holds
+ * any entry.
+ *
+ * Params:
+ * - FdCache *cache : The cache we want to free.
+ *
+ * Returns: -
+ */
+void fd_cache_destroy(FdCache *cache) {
+    if (cache == NULL)
+        return;
+
+    for (int i = 0; i < FDC_SHARDS; ++i) {
+        FdShard *shard = &cache->shards[i];
+
+        while (shard->head != NULL)
+            shard_remove(shard, shard->head);
+
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(cache);
+}
@@ -0,0 +1,606 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_cache.h"
+#include "utils.h"
+
+// Share of the shard budget given to the admission window, and the share
+// of the main area reserved for the protected segment (in percent).
+#define WINDOW_PCT    1
+#define PROTECTED_PCT 80
+
+// Sketch counters saturate at this value, like 4 bit counters would
+#define SKETCH_MAX 15
+
+// Number of sketch increments after which all counters are halved
+#define SKETCH_RESET (10 * FC_SKETCH_WIDTH)
+
+// Memory charged to the budget for an entry. A shared body is charged to
+// another entry.
+static
+size_t entry_size(CacheEntry *entry) {
+    return sizeof(CacheEntry) + strlen(entry->key) + entry->header_len + (entry->shared ? 0 : entry->body_len);
+}
+
+// Index of key in row i of the sketch, derived by double hashing.
+static
+size_t sketch_idx(uint64_t hash, int i) {
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+
+    return (h1 + i * h2) % FC_SKETCH_WIDTH;
+}
+
+/*
+ * Records an access of the key in the frequency sketch. Once enough
+ * accesses were recorded, all the counters are halved, so that old
+ * popularity fades away.
+ */
+static
+void sketch_increment(CacheShard *shard, uint64_t hash) {
+    for (int i = 0; i < FC_SKETCH_DEPTH; ++i) {
+        uint8_t *counter = &shard->sketch[i][sketch_idx(hash, i)];
+
+        if (*counter < SKETCH_MAX)
+            (*counter)++;
+    }
+
+    if (++shard->sketch_additions >= SKETCH_RESET) {
+        for (int i = 0; i < FC_SKETCH_DEPTH; ++i)
+            for (int j = 0; j < FC_SKETCH_WIDTH; ++j)
+                shard->sketch[i][j] >>= 1;
+
+        shard->sketch_additions /= 2;
+    }
+}
+
+// Estimated access frequency of the key.
+static
+int sketch_estimate(CacheShard *shard, uint64_t hash) {
+    int freq = SKETCH_MAX;
+
+    for (int i = 0; i < FC_SKETCH_DEPTH; ++i) {
+        int count = shard->sketch[i][sketch_idx(hash, i)];
+
+        if (count < freq)
+            freq = count;
+    }
+
+    return freq;
+}
+
+// Inserts the entry at the most recently used end of a segment.
+static
+void segment_push(CacheShard *shard, int seg, CacheEntry *entry) {
+    CacheSegment *segment = &shard->segments[seg];
+
+    entry->segment = seg;
+    entry->prev    = NULL;
+    entry->next    = segment->head;
+
+    if (segment->head != NULL)
+        segment->head->prev = entry;
+    else
+        segment->tail = entry;
+
+    segment->head   = entry;
+    segment->bytes += entry_size(entry);
+}
+
+// Removes the entry from the segment it lives in.
+static
+void segment_unlink(CacheShard *shard, CacheEntry *entry) {
+    CacheSegment *segment = &shard->segments[entry->segment];
+
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        segment->head = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        segment->tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = NULL;
+
+    segment->bytes -= entry_size(entry);
+}
+
+/*
+ * Drops a reference to the entry, and frees it once no references are
+ * left. Must be called once for every entry returned by lookup, and
+ * for every entry created with file_cache_entry_create.
+ *
+ * Params:
+ * - CacheEntry *entry : The entry we are done with.
+ *
+ * Returns: -
+ */
+void file_cache_release(CacheEntry *entry) {
+    if (entry == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    if (entry->stored != NULL)
+        body_store_release(entry->stored);
+    else
+        free(entry->body);
+
+    free(entry->key);
+    free(entry->header);
+    free(entry);
+}
+
+// Called as an entry leaves the cache, so that another entry pointing at
+// its body pays for it. Until then the shard counts the body as unpaid.
+static
+void entry_unclaim(CacheShard *shard, CacheEntry *entry) {
+    if (entry->stored != NULL && !entry->shared)
+        body_store_unclaim(entry->stored, entry, &shard->unpaid);
+}
+
+/*
+ * Unlinks an entry from the hash table and its segment, and drops the
+ * reference of the cache. Senders still holding the entry keep it alive.
+ * The shard lock must be held.
+ */
+static
+void shard_remove(CacheShard *shard, CacheEntry *entry) {
+    CacheEntry **link = &shard->buckets[entry->hash % FC_BUCKETS];
+
+    while (*link != entry)
+        link = &(*link)->h_next;
+
+    *link = entry->h_next;
+
+    segment_unlink(shard, entry);
+    entry_unclaim(shard, entry);
+
+    shard->n_entries--;
+
+    file_cache_release(entry);
+}
+
+// Finds the entry with the specified key. The shard lock must be held.
+static
+CacheEntry *shard_find(CacheShard *shard, char *key, uint64_t hash) {
+    CacheEntry *entry = shard->buckets[hash % FC_BUCKETS];
+
+    for (; entry != NULL; entry = entry->h_next)
+        if (entry->hash == hash && !strcmp(entry->key, key))
+            return entry;
+
+    return NULL;
+}
+
+// Checks if the entry was loaded from the file version described by f_stats.
+static
+int entry_matches(CacheEntry *entry, struct stat *f_stats) {
+    return entry->dev               == f_stats->st_dev         &&
+           entry->ino               == f_stats->st_ino         &&
+           entry->size              == f_stats->st_size        &&
+           entry->mtime.tv_sec      == f_stats->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec     == f_stats->st_mtim.tv_nsec;
+}
+
+/*
+ * Moves a candidate evicted from the window into the main area. If the
+ * main area is full, the candidate only gets in if it is accessed more
+ * often than the entries that would have to be evicted to make room for
+ * it; otherwise the candidate itself is dropped. Unpaid shared bodies
+ * take room from the main area too.
+ * The shard lock must be held.
+ */
+static
+void admit_to_main(CacheShard *shard, CacheEntry *cand) {
+    CacheSegment *probation = &shard->segments[FC_PROBATION];
+    CacheSegment *protected = &shard->segments[FC_PROTECTED];
+
+    size_t unpaid     = __atomic_load_n(&shard->unpaid, __ATOMIC_RELAXED);
+    size_t main_max   = probation->max_bytes > unpaid ? probation->max_bytes - unpaid : 0;
+    size_t main_bytes = probation->bytes + protected->bytes;
+    size_t cand_size  = entry_size(cand);
+
+    if (main_bytes + cand_size <= main_max) {
+        segment_push(shard, FC_PROBATION, cand);
+        return;
+    }
+
+    int cand_freq = sketch_estimate(shard, cand->hash);
+
+    // Walk the victims, least recently used probation entries first, until
+    // enough space would be freed
+    size_t needed = main_bytes + cand_size - main_max;
+    size_t freed  = 0;
+    int n_victims = 0;
+
+    CacheEntry *victim = probation->tail;
+    int in_probation   = 1;
+
+    while (freed < needed) {
+        if (victim == NULL && in_probation) {
+            victim       = protected->tail;
+            in_probation = 0;
+            continue;
+        }
+
+        // The candidate loses to a more popular entry, or is too large
+        if (victim == NULL || sketch_estimate(shard, victim->hash) >= cand_freq) {
+            CacheEntry **link = &shard->buckets[cand->hash % FC_BUCKETS];
+
+            while (*link != cand)
+                link = &(*link)->h_next;
+
+            *link = cand->h_next;
+
+            entry_unclaim(shard, cand);
+
+            shard->n_entries--;
+            shard->rejections++;
+
+            file_cache_release(cand);
+            return;
+        }
+
+        freed += entry_size(victim);
+        n_victims++;
+        victim = victim->prev;
+    }
+
+    // Evict the victims we walked over, in the same order
+    for (int i = 0; i < n_victims; ++i) {
+        CacheEntry *evicted = probation->tail != NULL ? probation->tail : protected->tail;
+
+        shard_remove(shard, evicted);
+        shard->evictions++;
+    }
+
+    segment_push(shard, FC_PROBATION, cand);
+}
+
+/*
+ * Creates a new file cache.
+ *
+ * Params:
+ * - size_t max_bytes  : The memory budget of the cache.
+ * - size_t max_object : The size of the largest file that will be cached.
+ * - int dedup         : Hold the bodies of entries with the same content
+ *                       once, in a body store.
+ *
+ * Returns:
+ * - A new file cache if no error occurred.
+ * - NULL otherwise.
+ */
+FileCache *file_cache_create(size_t max_bytes, size_t max_object, int dedup) {
+    FileCache *cache = (FileCache*) malloc(sizeof(FileCache));
+
+    if (cache == NULL) {
+        ERR("Memory allocation during file cache creation failed");
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(FileCache));
+
+    cache->max_object = max_object;
+
+    if (dedup && (cache->bodies = body_store_create()) == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    size_t shard_bytes  = max_bytes / FC_SHARDS;
+    size_t window_bytes = shard_bytes * WINDOW_PCT / 100;
+    size_t main_bytes   = shard_bytes - window_bytes;
+
+    for (int i = 0; i < FC_SHARDS; ++i) {
+        CacheShard *shard = &cache->shards[i];
+
+        int err;
+        if ((err = pthread_mutex_init(&shard->lock, NULL))) {
+            P_ERR("Failed to initialize file cache mutex", err);
+
+            for (int j = 0; j < i; ++j)
+                pthread_mutex_destroy(&cache->shards[j].lock);
+
+            body_store_destroy(cache->bodies);
+            free(cache);
+            return NULL;
+        }
+
+        shard->segments[FC_WINDOW].max_bytes    = window_bytes;
+        shard->segments[FC_PROBATION].max_bytes = main_bytes;
+        shard->segments[FC_PROTECTED].max_bytes = main_bytes * PROTECTED_PCT / 100;
+    }
+
+    return cache;
+}
+
+/*
+ * Checks if a file may be cached, based on its type and size.
+ *
+ * Returns:
+ * - 1 if the file may be cached.
+ * - 0 otherwise.
+ */
+int file_cache_cacheable(FileCache *cache, struct stat *f_stats) {
+    return S_ISREG(f_stats->st_mode) && (size_t)f_stats->st_size <= cache->max_object;
+}
+
+/*
+ * Checks if the response of a file version is cached, without counting
+ * an access to it.
+ *
+ * Params:
+ * - FileCache *cache      : The cache.
+ * - char *key             : The canonical path of the file.
+ * - struct stat *f_stats  : The current metadata of the file.
+ *
+ * Returns:
+ * - 1 if a lookup would hit.
+ * - 0 otherwise.
+ */
+int file_cache_contains(FileCache *cache, char *key, struct stat *f_stats) {
+    uint64_t hash     = hash_string(key);
+    CacheShard *shard = &cache->shards[hash % FC_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    CacheEntry *entry = shard_find(shard, key, hash);
+    int found         = entry != NULL && entry_matches(entry, f_stats);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+/*
+ * Looks up the cached response of a file. If the cached copy was loaded
+ * from a different version of the file than the one described by f_stats,
+ * it is invalidated.
+ *
+ * Params:
+ * - FileCache *cache      : The cache.
+ * - char *key             : The canonical path of the file.
+ * - struct stat *f_stats  : The current metadata of the file.
+ *
+ * Returns:
+ * - The entry, with a reference taken for the caller, on a hit.
+ * - NULL on a miss.
+ */
+CacheEntry *file_cache_lookup(FileCache *cache, char *key, struct stat *f_stats) {
+    uint64_t hash     = hash_string(key);
+    CacheShard *shard = &cache->shards[hash % FC_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    sketch_increment(shard, hash);
+
+    CacheEntry *entry = shard_find(shard, key, hash);
+
+    // Stale entry, the file changed since it was loaded
+    if (entry != NULL && !entry_matches(entry, f_stats)) {
+        shard_remove(shard, entry);
+        shard->invalidations++;
+        entry = NULL;
+    }
+
+    if (entry == NULL) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    shard->hits++;
+
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+
+    // The entry that paid for the body left the cache, this one pays now
+    if (entry->shared && body_store_claim(entry->stored, entry)) {
+        segment_unlink(shard, entry);
+        entry->shared = 0;
+        segment_push(shard, entry->segment, entry);
+    }
+
+    switch (entry->segment) {
+        case FC_WINDOW:
+        case FC_PROTECTED:
+            segment_unlink(shard, entry);
+            segment_push(shard, entry->segment, entry);
+            break;
+
+        case FC_PROBATION: {
+            // A second hit promotes the entry to the protected segment
+            CacheSegment *protected = &shard->segments[FC_PROTECTED];
+
+            segment_unlink(shard, entry);
+            segment_push(shard, FC_PROTECTED, entry);
+
+            // Demote the least recently used protected entries if needed
+            while (protected->bytes > protected->max_bytes && protected->tail != entry) {
+                CacheEntry *demoted = protected->tail;
+
+                segment_unlink(shard, demoted);
+                segment_push(shard, FC_PROBATION, demoted);
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return entry;
+}
+
+/*
+ * Creates a new, unpublished, cache entry for a file. The caller fills
+ * in the header and the body, and owns one reference to the entry.
+ *
+ * Params:
+ * - char *key            : The canonical path of the file. It is copied.
+ * - struct stat *f_stats : The metadata of the file version being loaded.
+ *
+ * Returns:
+ * - A new entry if no error occurred.
+ * - NULL otherwise.
+ */
+CacheEntry *file_cache_entry_create(char *key, struct stat *f_stats) {
+    CacheEntry *entry = (CacheEntry*) malloc(sizeof(CacheEntry));
+
+    if (entry == NULL) {
+        P_ERR("Malloc failed for cache entry", errno);
+        return NULL;
+    }
+
+    memset(entry, 0, sizeof(CacheEntry));
+
+    if ((entry->key = strdup(key)) == NULL) {
+        P_ERR("Malloc failed for cache key", errno);
+        free(entry);
+        return NULL;
+    }
+
+    entry->hash  = hash_string(key);
+    entry->dev   = f_stats->st_dev;
+    entry->ino   = f_stats->st_ino;
+    entry->size  = f_stats->st_size;
+    entry->mtime = f_stats->st_mtim;
+    entry->refs  = 1;
+
+    return entry;
+}
+
+/*
+ * Publishes a loaded entry. New entries always enter the admission
+ * window; entries pushed out of the window compete for the main area
+ * based on their estimated access frequency. If the cache deduplicates,
+ * the body is moved to the body store first, and replaced with the stored
+ * copy if the same content is already there.
+ *
+ * Params:
+ * - FileCache *cache  : The cache.
+ * - CacheEntry *entry : The entry. The caller keeps its own reference.
+ *
+ * Returns:
+ * - 1 if the entry was inserted.
+ * - 0 if it does not fit in the cache.
+ */
+int file_cache_insert(FileCache *cache, CacheEntry *entry) {
+    CacheShard *shard = &cache->shards[entry->hash % FC_SHARDS];
+
+    // The body is hashed before the shard is locked. If it cannot be
+    // stored, the entry keeps its own copy.
+    if (cache->bodies != NULL && entry->stored == NULL) {
+        StoredBody *stored = body_store_intern(cache->bodies, entry->body, entry->body_len);
+
+        if (stored != NULL) {
+            entry->stored = stored;
+            entry->body   = stored->data;
+        }
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (entry_size(entry) > shard->segments[FC_PROBATION].max_bytes) {
+        shard->rejections++;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+
+    // Another thread may have loaded the same file in the meantime
+    CacheEntry *old = shard_find(shard, entry->key, entry->hash);
+
+    if (old != NULL)
+        shard_remove(shard, old);
+
+    // Not charged for a body another cached entry already pays for
+    entry->shared = entry->stored != NULL && !body_store_claim(entry->stored, entry);
+
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+
+    entry->h_next = shard->buckets[entry->hash % FC_BUCKETS];
+    shard->buckets[entry->hash % FC_BUCKETS] = entry;
+    shard->n_entries++;
+
+    segment_push(shard, FC_WINDOW, entry);
+
+    // Push the overflow of the window towards the main area
+    CacheSegment *window = &shard->segments[FC_WINDOW];
+
+    while (window->bytes > window->max_bytes) {
+        CacheEntry *cand = window->tail;
+
+        segment_unlink(shard, cand);
+        admit_to_main(shard, cand);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return 1;
+}
+
+/*
+ * Collects the statistics of all the shards.
+ *
+ * Params:
+ * - FileCache *cache     : The cache.
+ * - FileCacheStats *dest : The struct where the totals will be stored.
+ *
+ * Returns: -
+ */
+void get_file_cache_stats(FileCache *cache, FileCacheStats *dest) {
+    memset(dest, 0, sizeof(FileCacheStats));
+
+    for (int i = 0; i < FC_SHARDS; ++i) {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        dest->hits          += shard->hits;
+        dest->misses        += shard->misses;
+        dest->evictions     += shard->evictions;
+        dest->rejections    += shard->rejections;
+        dest->invalidations += shard->invalidations;
+        dest->n_entries     += shard->n_entries;
+
+        dest->bytes     += shard->segments[FC_WINDOW].bytes +
+                           shard->segments[FC_PROBATION].bytes +
+                           shard->segments[FC_PROTECTED].bytes +
+                           __atomic_load_n(&shard->unpaid, __ATOMIC_RELAXED);
+        dest->max_bytes += shard->segments[FC_WINDOW].max_bytes +
+                           shard->segments[FC_PROBATION].max_bytes;
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/*
+ * Destructor for the file cache. Must only be called once no sender
+ * holds any entry.
+ *
+ * Params:
+ * - FileCache *cache : The cache we want to free.
+ *
+ * Returns: -
+ */
+void file_cache_destroy(FileCache *cache) {
+    if (cache == NULL)
+        return;
+
+    for (int i = 0; i < FC_SHARDS; ++i) {
+        CacheShard *shard = &cache->shards[i];
+
+        for (int seg = 0; seg < FC_SEGMENTS; ++seg)
+            while (shard->segments[seg].head != NULL)
+                shard_remove(shard, shard->segments[seg].head);
+
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    body_store_destroy(cache->bodies);
+    free(cache);
+}
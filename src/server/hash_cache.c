@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash_cache.h"
+#include "utils.h"
+
+// Slot of a file, from its device and inode number.
+static
+size_t slot_index(struct stat *f_stats) {
+    uint64_t h = (uint64_t) f_stats->st_ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t) f_stats->st_dev;
+    return (h >> 17) % HC_SLOTS;
+}
+
+// Checks if the slot holds the same version of the file.
+static
+int same_version(HashSlot *slot, struct stat *f_stats) {
+    return slot->valid &&
+           slot->dev == f_stats->st_dev &&
+           slot->ino == f_stats->st_ino &&
+           slot->size == f_stats->st_size &&
+           slot->mtime.tv_sec == f_stats->st_mtim.tv_sec &&
+           slot->mtime.tv_nsec == f_stats->st_mtim.tv_nsec;
+}
+
+/*
+ * Creates a new, empty, content hash cache.
+ *
+ * Returns:
+ * - A new cache if no error occurred.
+ * - NULL otherwise.
+ */
+HashCache *hash_cache_create(void) {
+    HashCache *cache = (HashCache*) malloc(sizeof(HashCache));
+
+    if (cache == NULL) {
+        ERR("Memory allocation during hash cache creation failed");
+        return NULL;
+    }
+
+    memset(cache, 0, sizeof(HashCache));
+
+    for (int i = 0; i < HC_LOCKS; ++i) {
+        int err;
+        if ((err = pthread_mutex_init(&cache->locks[i], NULL))) {
+            P_ERR("Failed to initialize hash cache mutex", err);
+
+            for (int j = 0; j < i; ++j)
+                pthread_mutex_destroy(&cache->locks[j]);
+
+            free(cache);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+/*
+ * Looks up the content hash of a file version.
+ *
+ * Params:
+ * - HashCache *cache     : The cache.
+ * - struct stat *f_stats : The metadata of the file.
+ * - uint64_t *hash       : Where the hash will be stored on a hit.
+ *
+ * Returns:
+ * - 1 on a hit.
+ * - 0 on a miss.
+ */
+int hash_cache_lookup(HashCache *cache, struct stat *f_stats, uint64_t *hash) {
+    size_t idx = slot_index(f_stats);
+    pthread_mutex_t *lock = &cache->locks[idx % HC_LOCKS];
+
+    pthread_mutex_lock(lock);
+
+    int hit = same_version(&cache->slots[idx], f_stats);
+
+    if (hit)
+        *hash = cache->slots[idx].hash;
+
+    pthread_mutex_unlock(lock);
+
+    if (hit)
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+
+    return hit;
+}
+
+/*
+ * Stores the content hash of a file version.
+ *
+ * Params:
+ * - HashCache *cache     : The cache.
+ * - struct stat *f_stats : The metadata of the file.
+ * - uint64_t hash        : The hash of its content.
+ *
+ * Returns: -
+ */
+void hash_cache_insert(HashCache *cache, struct stat *f_stats, uint64_t hash) {
+    size_t idx = slot_index(f_stats);
+    pthread_mutex_t *lock = &cache->locks[idx % HC_LOCKS];
+
+    pthread_mutex_lock(lock);
+
+    HashSlot *slot = &cache->slots[idx];
+
+    slot->dev   = f_stats->st_dev;
+    slot->ino   = f_stats->st_ino;
+    slot->size  = f_stats->st_size;
+    slot->mtime = f_stats->st_mtim;
+    slot->hash  = hash;
+    slot->valid = 1;
+
+    pthread_mutex_unlock(lock);
+}
+
+/*
+ * Destructor for the cache.
+ *
+ * Params:
+ * - HashCache *cache : The cache we want to free.
+ *
+ * Returns: -
+ */
+void hash_cache_destroy(HashCache *cache) {
+    if (cache == NULL)
+        return;
+
+    for (int i = 0; i < HC_LOCKS; ++i)
+        pthread_mutex_destroy(&cache->locks[i]);
+
+    free(cache);
+}
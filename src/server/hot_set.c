@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "hot_set.h"
+#include "utils.h"
+
+// The idle I/O class of ioprio_set, which glibc does not wrap
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_CLASS_SHIFT 13
+
+// Finds the path of a hash in its shard. The shard lock must be held.
+static
+HotPath *shard_find(HotShard *shard, const char *path, uint64_t hash) {
+    HotPath *entry = shard->buckets[(hash >> 8) % HOT_BUCKETS];
+
+    while (entry != NULL && !(entry->hash == hash && !strcmp(entry->path, path)))
+        entry = entry->h_next;
+
+    return entry;
+}
+
+/*
+ * Adds hits to a path, tracking it if there is room in its shard.
+ *
+ * Returns:
+ * -  0 if the path is tracked.
+ * - -1 if its shard is full, or allocation failed.
+ */
+static
+int add_hits(HotSet *set, const char *path, unsigned long long hits) {
+    uint64_t hash   = hash_string(path);
+    HotShard *shard = &set->shards[hash % HOT_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    HotPath *entry = shard_find(shard, path, hash);
+
+    if (entry == NULL) {
+        size_t len = strlen(path);
+
+        if (shard->n_paths >= HOT_SHARD_MAX || (entry = malloc(sizeof(HotPath) + len + 1)) == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+
+        memcpy(entry->path, path, len + 1);
+
+        entry->hash   = hash;
+        entry->hits   = 0;
+        entry->h_next = shard->buckets[(hash >> 8) % HOT_BUCKETS];
+
+        shard->buckets[(hash >> 8) % HOT_BUCKETS] = entry;
+        shard->n_paths++;
+    }
+
+    entry->hits += hits;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return 0;
+}
+
+/*
+ * Reads the paths saved by the previous run, hottest first, and tracks
+ * them with their counts, so the history carries over.
+ *
+ * Params:
+ * - HotSet *set : The hot set, with no paths to warm yet.
+ *
+ * Returns: -
+ */
+static
+void load_state(HotSet *set) {
+    FILE *state = fopen(set->state_path, "r");
+
+    if (state == NULL) {
+        if (errno != ENOENT)
+            P_ERR("Could not read the hot set", errno);
+
+        return;
+    }
+
+    set->warm_paths = malloc(HOT_SAVE_MAX * sizeof(char*));
+
+    char line[PATH_MAX + 32];
+
+    while (set->warm_paths != NULL && set->n_warm < HOT_SAVE_MAX && fgets(line, sizeof(line), state) != NULL) {
+        char *end;
+        unsigned long long hits = strtoull(line, &end, 10);
+
+        if (end == line || *end != ' ')
+            continue;
+
+        char *path = end + 1;
+        path[strcspn(path, "\n")] = '\0';
+
+        if (path[0] == '\0' || (set->warm_paths[set->n_warm] = strdup(path)) == NULL)
+            continue;
+
+        set->n_warm++;
+        add_hits(set, path, hits);
+    }
+
+    fclose(state);
+}
+
+// Orders saved paths by decreasing hits.
+static
+int by_hits(const void *a, const void *b) {
+    unsigned long long hits_a = (*(HotPath * const *) a)->hits;
+    unsigned long long hits_b = (*(HotPath * const *) b)->hits;
+
+    return hits_a < hits_b ? 1 : hits_a > hits_b ? -1 : 0;
+}
+
+/*
+ * Writes the hottest paths to the state file, replacing it atomically.
+ * Every count is halved after the save, so the set follows the traffic.
+ * Paths left without hits are dropped once the set is half full, to make
+ * room for new paths.
+ *
+ * Params:
+ * - HotSet *set : The hot set.
+ *
+ * Returns:
+ * -  0 if the state was saved.
+ * - -1 otherwise.
+ */
+static
+int save_state(HotSet *set) {
+    HotPath **paths = malloc(HOT_SHARDS * HOT_SHARD_MAX * sizeof(HotPath*));
+
+    if (paths == NULL)
+        return -1;
+
+    int n_paths = 0;
+    int tracked = 0;
+
+    for (int s = 0; s < HOT_SHARDS; ++s)
+        tracked += __atomic_load_n(&set->shards[s].n_paths, __ATOMIC_RELAXED);
+
+    int evict = tracked >= HOT_SHARDS * HOT_SHARD_MAX / 2;
+
+    // Copies of the paths, so no shard stays locked while the file is written
+    for (int s = 0; s < HOT_SHARDS; ++s) {
+        HotShard *shard = &set->shards[s];
+
+        pthread_mutex_lock(&shard->lock);
+
+        for (int b = 0; b < HOT_BUCKETS; ++b) {
+            HotPath **link = &shard->buckets[b];
+
+            while (*link != NULL) {
+                HotPath *entry = *link;
+                size_t len     = strlen(entry->path);
+                HotPath *copy  = malloc(sizeof(HotPath) + len + 1);
+
+                if (copy != NULL) {
+                    copy->hits = entry->hits;
+                    memcpy(copy->path, entry->path, len + 1);
+                    paths[n_paths++] = copy;
+                }
+
+                if ((entry->hits /= 2) > 0 || !evict) {
+                    link = &entry->h_next;
+                    continue;
+                }
+
+                *link = entry->h_next;
+                shard->n_paths--;
+
+                free(entry);
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    qsort(paths, n_paths, sizeof(HotPath*), by_hits);
+
+    int saved = n_paths < HOT_SAVE_MAX ? n_paths : HOT_SAVE_MAX;
+    int ret   = -1;
+
+    char *tmp_path = malloc(strlen(set->state_path) + sizeof(".tmp"));
+    FILE *state    = NULL;
+
+    if (tmp_path != NULL) {
+        sprintf(tmp_path, "%s.tmp", set->state_path);
+        state = fopen(tmp_path, "w");
+    }
+
+    if (state != NULL) {
+        for (int i = 0; i < saved; ++i)
+            fprintf(state, "%llu %s\n", paths[i]->hits, paths[i]->path);
+
+        int failed = fflush(state) != 0 || fsync(fileno(state)) < 0;
+
+        if (fclose(state) == 0 && !failed && rename(tmp_path, set->state_path) == 0)
+            ret = 0;
+        else
+            unlink(tmp_path);
+    }
+
+    if (ret < 0)
+        P_ERR("Could not save the hot set", errno);
+    else {
+        __atomic_add_fetch(&set->saves, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&set->last_saved, saved, __ATOMIC_RELAXED);
+    }
+
+    for (int i = 0; i < n_paths; ++i)
+        free(paths[i]);
+
+    free(paths);
+    free(tmp_path);
+
+    return ret;
+}
+
+/*
+ * Saves the hot set every interval, until the set is destroyed.
+ *
+ * Params:
+ * - void *arg : The HotSet.
+ *
+ * Returns: NULL
+ */
+static
+void *saver_main(void *arg) {
+    HotSet *set = (HotSet*) arg;
+
+    pthread_mutex_lock(&set->save_lock);
+
+    while (!set->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += set->interval;
+
+        while (!set->stop && pthread_cond_timedwait(&set->wake, &set->save_lock, &deadline) != ETIMEDOUT)
+            ;
+
+        if (set->stop)
+            break;
+
+        pthread_mutex_unlock(&set->save_lock);
+        save_state(set);
+        pthread_mutex_lock(&set->save_lock);
+    }
+
+    pthread_mutex_unlock(&set->save_lock);
+
+    return NULL;
+}
+
+/*
+ * Warms the saved paths, hottest first, at idle CPU and I/O priority, so
+ * the requests being served are never slowed down by the warming.
+ *
+ * Params:
+ * - void *arg : The HotSet.
+ *
+ * Returns: NULL
+ */
+static
+void *warmer_main(void *arg) {
+    HotSet *set = (HotSet*) arg;
+
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (int) syscall(SYS_gettid), IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+    while (!__atomic_load_n(&set->warm_stop, __ATOMIC_RELAXED)) {
+        int next = __atomic_fetch_add(&set->next_warm, 1, __ATOMIC_RELAXED);
+
+        if (next >= set->n_warm)
+            break;
+
+        long bytes = set->warm(set->warm_arg, set->warm_paths[next]);
+
+        if (bytes < 0)
+            __atomic_add_fetch(&set->warm_missing, 1, __ATOMIC_RELAXED);
+        else {
+            __atomic_add_fetch(&set->warm_bytes, bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&set->warmed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    // The last warmer out stops the clock
+    if (__atomic_sub_fetch(&set->warmers_running, 1, __ATOMIC_ACQ_REL) == 0)
+        clock_gettime(CLOCK_MONOTONIC, &set->warm_end);
+
+    return NULL;
+}
+
+/*
+ * Creates the hot set, and reads the paths saved by the previous run.
+ *
+ * Params:
+ * - const char *state_dir : The directory of the state file.
+ * - int interval          : Seconds between two saves.
+ *
+ * Returns:
+ * - A new hot set if no error occurred.
+ * - NULL otherwise.
+ */
+HotSet *hot_set_create(const char *state_dir, int interval) {
+    HotSet *set = (HotSet*) calloc(1, sizeof(HotSet));
+
+    if (set == NULL) {
+        ERR("Memory allocation during hot set creation failed");
+        return NULL;
+    }
+
+    set->state_path = malloc(strlen(state_dir) + sizeof("/" HOT_STATE_FILE));
+
+    if (set->state_path == NULL) {
+        free(set);
+        return NULL;
+    }
+
+    sprintf(set->state_path, "%s/%s", state_dir, HOT_STATE_FILE);
+
+    set->interval = interval;
+
+    for (int s = 0; s < HOT_SHARDS; ++s)
+        pthread_mutex_init(&set->shards[s].lock, NULL);
+
+    pthread_mutex_init(&set->save_lock, NULL);
+    pthread_cond_init(&set->wake, NULL);
+
+    load_state(set);
+
+    return set;
+}
+
+/*
+ * Counts a request served for a path.
+ *
+ * Params:
+ * - HotSet *set      : The hot set.
+ * - const char *path : The requested path.
+ *
+ * Returns: -
+ */
+void hot_set_record(HotSet *set, const char *path) {
+    if (add_hits(set, path, 1) < 0)
+        __atomic_add_fetch(&set->untracked, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&set->recorded, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Starts the periodic saves, and the threads warming the paths saved by
+ * the previous run. Must be called with the signals blocked, like the
+ * other server threads.
+ *
+ * Params:
+ * - HotSet *set     : The hot set.
+ * - int n_warmers   : The number of warming threads.
+ * - HotWarmFn warm  : Warms a single path.
+ * - void *warm_arg  : The argument of warm.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+int hot_set_start(HotSet *set, int n_warmers, HotWarmFn warm, void *warm_arg) {
+    int err;
+    if ((err = pthread_create(&set->saver, NULL, saver_main, set))) {
+        P_ERR("Failed to start the hot set saver", err);
+        return -1;
+    }
+
+    set->saver_started = 1;
+
+    set->warm     = warm;
+    set->warm_arg = warm_arg;
+
+    clock_gettime(CLOCK_MONOTONIC, &set->warm_start);
+    set->warm_end = set->warm_start;
+
+    if (set->n_warm == 0 || (set->warmers = malloc(n_warmers * sizeof(pthread_t))) == NULL)
+        return 0;
+
+    set->warmers_running = n_warmers;
+
+    for (int i = 0; i < n_warmers; ++i) {
+        if ((err = pthread_create(&set->warmers[i], NULL, warmer_main, set))) {
+            P_ERR("Failed to start a warming thread", err);
+
+            // The threads already running share the paths
+            if (__atomic_sub_fetch(&set->warmers_running, n_warmers - i, __ATOMIC_ACQ_REL) == 0)
+                clock_gettime(CLOCK_MONOTONIC, &set->warm_end);
+
+            break;
+        }
+
+        set->n_warmers++;
+    }
+
+    return 0;
+}
+
+/*
+ * Stops warming, and waits for the warming threads to exit. Must be
+ * called before the caches they warm are destroyed.
+ *
+ * Params:
+ * - HotSet *set : The hot set.
+ *
+ * Returns: -
+ */
+void hot_set_stop_warming(HotSet *set) {
+    if (set == NULL)
+        return;
+
+    __atomic_store_n(&set->warm_stop, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < set->n_warmers; ++i)
+        pthread_join(set->warmers[i], NULL);
+
+    set->n_warmers = 0;
+}
+
+/*
+ * Synchronized getter for the hot set statistics.
+ *
+ * Params:
+ * - HotSet *set       : The hot set.
+ * - HotSetStats *dest : The struct we want to copy to.
+ *
+ * Returns: -
+ */
+void get_hot_set_stats(HotSet *set, HotSetStats *dest) {
+    dest->tracked = 0;
+
+    for (int s = 0; s < HOT_SHARDS; ++s) {
+        pthread_mutex_lock(&set->shards[s].lock);
+        dest->tracked += set->shards[s].n_paths;
+        pthread_mutex_unlock(&set->shards[s].lock);
+    }
+
+    dest->recorded   = __atomic_load_n(&set->recorded, __ATOMIC_RELAXED);
+    dest->untracked  = __atomic_load_n(&set->untracked, __ATOMIC_RELAXED);
+    dest->saves      = __atomic_load_n(&set->saves, __ATOMIC_RELAXED);
+    dest->last_saved = __atomic_load_n(&set->last_saved, __ATOMIC_RELAXED);
+
+    dest->warm_total   = set->n_warm;
+    dest->warmed       = __atomic_load_n(&set->warmed, __ATOMIC_RELAXED);
+    dest->warm_missing = __atomic_load_n(&set->warm_missing, __ATOMIC_RELAXED);
+    dest->warm_running = __atomic_load_n(&set->warmers_running, __ATOMIC_ACQUIRE) > 0;
+    dest->warm_bytes   = __atomic_load_n(&set->warm_bytes, __ATOMIC_RELAXED);
+
+    // Until the warming is done, report the time spent so far
+    struct timespec end = set->warm_end;
+
+    if (dest->warm_running)
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+    dest->warm_ms = (end.tv_sec - set->warm_start.tv_sec) * 1e3 +
+                    (end.tv_nsec - set->warm_start.tv_nsec) / 1e6;
+}
+
+/*
+ * Destructor for the hot set. Stops the warming and the periodic saves,
+ * and saves the set one last time. No request may record paths anymore.
+ *
+ * Params:
+ * - HotSet *set : The hot set we want to free.
+ *
+ * Returns: -
+ */
+void hot_set_destroy(HotSet *set) {
+    if (set == NULL)
+        return;
+
+    hot_set_stop_warming(set);
+
+    if (set->saver_started) {
+        pthread_mutex_lock(&set->save_lock);
+        set->stop = 1;
+        pthread_cond_signal(&set->wake);
+        pthread_mutex_unlock(&set->save_lock);
+
+        pthread_join(set->saver, NULL);
+
+        save_state(set);
+    }
+
+    for (int s = 0; s < HOT_SHARDS; ++s) {
+        for (int b = 0; b < HOT_BUCKETS; ++b) {
+            HotPath *entry = set->shards[s].buckets[b];
+
+            while (entry != NULL) {
+                HotPath *next = entry->h_next;
+                free(entry);
+                entry = next;
+            }
+        }
+
+        pthread_mutex_destroy(&set->shards[s].lock);
+    }
+
+    for (int i = 0; i < set->n_warm; ++i)
+        free(set->warm_paths[i]);
+
+    pthread_cond_destroy(&set->wake);
+    pthread_mutex_destroy(&set->save_lock);
+
+    free(set->warm_paths);
+    free(set->warmers);
+    free(set->state_path);
+    free(set);
+}
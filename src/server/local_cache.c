@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "local_cache.h"
+#include "utils.h"
+
+#define LC_COPY_BUF_SZ (64 * 1024)
+
+// Milliseconds elapsed between two monotonic timestamps.
+static
+long elapsed_ms(struct timespec *t_start, struct timespec *t_end) {
+    return (t_end->tv_sec - t_start->tv_sec) * 1000L + (t_end->tv_nsec - t_start->tv_nsec) / 1000000L;
+}
+
+// Checks if the original is still the file that was copied, unchanged.
+static
+int same_original(struct stat *copied, struct stat *now) {
+    return copied->st_dev  == now->st_dev  &&
+           copied->st_ino  == now->st_ino  &&
+           copied->st_size == now->st_size &&
+           copied->st_mode == now->st_mode &&
+           copied->st_mtim.tv_sec == now->st_mtim.tv_sec &&
+           copied->st_mtim.tv_nsec == now->st_mtim.tv_nsec;
+}
+
+// Inserts the entry at the most recently used end of the LRU list.
+static
+void lru_push(LocalCache *cache, LcEntry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+
+    if (cache->head != NULL)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+
+    cache->head = entry;
+}
+
+// Removes the entry from the LRU list.
+static
+void lru_unlink(LocalCache *cache, LcEntry *entry) {
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+}
+
+// Finds the entry of a key. The lock must be held.
+static
+LcEntry *find_entry(LocalCache *cache, const char *key, uint64_t hash) {
+    LcEntry *entry = cache->buckets[hash % LC_BUCKETS];
+
+    while (entry != NULL && !(entry->hash == hash && !strcmp(entry->key, key)))
+        entry = entry->h_next;
+
+    return entry;
+}
+
+/*
+ * Unlinks an entry from the cache, removes its copy and frees it. Requests
+ * that already opened the copy keep reading it. The lock must be held.
+ */
+static
+void remove_entry(LocalCache *cache, LcEntry *entry) {
+    LcEntry **link = &cache->buckets[entry->hash % LC_BUCKETS];
+
+    while (*link != entry)
+        link = &(*link)->h_next;
+
+    *link = entry->h_next;
+
+    lru_unlink(cache, entry);
+
+    cache->bytes -= entry->f_stats.st_size;
+    cache->n_entries--;
+
+    unlink(entry->local_path);
+
+    free(entry->key);
+    free(entry->rel);
+    free(entry->local_path);
+    free(entry);
+}
+
+/*
+ * Copies a file of the root to a temporary file of the cache directory.
+ * The copy only counts if the original did not change while it was read.
+ *
+ * Params:
+ * - LcJob *job     : The file to copy, with an fd of the original.
+ * - char *tmp_path : The path of the temporary copy.
+ *
+ * Returns:
+ * -  0 if the file was copied.
+ * - -1 otherwise.
+ */
+static
+int copy_original(LcJob *job, char *tmp_path) {
+    int out = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+    if (out < 0)
+        return -1;
+
+    char *buf = malloc(LC_COPY_BUF_SZ);
+    off_t offset = 0;
+    int ret = -1;
+
+    while (buf != NULL && offset < job->f_stats.st_size) {
+        ssize_t n = pread(job->fd, buf, LC_COPY_BUF_SZ, offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            break;
+
+        ssize_t written = 0;
+
+        while (written < n) {
+            ssize_t w = write(out, buf + written, n - written);
+
+            if (w < 0 && errno == EINTR)
+                continue;
+
+            if (w <= 0)
+                break;
+
+            written += w;
+        }
+
+        if (written < n)
+            break;
+
+        offset += n;
+    }
+
+    struct stat f_stats;
+
+    if (offset == job->f_stats.st_size && fstat(job->fd, &f_stats) == 0 && same_original(&job->f_stats, &f_stats))
+        ret = 0;
+
+    free(buf);
+
+    if (close(out) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+/*
+ * Runs a copy job, and inserts the copy into the cache, removing the
+ * least recently used copies if it goes over its budget.
+ *
+ * Params:
+ * - LocalCache *cache : The cache.
+ * - LcJob *job        : The job, which is freed.
+ *
+ * Returns: -
+ */
+static
+void run_job(LocalCache *cache, LcJob *job) {
+    pthread_mutex_lock(&cache->lock);
+    unsigned long long seq = cache->seq++;
+    pthread_mutex_unlock(&cache->lock);
+
+    uint64_t hash = hash_string(job->key);
+
+    LcEntry *entry   = calloc(1, sizeof(LcEntry));
+    size_t path_len  = strlen(cache->dir) + sizeof("/" LC_PREFIX) + 40;
+    char *local_path = malloc(path_len);
+    char *tmp_path   = malloc(path_len + sizeof(".tmp"));
+
+    int copied = 0;
+
+    if (entry != NULL && local_path != NULL && tmp_path != NULL) {
+        snprintf(local_path, path_len, "%s/%s%016llx.%llu", cache->dir, LC_PREFIX, (unsigned long long) hash, seq);
+        sprintf(tmp_path, "%s.tmp", local_path);
+
+        copied = copy_original(job, tmp_path) == 0 && rename(tmp_path, local_path) == 0;
+
+        if (!copied)
+            unlink(tmp_path);
+    }
+
+    close(job->fd);
+    free(tmp_path);
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (!copied) {
+        cache->copy_failures++;
+        pthread_mutex_unlock(&cache->lock);
+
+        free(job->key);
+        free(job->rel);
+        free(local_path);
+        free(entry);
+        return;
+    }
+
+    // A previous copy of the key is replaced
+    LcEntry *old = find_entry(cache, job->key, hash);
+
+    if (old != NULL)
+        remove_entry(cache, old);
+
+    entry->key        = job->key;
+    entry->rel        = job->rel;
+    entry->hash       = hash;
+    entry->local_path = local_path;
+    entry->f_stats    = job->f_stats;
+    entry->root_gen   = job->root_gen;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &entry->validated);
+
+    entry->h_next = cache->buckets[hash % LC_BUCKETS];
+    cache->buckets[hash % LC_BUCKETS] = entry;
+
+    lru_push(cache, entry);
+
+    cache->bytes += entry->f_stats.st_size;
+    cache->n_entries++;
+    cache->copies++;
+
+    while (cache->bytes > cache->max_bytes && cache->tail != NULL) {
+        remove_entry(cache, cache->tail);
+        cache->evictions++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Takes copy jobs off the queue until the cache is destroyed.
+ *
+ * Params:
+ * - void *arg : The LocalCache.
+ *
+ * Returns: NULL
+ */
+static
+void *copier_main(void *arg) {
+    LocalCache *cache = (LocalCache*) arg;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (;;) {
+        while (!cache->stop && cache->q_len == 0)
+            pthread_cond_wait(&cache->queued, &cache->lock);
+
+        if (cache->stop)
+            break;
+
+        LcJob job = cache->queue[cache->q_head];
+
+        cache->q_head = (cache->q_head + 1) % LC_QUEUE_SZ;
+        cache->q_len--;
+
+        // Claim the key, so it is not queued again while it is copied. The
+        // job gives its own key away, so the claim holds a copy.
+        int slot = 0;
+
+        while (cache->copying[slot] != NULL)
+            slot++;
+
+        char *claim = strdup(job.key);
+
+        cache->copying[slot] = claim;
+
+        pthread_mutex_unlock(&cache->lock);
+
+        run_job(cache, &job);
+
+        pthread_mutex_lock(&cache->lock);
+
+        cache->copying[slot] = NULL;
+        free(claim);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return NULL;
+}
+
+// Removes the copies left behind by a previous run.
+static
+void remove_leftovers(const char *dir) {
+    DIR *d = opendir(dir);
+
+    if (d == NULL)
+        return;
+
+    struct dirent *entry;
+
+    while ((entry = readdir(d)) != NULL)
+        if (!strncmp(entry->d_name, LC_PREFIX, strlen(LC_PREFIX)))
+            unlinkat(dirfd(d), entry->d_name, 0);
+
+    closedir(d);
+}
+
+/*
+ * Creates the local cache, and starts its copier threads. Must be called
+ * with the signals blocked, like the other server threads.
+ *
+ * Params:
+ * - const char *dir  : The local cache directory.
+ * - size_t max_bytes : The budget of the copies.
+ * - long ttl_ms      : How long a copy is trusted before the original is
+ *                      checked again.
+ *
+ * Returns:
+ * - A new cache if no error occurred.
+ * - NULL otherwise.
+ */
+LocalCache *local_cache_create(const char *dir, size_t max_bytes, long ttl_ms) {
+    if (check_dir_access((char*) dir) < 0 || access(dir, W_OK) < 0) {
+        P_ERR("Could not access the local cache directory", errno);
+        return NULL;
+    }
+
+    LocalCache *cache = (LocalCache*) calloc(1, sizeof(LocalCache));
+
+    if (cache == NULL) {
+        ERR("Memory allocation during local cache creation failed");
+        return NULL;
+    }
+
+    if ((cache->dir = strdup(dir)) == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->max_bytes = max_bytes;
+    cache->ttl_ms    = ttl_ms;
+
+    remove_leftovers(dir);
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->queued, NULL);
+
+    for (int i = 0; i < LC_COPIERS; ++i) {
+        int err;
+        if ((err = pthread_create(&cache->copiers[i], NULL, copier_main, cache))) {
+            P_ERR("Failed to start a local cache copier", err);
+            break;
+        }
+
+        cache->n_copiers++;
+    }
+
+    if (cache->n_copiers == 0) {
+        local_cache_destroy(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/*
+ * Opens the local copy of a request path. A copy trusted for longer than
+ * the ttl, or copied from another version of the root, is checked against
+ * the original first, with a single stat, and removed if the original
+ * changed.
+ *
+ * Params:
+ * - LocalCache *cache    : The cache.
+ * - int root_fd          : An open fd of the root directory.
+ * - unsigned long gen    : The version of the root.
+ * - const char *key      : The normalized request path.
+ * - char **rel           : Where a new copy of the root relative path of
+ *                          the file will be stored.
+ * - int *fd              : Where the fd of the copy will be stored.
+ * - struct stat *f_stats : Where the metadata of the original will be
+ *                          stored.
+ *
+ * Returns:
+ * -  0 if the copy was opened.
+ * - -1 if the file must be served from the root.
+ */
+int local_cache_open(LocalCache *cache, int root_fd, unsigned long gen, const char *key, char **rel, int *fd,
+                     struct stat *f_stats) {
+    uint64_t hash = hash_string(key);
+
+    struct timespec t_now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t_now);
+
+    pthread_mutex_lock(&cache->lock);
+
+    LcEntry *entry = find_entry(cache, key, hash);
+
+    if (entry == NULL) {
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+
+    if (entry->root_gen != gen || elapsed_ms(&entry->validated, &t_now) >= cache->ttl_ms) {
+        char *rel_path = strdup(entry->rel);
+
+        cache->revalidations++;
+
+        pthread_mutex_unlock(&cache->lock);
+
+        // The stat of the original is the only lookup on the root. A
+        // symlink is never followed, it fails the comparison instead
+        struct stat now;
+        int valid = rel_path != NULL && fstatat(root_fd, rel_path, &now, AT_SYMLINK_NOFOLLOW) == 0;
+
+        free(rel_path);
+
+        pthread_mutex_lock(&cache->lock);
+
+        // The entry may have been replaced or evicted meanwhile
+        if ((entry = find_entry(cache, key, hash)) == NULL) {
+            __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&cache->lock);
+            return -1;
+        }
+
+        if (!valid || !same_original(&entry->f_stats, &now)) {
+            remove_entry(cache, entry);
+            cache->invalidated++;
+            __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&cache->lock);
+            return -1;
+        }
+
+        entry->validated = t_now;
+        entry->root_gen  = gen;
+    }
+
+    char *local_path = strdup(entry->local_path);
+
+    *rel     = strdup(entry->rel);
+    *f_stats = entry->f_stats;
+
+    lru_unlink(cache, entry);
+    lru_push(cache, entry);
+
+    pthread_mutex_unlock(&cache->lock);
+
+    *fd = local_path == NULL ? -1 : open(local_path, O_RDONLY | O_CLOEXEC);
+
+    free(local_path);
+
+    // Evicted meanwhile, fall back to the root
+    if (*fd < 0 || *rel == NULL) {
+        if (*fd >= 0)
+            close(*fd);
+
+        free(*rel);
+        *rel = NULL;
+
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * Queues a copy of a file just served from the root. Nothing is queued
+ * if the file is already being copied, does not fit the budget, or the
+ * queue is full.
+ *
+ * Params:
+ * - LocalCache *cache    : The cache.
+ * - unsigned long gen    : The version of the root the file was served
+ *                          from.
+ * - const char *key      : The normalized request path.
+ * - const char *rel      : The root relative path of the file served.
+ * - int fd               : The open original, duplicated for the copier.
+ * - struct stat *f_stats : The metadata of the original.
+ *
+ * Returns: -
+ */
+void local_cache_fill(LocalCache *cache, unsigned long gen, const char *key, const char *rel, int fd,
+                      struct stat *f_stats) {
+    if (!S_ISREG(f_stats->st_mode) || (size_t) f_stats->st_size > cache->max_bytes)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+
+    int queued = cache->q_len >= LC_QUEUE_SZ;
+
+    for (int i = 0; !queued && i < cache->q_len; ++i)
+        queued = !strcmp(cache->queue[(cache->q_head + i) % LC_QUEUE_SZ].key, key);
+
+    for (int i = 0; !queued && i < LC_COPIERS; ++i)
+        queued = cache->copying[i] != NULL && !strcmp(cache->copying[i], key);
+
+    if (queued) {
+        cache->dropped += cache->q_len >= LC_QUEUE_SZ;
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    LcJob *job = &cache->queue[(cache->q_head + cache->q_len) % LC_QUEUE_SZ];
+
+    job->key      = strdup(key);
+    job->rel      = strdup(rel);
+    job->fd       = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    job->f_stats  = *f_stats;
+    job->root_gen = gen;
+
+    if (job->key == NULL || job->rel == NULL || job->fd < 0) {
+        if (job->fd >= 0)
+            close(job->fd);
+
+        free(job->key);
+        free(job->rel);
+
+        cache->dropped++;
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    cache->q_len++;
+
+    pthread_cond_signal(&cache->queued);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Synchronized getter for the local cache statistics.
+ *
+ * Params:
+ * - LocalCache *cache     : The cache.
+ * - LocalCacheStats *dest : The struct we want to copy to.
+ *
+ * Returns: -
+ */
+void get_local_cache_stats(LocalCache *cache, LocalCacheStats *dest) {
+    pthread_mutex_lock(&cache->lock);
+
+    dest->n_entries     = cache->n_entries;
+    dest->bytes         = cache->bytes;
+    dest->max_bytes     = cache->max_bytes;
+    dest->queued        = cache->q_len;
+    dest->hits          = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    dest->misses        = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    dest->revalidations = cache->revalidations;
+    dest->invalidated   = cache->invalidated;
+    dest->copies        = cache->copies;
+    dest->copy_failures = cache->copy_failures;
+    dest->dropped       = cache->dropped;
+    dest->evictions     = cache->evictions;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Destructor for the cache. Stops the copiers, drops the queued copies and
+ * removes every copy, since the next run starts with an empty cache.
+ *
+ * Params:
+ * - LocalCache *cache : The cache we want to free.
+ *
+ * Returns: -
+ */
+void local_cache_destroy(LocalCache *cache) {
+    if (cache == NULL)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = 1;
+    pthread_cond_broadcast(&cache->queued);
+    pthread_mutex_unlock(&cache->lock);
+
+    for (int i = 0; i < cache->n_copiers; ++i)
+        pthread_join(cache->copiers[i], NULL);
+
+    for (; cache->q_len > 0; cache->q_len--) {
+        LcJob *job = &cache->queue[cache->q_head];
+
+        close(job->fd);
+        free(job->key);
+        free(job->rel);
+
+        cache->q_head = (cache->q_head + 1) % LC_QUEUE_SZ;
+    }
+
+    while (cache->head != NULL)
+        remove_entry(cache, cache->head);
+
+    pthread_cond_destroy(&cache->queued);
+    pthread_mutex_destroy(&cache->lock);
+
+    free(cache->dir);
+    free(cache);
+}
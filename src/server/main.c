@@ -5,20 +5,155 @@
 
 #include "server_manager.h"
 
+// Long options, for the optional server settings
+#define OPT_STAGES      256
+#define OPT_STAGE_QUEUE 257
+#define OPT_CACHE_MB    258
+#define OPT_CACHE_MAX   259
+#define OPT_FD_CACHE    260
+#define OPT_FD_TTL      261
+#define OPT_ETAG_HASH   262
+#define OPT_SIDECARS    263
+#define OPT_PRECOMPRESS 264
+#define OPT_COMPRESS    265
+#define OPT_COMPRESS_MB 266
+#define OPT_DISK_THREADS 267
+#define OPT_DROP_BEHIND 268
+#define OPT_MMAP_SEND   269
+#define OPT_INDEX       270
+#define OPT_NEG_CACHE   271
+#define OPT_BLOOM       272
+#define OPT_STATE_DIR   273
+#define OPT_WARM_INTERVAL 274
+#define OPT_WARM_THREADS 275
+#define OPT_LOCAL_CACHE 276
+#define OPT_LOCAL_CACHE_MB 277
+#define OPT_LOCAL_CACHE_TTL 278
+#define OPT_CACHE_POLICY 279
+#define OPT_DEDUP       280
+#define OPT_ZEROCOPY    281
+#define OPT_CONN_RATE   282
+#define OPT_GLOBAL_RATE 283
+#define OPT_RATE_BURST  284
+#define OPT_RATE_THREADS 285
+
+static const struct option long_options[] = {
+    {"stages",      required_argument, NULL, OPT_STAGES},
+    {"stage-queue", required_argument, NULL, OPT_STAGE_QUEUE},
+    {"cache-mb",    required_argument, NULL, OPT_CACHE_MB},
+    {"cache-max-kb",required_argument, NULL, OPT_CACHE_MAX},
+    {"dedup",       no_argument,       NULL, OPT_DEDUP},
+    {"fd-cache",    required_argument, NULL, OPT_FD_CACHE},
+    {"fd-cache-ttl",required_argument, NULL, OPT_FD_TTL},
+    {"etag-hash",   no_argument,       NULL, OPT_ETAG_HASH},
+    {"precompressed",no_argument,      NULL, OPT_SIDECARS},
+    {"precompress", no_argument,       NULL, OPT_PRECOMPRESS},
+    {"compress",    optional_argument, NULL, OPT_COMPRESS},
+    {"compress-cache-mb",required_argument,NULL, OPT_COMPRESS_MB},
+    {"disk-threads",required_argument, NULL, OPT_DISK_THREADS},
+    {"drop-behind", required_argument, NULL, OPT_DROP_BEHIND},
+    {"mmap-send",   no_argument,       NULL, OPT_MMAP_SEND},
+    {"zerocopy",    optional_argument, NULL, OPT_ZEROCOPY},
+    {"conn-rate-kb",required_argument, NULL, OPT_CONN_RATE},
+    {"global-rate-kb",required_argument,NULL, OPT_GLOBAL_RATE},
+    {"rate-burst-kb",required_argument,NULL, OPT_RATE_BURST},
+    {"rate-threads",required_argument, NULL, OPT_RATE_THREADS},
+    {"index",       no_argument,       NULL, OPT_INDEX},
+    {"neg-cache",   required_argument, NULL, OPT_NEG_CACHE},
+    {"bloom",       no_argument,       NULL, OPT_BLOOM},
+    {"state-dir",   required_argument, NULL, OPT_STATE_DIR},
+    {"warm-interval",required_argument,NULL, OPT_WARM_INTERVAL},
+    {"warm-threads",required_argument, NULL, OPT_WARM_THREADS},
+    {"local-cache", required_argument, NULL, OPT_LOCAL_CACHE},
+    {"local-cache-mb",required_argument,NULL, OPT_LOCAL_CACHE_MB},
+    {"local-cache-ttl",required_argument,NULL, OPT_LOCAL_CACHE_TTL},
+    {"cache-policy",required_argument, NULL, OPT_CACHE_POLICY},
+    {NULL, 0, NULL, 0}
+};
+
 void print_usage(){
-    fprintf(stderr, "Usage : ./myhttpd -p <http_port> -c <cmd_port> -t <num_threads> -d <root_dir>\n");
+    fprintf(stderr, "Usage : ./myhttpd -p <http_port> -c <cmd_port> -t <num_threads> -d <root_dir> [options]\n");
+    fprintf(stderr, "The root may also be a pack built by mkpack, served from memory (see RELOADPACK)\n");
+    fprintf(stderr, "A root directory may be a symlink to the current release, flipped on deploy (see RELOADROOT)\n");
+    fprintf(stderr, "Options :\n");
+    fprintf(stderr, "  --stages=<parse>,<resolve>,<send> : Staged mode, with a thread pool of the given size per stage\n");
+    fprintf(stderr, "  --stage-queue=<n>                 : Capacity of the queue in front of each stage\n");
+    fprintf(stderr, "  --cache-mb=<n>                    : Memory budget of the in-memory file cache\n");
+    fprintf(stderr, "  --cache-max-kb=<n>                : Largest file the file cache will hold\n");
+    fprintf(stderr, "  --dedup                           : Cache the body of files with the same content once\n");
+    fprintf(stderr, "  --fd-cache=<n>                    : Number of open files kept by the fd cache\n");
+    fprintf(stderr, "  --fd-cache-ttl=<ms>               : How long the fd cache trusts a resolved path\n");
+    fprintf(stderr, "  --etag-hash                       : Derive ETags from a hash of the file content\n");
+    fprintf(stderr, "  --precompressed                   : Serve <file>.br and <file>.gz to clients that accept them\n");
+    fprintf(stderr, "  --precompress                     : Same, and create the missing .gz copies in the background\n");
+    fprintf(stderr, "  --compress[=<min_bytes>]          : Compress files without a precompressed copy on the fly\n");
+    fprintf(stderr, "  --compress-cache-mb=<n>           : Memory budget of the files compressed on the fly\n");
+    fprintf(stderr, "  --disk-threads=<n>                : Serve files missing from the page cache from a pool of n disk threads\n");
+    fprintf(stderr, "  --drop-behind=<min_mb>            : Drop files of at least min_mb from the page cache as they are sent\n");
+    fprintf(stderr, "  --mmap-send                       : Send large files from a sequential mapping instead of with sendfile\n");
+    fprintf(stderr, "  --zerocopy[=<min_bytes>]          : Send bodies cached in memory with MSG_ZEROCOPY, from min_bytes\n");
+    fprintf(stderr, "  --conn-rate-kb=<n>                : KB/s of the response bodies of each connection (see RATELIMIT)\n");
+    fprintf(stderr, "  --global-rate-kb=<n>              : KB/s of the response bodies of all connections\n");
+    fprintf(stderr, "  --rate-burst-kb=<n>               : KB of every body sent before the rate limits apply\n");
+    fprintf(stderr, "  --rate-threads=<n>                : Threads sending the rate limited bodies, off the network workers\n");
+    fprintf(stderr, "  --index                           : Keep an index of the root directory in memory, updated with inotify\n");
+    fprintf(stderr, "  --neg-cache=<n>                   : Remember up to n missing paths, until their directories change\n");
+    fprintf(stderr, "  --bloom                           : Same as --index, with Bloom filters rejecting missing paths lock free\n");
+    fprintf(stderr, "  --state-dir=<dir>                 : Save the hottest paths in dir, and warm them on the next startup\n");
+    fprintf(stderr, "  --warm-interval=<sec>             : Seconds between two saves of the hottest paths\n");
+    fprintf(stderr, "  --warm-threads=<n>                : Idle priority threads warming the saved paths\n");
+    fprintf(stderr, "  --local-cache=<dir>               : Copy the files of a slow root to dir, and serve them from there\n");
+    fprintf(stderr, "  --local-cache-mb=<n>              : Byte budget of the local copies\n");
+    fprintf(stderr, "  --local-cache-ttl=<ms>            : How long a local copy is trusted before the original is checked\n");
+    fprintf(stderr, "  --cache-policy=<file>             : Cache-Control by path, one \"<pattern> <max-age> [immutable]\"\n");
+    fprintf(stderr, "                                      rule per line, pattern /<prefix>, *.<ext> or * (packs: see mkpack)\n");
 }
 
 void print_repeat_error(char p){
     fprintf(stderr, "Error : parameter -%c passed multiple times.\n", p);
 }
 
+/*
+ * Parses a comma seperated list of exactly n positive integers.
+ *
+ * Params:
+ * - char *str : The string holding the list.
+ * - int *vals : The array where the values will be stored.
+ * - int n     : The number of values expected.
+ *
+ * Returns:
+ * -  0 if the list is legal.
+ * - -1 otherwise.
+ */
+static
+int parse_int_list(char *str, int *vals, int n) {
+    char *end = str;
+
+    for (int i = 0; i < n; ++i) {
+        vals[i] = strtol(str, &end, 10);
+
+        if (end == str || vals[i] <= 0)
+            return -1;
+
+        // Values are seperated by commas, the last one by the end of the string
+        if (*end != (i == n - 1 ? '\0' : ','))
+            return -1;
+
+        str = end + 1;
+    }
+
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 9) {
+    if (argc < 9) {
         print_usage();
         return -1;
     }
 
+    ServerOptions options;
+    init_server_options(&options);
+
     int p;
     int c;
     int t;
@@ -31,8 +166,9 @@ int main(int argc, char *argv[]) {
 
     // Parse arguments
     int option;
+    long val;
     char *end;
-    while ((option = getopt(argc, argv, "p:c:t:d:")) != -1){
+    while ((option = getopt_long(argc, argv, "p:c:t:d:", long_options, NULL)) != -1){
         switch (option){
             case 'p':
                 if (read_p){
@@ -100,6 +236,252 @@ int main(int argc, char *argv[]) {
                 read_d = 1;
                 break;
 
+            case OPT_STAGES:
+                if (parse_int_list(optarg, options.stage_threads, N_STAGES) < 0) {
+                    fprintf(stderr, "Error : --stages argument must be three positive integers, seperated by commas.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_STAGE_QUEUE:
+                options.stage_queue_sz = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.stage_queue_sz <= 0){
+                    fprintf(stderr, "Error : --stage-queue argument must be a positive integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_CACHE_MB:
+                val = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || val <= 0){
+                    fprintf(stderr, "Error : --cache-mb argument must be a positive integer.\n");
+                    return -1;
+                }
+
+                options.cache_bytes = (size_t)val * 1024 * 1024;
+                break;
+
+            case OPT_CACHE_MAX:
+                val = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || val <= 0){
+                    fprintf(stderr, "Error : --cache-max-kb argument must be a positive integer.\n");
+                    return -1;
+                }
+
+                options.cache_max_object = (size_t)val * 1024;
+                break;
+
+            case OPT_DEDUP:
+                options.dedup = 1;
+                break;
+
+            case OPT_FD_CACHE:
+                options.fd_cache_entries = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.fd_cache_entries <= 0){
+                    fprintf(stderr, "Error : --fd-cache argument must be a positive integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_FD_TTL:
+                options.fd_cache_ttl_ms = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.fd_cache_ttl_ms < 0){
+                    fprintf(stderr, "Error : --fd-cache-ttl argument must be a non negative integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_ETAG_HASH:
+                options.etag_hash = 1;
+                break;
+
+            case OPT_SIDECARS:
+                options.sidecars = 1;
+                break;
+
+            case OPT_PRECOMPRESS:
+                options.sidecars    = 1;
+                options.precompress = 1;
+                break;
+
+            case OPT_COMPRESS:
+                options.compress = 1;
+
+                if (optarg == NULL)
+                    break;
+
+                options.compress_min = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.compress_min < 0){
+                    fprintf(stderr, "Error : --compress argument must be a non negative integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_COMPRESS_MB:
+                val = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || val <= 0){
+                    fprintf(stderr, "Error : --compress-cache-mb argument must be a positive integer.\n");
+                    return -1;
+                }
+
+                options.compress_cache_bytes = (size_t)val * 1024 * 1024;
+                break;
+
+            case OPT_DISK_THREADS:
+                options.disk_threads = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.disk_threads <= 0){
+                    fprintf(stderr, "Error : --disk-threads argument must be a positive integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_DROP_BEHIND:
+                val = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || val <= 0){
+                    fprintf(stderr, "Error : --drop-behind argument must be a positive integer.\n");
+                    return -1;
+                }
+
+                options.drop_behind_min = val * 1024 * 1024;
+                break;
+
+            case OPT_MMAP_SEND:
+                options.mmap_send = 1;
+                break;
+
+            case OPT_CONN_RATE:
+                val = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || val <= 0){
+                    fprintf(stderr, "Error : --conn-rate-kb argument must be a positive integer.\n");
+                    return -1;
+                }
+
+                options.conn_rate = val * 1024;
+                break;
+
+            case OPT_GLOBAL_RATE:
+                val = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || val <= 0){
+                    fprintf(stderr, "Error : --global-rate-kb argument must be a positive integer.\n");
+                    return -1;
+                }
+
+                options.global_rate = val * 1024;
+                break;
+
+            case OPT_RATE_BURST:
+                val = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || val < 0){
+                    fprintf(stderr, "Error : --rate-burst-kb argument must be a non negative integer.\n");
+                    return -1;
+                }
+
+                options.rate_burst = val * 1024;
+                break;
+
+            case OPT_RATE_THREADS:
+                options.rate_threads = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.rate_threads <= 0){
+                    fprintf(stderr, "Error : --rate-threads argument must be a positive integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_ZEROCOPY:
+                options.zerocopy_min = DEFAULT_ZEROCOPY_MIN;
+
+                if (optarg == NULL)
+                    break;
+
+                options.zerocopy_min = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.zerocopy_min <= 0){
+                    fprintf(stderr, "Error : --zerocopy argument must be a positive integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_INDEX:
+                options.index = 1;
+                break;
+
+            case OPT_NEG_CACHE:
+                options.neg_cache_entries = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.neg_cache_entries <= 0){
+                    fprintf(stderr, "Error : --neg-cache argument must be a positive integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_BLOOM:
+                options.index = 1;
+                options.bloom = 1;
+                break;
+
+            case OPT_STATE_DIR:
+                options.state_dir = optarg;
+                break;
+
+            case OPT_WARM_INTERVAL:
+                options.warm_interval = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.warm_interval <= 0){
+                    fprintf(stderr, "Error : --warm-interval argument must be a positive integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_CACHE_POLICY:
+                options.cache_policy = optarg;
+                break;
+
+            case OPT_LOCAL_CACHE:
+                options.local_cache_dir = optarg;
+                break;
+
+            case OPT_LOCAL_CACHE_MB:
+                val = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || val <= 0){
+                    fprintf(stderr, "Error : --local-cache-mb argument must be a positive integer.\n");
+                    return -1;
+                }
+
+                options.local_cache_bytes = (size_t)val * 1024 * 1024;
+                break;
+
+            case OPT_LOCAL_CACHE_TTL:
+                options.local_cache_ttl_ms = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.local_cache_ttl_ms < 0){
+                    fprintf(stderr, "Error : --local-cache-ttl argument must be a non negative integer.\n");
+                    return -1;
+                }
+                break;
+
+            case OPT_WARM_THREADS:
+                options.warm_threads = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || options.warm_threads <= 0){
+                    fprintf(stderr, "Error : --warm-threads argument must be a positive integer.\n");
+                    return -1;
+                }
+                break;
+
             case '?':
                 print_usage();
                 return -2;
@@ -109,8 +491,14 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // All the positional settings are mandatory
+    if (!(read_p && read_c && read_t && read_d)) {
+        print_usage();
+        return -1;
+    }
+
     // Argument parsing was sucessful
-    ServerResources *server = server_create(p, c, t, d);
+    ServerResources *server = server_create(p, c, t, d, &options);
 
     if (server == NULL)
         return -1;
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "neg_cache.h"
+#include "utils.h"
+
+// Events that may bring a missing path into existence
+#define NEG_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR)
+
+#define NEG_EVENT_BUF_SZ 4096
+
+// Inserts the entry at the most recently used end of the LRU list.
+static
+void lru_push(NegShard *shard, NegEntry *entry) {
+    entry->prev = NULL;
+    entry->next = shard->head;
+
+    if (shard->head != NULL)
+        shard->head->prev = entry;
+    else
+        shard->tail = entry;
+
+    shard->head = entry;
+}
+
+// Removes the entry from the LRU list.
+static
+void lru_unlink(NegShard *shard, NegEntry *entry) {
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        shard->head = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        shard->tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+/*
+ * Unlinks an entry from the shard and frees it. The shard lock must be
+ * held.
+ */
+static
+void shard_remove(NegShard *shard, NegEntry *entry) {
+    NegEntry **link = &shard->buckets[entry->hash % NCC_BUCKETS];
+
+    while (*link != entry)
+        link = &(*link)->h_next;
+
+    *link = entry->h_next;
+
+    lru_unlink(shard, entry);
+
+    shard->n_entries--;
+
+    free(entry);
+}
+
+// Finds the entry of a request path. The shard lock must be held.
+static
+NegEntry *shard_find(NegShard *shard, const char *key, uint64_t hash) {
+    NegEntry *entry = shard->buckets[hash % NCC_BUCKETS];
+
+    while (entry != NULL && !(entry->hash == hash && !strcmp(entry->key, key)))
+        entry = entry->h_next;
+
+    return entry;
+}
+
+/*
+ * Reads the pending inotify events, without blocking, and advances the
+ * generation if there were any. Events are queued by the kernel before
+ * the call that created the file returns, so a path created before the
+ * request arrived is never answered from the cache.
+ *
+ * Params:
+ * - NegCache *cache : The cache.
+ *
+ * Returns: The current generation.
+ */
+static
+unsigned long long sync_events(NegCache *cache) {
+    char buf[NEG_EVENT_BUF_SZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    pthread_mutex_lock(&cache->sync_lock);
+
+    int changed = 0;
+
+    while (read(cache->inotify_fd, buf, NEG_EVENT_BUF_SZ) > 0)
+        changed = 1;
+
+    if (changed)
+        cache->generation++;
+
+    unsigned long long generation = cache->generation;
+
+    pthread_mutex_unlock(&cache->sync_lock);
+
+    return generation;
+}
+
+/*
+ * Watches the existing directories a root relative path is looked up
+ * through, from the root down to the deepest one that exists.
+ *
+ * Params:
+ * - NegCache *cache      : The cache.
+ * - const char *rel_path : The normalized, root relative path.
+ *
+ * Returns:
+ * -  0 if every existing directory is watched.
+ * - -1 otherwise.
+ */
+static
+int watch_ancestors(NegCache *cache, const char *rel_path) {
+    size_t root_len = strlen(cache->root_dir);
+
+    char *path = malloc(root_len + strlen(rel_path) + 2);
+
+    if (path == NULL)
+        return -1;
+
+    memcpy(path, cache->root_dir, root_len + 1);
+
+    int ret = 0;
+
+    for (const char *p = rel_path; ; ++p) {
+        if (inotify_add_watch(cache->inotify_fd, path, NEG_WATCH_MASK) < 0) {
+            // The deeper directories do not exist either
+            if (errno != ENOENT && errno != ENOTDIR)
+                ret = -1;
+
+            break;
+        }
+
+        const char *slash = strchr(p, '/');
+
+        if (slash == NULL)
+            break;
+
+        // Extend the path by the next component
+        size_t len = strlen(path);
+
+        path[len] = '/';
+        memcpy(path + len + 1, p, slash - p);
+        path[len + 1 + (slash - p)] = '\0';
+
+        p = slash;
+    }
+
+    free(path);
+
+    return ret;
+}
+
+/*
+ * Creates a new negative cache.
+ *
+ * Params:
+ * - int max_entries : The maximum number of missing paths held.
+ * - char *root_dir  : The root directory. It is copied.
+ * - int root_fd     : An open fd of the root directory. It is duplicated.
+ *
+ * Returns:
+ * - A new cache if no error occurred.
+ * - NULL otherwise.
+ */
+NegCache *neg_cache_create(int max_entries, char *root_dir, int root_fd) {
+    NegCache *cache = (NegCache*) calloc(1, sizeof(NegCache));
+
+    if (cache == NULL) {
+        ERR("Memory allocation during negative cache creation failed");
+        return NULL;
+    }
+
+    cache->root_dir   = strdup(root_dir);
+    cache->root_fd    = fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (cache->root_dir == NULL || cache->root_fd < 0 || cache->inotify_fd < 0) {
+        P_ERR("Failed to set up the negative cache", errno);
+        goto FAIL;
+    }
+
+    int err;
+    if ((err = pthread_mutex_init(&cache->sync_lock, NULL))) {
+        P_ERR("Failed to initialize negative cache mutex", err);
+        goto FAIL;
+    }
+
+    for (int i = 0; i < NCC_SHARDS; ++i) {
+        if ((err = pthread_mutex_init(&cache->shards[i].lock, NULL))) {
+            P_ERR("Failed to initialize negative cache mutex", err);
+
+            for (int j = 0; j < i; ++j)
+                pthread_mutex_destroy(&cache->shards[j].lock);
+
+            pthread_mutex_destroy(&cache->sync_lock);
+            goto FAIL;
+        }
+
+        // Spread the budget over the shards, rounding up
+        cache->shards[i].max_entries = (max_entries + NCC_SHARDS - 1) / NCC_SHARDS;
+    }
+
+    return cache;
+
+FAIL:
+    free(cache->root_dir);
+
+    if (cache->root_fd >= 0)
+        close(cache->root_fd);
+
+    if (cache->inotify_fd >= 0)
+        close(cache->inotify_fd);
+
+    free(cache);
+    return NULL;
+}
+
+/*
+ * Checks if a request path is known to be missing. Entries found missing
+ * before the last change to a watched directory are dropped.
+ *
+ * Params:
+ * - NegCache *cache : The cache.
+ * - const char *key : The request path.
+ *
+ * Returns:
+ * - 1 if the path is missing, and the request can be answered 404.
+ * - 0 if it must be looked up.
+ */
+int neg_cache_lookup(NegCache *cache, const char *key) {
+    uint64_t hash   = hash_string(key);
+    NegShard *shard = &cache->shards[hash % NCC_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    NegEntry *entry = shard_find(shard, key, hash);
+
+    // Only hits have to look at the events
+    if (entry != NULL && entry->generation != sync_events(cache)) {
+        shard_remove(shard, entry);
+        shard->invalidated++;
+        entry = NULL;
+    }
+
+    if (entry == NULL) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+
+    shard->hits++;
+
+    lru_unlink(shard, entry);
+    lru_push(shard, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return 1;
+}
+
+/*
+ * Remembers that a request path is missing, evicting the least recently
+ * used paths if the shard is full. The directories the path goes through
+ * are watched first, and the path is checked once more, so a file
+ * created right after the failed lookup is not missed.
+ *
+ * Params:
+ * - NegCache *cache      : The cache.
+ * - const char *key      : The request path. It is copied.
+ * - const char *rel_path : The normalized, root relative path it maps to.
+ *
+ * Returns: -
+ */
+void neg_cache_insert(NegCache *cache, const char *key, const char *rel_path) {
+    if (watch_ancestors(cache, rel_path) < 0) {
+        __atomic_add_fetch(&cache->uncached, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    unsigned long long generation = sync_events(cache);
+
+    struct stat f_stats;
+
+    if (fstatat(cache->root_fd, rel_path, &f_stats, 0) == 0 || (errno != ENOENT && errno != ENOTDIR))
+        return;
+
+    size_t key_len  = strlen(key);
+    NegEntry *entry = (NegEntry*) malloc(sizeof(NegEntry) + key_len + 1);
+
+    if (entry == NULL) {
+        P_ERR("Malloc failed for negative cache entry", errno);
+        return;
+    }
+
+    memcpy(entry->key, key, key_len + 1);
+
+    entry->hash       = hash_string(key);
+    entry->generation = generation;
+
+    NegShard *shard = &cache->shards[entry->hash % NCC_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    NegEntry *old = shard_find(shard, key, entry->hash);
+
+    if (old != NULL)
+        shard_remove(shard, old);
+
+    while (shard->n_entries >= shard->max_entries && shard->tail != NULL) {
+        shard_remove(shard, shard->tail);
+        shard->evictions++;
+    }
+
+    entry->h_next = shard->buckets[entry->hash % NCC_BUCKETS];
+    shard->buckets[entry->hash % NCC_BUCKETS] = entry;
+    shard->n_entries++;
+
+    lru_push(shard, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Collects the statistics of all the shards.
+ *
+ * Params:
+ * - NegCache *cache     : The cache.
+ * - NegCacheStats *dest : The struct where the totals will be stored.
+ *
+ * Returns: -
+ */
+void get_neg_cache_stats(NegCache *cache, NegCacheStats *dest) {
+    memset(dest, 0, sizeof(NegCacheStats));
+
+    for (int i = 0; i < NCC_SHARDS; ++i) {
+        NegShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        dest->hits        += shard->hits;
+        dest->misses      += shard->misses;
+        dest->invalidated += shard->invalidated;
+        dest->evictions   += shard->evictions;
+        dest->n_entries   += shard->n_entries;
+        dest->max_entries += shard->max_entries;
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    dest->uncached   = __atomic_load_n(&cache->uncached, __ATOMIC_RELAXED);
+    dest->generation = sync_events(cache);
+}
+
+/*
+ * Destructor for the cache.
+ *
+ * Params:
+ * - NegCache *cache : The cache we want to free.
+ *
+ * Returns: -
+ */
+void neg_cache_destroy(NegCache *cache) {
+    if (cache == NULL)
+        return;
+
+    for (int i = 0; i < NCC_SHARDS; ++i) {
+        NegShard *shard = &cache->shards[i];
+
+        while (shard->head != NULL)
+            shard_remove(shard, shard->head);
+
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    pthread_mutex_destroy(&cache->sync_lock);
+
+    close(cache->inotify_fd);
+    close(cache->root_fd);
+
+    free(cache->root_dir);
+    free(cache);
+}
@@ -0,0 +1,984 @@
+#define _GNU_SOURCE
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+
+#include "ns_index.h"
+#include "utils.h"
+
+#define INITIAL_BUCKETS 1024
+
+// Events that change what the index knows about a directory
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// Room for a batch of inotify events, and how often the watcher checks
+// if it should stop
+#define EVENT_BUF_SZ  (64 * 1024)
+#define WATCH_POLL_MS 500
+
+// Bloom filter sizing, and the number of bits set per path
+#define BLOOM_BITS_PER_NODE 16
+#define BLOOM_MIN_BITS      (64 * 1024)
+#define BLOOM_K             4
+
+// FNV-1a, as in hash_string, so the ancestors of a path are hashed in the
+// same pass as the path itself
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+typedef struct {
+    NsIndex *index;
+    char *path;
+} ScanJob;
+
+static void scan_dir(NsIndex *index, const char *path, int parallel);
+
+static
+void free_job(void *arg) {
+    ScanJob *job = (ScanJob*) arg;
+
+    free(job->path);
+    free(job);
+}
+
+// Joins a directory and an entry into a root relative path.
+static
+char *join_path(const char *dir, const char *name) {
+    if (!strcmp(dir, "."))
+        return strdup(name);
+
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+    if (path != NULL)
+        sprintf(path, "%s/%s", dir, name);
+
+    return path;
+}
+
+// Maps the type and mode of a file to what the index answers for it.
+static
+int stat_kind(struct stat *f_stats) {
+    if (S_ISREG(f_stats->st_mode))
+        return f_stats->st_mode & S_IRUSR ? NS_FILE : NS_FORBIDDEN;
+
+    if (S_ISDIR(f_stats->st_mode))
+        return NS_DIR;
+
+    return NS_UNKNOWN;
+}
+
+/*
+ * Finds the node of a path. The lock must be held.
+ */
+static
+NsNode *node_find(NsIndex *index, const char *path, uint64_t hash) {
+    NsNode *node = index->buckets[hash & (index->n_buckets - 1)];
+
+    while (node != NULL && !(node->hash == hash && !strcmp(node->path, path)))
+        node = node->h_next;
+
+    return node;
+}
+
+// Spreads the bits of a path hash, to derive the Bloom filter positions.
+static
+uint64_t bloom_mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+// Sets the bits of a path hash in a Bloom filter.
+static
+void bloom_set(uint64_t *bits, size_t n_bits, uint64_t hash) {
+    uint64_t mixed = bloom_mix(hash);
+    uint32_t h1 = (uint32_t) mixed;
+    uint32_t h2 = (uint32_t)(mixed >> 32) | 1;
+
+    for (uint32_t i = 0; i < BLOOM_K; ++i) {
+        size_t bit = (h1 + i * h2) & (n_bits - 1);
+        __atomic_or_fetch(&bits[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+    }
+}
+
+// Checks if a path hash may have been set in a Bloom filter.
+static
+int bloom_test(uint64_t *bits, size_t n_bits, uint64_t hash) {
+    uint64_t mixed = bloom_mix(hash);
+    uint32_t h1 = (uint32_t) mixed;
+    uint32_t h2 = (uint32_t)(mixed >> 32) | 1;
+
+    for (uint32_t i = 0; i < BLOOM_K; ++i) {
+        size_t bit = (h1 + i * h2) & (n_bits - 1);
+
+        if (!(__atomic_load_n(&bits[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64))))
+            return 0;
+    }
+
+    return 1;
+}
+
+// Adds a node to the Bloom filters, if they are enabled.
+static
+void bloom_add(NsIndex *index, NsNode *node) {
+    if (index->bloom == NULL)
+        return;
+
+    bloom_set(index->bloom, index->bloom_bits, node->hash);
+
+    if (node->kind == NS_UNKNOWN)
+        bloom_set(index->bloom_unknown, index->bloom_bits, node->hash);
+}
+
+/*
+ * Checks, without the lock, if a path is certainly missing: it was never
+ * indexed, and neither the root nor any of its ancestors is a path the
+ * index does not follow.
+ *
+ * Params:
+ * - NsIndex *index   : The index, with its Bloom filters.
+ * - const char *path : The normalized, root relative path.
+ *
+ * Returns:
+ * - 1 if the path is missing.
+ * - 0 if the index must be searched.
+ */
+static
+int bloom_excludes(NsIndex *index, const char *path) {
+    if (bloom_test(index->bloom_unknown, index->bloom_bits, hash_string(".")))
+        return 0;
+
+    uint64_t hash = FNV_OFFSET;
+
+    for (const char *p = path; *p != '\0'; ++p) {
+        if (*p == '/' && bloom_test(index->bloom_unknown, index->bloom_bits, hash))
+            return 0;
+
+        hash ^= (unsigned char)*p;
+        hash *= FNV_PRIME;
+    }
+
+    return !bloom_test(index->bloom, index->bloom_bits, hash);
+}
+
+/*
+ * Sizes the Bloom filters for the scanned tree, with room to grow, and
+ * adds every indexed path. The watcher must not be running yet.
+ *
+ * Params:
+ * - NsIndex *index : The index.
+ *
+ * Returns: -
+ */
+static
+void bloom_create(NsIndex *index) {
+    size_t n_bits = BLOOM_MIN_BITS;
+
+    while (n_bits < index->n_nodes * BLOOM_BITS_PER_NODE)
+        n_bits *= 2;
+
+    uint64_t *bloom   = calloc(n_bits / 64, sizeof(uint64_t));
+    uint64_t *unknown = calloc(n_bits / 64, sizeof(uint64_t));
+
+    if (bloom == NULL || unknown == NULL) {
+        ERR("Failed to allocate the Bloom filters of the index");
+        free(bloom);
+        free(unknown);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    index->bloom         = bloom;
+    index->bloom_unknown = unknown;
+    index->bloom_bits    = n_bits;
+
+    for (size_t i = 0; i < index->n_buckets; ++i)
+        for (NsNode *node = index->buckets[i]; node != NULL; node = node->h_next)
+            bloom_add(index, node);
+
+    index->bytes += 2 * n_bits / 8;
+
+    pthread_rwlock_unlock(&index->lock);
+}
+
+// Creates a node, not yet linked in the index.
+static
+NsNode *node_new(const char *path, int kind) {
+    size_t len   = strlen(path);
+    NsNode *node = malloc(sizeof(NsNode) + len + 1);
+
+    if (node == NULL) {
+        P_ERR("Malloc failed for index node", errno);
+        return NULL;
+    }
+
+    memcpy(node->path, path, len + 1);
+
+    node->hash      = hash_string(path);
+    node->kind      = kind;
+    node->has_index = 0;
+    node->h_next    = NULL;
+
+    return node;
+}
+
+// Adds (sign 1) or removes (sign -1) a node from the statistics.
+static
+void account(NsIndex *index, NsNode *node, int sign) {
+    index->n_nodes += sign;
+    index->bytes   += sign * (long)(sizeof(NsNode) + strlen(node->path) + 1);
+
+    if (node->kind == NS_DIR)
+        index->n_dirs += sign;
+    else if (node->kind == NS_FILE)
+        index->n_files += sign;
+}
+
+/*
+ * Doubles the hash table once it holds more nodes than buckets. The write
+ * lock must be held.
+ */
+static
+void maybe_grow(NsIndex *index) {
+    if (index->n_nodes < index->n_buckets)
+        return;
+
+    size_t n_buckets = index->n_buckets * 2;
+    NsNode **buckets = calloc(n_buckets, sizeof(NsNode*));
+
+    // Keep the current table, lookups only get slower
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < index->n_buckets; ++i) {
+        NsNode *node = index->buckets[i];
+
+        while (node != NULL) {
+            NsNode *next = node->h_next;
+
+            node->h_next = buckets[node->hash & (n_buckets - 1)];
+            buckets[node->hash & (n_buckets - 1)] = node;
+
+            node = next;
+        }
+    }
+
+    free(index->buckets);
+
+    index->bytes    += (n_buckets - index->n_buckets) * sizeof(NsNode*);
+    index->buckets   = buckets;
+    index->n_buckets = n_buckets;
+}
+
+/*
+ * Links a node in the index, replacing the node of the same path. A
+ * directory keeps knowing about its index.html. The write lock must be
+ * held.
+ */
+static
+void node_put(NsIndex *index, NsNode *node) {
+    NsNode **link = &index->buckets[node->hash & (index->n_buckets - 1)];
+
+    while (*link != NULL && !((*link)->hash == node->hash && !strcmp((*link)->path, node->path)))
+        link = &(*link)->h_next;
+
+    if (*link != NULL) {
+        NsNode *old = *link;
+
+        if (old->kind == NS_DIR && node->kind == NS_DIR)
+            node->has_index = old->has_index;
+
+        *link = old->h_next;
+
+        account(index, old, -1);
+        free(old);
+    }
+
+    node->h_next = index->buckets[node->hash & (index->n_buckets - 1)];
+    index->buckets[node->hash & (index->n_buckets - 1)] = node;
+
+    account(index, node, 1);
+    bloom_add(index, node);
+
+    maybe_grow(index);
+}
+
+// Checks if path is prefix itself, or lies beneath it.
+static
+int in_subtree(const char *path, const char *prefix, size_t prefix_len) {
+    return !strncmp(path, prefix, prefix_len) && (path[prefix_len] == '\0' || path[prefix_len] == '/');
+}
+
+/*
+ * Removes a path and everything beneath it, along with the watches of the
+ * directories removed. Only directories need a pass over the whole table.
+ * The write lock must be held.
+ */
+static
+void remove_subtree(NsIndex *index, const char *path) {
+    uint64_t hash = hash_string(path);
+    NsNode *found = node_find(index, path, hash);
+
+    if (found == NULL)
+        return;
+
+    if (found->kind == NS_FILE || found->kind == NS_FORBIDDEN) {
+        NsNode **link = &index->buckets[hash & (index->n_buckets - 1)];
+
+        while (*link != found)
+            link = &(*link)->h_next;
+
+        *link = found->h_next;
+
+        account(index, found, -1);
+        free(found);
+        return;
+    }
+
+    size_t len = strlen(path);
+
+    for (size_t i = 0; i < index->n_buckets; ++i) {
+        NsNode **link = &index->buckets[i];
+
+        while (*link != NULL) {
+            NsNode *node = *link;
+
+            if (!in_subtree(node->path, path, len)) {
+                link = &node->h_next;
+                continue;
+            }
+
+            *link = node->h_next;
+
+            account(index, node, -1);
+            free(node);
+        }
+    }
+
+    for (int wd = 0; wd < index->n_watches; ++wd) {
+        if (index->watches[wd] == NULL || !in_subtree(index->watches[wd], path, len))
+            continue;
+
+        inotify_rm_watch(index->inotify_fd, wd);
+
+        index->bytes -= strlen(index->watches[wd]) + 1;
+
+        free(index->watches[wd]);
+        index->watches[wd] = NULL;
+    }
+}
+
+/*
+ * Remembers the directory behind a watch descriptor. The write lock must
+ * be held.
+ */
+static
+void watch_put(NsIndex *index, int wd, const char *path) {
+    if (wd >= index->n_watches) {
+        int n_watches = wd * 2 + 16;
+        char **watches = realloc(index->watches, n_watches * sizeof(char*));
+
+        if (watches == NULL) {
+            P_ERR("Malloc failed for index watches", errno);
+            return;
+        }
+
+        for (int i = index->n_watches; i < n_watches; ++i)
+            watches[i] = NULL;
+
+        index->watches   = watches;
+        index->n_watches = n_watches;
+    }
+
+    if (index->watches[wd] != NULL) {
+        index->bytes -= strlen(index->watches[wd]) + 1;
+        free(index->watches[wd]);
+    }
+
+    if ((index->watches[wd] = strdup(path)) != NULL)
+        index->bytes += strlen(path) + 1;
+}
+
+/*
+ * Tells the directory holding path if it has an index.html to serve, when
+ * path is one. The write lock must be held.
+ */
+static
+void update_dir_index(NsIndex *index, const char *path, int kind) {
+    const char *slash = strrchr(path, '/');
+    const char *name  = slash == NULL ? path : slash + 1;
+
+    if (strcmp(name, NS_DIR_INDEX))
+        return;
+
+    char *dir = slash == NULL ? strdup(".") : strndup(path, slash - path);
+
+    if (dir == NULL)
+        return;
+
+    NsNode *node = node_find(index, dir, hash_string(dir));
+
+    if (node != NULL && node->kind == NS_DIR)
+        node->has_index = kind == NS_FILE;
+
+    free(dir);
+}
+
+static
+void scan_finished(NsIndex *index) {
+    pthread_mutex_lock(&index->scan_lock);
+
+    if (--index->scans_pending == 0)
+        pthread_cond_signal(&index->scan_done);
+
+    pthread_mutex_unlock(&index->scan_lock);
+}
+
+static
+void scan_task(void *arg) {
+    ScanJob *job = (ScanJob*) arg;
+
+    scan_dir(job->index, job->path, 1);
+    scan_finished(job->index);
+}
+
+/*
+ * Queues the scan of a directory on the thread pool, or scans it right
+ * away if it cannot be queued.
+ */
+static
+void scan_spawn(NsIndex *index, const char *path) {
+    pthread_mutex_lock(&index->scan_lock);
+    index->scans_pending++;
+    pthread_mutex_unlock(&index->scan_lock);
+
+    ScanJob *job = malloc(sizeof(ScanJob));
+
+    if (job != NULL && (job->path = strdup(path)) != NULL) {
+        job->index = index;
+
+        if (thread_pool_add(index->pool, scan_task, free_job, job) == 0)
+            return;
+
+        free(job->path);
+    }
+
+    free(job);
+
+    scan_dir(index, path, 1);
+    scan_finished(index);
+}
+
+/*
+ * Adds the entries of a directory to the index and watches it for
+ * changes, then does the same for its subdirectories. The directory node
+ * itself must already be in the index. A directory that cannot be read,
+ * or watched (e.g. out of inotify watches), is marked NS_UNKNOWN, so the
+ * paths beneath it are looked up on the filesystem.
+ *
+ * Params:
+ * - NsIndex *index   : The index.
+ * - const char *path : The root relative path of the directory.
+ * - int parallel     : 1 to scan the subdirectories on the thread pool,
+ *                      0 to scan them before returning.
+ *
+ * Returns: -
+ */
+static
+void scan_dir(NsIndex *index, const char *path, int parallel) {
+    char *full_path = malloc(strlen(index->root_dir) + strlen(path) + 2);
+
+    if (full_path == NULL)
+        return;
+
+    sprintf(full_path, "%s/%s", index->root_dir, path);
+
+    // Watch before reading, so no change falls in between
+    int wd = inotify_add_watch(index->inotify_fd, full_path, WATCH_MASK);
+
+    free(full_path);
+
+    // Without a watch the entries would go stale, so they are not indexed
+    int dir_fd = wd < 0 ? -1 : openat(index->root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir   = dir_fd < 0 ? NULL : fdopendir(dir_fd);
+
+    if (dir == NULL) {
+        if (dir_fd >= 0)
+            close(dir_fd);
+
+        NsNode *node = node_new(path, NS_UNKNOWN);
+
+        pthread_rwlock_wrlock(&index->lock);
+
+        if (node != NULL)
+            node_put(index, node);
+
+        pthread_rwlock_unlock(&index->lock);
+        return;
+    }
+
+    // The entries are linked into a batch, and published with a single
+    // lock acquisition
+    NsNode *batch   = NULL;
+    char **subdirs  = NULL;
+    size_t n_subdirs = 0;
+    int has_index   = 0;
+
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        struct stat f_stats;
+
+        if (fstatat(dirfd(dir), entry->d_name, &f_stats, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        char *child = join_path(path, entry->d_name);
+
+        if (child == NULL)
+            continue;
+
+        int kind     = stat_kind(&f_stats);
+        NsNode *node = node_new(child, kind);
+
+        if (node != NULL) {
+            node->h_next = batch;
+            batch        = node;
+        }
+
+        if (kind == NS_FILE && !strcmp(entry->d_name, NS_DIR_INDEX))
+            has_index = 1;
+
+        char **grown;
+
+        if (kind == NS_DIR && (grown = realloc(subdirs, (n_subdirs + 1) * sizeof(char*))) != NULL) {
+            subdirs = grown;
+            subdirs[n_subdirs++] = child;
+        }
+        else
+            free(child);
+    }
+
+    closedir(dir);
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    watch_put(index, wd, path);
+
+    while (batch != NULL) {
+        NsNode *next = batch->h_next;
+        node_put(index, batch);
+        batch = next;
+    }
+
+    NsNode *self = node_find(index, path, hash_string(path));
+
+    if (self != NULL)
+        self->has_index = has_index;
+
+    pthread_rwlock_unlock(&index->lock);
+
+    for (size_t i = 0; i < n_subdirs; ++i) {
+        if (parallel)
+            scan_spawn(index, subdirs[i]);
+        else
+            scan_dir(index, subdirs[i], 0);
+
+        free(subdirs[i]);
+    }
+
+    free(subdirs);
+}
+
+/*
+ * Drops the whole index and scans the root again, after inotify lost
+ * events. Lookups go to the filesystem in the meantime.
+ */
+static
+void rebuild(NsIndex *index) {
+    index->stale = 1;
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    for (size_t i = 0; i < index->n_buckets; ++i)
+        while (index->buckets[i] != NULL) {
+            NsNode *node = index->buckets[i];
+
+            index->buckets[i] = node->h_next;
+
+            account(index, node, -1);
+            free(node);
+        }
+
+    for (int wd = 0; wd < index->n_watches; ++wd)
+        if (index->watches[wd] != NULL) {
+            inotify_rm_watch(index->inotify_fd, wd);
+
+            index->bytes -= strlen(index->watches[wd]) + 1;
+
+            free(index->watches[wd]);
+            index->watches[wd] = NULL;
+        }
+
+    NsNode *root = node_new(".", NS_DIR);
+
+    if (root != NULL)
+        node_put(index, root);
+
+    pthread_rwlock_unlock(&index->lock);
+
+    scan_dir(index, ".", 0);
+
+    __atomic_add_fetch(&index->rescans, 1, __ATOMIC_RELAXED);
+
+    index->stale = 0;
+}
+
+/*
+ * Applies a single inotify event to the index.
+ *
+ * Params:
+ * - NsIndex *index             : The index.
+ * - struct inotify_event *event : The event.
+ *
+ * Returns: -
+ */
+static
+void apply_event(NsIndex *index, struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        ERR("Index lost inotify events, scanning the root directory again");
+        rebuild(index);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    char *dir = NULL;
+
+    if (event->wd >= 0 && event->wd < index->n_watches && index->watches[event->wd] != NULL)
+        dir = strdup(index->watches[event->wd]);
+
+    if (event->mask & IN_IGNORED && dir != NULL) {
+        index->bytes -= strlen(index->watches[event->wd]) + 1;
+
+        free(index->watches[event->wd]);
+        index->watches[event->wd] = NULL;
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+
+    if (dir == NULL)
+        return;
+
+    // Other directories are handled through the events of their parent
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (!strcmp(dir, "."))
+            rebuild(index);
+
+        free(dir);
+        return;
+    }
+
+    char *path = event->len > 0 ? join_path(dir, event->name) : NULL;
+
+    free(dir);
+
+    if (path == NULL)
+        return;
+
+    struct stat f_stats;
+
+    int exists = !(event->mask & (IN_DELETE | IN_MOVED_FROM)) &&
+                 fstatat(index->root_fd, path, &f_stats, AT_SYMLINK_NOFOLLOW) == 0;
+
+    int kind = exists ? stat_kind(&f_stats) : NS_MISSING;
+
+    NsNode *node = exists ? node_new(path, kind) : NULL;
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    // A directory is scanned again as a whole, its access may have changed
+    remove_subtree(index, path);
+
+    if (node != NULL)
+        node_put(index, node);
+
+    update_dir_index(index, path, kind);
+
+    pthread_rwlock_unlock(&index->lock);
+
+    if (node != NULL && kind == NS_DIR)
+        scan_dir(index, path, 0);
+
+    __atomic_add_fetch(&index->updates, 1, __ATOMIC_RELAXED);
+
+    free(path);
+}
+
+/*
+ * The thread that keeps the index up to date, applying the inotify events
+ * as they come.
+ *
+ * Params:
+ * - void *arg : The NsIndex.
+ *
+ * Returns: NULL
+ */
+static
+void *watch_events(void *arg) {
+    NsIndex *index = (NsIndex*) arg;
+
+    char buf[EVENT_BUF_SZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    struct pollfd fd_info;
+
+    fd_info.fd     = index->inotify_fd;
+    fd_info.events = POLLIN;
+
+    while (index->running) {
+        if (poll(&fd_info, 1, WATCH_POLL_MS) <= 0)
+            continue;
+
+        ssize_t len = read(index->inotify_fd, buf, EVENT_BUF_SZ);
+
+        if (len <= 0)
+            continue;
+
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event*) p;
+
+            apply_event(index, event);
+
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Builds the index of a root directory. The tree is scanned by the thread
+ * pool, and the call returns once the scan is complete and the watcher
+ * thread is running.
+ *
+ * Params:
+ * - thread_pool *pool : The pool scanning the directories.
+ * - char *root_dir    : The root directory. It is copied.
+ * - int root_fd       : An open fd of the root directory. It is duplicated.
+ * - int bloom         : Also keep Bloom filters of the paths, to reject
+ *                       missing ones without the lock.
+ *
+ * Returns:
+ * - A new index if no error occurred.
+ * - NULL otherwise.
+ */
+NsIndex *ns_index_create(thread_pool *pool, char *root_dir, int root_fd, int bloom) {
+    NsIndex *index = (NsIndex*) calloc(1, sizeof(NsIndex));
+
+    if (index == NULL) {
+        ERR("Memory allocation during index creation failed");
+        return NULL;
+    }
+
+    index->pool       = pool;
+    index->n_buckets  = INITIAL_BUCKETS;
+    index->buckets    = calloc(INITIAL_BUCKETS, sizeof(NsNode*));
+    index->root_dir   = strdup(root_dir);
+    index->root_fd    = fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+    index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    index->bytes      = sizeof(NsIndex) + INITIAL_BUCKETS * sizeof(NsNode*);
+
+    NsNode *root = node_new(".", NS_DIR);
+
+    if (index->buckets == NULL || index->root_dir == NULL || root == NULL ||
+        index->root_fd < 0 || index->inotify_fd < 0) {
+        P_ERR("Failed to set up the index", errno);
+        goto FAIL;
+    }
+
+    pthread_rwlock_init(&index->lock, NULL);
+    pthread_mutex_init(&index->scan_lock, NULL);
+    pthread_cond_init(&index->scan_done, NULL);
+
+    node_put(index, root);
+    root = NULL;
+
+    struct timeval t_start, t_end;
+    gettimeofday(&t_start, NULL);
+
+    scan_spawn(index, ".");
+
+    pthread_mutex_lock(&index->scan_lock);
+
+    while (index->scans_pending > 0)
+        pthread_cond_wait(&index->scan_done, &index->scan_lock);
+
+    pthread_mutex_unlock(&index->scan_lock);
+
+    gettimeofday(&t_end, NULL);
+
+    index->scan_ms = (t_end.tv_sec - t_start.tv_sec) * 1000.0 + (t_end.tv_usec - t_start.tv_usec) / 1000.0;
+
+    if (bloom)
+        bloom_create(index);
+
+    index->running = 1;
+
+    int err;
+    if ((err = pthread_create(&index->watcher, NULL, watch_events, index))) {
+        P_ERR("Failed to start the index watcher", err);
+        index->running = 0;
+        ns_index_destroy(index);
+        return NULL;
+    }
+
+    return index;
+
+FAIL:
+    free(root);
+    free(index->buckets);
+    free(index->root_dir);
+
+    if (index->root_fd >= 0)
+        close(index->root_fd);
+
+    if (index->inotify_fd >= 0)
+        close(index->inotify_fd);
+
+    free(index);
+    return NULL;
+}
+
+/*
+ * Answers what is at a root relative path, from memory. A directory with
+ * an index.html is answered as that file.
+ *
+ * Params:
+ * - NsIndex *index   : The index.
+ * - const char *path : The normalized, root relative path.
+ * - char *dest       : Where the path of the index.html of a directory is
+ *                      stored. It is left empty for any other answer.
+ * - size_t dest_sz   : The size of dest.
+ *
+ * Returns:
+ * - NS_FILE, NS_DIR, NS_FORBIDDEN or NS_MISSING, if the index knows.
+ * - NS_UNKNOWN if the path must be looked up on the filesystem.
+ */
+int ns_index_lookup(NsIndex *index, const char *path, char *dest, size_t dest_sz) {
+    dest[0] = '\0';
+
+    if (index->stale) {
+        __atomic_add_fetch(&index->fallbacks, 1, __ATOMIC_RELAXED);
+        return NS_UNKNOWN;
+    }
+
+    if (index->bloom != NULL && bloom_excludes(index, path)) {
+        __atomic_add_fetch(&index->bloom_rejects, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&index->hits, 1, __ATOMIC_RELAXED);
+        return NS_MISSING;
+    }
+
+    pthread_rwlock_rdlock(&index->lock);
+
+    NsNode *node = node_find(index, path, hash_string(path));
+    int kind;
+
+    if (node != NULL) {
+        kind = node->kind;
+
+        if (kind == NS_DIR && node->has_index) {
+            int n = !strcmp(path, ".") ? snprintf(dest, dest_sz, "%s", NS_DIR_INDEX) :
+                                         snprintf(dest, dest_sz, "%s/%s", path, NS_DIR_INDEX);
+
+            if (n > 0 && (size_t)n < dest_sz)
+                kind = NS_FILE;
+            else
+                kind = NS_UNKNOWN;
+        }
+    }
+    else {
+        // Nothing there, unless it lies beneath a path the index does not
+        // follow. The closest ancestor in the index tells.
+        char *ancestor = strdup(path);
+        char *slash;
+
+        NsNode *parent = NULL;
+
+        while (ancestor != NULL && parent == NULL && (slash = strrchr(ancestor, '/')) != NULL) {
+            *slash = '\0';
+            parent = node_find(index, ancestor, hash_string(ancestor));
+        }
+
+        // Top level paths lie beneath the root
+        if (ancestor != NULL && parent == NULL)
+            parent = node_find(index, ".", hash_string("."));
+
+        kind = parent == NULL || parent->kind == NS_UNKNOWN ? NS_UNKNOWN : NS_MISSING;
+
+        free(ancestor);
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+
+    __atomic_add_fetch(kind == NS_UNKNOWN ? &index->fallbacks : &index->hits, 1, __ATOMIC_RELAXED);
+
+    return kind;
+}
+
+/*
+ * Destructor for the index. Stops the watcher thread and frees every
+ * node. The scan must be complete.
+ *
+ * Params:
+ * - NsIndex *index : The index we want to free.
+ *
+ * Returns: -
+ */
+void ns_index_destroy(NsIndex *index) {
+    if (index == NULL)
+        return;
+
+    if (index->running) {
+        index->running = 0;
+        pthread_join(index->watcher, NULL);
+    }
+
+    for (size_t i = 0; i < index->n_buckets; ++i)
+        while (index->buckets[i] != NULL) {
+            NsNode *node = index->buckets[i];
+
+            index->buckets[i] = node->h_next;
+            free(node);
+        }
+
+    for (int wd = 0; wd < index->n_watches; ++wd)
+        free(index->watches[wd]);
+
+    free(index->watches);
+    free(index->buckets);
+    free(index->bloom);
+    free(index->bloom_unknown);
+    free(index->root_dir);
+
+    close(index->inotify_fd);
+    close(index->root_fd);
+
+    pthread_rwlock_destroy(&index->lock);
+    pthread_mutex_destroy(&index->scan_lock);
+    pthread_cond_destroy(&index->scan_done);
+
+    free(index);
+}
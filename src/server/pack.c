@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pack.h"
+#include "encoding.h"
+#include "http_date.h"
+#include "hash.h"
+#include "utils.h"
+
+// Seed of the path hash, shared with mkpack
+#define PACK_SEED 0x9e3779b97f4a7c15ULL
+
+// Longest ETag a record may carry, quotes included
+#define PACK_ETAG_MAX 64
+
+/*
+ * Hashes a path, for the perfect hash of the pack.
+ *
+ * Params:
+ * - const char *key : The path.
+ * - size_t len      : Its length.
+ *
+ * Returns: The hash.
+ */
+uint64_t pack_hash(const char *key, size_t len) {
+    return xxh64(key, len, PACK_SEED);
+}
+
+/*
+ * Picks the bucket of a path hash, whose displacement places it.
+ *
+ * Params:
+ * - uint64_t hash      : The hash of the path.
+ * - uint32_t n_buckets : The number of buckets.
+ *
+ * Returns: The bucket.
+ */
+uint32_t pack_bucket(uint64_t hash, uint32_t n_buckets) {
+    return (uint32_t)((hash >> 20) % n_buckets);
+}
+
+/*
+ * Places a path hash in the slot table, with the displacement of its
+ * bucket. The table size is prime, so every displacement step reaches a
+ * different slot.
+ *
+ * Params:
+ * - uint64_t hash         : The hash of the path.
+ * - uint32_t displacement : The displacement of its bucket.
+ * - uint32_t n_slots      : The number of slots.
+ *
+ * Returns: The slot.
+ */
+uint32_t pack_slot(uint64_t hash, uint32_t displacement, uint32_t n_slots) {
+    if (n_slots < 2)
+        return 0;
+
+    uint64_t h1 = hash % n_slots;
+    uint64_t h2 = 1 + (hash >> 32) % (n_slots - 1);
+
+    return (uint32_t)((h1 + displacement * h2) % n_slots);
+}
+
+// Checks that a range of bytes lies inside the pack.
+static
+int in_pack(Pack *pack, uint64_t offset, uint64_t len) {
+    return offset <= pack->size && len <= pack->size - offset;
+}
+
+// Checks that a NUL terminated string, of at most max_len bytes, starts at
+// offset.
+static
+int string_in_pack(Pack *pack, uint64_t offset, size_t max_len) {
+    if (offset >= pack->size)
+        return 0;
+
+    size_t room = pack->size - offset < max_len + 1 ? pack->size - offset : max_len + 1;
+
+    return memchr(pack->map + offset, '\0', room) != NULL;
+}
+
+/*
+ * Checks every offset of the pack, so lookups can trust them.
+ *
+ * Params:
+ * - Pack *pack : The mapped pack.
+ *
+ * Returns:
+ * -  0 if the pack is well formed.
+ * - -1 otherwise.
+ */
+static
+int validate_pack(Pack *pack) {
+    PackHeader *header = pack->header;
+
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) || header->version != PACK_VERSION)
+        return -1;
+
+    if (header->size != pack->size || header->n_slots < header->n_keys || header->n_buckets == 0)
+        return -1;
+
+    if (!in_pack(pack, header->records_off, (uint64_t) header->n_records * sizeof(PackRecord)) ||
+        !in_pack(pack, header->slots_off, (uint64_t) header->n_slots * sizeof(PackSlot)) ||
+        !in_pack(pack, header->buckets_off, (uint64_t) header->n_buckets * sizeof(uint32_t)))
+        return -1;
+
+    if (header->records_off % 8 || header->slots_off % 8 || header->buckets_off % 8)
+        return -1;
+
+    for (uint32_t i = 0; i < header->n_records; ++i) {
+        PackRecord *record = &pack->records[i];
+
+        if (!in_pack(pack, record->body_off, record->body_len) ||
+            !in_pack(pack, record->header_off, record->header_len) ||
+            record->date_offset + HTTP_DATE_LEN > record->header_len ||
+            !string_in_pack(pack, record->path_off, PATH_MAX) ||
+            !string_in_pack(pack, record->etag_off, PACK_ETAG_MAX))
+            return -1;
+
+        if ((record->encoding != ENC_IDENTITY && record->encoding != ENC_GZIP) ||
+            (record->gzip != PACK_NONE && record->gzip >= header->n_records))
+            return -1;
+    }
+
+    for (uint32_t i = 0; i < header->n_slots; ++i) {
+        PackSlot *slot = &pack->slots[i];
+
+        if (slot->record != PACK_NONE &&
+            (slot->record >= header->n_records || !in_pack(pack, slot->key_off, slot->key_len)))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Opens and maps a pack built by mkpack.
+ *
+ * Params:
+ * - const char *path : The path of the pack.
+ *
+ * Returns:
+ * - The mapped pack, holding one reference for the caller.
+ * - NULL if it could not be opened, or is not a valid pack.
+ */
+Pack *pack_open(const char *path) {
+    Pack *pack = (Pack*) calloc(1, sizeof(Pack));
+
+    if (pack == NULL) {
+        ERR("Memory allocation during pack creation failed");
+        return NULL;
+    }
+
+    pack->map = MAP_FAILED;
+    pack->fd  = open(path, O_RDONLY | O_CLOEXEC);
+
+    struct stat p_stats;
+
+    if (pack->fd < 0 || fstat(pack->fd, &p_stats) < 0) {
+        P_ERR("Failed to open the pack", errno);
+        goto FAIL;
+    }
+
+    if (!S_ISREG(p_stats.st_mode) || (size_t) p_stats.st_size < PACK_ALIGN) {
+        ERR("Not a pack file");
+        goto FAIL;
+    }
+
+    pack->size = p_stats.st_size;
+    pack->map  = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, pack->fd, 0);
+
+    if (pack->map == MAP_FAILED) {
+        P_ERR("Failed to map the pack", errno);
+        goto FAIL;
+    }
+
+    pack->header = (PackHeader*) pack->map;
+
+    if (pack->header->size == pack->size) {
+        pack->records = (PackRecord*)(pack->map + pack->header->records_off);
+        pack->slots   = (PackSlot*)(pack->map + pack->header->slots_off);
+        pack->buckets = (uint32_t*)(pack->map + pack->header->buckets_off);
+    }
+
+    if (validate_pack(pack) < 0) {
+        ERR("Corrupt or incompatible pack");
+        goto FAIL;
+    }
+
+    // Every lookup goes through the index, bring it in now
+    madvise(pack->map + pack->header->records_off, pack->size - pack->header->records_off, MADV_WILLNEED);
+
+    pack->refs = 1;
+
+    return pack;
+
+FAIL:
+    if (pack->map != MAP_FAILED)
+        munmap(pack->map, pack->size);
+
+    if (pack->fd >= 0)
+        close(pack->fd);
+
+    free(pack);
+    return NULL;
+}
+
+/*
+ * Looks up a path in the perfect hash of the pack: a single slot is
+ * checked, with no syscall.
+ *
+ * Params:
+ * - Pack *pack      : The pack.
+ * - const char *key : The normalized, root relative path.
+ *
+ * Returns:
+ * - The record of the file.
+ * - NULL if the path is not in the pack.
+ */
+PackRecord *pack_lookup(Pack *pack, const char *key) {
+    PackHeader *header = pack->header;
+
+    if (header->n_keys == 0)
+        return NULL;
+
+    size_t len    = strlen(key);
+    uint64_t hash = pack_hash(key, len);
+
+    uint32_t displacement = pack->buckets[pack_bucket(hash, header->n_buckets)];
+    PackSlot *slot        = &pack->slots[pack_slot(hash, displacement, header->n_slots)];
+
+    if (slot->record == PACK_NONE || slot->key_len != len || memcmp(pack->map + slot->key_off, key, len))
+        return NULL;
+
+    return &pack->records[slot->record];
+}
+
+/*
+ * Drops a reference to the pack, and unmaps it once no references are
+ * left.
+ *
+ * Params:
+ * - Pack *pack : The pack we are done with.
+ *
+ * Returns: -
+ */
+void pack_release(Pack *pack) {
+    if (pack == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&pack->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    munmap(pack->map, pack->size);
+    close(pack->fd);
+
+    free(pack);
+}
+
+/*
+ * Opens the pack to serve.
+ *
+ * Params:
+ * - const char *path : The path of the pack. It is opened again on every
+ *                      reload, so a new pack can be renamed over it.
+ *
+ * Returns:
+ * - A new store if no error occurred.
+ * - NULL otherwise.
+ */
+PackStore *pack_store_create(const char *path) {
+    PackStore *store = (PackStore*) calloc(1, sizeof(PackStore));
+
+    if (store == NULL) {
+        ERR("Memory allocation during pack store creation failed");
+        return NULL;
+    }
+
+    if ((store->path = strdup(path)) == NULL || (store->current = pack_open(path)) == NULL) {
+        free(store->path);
+        free(store);
+        return NULL;
+    }
+
+    int err;
+    if ((err = pthread_mutex_init(&store->lock, NULL))) {
+        P_ERR("Failed to initialize pack store mutex", err);
+        pack_release(store->current);
+        free(store->path);
+        free(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+/*
+ * Takes a reference to the pack currently served.
+ *
+ * Params:
+ * - PackStore *store : The store.
+ *
+ * Returns: The pack. The caller must release it.
+ */
+Pack *pack_store_acquire(PackStore *store) {
+    pthread_mutex_lock(&store->lock);
+
+    Pack *pack = store->current;
+    __atomic_add_fetch(&pack->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&store->lock);
+
+    return pack;
+}
+
+/*
+ * Opens the pack path again and switches to it. Requests that already
+ * hold the previous pack finish with it, new requests get the new one.
+ * The previous pack is kept if the new one cannot be opened.
+ *
+ * Params:
+ * - PackStore *store : The store.
+ *
+ * Returns:
+ * -  0 if the new pack is served.
+ * - -1 otherwise.
+ */
+int pack_store_reload(PackStore *store) {
+    Pack *pack = pack_open(store->path);
+
+    if (pack == NULL)
+        return -1;
+
+    pthread_mutex_lock(&store->lock);
+
+    Pack *old = store->current;
+
+    store->current = pack;
+    store->reloads++;
+
+    pthread_mutex_unlock(&store->lock);
+
+    pack_release(old);
+
+    return 0;
+}
+
+/*
+ * Destructor for the store. Must only be called once no request holds a
+ * pack.
+ *
+ * Params:
+ * - PackStore *store : The store we want to free.
+ *
+ * Returns: -
+ */
+void pack_store_destroy(PackStore *store) {
+    if (store == NULL)
+        return;
+
+    pack_release(store->current);
+    pthread_mutex_destroy(&store->lock);
+
+    free(store->path);
+    free(store);
+}
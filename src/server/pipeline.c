@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <sys/time.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "request_manager.h"
+#include "server_types.h"
+#include "pipeline.h"
+#include "future.h"
+#include "utils.h"
+
+static const char * const stage_names[N_STAGES] = {
+    [STAGE_PARSE]   = "parse",
+    [STAGE_RESOLVE] = "resolve",
+    [STAGE_SEND]    = "send"
+};
+
+/*
+ * A request travelling through the pipeline. The same job is passed to
+ * every stage, and is freed after the last one.
+ */
+typedef struct {
+    Pipeline *pipeline;
+    RequestCtx *ctx;
+
+    // The time the job was handed to the current stage
+    struct timeval t_ready;
+} PipelineJob;
+
+// Microseconds elapsed between two timevals.
+static
+unsigned long long elapsed_usec(struct timeval *t_start, struct timeval *t_end) {
+    return (t_end->tv_sec - t_start->tv_sec) * 1000000ULL + (t_end->tv_usec - t_start->tv_usec);
+}
+
+/*
+ * Runs a single request step as part of a stage, and accounts the time
+ * the job spent waiting in the stage queue and running in the stage.
+ *
+ * Params:
+ * - PipelineJob *job           : The job being processed.
+ * - int stage                  : The index of the stage.
+ * - void (*step)(RequestCtx *) : The request step this stage runs.
+ *
+ * Returns: -
+ */
+static
+void run_stage(PipelineJob *job, int stage, void (*step)(RequestCtx*)) {
+    PipelineStage *st = &job->pipeline->stages[stage];
+
+    struct timeval t_start;
+    gettimeofday(&t_start, NULL);
+
+    step(job->ctx);
+
+    struct timeval t_end;
+    gettimeofday(&t_end, NULL);
+
+    int err;
+    if ((err = pthread_mutex_lock(&st->lock))) {
+        P_ERR("Could not acquire lock for stage stats", err);
+    }
+    else {
+        st->n_processed++;
+        st->wait_usec    += elapsed_usec(&job->t_ready, &t_start);
+        st->service_usec += elapsed_usec(&t_start, &t_end);
+
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    // The next stage starts counting from here
+    job->t_ready = t_end;
+}
+
+static
+void stage_resolve(void *arg) {
+    run_stage((PipelineJob*)arg, STAGE_RESOLVE, request_resolve);
+}
+
+static
+void stage_send(void *arg) {
+    PipelineJob *job = (PipelineJob*)arg;
+
+    run_stage(job, STAGE_SEND, request_respond);
+
+    request_ctx_free(job->ctx);
+}
+
+// The job is shared between stages, only the last one frees it.
+static
+void keep_job(void *arg) {
+    (void) arg;
+}
+
+/*
+ * Runs the parse stage, and chains the resolve and send stages behind it
+ * with futures. They are chained here rather than on submit, so a stage
+ * that completes early never delivers the next one from the accept loop.
+ * A full queue downstream makes this worker wait, pushing back on the
+ * parse queue.
+ *
+ * Params:
+ * - void *arg : The PipelineJob of the request.
+ *
+ * Returns: -
+ */
+static
+void stage_parse(void *arg) {
+    PipelineJob *job   = (PipelineJob*)arg;
+    Pipeline *pipeline = job->pipeline;
+
+    run_stage(job, STAGE_PARSE, request_parse);
+
+    task_future *resolved = thread_pool_submit(pipeline->stages[STAGE_RESOLVE].pool, stage_resolve, keep_job, job);
+    task_future *sent     = NULL;
+
+    if (resolved != NULL)
+        sent = future_then(resolved, pipeline->stages[STAGE_SEND].pool, stage_send, NULL, job);
+
+    // Nothing will send the response; let the resolve stage finish if it
+    // was scheduled, and drop the connection
+    if (sent == NULL) {
+        ERR("Failed to chain pipeline stages");
+
+        if (resolved != NULL)
+            future_wait(resolved);
+
+        close(job->ctx->fd);
+        request_ctx_free(job->ctx);
+        free(job);
+    }
+
+    future_release(resolved);
+    future_release(sent);
+}
+
+/*
+ * Creates the staged pipeline, with a separate thread pool and a bounded
+ * queue for every stage.
+ *
+ * Params:
+ * - ServerOptions *options : The server options holding the stage sizes.
+ *
+ * Returns:
+ * - A new pipeline if no error occurred.
+ * - NULL otherwise.
+ */
+Pipeline *pipeline_create(ServerOptions *options) {
+    Pipeline *pipeline = (Pipeline*) malloc(sizeof(Pipeline));
+
+    if (pipeline == NULL) {
+        ERR("Memory allocation during pipeline creation failed");
+        return NULL;
+    }
+
+    for (int i = 0; i < N_STAGES; ++i) {
+        PipelineStage *stage = &pipeline->stages[i];
+
+        stage->name         = stage_names[i];
+        stage->n_processed  = 0;
+        stage->wait_usec    = 0;
+        stage->service_usec = 0;
+
+        int err;
+        if ((err = pthread_mutex_init(&stage->lock, NULL))) {
+            P_ERR("Failed to initialize stage stats mutex", err);
+            stage->pool = NULL;
+        }
+        else
+            stage->pool = thread_pool_create_bounded(options->stage_threads[i], options->stage_queue_sz, NULL);
+
+        if (stage->pool == NULL) {
+            ERR("Stage thread pool creation failed");
+
+            if (!err)
+                pthread_mutex_destroy(&stage->lock);
+
+            for (int j = 0; j < i; ++j) {
+                thread_pool_destroy(pipeline->stages[j].pool);
+                pthread_mutex_destroy(&pipeline->stages[j].lock);
+            }
+
+            free(pipeline);
+            return NULL;
+        }
+    }
+
+    pipeline->shed = 0;
+
+    return pipeline;
+}
+
+/*
+ * Hands a new connection to the pipeline. Never blocks: if the parse queue
+ * is full the connection is refused, and the caller turns it away.
+ *
+ * Params:
+ * - Pipeline *pipeline : The pipeline.
+ * - AcceptArgs *args   : The connection and the resources it needs. The
+ *                        struct is not referenced after the call returns.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise, or if the parse queue is full. The connection is left
+ *      open.
+ */
+int pipeline_submit(Pipeline *pipeline, AcceptArgs *args) {
+    PipelineJob *job = (PipelineJob*) malloc(sizeof(PipelineJob));
+
+    if (job == NULL) {
+        P_ERR("Malloc failed for pipeline job", errno);
+        return -1;
+    }
+
+    job->pipeline = pipeline;
+    job->ctx      = request_ctx_create(args);
+
+    if (job->ctx == NULL) {
+        free(job);
+        return -1;
+    }
+
+    gettimeofday(&job->t_ready, NULL);
+
+    int status = thread_pool_try_add(pipeline->stages[STAGE_PARSE].pool, stage_parse, keep_job, job);
+
+    if (status != 0) {
+        if (status > 0)
+            __atomic_add_fetch(&pipeline->shed, 1, __ATOMIC_RELAXED);
+
+        request_ctx_free(job->ctx);
+        free(job);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Synchronized getter for the statistics of a stage.
+ *
+ * Params:
+ * - PipelineStage *stage : The stage we are interested in.
+ * - StageStats *dest     : The struct we want to copy to.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+int get_stage_stats(PipelineStage *stage, StageStats *dest) {
+    int err;
+    if ((err = pthread_mutex_lock(&stage->lock))) {
+        P_ERR("Could not acquire lock for stage stats", err);
+        return -1;
+    }
+
+    dest->n_processed  = stage->n_processed;
+    dest->wait_usec    = stage->wait_usec;
+    dest->service_usec = stage->service_usec;
+
+    pthread_mutex_unlock(&stage->lock);
+
+    // Queue depth is guarded by the queue lock
+    task_queue *queue = &stage->pool->task_queue;
+
+    pthread_mutex_lock(&queue->queue_rwlock);
+    dest->queued = queue->n_tasks;
+    pthread_mutex_unlock(&queue->queue_rwlock);
+
+    dest->n_threads = stage->pool->n_threads;
+
+    return 0;
+}
+
+/*
+ * Destructor for the pipeline. Stages are destroyed front to back, so
+ * every queued request is drained into the next stage before it stops.
+ *
+ * Params:
+ * - Pipeline *pipeline : The pipeline we want to free.
+ *
+ * Returns: -
+ */
+void pipeline_destroy(Pipeline *pipeline) {
+    if (pipeline == NULL)
+        return;
+
+    for (int i = 0; i < N_STAGES; ++i) {
+        thread_pool_destroy(pipeline->stages[i].pool);
+        pthread_mutex_destroy(&pipeline->stages[i].lock);
+    }
+
+    free(pipeline);
+}
@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <zlib.h>
+
+#include "precompress.h"
+#include "mime_types.h"
+#include "utils.h"
+
+#define COMPRESS_CHUNK_SZ (64 * 1024)
+
+// Maximum number of directories nftw keeps open
+#define WALK_FDS 32
+
+typedef struct {
+    Precompressor *pre;
+    char *path;
+} CompressJob;
+
+// nftw passes no user argument, the walk in progress is kept here
+static Precompressor *walk_pre = NULL;
+
+static
+void add_stat(unsigned long long *counter, unsigned long long val) {
+    __atomic_add_fetch(counter, val, __ATOMIC_RELAXED);
+}
+
+static
+void free_job(void *arg) {
+    CompressJob *job = (CompressJob*) arg;
+
+    free(job->path);
+    free(job);
+}
+
+// Writes the whole buffer to a regular file.
+static
+int write_all(int fd, unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Deflates a whole file into an open output file, in gzip format.
+ *
+ * Params:
+ * - int in      : The file to compress.
+ * - int out     : The file the gzip stream is written to.
+ * - off_t *size : Where the size of the output will be stored.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int gzip_file(int in, int out, off_t *size) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    // 15 bits of window, plus 16 for a gzip header and trailer
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    unsigned char *in_buf  = malloc(COMPRESS_CHUNK_SZ);
+    unsigned char *out_buf = malloc(COMPRESS_CHUNK_SZ);
+
+    int ret = -1;
+    *size = 0;
+
+    if (in_buf == NULL || out_buf == NULL)
+        goto EXIT;
+
+    int flush;
+
+    do {
+        ssize_t n = read(in, in_buf, COMPRESS_CHUNK_SZ);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            goto EXIT;
+        }
+
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+
+        stream.next_in  = in_buf;
+        stream.avail_in = n;
+
+        do {
+            stream.next_out  = out_buf;
+            stream.avail_out = COMPRESS_CHUNK_SZ;
+
+            deflate(&stream, flush);
+
+            size_t produced = COMPRESS_CHUNK_SZ - stream.avail_out;
+
+            if (write_all(out, out_buf, produced) < 0)
+                goto EXIT;
+
+            *size += produced;
+        } while (stream.avail_out == 0);
+    } while (flush != Z_FINISH);
+
+    ret = 0;
+
+EXIT:
+    deflateEnd(&stream);
+    free(in_buf);
+    free(out_buf);
+    return ret;
+}
+
+/*
+ * Task that compresses a single file into <file>.gz. The copy is written
+ * to a temporary file and renamed into place, so it is never served half
+ * written, and it is dropped if it does not save anything.
+ *
+ * Params:
+ * - void *arg : A pointer to a CompressJob.
+ *
+ * Returns: -
+ */
+static
+void compress_task(void *arg) {
+    CompressJob *job   = (CompressJob*) arg;
+    Precompressor *pre = job->pre;
+
+    if (pre->cancelled)
+        return;
+
+    size_t path_len = strlen(job->path);
+
+    char *tmp_path = malloc(path_len + sizeof(".gz.XXXXXX"));
+    char *gz_path  = malloc(path_len + sizeof(".gz"));
+
+    int in  = -1;
+    int out = -1;
+
+    if (tmp_path == NULL || gz_path == NULL)
+        goto FAIL;
+
+    sprintf(tmp_path, "%s.gz.XXXXXX", job->path);
+    sprintf(gz_path, "%s.gz", job->path);
+
+    struct stat f_stats;
+
+    if ((in = open(job->path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(in, &f_stats) < 0)
+        goto FAIL;
+
+    if ((out = mkostemp(tmp_path, O_CLOEXEC)) < 0)
+        goto FAIL;
+
+    off_t out_size;
+
+    if (gzip_file(in, out, &out_size) < 0) {
+        unlink(tmp_path);
+        goto FAIL;
+    }
+
+    // Not worth it, the original is served instead
+    if (out_size >= f_stats.st_size) {
+        unlink(tmp_path);
+        add_stat(&pre->skipped, 1);
+        goto EXIT;
+    }
+
+    // The copy is as readable as the original
+    fchmod(out, f_stats.st_mode & 0777);
+
+    if (rename(tmp_path, gz_path) < 0) {
+        unlink(tmp_path);
+        goto FAIL;
+    }
+
+    add_stat(&pre->compressed, 1);
+    add_stat(&pre->bytes_in, f_stats.st_size);
+    add_stat(&pre->bytes_out, out_size);
+
+    goto EXIT;
+
+FAIL:
+    P_DEBUG("Failed to precompress %s\n", job->path);
+    add_stat(&pre->failed, 1);
+
+EXIT:
+    if (in >= 0)
+        close(in);
+
+    if (out >= 0)
+        close(out);
+
+    free(tmp_path);
+    free(gz_path);
+}
+
+/*
+ * Checks if a file needs a fresh gzip copy: it must be compressible, not a
+ * compressed copy itself, and its copy must be missing or older than it.
+ */
+static
+int needs_compression(const char *path, const struct stat *f_stats) {
+    size_t len = strlen(path);
+
+    if (len >= 3 && (!strcmp(path + len - 3, ".gz") || !strcmp(path + len - 3, ".br")))
+        return 0;
+
+    if (f_stats->st_size < PRECOMPRESS_MIN_SZ || f_stats->st_size > PRECOMPRESS_MAX_SZ)
+        return 0;
+
+    if (!mime_compressible(mime_type(path)))
+        return 0;
+
+    char *gz_path = malloc(len + sizeof(".gz"));
+
+    if (gz_path == NULL)
+        return 0;
+
+    sprintf(gz_path, "%s.gz", path);
+
+    struct stat gz_stats;
+    int stale = stat(gz_path, &gz_stats) < 0 ||
+                gz_stats.st_mtim.tv_sec < f_stats->st_mtim.tv_sec ||
+                (gz_stats.st_mtim.tv_sec == f_stats->st_mtim.tv_sec &&
+                 gz_stats.st_mtim.tv_nsec < f_stats->st_mtim.tv_nsec);
+
+    free(gz_path);
+    return stale;
+}
+
+// Called by nftw for every entry of the root directory.
+static
+int walk_entry(const char *path, const struct stat *f_stats, int type, struct FTW *ftw) {
+    (void) ftw;
+
+    Precompressor *pre = walk_pre;
+
+    if (pre->cancelled)
+        return 1;
+
+    if (type != FTW_F || !S_ISREG(f_stats->st_mode))
+        return 0;
+
+    if (!needs_compression(path, f_stats))
+        return 0;
+
+    CompressJob *job = malloc(sizeof(CompressJob));
+
+    if (job == NULL || (job->path = strdup(path)) == NULL) {
+        free(job);
+        add_stat(&pre->failed, 1);
+        return 0;
+    }
+
+    job->pre = pre;
+
+    if (thread_pool_add(pre->pool, compress_task, free_job, job) < 0) {
+        free_job(job);
+        add_stat(&pre->failed, 1);
+        return 0;
+    }
+
+    add_stat(&pre->queued, 1);
+
+    return 0;
+}
+
+// Task that walks the root directory and queues a task per file, then
+// walks the roots loaded while it ran, if any.
+static
+void walk_task(void *arg) {
+    Precompressor *pre = (Precompressor*) arg;
+
+    walk_pre = pre;
+
+    for (;;) {
+        // Symbolic links are not followed, they may point outside the root
+        if (nftw(pre->root_dir, walk_entry, WALK_FDS, FTW_PHYS) < 0)
+            P_ERR("Failed to walk the root directory", errno);
+
+        pthread_mutex_lock(&pre->lock);
+
+        if (pre->next_dir == NULL || pre->cancelled) {
+            pre->walking = 0;
+            pthread_mutex_unlock(&pre->lock);
+            break;
+        }
+
+        free(pre->root_dir);
+        pre->root_dir = pre->next_dir;
+        pre->next_dir = NULL;
+
+        pthread_mutex_unlock(&pre->lock);
+    }
+
+    walk_pre = NULL;
+}
+
+// The precompressor outlives the walk, nothing to free.
+static
+void keep_precompressor(void *arg) {
+    (void) arg;
+}
+
+/*
+ * Starts precompressing the root directory in the background.
+ *
+ * Params:
+ * - thread_pool *pool : The pool that will run the walk and the compression.
+ * - char *root_dir    : The root directory. It is copied.
+ *
+ * Returns:
+ * - The running job, if no error occurred.
+ * - NULL otherwise.
+ */
+Precompressor *precompress_start(thread_pool *pool, char *root_dir) {
+    Precompressor *pre = (Precompressor*) malloc(sizeof(Precompressor));
+
+    if (pre == NULL) {
+        ERR("Memory allocation during precompressor creation failed");
+        return NULL;
+    }
+
+    memset(pre, 0, sizeof(Precompressor));
+
+    int err;
+    if ((err = pthread_mutex_init(&pre->lock, NULL))) {
+        P_ERR("Failed to initialize precompressor mutex", err);
+        free(pre);
+        return NULL;
+    }
+
+    pre->pool     = pool;
+    pre->root_dir = strdup(root_dir);
+    pre->walking  = 1;
+
+    if (pre->root_dir == NULL || thread_pool_add(pool, walk_task, keep_precompressor, pre) < 0) {
+        pthread_mutex_destroy(&pre->lock);
+        free(pre->root_dir);
+        free(pre);
+        return NULL;
+    }
+
+    return pre;
+}
+
+/*
+ * Precompresses a new root directory, once the root is reloaded. If a
+ * walk is still running, the new root is walked once it ends; a root
+ * still waiting for its walk is replaced, as it is no longer served.
+ *
+ * Params:
+ * - Precompressor *pre : The job.
+ * - char *root_dir     : The new root directory. It is copied.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+int precompress_restart(Precompressor *pre, char *root_dir) {
+    char *dir = strdup(root_dir);
+
+    if (dir == NULL) {
+        P_ERR("Malloc failed for precompressed root", errno);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pre->lock);
+
+    if (pre->walking) {
+        free(pre->next_dir);
+        pre->next_dir = dir;
+
+        pthread_mutex_unlock(&pre->lock);
+        return 0;
+    }
+
+    free(pre->root_dir);
+    pre->root_dir = dir;
+    pre->walking  = 1;
+
+    pthread_mutex_unlock(&pre->lock);
+
+    if (thread_pool_add(pre->pool, walk_task, keep_precompressor, pre) < 0) {
+        pre->walking = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Makes the queued tasks return without doing anything, so the pool can
+ * be drained quickly.
+ *
+ * Params:
+ * - Precompressor *pre : The job to cancel.
+ *
+ * Returns: -
+ */
+void precompress_cancel(Precompressor *pre) {
+    if (pre != NULL)
+        pre->cancelled = 1;
+}
+
+/*
+ * Destructor for the job. Must only be called once the pool is destroyed.
+ *
+ * Params:
+ * - Precompressor *pre : The job we want to free.
+ *
+ * Returns: -
+ */
+void precompress_free(Precompressor *pre) {
+    if (pre == NULL)
+        return;
+
+    pthread_mutex_destroy(&pre->lock);
+    free(pre->root_dir);
+    free(pre->next_dir);
+    free(pre);
+}
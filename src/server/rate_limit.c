@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "rate_limit.h"
+#include "utils.h"
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+// Smallest piece of a body sent against the token buckets
+#define RL_MIN_PIECE 1024
+
+/*
+ * Takes n bytes from a token bucket refilled at rate bytes per second,
+ * which holds at most a quantum. The tokens may go negative, queueing the
+ * sender behind the ones before it.
+ *
+ * Returns: The nanoseconds to wait before sending.
+ */
+static
+long long bucket_take(double *tokens, struct timespec *last, long rate, size_t n) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = (now.tv_sec - last->tv_sec) + (now.tv_nsec - last->tv_nsec) / 1e9;
+    *last = now;
+
+    *tokens += elapsed * rate;
+
+    if (*tokens > RL_QUANTUM)
+        *tokens = RL_QUANTUM;
+
+    *tokens -= n;
+
+    return *tokens < 0 ? (long long) (-*tokens / rate * 1e9) : 0;
+}
+
+/*
+ * Creates the rate limiter, and the pool writing the shaped responses.
+ *
+ * Params:
+ * - long conn_rate   : Bytes per second of each connection (0 if unlimited).
+ * - long global_rate : Bytes per second of all the connections (0 if
+ *                      unlimited).
+ * - long burst       : Bytes of every body sent before the limits apply.
+ * - int n_threads    : The number of threads writing shaped responses.
+ * - int queue_sz     : The capacity of the queue in front of them.
+ *
+ * Returns:
+ * - A new rate limiter if no error occurred.
+ * - NULL otherwise.
+ */
+RateLimiter *rate_limiter_create(long conn_rate, long global_rate, long burst, int n_threads, int queue_sz) {
+    RateLimiter *limiter = (RateLimiter*) calloc(1, sizeof(RateLimiter));
+
+    if (limiter == NULL) {
+        ERR("Memory allocation during rate limiter creation failed");
+        return NULL;
+    }
+
+    int err;
+    if ((err = pthread_mutex_init(&limiter->lock, NULL))) {
+        P_ERR("Failed to initialize rate limiter mutex", err);
+        free(limiter);
+        return NULL;
+    }
+
+    if ((limiter->pool = thread_pool_create_bounded(n_threads, queue_sz, NULL)) == NULL) {
+        ERR("Shaping thread pool creation failed");
+        pthread_mutex_destroy(&limiter->lock);
+        free(limiter);
+        return NULL;
+    }
+
+    limiter->conn_rate   = conn_rate;
+    limiter->global_rate = global_rate;
+    limiter->burst       = burst;
+
+    clock_gettime(CLOCK_MONOTONIC, &limiter->last);
+
+    return limiter;
+}
+
+/*
+ * Changes the limits. Bodies already being sent keep the previous ones.
+ *
+ * Params:
+ * - RateLimiter *limiter : The rate limiter.
+ * - long conn_rate       : Bytes per second of each connection (0 if
+ *                          unlimited).
+ * - long global_rate     : Bytes per second of all the connections (0 if
+ *                          unlimited).
+ *
+ * Returns: -
+ */
+void rate_limiter_set(RateLimiter *limiter, long conn_rate, long global_rate) {
+    __atomic_store_n(&limiter->conn_rate, conn_rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&limiter->global_rate, global_rate, __ATOMIC_RELAXED);
+}
+
+/*
+ * Checks if a body falls under the limits in place, and must be sent by
+ * the shaping pool.
+ *
+ * Params:
+ * - RateLimiter *limiter : The rate limiter (NULL if disabled).
+ * - size_t len           : The length of the body.
+ *
+ * Returns:
+ * - 1 if the body is shaped.
+ * - 0 otherwise.
+ */
+int rate_limiter_shapes(RateLimiter *limiter, size_t len) {
+    if (limiter == NULL)
+        return 0;
+
+    long conn_rate   = __atomic_load_n(&limiter->conn_rate, __ATOMIC_RELAXED);
+    long global_rate = __atomic_load_n(&limiter->global_rate, __ATOMIC_RELAXED);
+
+    return (conn_rate > 0 || global_rate > 0) && len > (size_t) limiter->burst;
+}
+
+// Destructor for the arguments of the shaping pool, which the handlers own.
+static
+void keep_arg(void *arg) {
+    (void) arg;
+}
+
+/*
+ * Hands a shaped response over to the shaping pool. Never blocks.
+ *
+ * Params:
+ * - RateLimiter *limiter   : The rate limiter.
+ * - void (*handler)(void*) : The function writing the response.
+ * - void *arg              : Its argument, owned by the handler.
+ *
+ * Returns:
+ * -  0 if the pool will write the response.
+ * - -1 if its queue is full, or an error occurred.
+ */
+int rate_limiter_submit(RateLimiter *limiter, void (*handler)(void*), void *arg) {
+    if (thread_pool_try_add(limiter->pool, handler, keep_arg, arg) != 0) {
+        __atomic_add_fetch(&limiter->refused, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    __atomic_add_fetch(&limiter->deferred, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * Starts shaping a body, with the limits in place.
+ *
+ * Params:
+ * - Shaper *shaper       : The shaping of the body.
+ * - RateLimiter *limiter : The rate limiter (NULL if disabled).
+ * - int fd               : The socket the body is sent to.
+ * - size_t len           : The length of the body.
+ *
+ * Returns:
+ * - 1 if the body must be sent in the pieces given by shaper_quota.
+ * - 0 if no limit applies to it.
+ */
+int shaper_start(Shaper *shaper, RateLimiter *limiter, int fd, size_t len) {
+    if (limiter == NULL)
+        return 0;
+
+    shaper->conn_rate   = __atomic_load_n(&limiter->conn_rate, __ATOMIC_RELAXED);
+    shaper->global_rate = __atomic_load_n(&limiter->global_rate, __ATOMIC_RELAXED);
+    shaper->burst       = __atomic_load_n(&limiter->burst, __ATOMIC_RELAXED);
+
+    if ((shaper->conn_rate == 0 && shaper->global_rate == 0) || len <= (size_t) shaper->burst)
+        return 0;
+
+    shaper->limiter  = limiter;
+    shaper->fd       = fd;
+    shaper->sent     = 0;
+    shaper->paced    = 0;
+    shaper->bucketed = 0;
+    shaper->tokens   = 0;
+
+    // A tenth of a second at the lowest rate, so slow links get small
+    // pieces instead of long pauses
+    long rate = shaper->conn_rate == 0 ? shaper->global_rate :
+                shaper->global_rate == 0 || shaper->conn_rate < shaper->global_rate ? shaper->conn_rate :
+                shaper->global_rate;
+
+    shaper->piece = rate / 10 < RL_MIN_PIECE ? RL_MIN_PIECE :
+                    rate / 10 > RL_QUANTUM   ? RL_QUANTUM : (size_t) rate / 10;
+
+    __atomic_add_fetch(&limiter->shaped, 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+/*
+ * Gives the number of bytes of the body to send next, waiting until the
+ * limits allow them. The burst is sent at once. After it, the kernel paces
+ * the connection if the socket takes SO_MAX_PACING_RATE; the rest of the
+ * body is then sent at once too, unless the global limit applies.
+ * Otherwise the body is sent in pieces, against the connection bucket and
+ * the global one.
+ *
+ * Params:
+ * - Shaper *shaper : The shaping of the body.
+ * - size_t left    : The bytes of the body left to send.
+ *
+ * Returns: The bytes to send next, which are counted as sent.
+ */
+size_t shaper_quota(Shaper *shaper, size_t left) {
+    RateLimiter *limiter = shaper->limiter;
+
+    if (shaper->sent < (size_t) shaper->burst) {
+        size_t n = left < shaper->burst - shaper->sent ? left : shaper->burst - shaper->sent;
+
+        shaper->sent += n;
+        return n;
+    }
+
+    if (shaper->conn_rate > 0 && !shaper->paced && !shaper->bucketed) {
+        unsigned int rate = shaper->conn_rate > UINT_MAX ? UINT_MAX : (unsigned int) shaper->conn_rate;
+
+        if (setsockopt(shaper->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0) {
+            shaper->paced = 1;
+            __atomic_add_fetch(&limiter->paced, 1, __ATOMIC_RELAXED);
+        } else {
+            shaper->bucketed = 1;
+            clock_gettime(CLOCK_MONOTONIC, &shaper->last);
+        }
+    }
+
+    if (!shaper->bucketed && shaper->global_rate == 0) {
+        shaper->sent += left;
+        return left;
+    }
+
+    size_t n = left < shaper->piece ? left : shaper->piece;
+    long long wait_ns = 0;
+
+    if (shaper->bucketed)
+        wait_ns = bucket_take(&shaper->tokens, &shaper->last, shaper->conn_rate, n);
+
+    if (shaper->global_rate > 0) {
+        pthread_mutex_lock(&limiter->lock);
+
+        long long global_ns = bucket_take(&limiter->tokens, &limiter->last, shaper->global_rate, n);
+
+        pthread_mutex_unlock(&limiter->lock);
+
+        if (global_ns > wait_ns)
+            wait_ns = global_ns;
+    }
+
+    // Only the shaping pool waits here, and not once the server stops
+    if (wait_ns > 0 && !__atomic_load_n(&limiter->stopping, __ATOMIC_RELAXED)) {
+        struct timespec delay = {wait_ns / 1000000000LL, wait_ns % 1000000000LL};
+
+        while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+            ;
+
+        __atomic_add_fetch(&limiter->sleeps, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&limiter->slept_us, wait_ns / 1000, __ATOMIC_RELAXED);
+    }
+
+    shaper->sent += n;
+
+    return n;
+}
+
+/*
+ * Destructor for the rate limiter. Queued responses are still written,
+ * without waiting for the limits, before the threads stop.
+ *
+ * Params:
+ * - RateLimiter *limiter : The rate limiter we want to free.
+ *
+ * Returns: -
+ */
+void rate_limiter_destroy(RateLimiter *limiter) {
+    if (limiter == NULL)
+        return;
+
+    __atomic_store_n(&limiter->stopping, 1, __ATOMIC_RELAXED);
+
+    thread_pool_destroy(limiter->pool);
+
+    pthread_mutex_destroy(&limiter->lock);
+    free(limiter);
+}
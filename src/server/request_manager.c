@@ -5,19 +5,58 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/uio.h>
+#include <strings.h>
+#include <zlib.h>
 
+#include "request_manager.h"
 #include "server_manager.h"
 #include "server_types.h"
 #include "http_types.h"
+#include "response_messages.h"
 #include "network_io.h"
 #include "request.h"
+#include "http_date.h"
+#include "mime_types.h"
+#include "conditional.h"
+#include "encoding.h"
+#include "hash.h"
+#include "disk_pool.h"
+#include "ns_index.h"
+#include "neg_cache.h"
+#include "single_flight.h"
+#include "local_cache.h"
+#include "rate_limit.h"
+#include "cache_policy.h"
 #include "utils.h"
 
-extern const char * const response_messages[];
+// Files up to this size are read into memory, and leave in the same
+// writev as their header
+#define SMALL_FILE_SZ (16 * 1024)
+
+// Room for the header of a 206, 304 or 416 response, and of every body part
+// of a multipart/byteranges response
+#define RANGE_HEADER_SZ 768
+#define PART_HEADER_SZ  256
+
+// Room for a multipart boundary, 16 hex digits
+#define BOUNDARY_SZ 17
+
+// Size of the reads used to hash a file
+#define HASH_CHUNK_SZ (64 * 1024)
+
+// Size of the reads, and of the chunks sent, when compressing a file
+#define COMPRESS_CHUNK_SZ (64 * 1024)
+#define COMPRESS_LEVEL    6
+
+// Transfers of at least this size are announced to the kernel as sequential,
+// and the first READAHEAD_SZ bytes are read ahead
+#define LARGE_FILE_SZ (1024 * 1024)
+#define READAHEAD_SZ  (2 * 1024 * 1024)
 
 /*
- * This function sends an error response header that corresponds to the
- * HTTP error code.
+ * This function sends the prebuilt error response that corresponds to
+ * the HTTP error code, with a single writev.
  *
  * Params:
  * - int fd        : The file descriptior where the response will be written to.
@@ -32,258 +71,2317 @@ void write_err_response(int fd, HttpError err) {
         return;
     }
 
-    const char *format = response_messages[err];
-
-    // Get date
-    time_t t_now      = time(NULL);
-    struct tm t_data;
-    gmtime_r(&t_now, &t_data);
+    char date[HTTP_DATE_LEN + 1];
+    struct iovec iov[3];
 
-    char date[512];
-    strftime(date, 512, "%a, %d %b %Y %H:%M:%S %Z", &t_data);
-
-    int len = snprintf(NULL, 0, format, date);
-    
-    if (len < 0) { 
-        P_DEBUG("sprintf failed while writing the date\n");
+    if (err_response_iov(err, date, iov) < 0) {
+        P_DEBUG("No response for error code %d\n", err);
         return;
     }
 
-    char *msg = malloc(len + 1);
+    write_iovec(fd, iov, 3, HTTP_TIMEOUT);
+}
 
-    if (msg == NULL) {
-        P_ERR("Malloc failed for date string", errno);
-        goto EXIT;
+/*
+ * Hashes the whole content of a file with XXH64.
+ *
+ * Params:
+ * - int file      : The open file.
+ * - off_t size    : The size of the file.
+ * - uint64_t *dest : Where the hash will be stored.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int hash_file_content(int file, off_t size, uint64_t *dest) {
+    char *buf = malloc(HASH_CHUNK_SZ);
+
+    if (buf == NULL) {
+        P_ERR("Malloc failed for hash buffer", errno);
+        return -1;
     }
 
-    len = snprintf(msg, len + 1, format, date);
-    
-    if (len < 0) { 
-        P_DEBUG("sprintf failed while writing the date\n");
-        goto EXIT;
+    Xxh64State state;
+    xxh64_init(&state, 0);
+
+    for (off_t offset = 0; offset < size; ) {
+        size_t n = size - offset < HASH_CHUNK_SZ ? size - offset : HASH_CHUNK_SZ;
+
+        if (read_file_fd(file, buf, offset, n) != IO_OK) {
+            free(buf);
+            return -1;
+        }
+
+        xxh64_update(&state, buf, n);
+        offset += n;
     }
 
-    write_bytes(fd, msg, HTTP_TIMEOUT, len);
+    *dest = xxh64_digest(&state);
 
-EXIT:
-    free(msg);
+    free(buf);
+    return 0;
 }
 
 /*
- * This function sends an OK response header, and then sends
- * the requested file.
+ * Formats the strong ETag of a file version. By default it is built from
+ * the inode, size and modification time, so it changes whenever the file
+ * is replaced or modified. With content hashes enabled, it is the XXH64
+ * of the content instead, which survives copies and restores; each file
+ * version is only hashed once.
  *
  * Params:
- * - int fd             : The file descriptior where the response will be written to.
- * - char *full_path    : The full path of the requested file.
- * - ServerStats *stats : The struct containing the server stats, so they can be updated.
+ * - HashCache *hash_cache : The content hash cache (NULL if disabled).
+ * - int file              : The open file.
+ * - struct stat *f_stats  : The metadata of the file.
+ * - char *etag            : A buffer of at least ETAG_SZ bytes.
  *
  * Returns: -
  */
-static 
-void write_ok_response(int fd, char *file, ServerStats *stats) {
-    const char *format = response_messages[OK];
+static
+void format_etag(HashCache *hash_cache, int file, struct stat *f_stats, char *etag) {
+    if (hash_cache != NULL) {
+        uint64_t hash;
 
-    char *msg  = NULL;
+        if (!hash_cache_lookup(hash_cache, f_stats, &hash)) {
+            if (hash_file_content(file, f_stats->st_size, &hash) < 0)
+                goto FALLBACK;
 
-    // Get date
-    time_t t_now      = time(NULL);
-    struct tm t_data;
-    gmtime_r(&t_now, &t_data);
+            hash_cache_insert(hash_cache, f_stats, hash);
+        }
 
-    char date[512];
-    strftime(date, 512, "%a, %d %b %Y %H:%M:%S %Z", &t_data);
+        snprintf(etag, ETAG_SZ, "\"%016llx\"", (unsigned long long) hash);
 
-    // Get content length
-    long sz = 0;
-    if (count_bytes(file, &sz) < 0) {
-        P_DEBUG("Size counting failed\n");
         return;
     }
 
-    int len = snprintf(NULL, 0, format, date, sz);
-    
-    if (len < 0) { 
-        P_DEBUG("sprintf failed while writing the date\n");
-        return;
+FALLBACK:
+    snprintf(etag, ETAG_SZ, "\"%lx-%lx-%llx\"",
+             (unsigned long) f_stats->st_ino,
+             (unsigned long) f_stats->st_size,
+             (unsigned long long) f_stats->st_mtim.tv_sec * 1000000000ULL + f_stats->st_mtim.tv_nsec);
+}
+
+/*
+ * Returns the ETag of the representation the request is served, computing
+ * it on first use.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request for the file.
+ *
+ * Returns:
+ * - The ETag, quotes included.
+ */
+static
+char *request_etag(RequestCtx *ctx) {
+    if (ctx->etag[0] != '\0')
+        return ctx->etag;
+
+    format_etag(ctx->hash_cache, ctx->file, &ctx->f_stats, ctx->etag);
+
+    // Compressed on the fly, a different representation of the same file
+    if (ctx->compress) {
+        size_t len = strlen(ctx->etag);
+        snprintf(ctx->etag + len - 1, ETAG_SZ - len + 1, "-%s\"", encoding_names[ctx->encoding]);
     }
 
-    msg = malloc(len + 1);
+    return ctx->etag;
+}
 
-    if (msg == NULL) {
-        P_ERR("Malloc failed for date string", errno);
-        return;
+/*
+ * Renders the OK response header of a file: the status line and every
+ * field that only depends on the version of the file. An empty slot is
+ * left where the date goes, so the same header can be sent with any date.
+ *
+ * Params:
+ * - const char *type      : The media type of the file.
+ * - struct stat *f_stats : The metadata of the file.
+ * - char *etag           : The ETag of the file.
+ * - const char *extra    : Optional fields, such as Content-Encoding.
+ * - const char *caching  : The caching fields, such as Cache-Control.
+ * - size_t *len          : Where the length of the header will be stored.
+ * - size_t *date_offset  : Where the offset of the date slot will be stored.
+ *
+ * Returns:
+ * - The header buffer, if no error occurred.
+ * - NULL otherwise.
+ */
+static
+char *render_ok_header(const char *type, struct stat *f_stats, char *etag, const char *extra,
+                       const char *caching, size_t *len, size_t *date_offset) {
+    const char *format = response_messages[OK];
+
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_http_date(f_stats->st_mtim.tv_sec, last_modified);
+
+    long sz = f_stats->st_size;
+
+    int n = snprintf(NULL, 0, format, "", sz, type, last_modified, etag, extra, caching);
+
+    if (n < 0) {
+        P_DEBUG("sprintf failed while rendering the header\n");
+        return NULL;
     }
 
-    len = snprintf(msg, len + 1, format, date, sz);
-    
-    if (len < 0) { 
-        P_DEBUG("sprintf failed while writing the date\n");
-        goto EXIT;
+    char *header = malloc(n + 1);
+
+    if (header == NULL) {
+        P_ERR("Malloc failed for header", errno);
+        return NULL;
     }
 
-    // If header write and html file write suceeded, update the stats
-    if ((write_bytes(fd, msg, HTTP_TIMEOUT, len) == IO_OK) && (write_file(fd, file, HTTP_TIMEOUT) == IO_OK))
-        update_stats(stats, sz);
+    snprintf(header, n + 1, format, "", sz, type, last_modified, etag, extra, caching);
 
-EXIT:
-    free(msg);
+    *len         = n;
+    *date_offset = strstr(header, "Date: ") - header + strlen("Date: ");
+
+    return header;
 }
 
 /*
- * Wrapper function that calls the appropriate response function.
+ * Splits a rendered header around its date slot, filling three iovecs.
  *
  * Params:
- * - int fd             : The file descriptior where the response will be written to.
- * - HttpError err      : The HTTP error code that the caller had.
- * - char *full_path    : The full path of the requested file.
- * - ServerStats *stats : The struct containing the server stats, so they can be updated.
+ * - struct iovec *iov  : The first of the three iovecs.
+ * - char *header       : The rendered header.
+ * - size_t header_len  : The length of the header.
+ * - size_t date_offset : The offset of the date slot.
+ * - char *date         : The date to send.
  *
  * Returns: -
  */
-static 
-void write_response(int fd, HttpError err, char *full_path, ServerStats *stats) {
-    if (err == OK) 
-        write_ok_response(fd, full_path, stats);
-    else
-        write_err_response(fd, err);
+static
+void header_iov(struct iovec *iov, char *header, size_t header_len, size_t date_offset, char *date) {
+    iov[0].iov_base = header;
+    iov[0].iov_len  = date_offset;
+    iov[1].iov_base = date;
+    iov[1].iov_len  = HTTP_DATE_LEN;
+    iov[2].iov_base = header + date_offset;
+    iov[2].iov_len  = header_len - date_offset;
 }
 
 /*
- * Checks if a file exists, we have read access to it and is under the
- * root directory. It also returns the absolute path of the file.
+ * Sends a response held in memory, a header split around its date slot
+ * and a body. Bodies of at least zerocopy_min bytes are sent with
+ * MSG_ZEROCOPY, so the socket sends from the body instead of a copy; the
+ * call returns once the kernel is done with the buffers. Smaller bodies
+ * are copied, as pinning their pages costs more than the copy. Past the
+ * burst, bodies under a rate limit are sent in the pieces the limiter
+ * allows; the header leaves with the first one.
  *
  * Params:
- * - char *file       : The file we want to check.
- * - char *root_dir   : The root directory that the server is serving.
- * - char **full_path : The buffer where the absolute path will be stored.
+ * - RequestCtx *ctx   : The request we are responding to.
+ * - struct iovec *iov : The three iovecs of the header, then the body.
  *
  * Returns:
- * - OK if no error occured.
- * - An appropriate HTTP error code otherwise.
+ * - IO_OK if the response was sent.
+ * - An appropriate io error code otherwise.
  */
 static
-HttpError check_file_access(char *file, char *root_dir, char **full_path) {
-    P_DEBUG("File : (%s) Root : (%s)\n", file, root_dir);
-    char *expanded_path = realpath(file, NULL);
+int write_memory_response(RequestCtx *ctx, struct iovec *iov) {
+    ServerStats *stats = ctx->stats;
 
-    if (expanded_path == NULL) {
-        switch (errno) {
-            case ENOENT:
-            case ENOTDIR:
-                return NOT_FOUND;
-            case EACCES:
-                return FORBIDDEN;
-            default:
-                return UNEXPECTED;
+    char *body      = iov[3].iov_base;
+    size_t body_len = iov[3].iov_len;
+
+    int zerocopy = ctx->zerocopy_min > 0 && body_len >= (size_t) ctx->zerocopy_min;
+
+    if (ctx->zerocopy_min > 0 && !zerocopy)
+        __atomic_add_fetch(&stats->zc_small, 1, __ATOMIC_RELAXED);
+
+    Shaper shaper;
+    int shaped = shaper_start(&shaper, ctx->limiter, ctx->fd, body_len);
+
+    int status = IO_OK;
+    int copied = 0;
+    int iovcnt = 4;
+
+    size_t left = body_len;
+
+    do {
+        size_t n = shaped ? shaper_quota(&shaper, left) : left;
+
+        iov[3].iov_base = body;
+        iov[3].iov_len  = n;
+
+        struct iovec *first = iov + 4 - iovcnt;
+
+        if (zerocopy) {
+            int piece_copied;
+
+            status  = write_iovec_zerocopy(ctx->fd, first, iovcnt, HTTP_TIMEOUT, &piece_copied);
+            copied |= piece_copied;
+
+            if (status == IO_INVALID) {
+                __atomic_add_fetch(&stats->zc_unsupported, 1, __ATOMIC_RELAXED);
+                zerocopy = 0;
+            }
         }
+
+        if (!zerocopy)
+            status = write_iovec(ctx->fd, first, iovcnt, HTTP_TIMEOUT);
+
+        body  += n;
+        left  -= n;
+        iovcnt = 1;
+    } while (status == IO_OK && left > 0);
+
+    if (zerocopy) {
+        __atomic_add_fetch(&stats->zc_sends, 1, __ATOMIC_RELAXED);
+
+        if (copied)
+            __atomic_add_fetch(&stats->zc_copied, 1, __ATOMIC_RELAXED);
+        else if (status == IO_OK)
+            __atomic_add_fetch(&stats->zc_bytes, body_len, __ATOMIC_RELAXED);
     }
 
-    *full_path = expanded_path;
+    return status;
+}
 
-    struct stat f_stats;
+/*
+ * Loads a file and its rendered header into a new cache entry.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request for the file.
+ *
+ * Returns:
+ * - The new entry, if no error occurred.
+ * - NULL otherwise.
+ */
+static
+CacheEntry *load_cache_entry(RequestCtx *ctx) {
+    CacheEntry *entry = file_cache_entry_create(ctx->file_rel_path, &ctx->f_stats);
 
-    if (stat(expanded_path, &f_stats) < 0) {
-        switch (errno) {
-            case ENOTDIR:
-            case ENOENT:
-                return NOT_FOUND;
-            case EACCES:
-                return FORBIDDEN;
-            default:
-                return UNEXPECTED;
-        }
+    if (entry == NULL)
+        return NULL;
+
+    entry->body_len    = ctx->f_stats.st_size;
+    entry->header_len  = ctx->header_len;
+    entry->date_offset = ctx->date_offset;
+    entry->header      = malloc(ctx->header_len);
+
+    // Allocate at least one byte, so empty files get a buffer too
+    entry->body = malloc(entry->body_len + 1);
+
+    if (entry->header == NULL || entry->body == NULL) {
+        file_cache_release(entry);
+        return NULL;
     }
 
-    // Check if the file is a regular file
-    if (S_ISDIR(f_stats.st_mode))
-        return NOT_FOUND;
+    memcpy(entry->header, ctx->header, ctx->header_len);
 
-    // Check if the file is readable
-    if (!(f_stats.st_mode & S_IRUSR))
-        return FORBIDDEN;
+    if (read_file_fd(ctx->file, entry->body, 0, entry->body_len) != IO_OK) {
+        file_cache_release(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/*
+ * Looks up the file in the file cache, loading it into the cache on a
+ * miss. Concurrent misses for the same version of the file wait for a
+ * single load.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request for the file.
+ *
+ * Returns:
+ * - The entry of the file, with a reference taken for the caller.
+ * - NULL if the file could not be loaded.
+ */
+static
+CacheEntry *get_cache_entry(RequestCtx *ctx) {
+    CacheEntry *entry = file_cache_lookup(ctx->file_cache, ctx->file_rel_path, &ctx->f_stats);
 
-    int root_len = strlen(root_dir);
-    int file_len = strlen(expanded_path);
+    if (entry != NULL)
+        return entry;
 
-    if (root_len > file_len)
-        return FORBIDDEN;
+    int leader     = 1;
+    Flight *flight = NULL;
 
-    for (int i = 0; i < root_len; ++i)
-        if (root_dir[i] != expanded_path[i])
-            return FORBIDDEN;
+    if (ctx->flights != NULL)
+        flight = single_flight_join(ctx->flights, ctx->file_rel_path, &ctx->f_stats, &leader);
 
-    return OK;
+    if (!leader)
+        return single_flight_wait(ctx->flights, flight);
+
+    if ((entry = load_cache_entry(ctx)) != NULL)
+        file_cache_insert(ctx->file_cache, entry);
+
+    if (flight != NULL)
+        single_flight_land(ctx->flights, flight, entry);
+
+    return entry;
 }
 
 /*
- * The fucnction that the worker threads run, so they can accept
- * server requests.
+ * Sends the OK response from the file cache, loading the file into
+ * the cache on a miss. The header, date and body leave with a single
+ * writev.
  *
  * Params:
- * - void *arg : The arguments passed to the function. This void pointer
- *               will ALWAYS point to a struct of type AcceptArgs.
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns:
+ * -  0 if the response was handled.
+ * - -1 if the file could not be loaded, and must be sent from disk.
+ */
+static
+int write_cached_response(RequestCtx *ctx) {
+    CacheEntry *entry = get_cache_entry(ctx);
+
+    if (entry == NULL)
+        return -1;
+
+    char date[HTTP_DATE_LEN + 1];
+    http_date_now(date);
+
+    struct iovec iov[4];
+
+    header_iov(iov, entry->header, entry->header_len, entry->date_offset, date);
+    iov[3].iov_base = entry->body;
+    iov[3].iov_len  = entry->body_len;
+
+    if (write_memory_response(ctx, iov) == IO_OK)
+        update_stats(ctx->stats, entry->body_len);
+
+    file_cache_release(entry);
+
+    return 0;
+}
+
+/*
+ * Sends one chunk of a response with chunked transfer encoding.
+ *
+ * Params:
+ * - int fd     : The socket.
+ * - char *data : The data of the chunk.
+ * - size_t len : The length of the data. It must not be 0.
+ *
+ * Returns:
+ * - IO_OK if the chunk was sent.
+ * - The error of write_iovec otherwise.
+ */
+static
+int write_chunk(int fd, char *data, size_t len) {
+    char size[20];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+
+    struct iovec iov[3];
+
+    iov[0].iov_base = size;
+    iov[0].iov_len  = n;
+    iov[1].iov_base = data;
+    iov[1].iov_len  = len;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len  = 2;
+
+    return write_iovec(fd, iov, 3, HTTP_TIMEOUT);
+}
+
+/*
+ * Appends compressed output to the copy kept for the compressed cache.
+ * The copy is dropped once it grows past the largest cacheable object.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are compressing for.
+ * - char **copy     : The copy, NULL once dropped.
+ * - size_t *len     : The length of the copy.
+ * - char *data      : The new output.
+ * - size_t n        : The length of the new output.
  *
  * Returns: -
  */
-void accept_http(void *arg) {
-    int fd             = ((AcceptArgs*)arg)->fd;
-    char *root_dir     = ((AcceptArgs*)arg)->root_dir;
-    ServerStats *stats = ((AcceptArgs*)arg)->stats;
+static
+void keep_compressed(RequestCtx *ctx, char **copy, size_t *len, char *data, size_t n) {
+    if (*copy == NULL)
+        return;
+
+    char *grown = NULL;
+
+    if (*len + n <= ctx->compress_cache->max_object)
+        grown = realloc(*copy, *len + n + 1);
+
+    if (grown == NULL) {
+        free(*copy);
+        *copy = NULL;
+        return;
+    }
 
-    char *header   = NULL;
+    memcpy(grown + *len, data, n);
 
-    char *file_full_path = NULL;
-    char *file_w_root    = NULL;
+    *copy = grown;
+    *len += n;
+}
+
+// Builds the key of the compressed file in the compressed cache.
+static
+void compressed_key(RequestCtx *ctx, char *key, size_t key_sz) {
+    snprintf(key, key_sz, "%s;%s", ctx->file_rel_path, encoding_names[ctx->encoding]);
+}
+
+/*
+ * Publishes a file compressed on the fly in the compressed cache, so the
+ * next requests for the same version of the file send it with a known
+ * length. The entry takes ownership of body.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request the file was compressed for.
+ * - char *key       : The cache key, the path and the encoding.
+ * - char *body      : The compressed file.
+ * - size_t body_len : The length of the compressed file.
+ *
+ * Returns: -
+ */
+static
+void cache_compressed(RequestCtx *ctx, char *key, char *body, size_t body_len) {
+    CacheEntry *entry = file_cache_entry_create(key, &ctx->f_stats);
+
+    if (entry == NULL) {
+        free(body);
+        return;
+    }
+
+    entry->body     = body;
+    entry->body_len = body_len;
 
-    P_DEBUG("Got fd %d\n", fd);
+    // The header carries the length of the compressed file
+    struct stat c_stats = ctx->f_stats;
+    c_stats.st_size = body_len;
 
-    HttpRequest *request = malloc(sizeof(HttpRequest));
+    entry->header = render_ok_header(ctx->content_type, &c_stats, request_etag(ctx), ctx->extra_headers,
+                                     cache_rule_fields(ctx->cache_rule), &entry->header_len, &entry->date_offset);
 
-    HttpError err = UNEXPECTED;
+    if (entry->header != NULL)
+        file_cache_insert(ctx->compress_cache, entry);
 
-    if (request == NULL)
-        goto CLOSE_CONNECTION;
+    file_cache_release(entry);
+}
+
+/*
+ * Compresses the file while sending it with chunked transfer encoding,
+ * as its compressed length is not known in advance. Output that fits
+ * in the compressed cache is kept, and published once the whole file
+ * was compressed.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ * - char *key       : The key of the file in the compressed cache.
+ *
+ * Returns: -
+ */
+static
+void write_chunked_response(RequestCtx *ctx, char *key) {
+    int fd = ctx->fd;
 
-    if (init_request(request) < 0)
-        goto CLOSE_CONNECTION;
-    
-    if ((err = read_request(fd, &header)) != OK)
-        goto CLOSE_CONNECTION;
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
 
-    if ((err = parse_request(header, request)) != OK)
-        goto CLOSE_CONNECTION;
+    // gzip wraps the stream in its own header, deflate in zlib's
+    int window_bits = ctx->encoding == ENC_GZIP ? 15 + 16 : 15;
 
-    if ((err = check_request_header(request->key_value_pairs)) != OK)
-        goto CLOSE_CONNECTION;
+    if (deflateInit2(&strm, COMPRESS_LEVEL, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        P_DEBUG("deflateInit2 failed\n");
+        write_err_response(fd, UNEXPECTED);
+        return;
+    }
 
-    int root_len = strlen(root_dir);
-    int file_len = strlen(request->requested_file);
+    char *in  = malloc(COMPRESS_CHUNK_SZ);
+    char *out = malloc(COMPRESS_CHUNK_SZ);
 
-    // Requested file is <root_dir>/file_name
-    file_w_root = malloc(root_len + file_len +1);
+    char *copy      = malloc(1);
+    size_t copy_len = 0;
 
-    err = UNEXPECTED;
+    if (in == NULL || out == NULL) {
+        P_ERR("Malloc failed for compression buffers", errno);
+        write_err_response(fd, UNEXPECTED);
+        goto EXIT;
+    }
 
-    if (file_w_root == NULL)
-        goto CLOSE_CONNECTION;
+    char date[HTTP_DATE_LEN + 1];
+    http_date_now(date);
 
-    // Clear buffer
-    memset(file_w_root, 0, root_len + file_len + 1);
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_http_date(ctx->f_stats.st_mtim.tv_sec, last_modified);
 
-    // Copy root
-    memcpy(file_w_root, root_dir, root_len);
+    char header[RANGE_HEADER_SZ];
+    int n = snprintf(header, RANGE_HEADER_SZ, chunked_response, date, ctx->content_type,
+                     last_modified, request_etag(ctx), ctx->extra_headers, cache_rule_fields(ctx->cache_rule));
 
-    // Copy file
-    memcpy(file_w_root + root_len, request->requested_file, file_len);
+    if (n < 0 || n >= RANGE_HEADER_SZ) {
+        P_DEBUG("sprintf failed while building the chunked header\n");
+        write_err_response(fd, UNEXPECTED);
+        goto EXIT;
+    }
 
-    if ((err = check_file_access(file_w_root, root_dir, &file_full_path)) != OK)
-        goto CLOSE_CONNECTION;
+    set_tcp_cork(fd, 1);
 
-CLOSE_CONNECTION:
-    write_response(fd, err, file_full_path, stats);
-    free_request(request);
-    free(file_w_root);
-    free(file_full_path);
-    close(fd);
+    if (write_bytes(fd, header, HTTP_TIMEOUT, n) != IO_OK)
+        goto UNCORK;
+
+    off_t size   = ctx->f_stats.st_size;
+    off_t offset = 0;
+    size_t sent  = 0;
+    int flush;
+
+    do {
+        size_t len = size - offset < COMPRESS_CHUNK_SZ ? size - offset : COMPRESS_CHUNK_SZ;
+
+        // Once the headers left, a short read can only cut the response
+        if (read_file_fd(ctx->file, in, offset, len) != IO_OK)
+            goto UNCORK;
+
+        offset += len;
+        flush   = offset == size ? Z_FINISH : Z_NO_FLUSH;
+
+        strm.next_in  = (Bytef*) in;
+        strm.avail_in = len;
+
+        do {
+            strm.next_out  = (Bytef*) out;
+            strm.avail_out = COMPRESS_CHUNK_SZ;
+
+            int status = deflate(&strm, flush);
+
+            // A broken stream cuts the response short, so a corrupt body
+            // is neither finished nor cached
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                P_DEBUG("deflate failed : %d\n", status);
+                goto UNCORK;
+            }
+
+            size_t produced = COMPRESS_CHUNK_SZ - strm.avail_out;
+
+            if (produced == 0)
+                continue;
+
+            if (write_chunk(fd, out, produced) != IO_OK)
+                goto UNCORK;
+
+            keep_compressed(ctx, &copy, &copy_len, out, produced);
+            sent += produced;
+        } while (strm.avail_out == 0);
+    } while (flush != Z_FINISH);
+
+    if (write_bytes(fd, "0\r\n\r\n", HTTP_TIMEOUT, 5) != IO_OK)
+        goto UNCORK;
+
+    update_stats(ctx->stats, sent);
+
+    if (copy != NULL) {
+        cache_compressed(ctx, key, copy, copy_len);
+        copy = NULL;
+    }
+
+UNCORK:
+    set_tcp_cork(fd, 0);
+
+EXIT:
+    deflateEnd(&strm);
+
+    free(in);
+    free(out);
+    free(copy);
+}
+
+/*
+ * Sends the file compressed, from the compressed cache if this version
+ * of the file was compressed before, or compressing it on the fly.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns: -
+ */
+static
+void write_compressed_response(RequestCtx *ctx) {
+    char key[PATH_MAX + 16];
+    compressed_key(ctx, key, sizeof(key));
+
+    CacheEntry *entry = file_cache_lookup(ctx->compress_cache, key, &ctx->f_stats);
+
+    if (entry == NULL) {
+        write_chunked_response(ctx, key);
+        return;
+    }
+
+    char date[HTTP_DATE_LEN + 1];
+    http_date_now(date);
+
+    struct iovec iov[4];
+
+    header_iov(iov, entry->header, entry->header_len, entry->date_offset, date);
+    iov[3].iov_base = entry->body;
+    iov[3].iov_len  = entry->body_len;
+
+    if (write_memory_response(ctx, iov) == IO_OK)
+        update_stats(ctx->stats, entry->body_len);
+
+    file_cache_release(entry);
+}
+
+/*
+ * Sends a piece of a range, from the pack or the file.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ * - off_t offset    : The offset of the first byte to send, in the file.
+ * - size_t len      : The number of bytes to send.
+ * - int large       : The piece belongs to a large transfer.
+ *
+ * Returns:
+ * - IO_OK if the piece was sent.
+ * - An appropriate io error code otherwise.
+ */
+static
+int send_file_piece(RequestCtx *ctx, off_t offset, size_t len, int large) {
+    if (!large)
+        return write_file_fd(ctx->fd, ctx->file, offset, len, HTTP_TIMEOUT);
+
+    // Only large files are dropped, not large ranges of small ones
+    unsigned long long *dropped = NULL;
+
+    if (ctx->drop_behind_min > 0 && ctx->f_stats.st_size >= ctx->drop_behind_min)
+        dropped = &ctx->stats->dropped_bytes;
+
+    if (ctx->mmap_send)
+        return write_file_mmap(ctx->fd, ctx->file, offset, len, HTTP_TIMEOUT, dropped);
+
+    return write_file_fd_drop(ctx->fd, ctx->file, offset, len, HTTP_TIMEOUT, dropped);
+}
+
+/*
+ * Sends a range of the requested file. Large transfers are announced to
+ * the kernel as sequential, with their start read ahead, and are sent from
+ * a mapping or dropped from the page cache behind the send offset, if the
+ * server was asked to. Past the burst, ranges under a rate limit are sent
+ * in the pieces the limiter allows.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ * - off_t offset    : The offset of the first byte to send.
+ * - size_t len      : The number of bytes to send.
+ *
+ * Returns:
+ * - IO_OK if the range was sent.
+ * - An appropriate io error code otherwise.
+ */
+static
+int send_file_range(RequestCtx *ctx, off_t offset, size_t len) {
+    // The file is a body of the pack
+    offset += ctx->body_offset;
+
+    int large = len >= LARGE_FILE_SZ;
+
+    if (large) {
+        posix_fadvise(ctx->file, offset, len, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(ctx->file, offset, len < READAHEAD_SZ ? len : READAHEAD_SZ, POSIX_FADV_WILLNEED);
+    }
+
+    Shaper shaper;
+
+    if (!shaper_start(&shaper, ctx->limiter, ctx->fd, len))
+        return send_file_piece(ctx, offset, len, large);
+
+    int status = IO_OK;
+
+    while (status == IO_OK && len > 0) {
+        size_t n = shaper_quota(&shaper, len);
+
+        status = send_file_piece(ctx, offset, n, large);
+
+        offset += n;
+        len    -= n;
+    }
+
+    return status;
+}
+
+/*
+ * This function sends the OK response header, and then sends the
+ * requested file. Files that fit in the file cache are served from
+ * memory; small files are read and sent along with the header in a
+ * single writev, and the rest are streamed with sendfile.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns: -
+ */
+static 
+void write_ok_response(RequestCtx *ctx) {
+    int fd             = ctx->fd;
+    ServerStats *stats = ctx->stats;
+
+    if (ctx->compress) {
+        write_compressed_response(ctx);
+        return;
+    }
+
+    if (ctx->file_cache != NULL && file_cache_cacheable(ctx->file_cache, &ctx->f_stats))
+        if (write_cached_response(ctx) == 0)
+            return;
+
+    long sz = ctx->f_stats.st_size;
+
+    char date[HTTP_DATE_LEN + 1];
+    http_date_now(date);
+
+    struct iovec iov[4];
+    header_iov(iov, ctx->header, ctx->header_len, ctx->date_offset, date);
+
+    if (sz <= SMALL_FILE_SZ) {
+        char body[SMALL_FILE_SZ];
+
+        // Bodies in a pack are already mapped
+        char *data = ctx->pack != NULL ? ctx->pack->map + ctx->body_offset : body;
+
+        if (ctx->pack != NULL || read_file_fd(ctx->file, body, 0, sz) == IO_OK) {
+            iov[3].iov_base = data;
+            iov[3].iov_len  = sz;
+
+            if (write_iovec(fd, iov, 4, HTTP_TIMEOUT) == IO_OK)
+                update_stats(stats, sz);
+
+            return;
+        }
+    }
+
+    // Cork the socket, so the header leaves in the same segment as the
+    // first bytes of the body
+    set_tcp_cork(fd, 1);
+
+    // If header write and html file write suceeded, update the stats
+    if ((write_iovec(fd, iov, 3, HTTP_TIMEOUT) == IO_OK) && (send_file_range(ctx, 0, sz) == IO_OK))
+        update_stats(stats, sz);
+
+    set_tcp_cork(fd, 0);
+}
+
+/*
+ * Answers a conditional request whose validator still matches the file
+ * with 304, so the body is never read.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns: -
+ */
+static
+void write_not_modified_response(RequestCtx *ctx) {
+    char date[HTTP_DATE_LEN + 1];
+    http_date_now(date);
+
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_http_date(ctx->f_stats.st_mtim.tv_sec, last_modified);
+
+    char msg[RANGE_HEADER_SZ];
+    // Only Vary applies to a 304, the encoding is the one the client has
+    const char *vary = ctx->extra_headers[0] != '\0' ? encoding_headers[ENC_IDENTITY] : "";
+
+    int len = snprintf(msg, RANGE_HEADER_SZ, not_modified_response, date, last_modified, request_etag(ctx), vary,
+                       cache_rule_fields(ctx->cache_rule));
+
+    if (len < 0 || len >= RANGE_HEADER_SZ) {
+        P_DEBUG("sprintf failed while rendering the header\n");
+        return;
+    }
+
+    write_bytes(ctx->fd, msg, HTTP_TIMEOUT, len);
+}
+
+/*
+ * Answers a request whose ranges are all outside the file with 416.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns: -
+ */
+static
+void write_unsatisfiable_response(RequestCtx *ctx) {
+    char date[HTTP_DATE_LEN + 1];
+    http_date_now(date);
+
+    char msg[RANGE_HEADER_SZ];
+    int len = snprintf(msg, RANGE_HEADER_SZ, range_not_satisfiable_response, date, (long) ctx->f_stats.st_size);
+
+    if (len < 0 || len >= RANGE_HEADER_SZ) {
+        P_DEBUG("sprintf failed while rendering the header\n");
+        return;
+    }
+
+    write_bytes(ctx->fd, msg, HTTP_TIMEOUT, len);
+}
+
+/*
+ * Sends a single range of the file with 206, streaming it from its
+ * offset in the file with sendfile.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns: -
+ */
+static
+void write_partial_response(RequestCtx *ctx) {
+    ByteRange *range = &ctx->ranges[0];
+    long len = range->end - range->start + 1;
+
+    char date[HTTP_DATE_LEN + 1];
+    http_date_now(date);
+
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_http_date(ctx->f_stats.st_mtim.tv_sec, last_modified);
+
+    char *etag = request_etag(ctx);
+
+    char header[RANGE_HEADER_SZ];
+    int n = snprintf(header, RANGE_HEADER_SZ, partial_response, date, len, ctx->content_type,
+                     (long) range->start, (long) range->end, (long) ctx->f_stats.st_size, last_modified, etag,
+                     ctx->extra_headers, cache_rule_fields(ctx->cache_rule));
+
+    if (n < 0 || n >= RANGE_HEADER_SZ) {
+        P_DEBUG("sprintf failed while rendering the header\n");
+        return;
+    }
+
+    set_tcp_cork(ctx->fd, 1);
+
+    if ((write_bytes(ctx->fd, header, HTTP_TIMEOUT, n) == IO_OK) &&
+        (send_file_range(ctx, range->start, len) == IO_OK))
+        update_stats(ctx->stats, len);
+
+    set_tcp_cork(ctx->fd, 0);
+}
+
+/*
+ * Sends several ranges of the file with 206, as a multipart/byteranges
+ * body. Each part header is rendered up front, since the total length
+ * of the body has to be known before the header is sent.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns: -
+ */
+static
+void write_multipart_response(RequestCtx *ctx) {
+    const char *type = ctx->content_type;
+    long size = ctx->f_stats.st_size;
+
+    char date[HTTP_DATE_LEN + 1];
+    http_date_now(date);
+
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_http_date(ctx->f_stats.st_mtim.tv_sec, last_modified);
+
+    char *etag = request_etag(ctx);
+
+    // The boundary only has to be unlikely to appear in the body
+    struct timespec t_now;
+    clock_gettime(CLOCK_MONOTONIC, &t_now);
+
+    char boundary[BOUNDARY_SZ];
+    snprintf(boundary, BOUNDARY_SZ, "%016llx", (unsigned long long) (hash_string(etag) ^ t_now.tv_nsec));
+
+    char parts[MAX_RANGES][PART_HEADER_SZ];
+    int part_len[MAX_RANGES];
+
+    long content_len = 0;
+    long body_len    = 0;
+
+    for (int i = 0; i < ctx->n_ranges; ++i) {
+        ByteRange *range = &ctx->ranges[i];
+
+        part_len[i] = snprintf(parts[i], PART_HEADER_SZ, multipart_part, boundary, type,
+                               (long) range->start, (long) range->end, size);
+
+        if (part_len[i] < 0 || part_len[i] >= PART_HEADER_SZ) {
+            P_DEBUG("sprintf failed while rendering a part header\n");
+            return;
+        }
+
+        body_len    += range->end - range->start + 1;
+        content_len += part_len[i] + range->end - range->start + 1;
+    }
+
+    char end[PART_HEADER_SZ];
+    int end_len = snprintf(end, PART_HEADER_SZ, multipart_end, boundary);
+
+    content_len += end_len;
+
+    char header[RANGE_HEADER_SZ];
+    int n = snprintf(header, RANGE_HEADER_SZ, multipart_response, date, content_len, boundary, last_modified, etag,
+                     ctx->extra_headers, cache_rule_fields(ctx->cache_rule));
+
+    if (n < 0 || n >= RANGE_HEADER_SZ) {
+        P_DEBUG("sprintf failed while rendering the header\n");
+        return;
+    }
+
+    set_tcp_cork(ctx->fd, 1);
+
+    if (write_bytes(ctx->fd, header, HTTP_TIMEOUT, n) != IO_OK)
+        goto EXIT;
+
+    for (int i = 0; i < ctx->n_ranges; ++i) {
+        ByteRange *range = &ctx->ranges[i];
+
+        if (write_bytes(ctx->fd, parts[i], HTTP_TIMEOUT, part_len[i]) != IO_OK)
+            goto EXIT;
+
+        if (send_file_range(ctx, range->start, range->end - range->start + 1) != IO_OK)
+            goto EXIT;
+    }
+
+    if (write_bytes(ctx->fd, end, HTTP_TIMEOUT, end_len) == IO_OK)
+        update_stats(ctx->stats, body_len);
+
+EXIT:
+    set_tcp_cork(ctx->fd, 0);
+}
+
+/*
+ * Wrapper function that calls the appropriate response function.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns: -
+ */
+static 
+void write_response(RequestCtx *ctx) {
+    if (ctx->err != OK)
+        write_err_response(ctx->fd, ctx->err);
+    else if (ctx->not_modified)
+        write_not_modified_response(ctx);
+    else if (ctx->n_ranges == RANGE_UNSATISFIABLE)
+        write_unsatisfiable_response(ctx);
+    else if (ctx->n_ranges == 1)
+        write_partial_response(ctx);
+    else if (ctx->n_ranges > 1)
+        write_multipart_response(ctx);
+    else
+        write_ok_response(ctx);
+}
+
+/*
+ * Maps an errno value of a failed path lookup to an HTTP error code.
+ */
+static
+HttpError lookup_error(int err) {
+    switch (err) {
+        case ENOENT:
+        case ENOTDIR:
+            return NOT_FOUND;
+        case EACCES:
+            return FORBIDDEN;
+        default:
+            return UNEXPECTED;
+    }
+}
+
+/*
+ * Lexically normalizes a request path: empty and "." components are
+ * dropped, and ".." removes the previous component. The result is
+ * relative to the root directory, and never starts with a '/'.
+ *
+ * Params:
+ * - char *file : The requested path.
+ *
+ * Returns:
+ * - A new buffer holding the normalized path ("." for the root itself).
+ * - NULL if the path climbs above the root, or allocation failed (errno
+ *   is set to EXDEV or ENOMEM respectively).
+ */
+static
+char *normalize_path(char *file) {
+    size_t len = strlen(file);
+
+    char *norm = malloc(len + 2);
+
+    if (norm == NULL)
+        return NULL;
+
+    size_t out = 0;
+
+    for (size_t i = 0; i < len; ) {
+        // Skip seperators
+        if (file[i] == '/') {
+            i++;
+            continue;
+        }
+
+        size_t seg_len = strcspn(file + i, "/");
+
+        if (seg_len == 1 && file[i] == '.') {
+            // Current directory, nothing to do
+        }
+        else if (seg_len == 2 && file[i] == '.' && file[i + 1] == '.') {
+            // Climbing above the root
+            if (out == 0) {
+                free(norm);
+                errno = EXDEV;
+                return NULL;
+            }
+
+            // Drop the last component
+            while (out > 0 && norm[out - 1] != '/')
+                out--;
+
+            if (out > 0)
+                out--;
+        }
+        else {
+            if (out > 0)
+                norm[out++] = '/';
+
+            memcpy(norm + out, file + i, seg_len);
+            out += seg_len;
+        }
+
+        i += seg_len;
+    }
+
+    if (out == 0)
+        norm[out++] = '.';
+
+    norm[out] = '\0';
+
+    return norm;
+}
+
+/*
+ * Fallback for kernels without openat2. Expands the path with realpath,
+ * checks that it is inside the root directory, and opens it.
+ *
+ * Params:
+ * - char *path     : The absolute path of the file.
+ * - char *root_dir : The root directory that the server is serving.
+ *
+ * Returns:
+ * - The open file descriptor, if no error occurred.
+ * - -1 otherwise, with errno set (EXDEV if the file is outside the root).
+ */
+static
+int open_checked_realpath(char *path, char *root_dir) {
+    char *expanded_path = realpath(path, NULL);
+
+    if (expanded_path == NULL)
+        return -1;
+
+    size_t root_len = strlen(root_dir);
+
+    // The root must be a prefix that ends on a directory boundary, so that
+    // /srv/www does not match /srv/www2
+    int inside = !strncmp(expanded_path, root_dir, root_len) &&
+                 (expanded_path[root_len] == '/'  ||
+                  expanded_path[root_len] == '\0' ||
+                  root_dir[root_len - 1]   == '/');
+
+    int fd = -1;
+
+    if (inside)
+        fd = open(expanded_path, O_RDONLY | O_CLOEXEC);
+    else
+        errno = EXDEV;
+
+    free(expanded_path);
+    return fd;
+}
+
+/*
+ * Builds the absolute path of a root relative path, <root_dir>/<rel_path>.
+ *
+ * Params:
+ * - char *root_dir       : The root directory that the server is serving.
+ * - const char *rel_path : The normalized, root relative path.
+ *
+ * Returns:
+ * - A new buffer holding the path.
+ * - NULL if allocation failed.
+ */
+static
+char *root_path(char *root_dir, const char *rel_path) {
+    size_t root_len = strlen(root_dir);
+    size_t rel_len  = strlen(rel_path);
+
+    char *path = malloc(root_len + rel_len + 2);
+
+    if (path == NULL)
+        return NULL;
+
+    memcpy(path, root_dir, root_len);
+    path[root_len] = '/';
+    memcpy(path + root_len + 1, rel_path, rel_len + 1);
+
+    return path;
+}
+
+/*
+ * Opens a root relative path beneath the root directory. The file is
+ * opened relative to the root directory fd with openat2 and
+ * RESOLVE_BENEATH, so the kernel guarantees it does not escape the root,
+ * with a single syscall.
+ *
+ * Params:
+ * - char *rel_path       : The normalized, root relative path.
+ * - char *root_dir       : The root directory that the server is serving.
+ * - int root_fd          : An open fd of the root directory.
+ * - char **full_path     : Where the absolute path will be stored. It is
+ *                          set even if the file could not be opened.
+ * - int *fd              : Where the open file descriptor will be stored.
+ * - struct stat *f_stats : Where the metadata of the file will be stored.
+ *
+ * Returns:
+ * - OK if no error occured.
+ * - An appropriate HTTP error code otherwise.
+ */
+static
+HttpError open_rel_path(char *rel_path, char *root_dir, int root_fd, char **full_path, int *fd, struct stat *f_stats) {
+    static volatile int have_openat2 = 1;
+
+    char *path = root_path(root_dir, rel_path);
+
+    if (path == NULL)
+        return UNEXPECTED;
+
+    *full_path = path;
+
+    int file_fd = -1;
+
+    if (have_openat2) {
+        file_fd = open_beneath(root_fd, rel_path, O_RDONLY | O_CLOEXEC);
+
+        if (file_fd < 0 && errno == ENOSYS)
+            have_openat2 = 0;
+    }
+
+    if (!have_openat2)
+        file_fd = open_checked_realpath(path, root_dir);
+
+    if (file_fd < 0) {
+        switch (errno) {
+            // Escaping the root, or following a magic link
+            case EXDEV:
+            case ELOOP:
+                return FORBIDDEN;
+            default:
+                return lookup_error(errno);
+        }
+    }
+
+    if (fstat(file_fd, f_stats) < 0) {
+        close(file_fd);
+        return lookup_error(errno);
+    }
+
+    *fd = file_fd;
+
+    return OK;
+}
+
+/*
+ * Checks if a file exists, we have read access to it and is under the
+ * root directory, and opens it. A directory is served through its
+ * index.html. If the server keeps an index of the root, missing files,
+ * directories and unreadable files are answered from memory, and only
+ * the files that can be served are opened. Paths recently found missing
+ * on the filesystem are answered from the negative cache, if enabled.
+ * Files with a local copy are opened from the local cache, and the files
+ * opened from the root are queued for copying, if enabled. On success the
+ * open fd, the absolute (lexically normalized) path of the file and its
+ * metadata are returned, so the file never has to be looked up by path
+ * again.
+ *
+ * Params:
+ * - RequestCtx *ctx      : The request, for the root directory and caches.
+ * - char *file           : The requested file.
+ * - char **full_path     : The buffer where the absolute path will be stored.
+ * - int *fd              : Where the open file descriptor will be stored.
+ * - struct stat *f_stats : Where the metadata of the file will be stored.
+ *
+ * Returns:
+ * - OK if no error occured.
+ * - An appropriate HTTP error code otherwise.
+ */
+static
+HttpError check_file_access(RequestCtx *ctx, char *file, char **full_path, int *fd, struct stat *f_stats) {
+    char *root_dir = ctx->root_dir;
+    int root_fd    = ctx->root_fd;
+
+    P_DEBUG("File : (%s) Root : (%s)\n", file, root_dir);
+
+    if (ctx->neg_cache != NULL && neg_cache_lookup(ctx->neg_cache, file))
+        return NOT_FOUND;
+
+    char *rel_path = normalize_path(file);
+
+    if (rel_path == NULL)
+        return errno == EXDEV ? FORBIDDEN : UNEXPECTED;
+
+    int mapped = 0;
+
+    if (ctx->ns_index != NULL) {
+        char dir_index[PATH_MAX];
+
+        switch (ns_index_lookup(ctx->ns_index, rel_path, dir_index, PATH_MAX)) {
+            case NS_MISSING:
+            case NS_DIR:
+                free(rel_path);
+                return NOT_FOUND;
+            case NS_FORBIDDEN:
+                free(rel_path);
+                return FORBIDDEN;
+            case NS_FILE:
+                if (dir_index[0] == '\0')
+                    break;
+
+                free(rel_path);
+
+                if ((rel_path = strdup(dir_index)) == NULL)
+                    return UNEXPECTED;
+
+                mapped = 1;
+                break;
+        }
+    }
+
+    // A local copy is served without touching the root, and carries the
+    // metadata of the original
+    if (ctx->local_cache != NULL) {
+        char *copy_rel = NULL;
+
+        if (local_cache_open(ctx->local_cache, root_fd, ctx->root->gen, rel_path, &copy_rel, fd, f_stats) == 0) {
+            HttpError err = OK;
+
+            if ((*full_path = root_path(root_dir, copy_rel)) == NULL) {
+                close(*fd);
+                err = UNEXPECTED;
+            }
+
+            free(copy_rel);
+            free(rel_path);
+            return err;
+        }
+    }
+
+    HttpError err = open_rel_path(rel_path, root_dir, root_fd, full_path, fd, f_stats);
+
+    if (err == NOT_FOUND && !mapped && ctx->neg_cache != NULL)
+        neg_cache_insert(ctx->neg_cache, file, rel_path);
+
+    // The root relative path of the file served
+    char *served = rel_path;
+    char *index_path = NULL;
+
+    // A directory is served through its index.html, once
+    if (err == OK && S_ISDIR(f_stats->st_mode)) {
+        close(*fd);
+        err = NOT_FOUND;
+
+        index_path = mapped ? NULL : malloc(strlen(rel_path) + sizeof("/" NS_DIR_INDEX));
+
+        if (index_path != NULL) {
+            if (!strcmp(rel_path, "."))
+                strcpy(index_path, NS_DIR_INDEX);
+            else
+                sprintf(index_path, "%s/%s", rel_path, NS_DIR_INDEX);
+
+            free(*full_path);
+            *full_path = NULL;
+
+            err = open_rel_path(index_path, root_dir, root_fd, full_path, fd, f_stats);
+
+            if (err == OK && S_ISDIR(f_stats->st_mode)) {
+                close(*fd);
+                err = NOT_FOUND;
+            }
+
+            served = index_path;
+        }
+    }
+
+    // Check if the file is readable
+    if (err == OK && !(f_stats->st_mode & S_IRUSR)) {
+        close(*fd);
+        err = FORBIDDEN;
+    }
+
+    // Copy the file to the local cache, so the next request skips the root
+    if (err == OK && ctx->local_cache != NULL)
+        local_cache_fill(ctx->local_cache, ctx->root->gen, rel_path, served, *fd, f_stats);
+
+    free(index_path);
+    free(rel_path);
+
+    return err;
+}
+
+/*
+ * Creates the state for a new request on the connection described
+ * by args.
+ *
+ * Params:
+ * - AcceptArgs *args : The connection fd and the server resources it needs.
+ *
+ * Returns:
+ * - A new request context if no error occurred. If the request struct
+ *   itself could not be allocated, err is set to UNEXPECTED so the
+ *   client still gets a response.
+ * - NULL if the context could not be allocated.
+ */
+RequestCtx *request_ctx_create(AcceptArgs *args) {
+    RequestCtx *ctx = malloc(sizeof(RequestCtx));
+
+    if (ctx == NULL) {
+        P_ERR("Malloc failed for request context", errno);
+        return NULL;
+    }
+
+    ctx->fd             = args->fd;
+    ctx->roots          = args->roots;
+    ctx->root           = NULL;
+    ctx->root_dir       = NULL;
+    ctx->root_fd        = -1;
+    ctx->ns_index       = NULL;
+    ctx->neg_cache      = NULL;
+    ctx->stats          = args->stats;
+    ctx->file_cache     = args->file_cache;
+    ctx->fd_cache       = args->fd_cache;
+    ctx->hash_cache     = args->hash_cache;
+    ctx->sidecars       = args->sidecars;
+    ctx->compress_cache = args->compress_cache;
+    ctx->compress_min   = args->compress_min;
+    ctx->disk_pool      = args->disk_pool;
+    ctx->drop_behind_min = args->drop_behind_min;
+    ctx->mmap_send      = args->mmap_send;
+    ctx->zerocopy_min   = args->zerocopy_min;
+    ctx->flights        = args->flights;
+    ctx->packs          = args->packs;
+    ctx->hot_set        = args->hot_set;
+    ctx->local_cache    = args->local_cache;
+    ctx->limiter        = args->limiter;
+    ctx->cache_policy   = args->cache_policy;
+    ctx->cache_rule     = NULL;
+    ctx->pack           = NULL;
+    ctx->body_offset    = 0;
+    ctx->refs           = 1;
+    ctx->file_full_path = NULL;
+    ctx->file_rel_path  = NULL;
+    ctx->file           = -1;
+    ctx->header         = NULL;
+    ctx->etag[0]        = '\0';
+    ctx->not_modified   = 0;
+    ctx->accepted       = 0;
+    ctx->encoding       = ENC_IDENTITY;
+    ctx->compress       = 0;
+    ctx->content_type   = NULL;
+    ctx->extra_headers  = "";
+    ctx->n_ranges       = 0;
+    ctx->fd_entry       = NULL;
+    ctx->err            = OK;
+
+    // The request resolves against the version current when it starts
+    if (ctx->roots != NULL) {
+        ctx->root      = root_store_acquire(ctx->roots);
+        ctx->root_dir  = ctx->root->dir;
+        ctx->root_fd   = ctx->root->fd;
+        ctx->ns_index  = ctx->root->ns_index;
+        ctx->neg_cache = ctx->root->neg_cache;
+    }
+
+    ctx->request = malloc(sizeof(HttpRequest));
+
+    if (ctx->request == NULL) {
+        ctx->err = UNEXPECTED;
+        return ctx;
+    }
+
+    if (init_request(ctx->request) < 0) {
+        free(ctx->request);
+        ctx->request = NULL;
+        ctx->err = UNEXPECTED;
+    }
+
+    return ctx;
+}
+
+/*
+ * Reads the request from the connection, parses it and checks the header.
+ * Does nothing if a previous step failed.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns: -
+ */
+void request_parse(RequestCtx *ctx) {
+    char *header = NULL;
+
+    if (ctx->err != OK)
+        return;
+
+    P_DEBUG("Got fd %d\n", ctx->fd);
+
+    if ((ctx->err = read_request(ctx->fd, &header)) != OK)
+        return;
+
+    if ((ctx->err = parse_request(header, ctx->request)) != OK)
+        return;
+
+    ctx->err = check_request_header(ctx->request->key_value_pairs);
+}
+
+/*
+ * Points the request at the file held by an fd cache entry.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ * - FdEntry *entry  : The entry holding the file.
+ *
+ * Returns: -
+ */
+static
+void use_entry(RequestCtx *ctx, FdEntry *entry) {
+    ctx->file           = entry->fd;
+    ctx->f_stats        = entry->f_stats;
+    ctx->file_full_path = entry->full_path;
+    ctx->file_rel_path  = entry->full_path + entry->root_len;
+    ctx->header         = entry->header;
+    ctx->header_len     = entry->header_len;
+    ctx->date_offset    = entry->date_offset;
+    ctx->etag[0]        = '\0';
+}
+
+/*
+ * Opens the precompressed copy of the requested file for an encoding
+ * (e.g. foo.js.br next to foo.js), and renders its header. Copies older
+ * than the file are ignored, since they are stale.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request, already resolved to the original file.
+ * - int enc         : The encoding of the copy.
+ *
+ * Returns:
+ * - A new, uncached, entry holding the copy, if it exists.
+ * - NULL otherwise.
+ */
+static
+FdEntry *open_variant(RequestCtx *ctx, int enc) {
+    // The copy is looked up beneath the root, just like the original
+    const char *rel    = ctx->file_full_path + strlen(ctx->root_dir);
+    const char *suffix = encoding_suffixes[enc];
+
+    char *variant_file = malloc(strlen(rel) + strlen(suffix) + 1);
+
+    if (variant_file == NULL)
+        return NULL;
+
+    sprintf(variant_file, "%s%s", rel, suffix);
+
+    char *path = NULL;
+    int fd;
+    struct stat f_stats;
+
+    HttpError err = check_file_access(ctx, variant_file, &path, &fd, &f_stats);
+
+    free(variant_file);
+
+    if (err != OK) {
+        free(path);
+        return NULL;
+    }
+
+    struct timespec *mtime = &ctx->f_stats.st_mtim;
+
+    if (!S_ISREG(f_stats.st_mode) ||
+        f_stats.st_mtim.tv_sec < mtime->tv_sec ||
+        (f_stats.st_mtim.tv_sec == mtime->tv_sec && f_stats.st_mtim.tv_nsec < mtime->tv_nsec)) {
+        close(fd);
+        free(path);
+        return NULL;
+    }
+
+    char etag[ETAG_SZ];
+    format_etag(ctx->hash_cache, fd, &f_stats, etag);
+
+    size_t header_len, date_offset;
+    char *header = render_ok_header(ctx->content_type, &f_stats, etag, encoding_headers[enc], cache_rule_fields(ctx->cache_rule),
+                                    &header_len, &date_offset);
+
+    FdEntry *variant = NULL;
+
+    if (header != NULL)
+        variant = fd_entry_create(path, fd, &f_stats, path);
+
+    if (variant == NULL) {
+        close(fd);
+        free(path);
+        free(header);
+        return NULL;
+    }
+
+    variant->header      = header;
+    variant->header_len  = header_len;
+    variant->date_offset = date_offset;
+
+    return variant;
+}
+
+/*
+ * Switches the request to the preferred precompressed copy of the file
+ * the client accepts, if the entry of the file has one.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns: -
+ */
+static
+void select_variant(RequestCtx *ctx) {
+    if (ctx->fd_entry == NULL)
+        return;
+
+    // Encodings are numbered in order of preference
+    for (int enc = ENC_IDENTITY + 1; enc < N_ENCODINGS; ++enc) {
+        FdEntry *variant = ctx->fd_entry->variants[enc];
+
+        if (variant != NULL && (ctx->accepted & ENC_BIT(enc))) {
+            use_entry(ctx, variant);
+
+            ctx->encoding      = enc;
+            ctx->extra_headers = encoding_headers[enc];
+            return;
+        }
+    }
+}
+
+/*
+ * Works out the media type and the cache rule of the resolved file, and
+ * the optional fields sent along with it when it is served unencoded.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns: -
+ */
+static
+void set_content_type(RequestCtx *ctx) {
+    ctx->content_type = mime_type(ctx->file_full_path);
+
+    // Responses for files that may be sent compressed vary with the
+    // encodings the client accepts
+    if ((ctx->sidecars || ctx->compress_cache != NULL) && mime_compressible(ctx->content_type))
+        ctx->extra_headers = encoding_headers[ENC_IDENTITY];
+
+    // Copies of the file are cached like the file itself
+    if (ctx->cache_policy != NULL)
+        ctx->cache_rule = cache_policy_match(ctx->cache_policy, ctx->file_rel_path);
+}
+
+/*
+ * Looks up the requested file in the pack, and points the request at its
+ * body and pre-rendered header, or at those of its gzip copy if the client
+ * accepts gzip. No syscall is made.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns: -
+ */
+static
+void resolve_pack(RequestCtx *ctx) {
+    char *accept_encoding = lookup_str_map(ctx->request->key_value_pairs, "accept-encoding");
+
+    if (accept_encoding != NULL)
+        ctx->accepted = parse_accept_encoding(accept_encoding);
+
+    char *rel_path = normalize_path(ctx->request->requested_file);
+
+    if (rel_path == NULL) {
+        ctx->err = errno == EXDEV ? FORBIDDEN : UNEXPECTED;
+        return;
+    }
+
+    // Held until the response is sent, even if the pack is replaced
+    ctx->pack = pack_store_acquire(ctx->packs);
+
+    PackRecord *record = pack_lookup(ctx->pack, rel_path);
+
+    free(rel_path);
+
+    if (record == NULL) {
+        ctx->err = NOT_FOUND;
+        return;
+    }
+
+    if (record->gzip != PACK_NONE && (ctx->accepted & ENC_BIT(ENC_GZIP)))
+        record = &ctx->pack->records[record->gzip];
+
+    char *map = ctx->pack->map;
+
+    ctx->file           = ctx->pack->fd;
+    ctx->body_offset    = record->body_off;
+    ctx->file_full_path = map + record->path_off;
+    ctx->file_rel_path  = ctx->file_full_path;
+    ctx->header         = map + record->header_off;
+    ctx->header_len     = record->header_len;
+    ctx->date_offset    = record->date_offset;
+
+    memset(&ctx->f_stats, 0, sizeof(struct stat));
+
+    ctx->f_stats.st_mode        = S_IFREG | 0444;
+    ctx->f_stats.st_size        = record->body_len;
+    ctx->f_stats.st_mtim.tv_sec = record->mtime;
+
+    snprintf(ctx->etag, ETAG_SZ, "%s", map + record->etag_off);
+
+    ctx->content_type  = mime_type(ctx->file_full_path);
+    ctx->encoding      = record->encoding;
+    ctx->extra_headers = record->encoding != ENC_IDENTITY ? encoding_headers[record->encoding] :
+                         record->vary                     ? encoding_headers[ENC_IDENTITY]    : "";
+}
+
+// Checks if two stats describe the same, unchanged, file.
+static
+int same_file(struct stat *a, struct stat *b) {
+    return a->st_dev          == b->st_dev          &&
+           a->st_ino          == b->st_ino          &&
+           a->st_mode         == b->st_mode         &&
+           a->st_size         == b->st_size         &&
+           a->st_mtim.tv_sec  == b->st_mtim.tv_sec  &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Stats a root relative path the way requests open it: beneath the root,
+ * following only the symlinks that stay inside it. Without openat2, no
+ * symlink is followed.
+ *
+ * Params:
+ * - int root_fd          : The root directory.
+ * - const char *rel      : The root relative path.
+ * - struct stat *f_stats : Where the metadata of the file will be stored.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int stat_beneath(int root_fd, const char *rel, struct stat *f_stats) {
+    int fd = open_beneath(root_fd, rel, O_PATH | O_CLOEXEC);
+
+    if (fd < 0)
+        return errno == ENOSYS ? fstatat(root_fd, rel, f_stats, AT_SYMLINK_NOFOLLOW) : -1;
+
+    int status = fstat(fd, f_stats);
+
+    close(fd);
+
+    return status;
+}
+
+/*
+ * Checks if the precompressed copy of an entry for an encoding is still
+ * the one the entry holds, in the version of the request. If the entry has
+ * none, the copy must still be missing, or older than the file.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ * - FdEntry *entry  : The entry of the original file.
+ * - const char *rel : The root relative path of the original file.
+ * - int enc         : The encoding of the copy.
+ *
+ * Returns:
+ * - 1 if the copy is unchanged.
+ * - 0 otherwise.
+ */
+static
+int variant_unchanged(RequestCtx *ctx, FdEntry *entry, const char *rel, int enc) {
+    const char *suffix = encoding_suffixes[enc];
+
+    char *path = malloc(strlen(rel) + strlen(suffix) + 1);
+
+    if (path == NULL)
+        return 0;
+
+    sprintf(path, "%s%s", rel, suffix);
+
+    struct stat f_stats;
+    int exists = stat_beneath(ctx->root_fd, path, &f_stats) == 0;
+
+    free(path);
+
+    if (entry->variants[enc] != NULL)
+        return exists && same_file(&f_stats, &entry->variants[enc]->f_stats);
+
+    struct timespec *mtime = &entry->f_stats.st_mtim;
+
+    return !exists || !S_ISREG(f_stats.st_mode) ||
+           f_stats.st_mtim.tv_sec < mtime->tv_sec ||
+           (f_stats.st_mtim.tv_sec == mtime->tv_sec && f_stats.st_mtim.tv_nsec < mtime->tv_nsec);
+}
+
+/*
+ * Checks if an fd cache entry resolved in an older version of the root
+ * still holds the file its path leads to in the version of the request,
+ * along with the same precompressed copies. The paths are stat'ed beneath
+ * the new root. Releases that hard link their unchanged files keep their
+ * entries, the rest are resolved again.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ * - FdEntry *entry  : The entry found for the request path.
+ *
+ * Returns:
+ * - 1 if the entry is carried over to the version of the request.
+ * - 0 otherwise.
+ */
+static
+int carry_entry(RequestCtx *ctx, FdEntry *entry) {
+    const char *rel = entry->full_path + entry->root_len + 1;
+
+    struct stat f_stats;
+
+    int same = stat_beneath(ctx->root_fd, rel, &f_stats) == 0 && same_file(&f_stats, &entry->f_stats);
+
+    // Copies are only looked for next to compressible files
+    int sidecars = ctx->sidecars && mime_compressible(mime_type(entry->full_path));
+
+    for (int enc = ENC_IDENTITY + 1; same && enc < N_ENCODINGS; ++enc)
+        if (entry->variants[enc] != NULL || (sidecars && encoding_suffixes[enc] != NULL))
+            same = variant_unchanged(ctx, entry, rel, enc);
+
+    if (same)
+        __atomic_store_n(&entry->root_gen, ctx->root->gen, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(same ? &ctx->roots->carried : &ctx->roots->replaced, 1, __ATOMIC_RELAXED);
+
+    return same;
+}
+
+/*
+ * Opens the requested file, or borrows it from the fd cache, along with
+ * its metadata and rendered header. If precompressed copies are served,
+ * the request is switched to the best copy the client accepts. An entry
+ * resolved in an older version of the root is reused if its file is
+ * unchanged.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns: -
+ */
+static
+void resolve_file(RequestCtx *ctx) {
+    if (ctx->sidecars || ctx->compress_cache != NULL) {
+        char *accept_encoding = lookup_str_map(ctx->request->key_value_pairs, "accept-encoding");
+
+        if (accept_encoding != NULL)
+            ctx->accepted = parse_accept_encoding(accept_encoding);
+    }
+
+    // The path was resolved recently, reuse the open file
+    if (ctx->fd_cache != NULL) {
+        FdEntry *entry = fd_cache_lookup(ctx->fd_cache, ctx->request->requested_file);
+
+        // Resolved in another version of the root, and the file changed
+        if (entry != NULL && entry->root_gen != ctx->root->gen && !carry_entry(ctx, entry)) {
+            fd_cache_release(entry);
+            entry = NULL;
+        }
+
+        if (entry != NULL) {
+            ctx->fd_entry = entry;
+            use_entry(ctx, entry);
+            set_content_type(ctx);
+            select_variant(ctx);
+            return;
+        }
+    }
+
+    ctx->err = check_file_access(ctx, ctx->request->requested_file, &ctx->file_full_path, &ctx->file, &ctx->f_stats);
+
+    if (ctx->err != OK)
+        return;
+
+    ctx->file_rel_path = ctx->file_full_path + strlen(ctx->root_dir);
+
+    set_content_type(ctx);
+
+    ctx->header = render_ok_header(ctx->content_type, &ctx->f_stats, request_etag(ctx), ctx->extra_headers,
+                                   cache_rule_fields(ctx->cache_rule), &ctx->header_len, &ctx->date_offset);
+
+    if (ctx->header == NULL) {
+        ctx->err = UNEXPECTED;
+        return;
+    }
+
+    // Only the fd cache and the compressed copies need the file in an entry
+    if (ctx->fd_cache == NULL && !ctx->sidecars)
+        return;
+
+    FdEntry *entry = fd_entry_create(ctx->request->requested_file, ctx->file, &ctx->f_stats, ctx->file_full_path);
+
+    if (entry == NULL)
+        return;
+
+    entry->header      = ctx->header;
+    entry->header_len  = ctx->header_len;
+    entry->date_offset = ctx->date_offset;
+    entry->root_gen    = ctx->root->gen;
+    entry->root_len    = strlen(ctx->root_dir);
+
+    ctx->fd_entry = entry;
+
+    // A cached entry is shared by every client, so it gets all the copies
+    // that exist; otherwise only the ones this client can use are opened
+    if (ctx->sidecars && mime_compressible(ctx->content_type))
+        for (int enc = ENC_IDENTITY + 1; enc < N_ENCODINGS; ++enc)
+            if (encoding_suffixes[enc] != NULL && (ctx->fd_cache != NULL || (ctx->accepted & ENC_BIT(enc))))
+                entry->variants[enc] = open_variant(ctx, enc);
+
+    // Hand the open file and its header over to the fd cache, so later
+    // requests skip both the lookup and the rendering
+    if (ctx->fd_cache != NULL)
+        fd_cache_insert(ctx->fd_cache, entry);
+
+    select_variant(ctx);
+}
+
+/*
+ * Checks the If-Range precondition of the request. The ranges are only
+ * honored if the validator the client has still matches the file.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns:
+ * - 1 if there is no If-Range, or it matches the file.
+ * - 0 otherwise.
+ */
+static
+int if_range_matches(RequestCtx *ctx) {
+    char *if_range = lookup_str_map(ctx->request->key_value_pairs, "if-range");
+
+    if (if_range == NULL)
+        return 1;
+
+    // An entity tag, which must match strongly, so weak tags never do
+    if (if_range[0] == '"')
+        return !strcmp(if_range, request_etag(ctx));
+
+    if (!strncmp(if_range, "w/", 2))
+        return 0;
+
+    // An HTTP date, which must be the exact Last-Modified we send
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_http_date(ctx->f_stats.st_mtim.tv_sec, last_modified);
+
+    return !strcasecmp(if_range, last_modified);
+}
+
+/*
+ * Decides if the file is compressed on the fly: it must be compressible,
+ * large enough, not already served from a precompressed copy, and the
+ * client must accept gzip or deflate. Range requests are served from the
+ * file as is.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns: -
+ */
+static
+void choose_compression(RequestCtx *ctx) {
+    if (ctx->compress_cache == NULL || ctx->encoding != ENC_IDENTITY)
+        return;
+
+    if (!mime_compressible(ctx->content_type) || ctx->f_stats.st_size < ctx->compress_min)
+        return;
+
+    if (lookup_str_map(ctx->request->key_value_pairs, "range") != NULL)
+        return;
+
+    int enc = ctx->accepted & ENC_BIT(ENC_GZIP)    ? ENC_GZIP    :
+              ctx->accepted & ENC_BIT(ENC_DEFLATE) ? ENC_DEFLATE : ENC_IDENTITY;
+
+    if (enc == ENC_IDENTITY)
+        return;
+
+    ctx->encoding      = enc;
+    ctx->compress      = 1;
+    ctx->extra_headers = encoding_headers[enc];
+    ctx->etag[0]       = '\0';
+}
+
+/*
+ * Evaluates the If-None-Match and If-Modified-Since preconditions of the
+ * request. If-Modified-Since is only looked at when there is no
+ * If-None-Match, as the latter is the more precise validator.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns:
+ * - 1 if the copy the client holds is still valid.
+ * - 0 otherwise.
+ */
+static
+int client_copy_valid(RequestCtx *ctx) {
+    char *if_none_match = lookup_str_map(ctx->request->key_value_pairs, "if-none-match");
+
+    if (if_none_match != NULL)
+        return etag_list_matches(if_none_match, request_etag(ctx));
+
+    char *if_modified_since = lookup_str_map(ctx->request->key_value_pairs, "if-modified-since");
+
+    time_t since;
+
+    if (if_modified_since == NULL || parse_http_date(if_modified_since, &since) < 0)
+        return 0;
+
+    return ctx->f_stats.st_mtim.tv_sec <= since;
+}
+
+/*
+ * Maps the requested file onto the root directory, checks that it can be
+ * served, evaluates the conditional headers, and works out which ranges
+ * of it were requested. Does nothing if a previous step failed.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns: -
+ */
+void request_resolve(RequestCtx *ctx) {
+    if (ctx->err != OK)
+        return;
+
+    if (ctx->packs != NULL)
+        resolve_pack(ctx);
+    else
+        resolve_file(ctx);
+
+    if (ctx->err != OK)
+        return;
+
+    if (ctx->hot_set != NULL)
+        hot_set_record(ctx->hot_set, ctx->request->requested_file);
+
+    choose_compression(ctx);
+
+    if (client_copy_valid(ctx)) {
+        ctx->not_modified = 1;
+        return;
+    }
+
+    char *range = lookup_str_map(ctx->request->key_value_pairs, "range");
+
+    if (range != NULL && if_range_matches(ctx))
+        ctx->n_ranges = parse_range(range, ctx->f_stats.st_size, ctx->ranges, MAX_RANGES);
+}
+
+/*
+ * Checks if the body of the response is sent from memory: the file, or
+ * the compressed copy the client gets, is in its cache.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns:
+ * - 1 if the body is cached.
+ * - 0 otherwise.
+ */
+static
+int body_cached(RequestCtx *ctx) {
+    if (ctx->compress) {
+        char key[PATH_MAX + 16];
+        compressed_key(ctx, key, sizeof(key));
+
+        return file_cache_contains(ctx->compress_cache, key, &ctx->f_stats);
+    }
+
+    return ctx->n_ranges == 0 && ctx->file_cache != NULL &&
+           file_cache_cacheable(ctx->file_cache, &ctx->f_stats) &&
+           file_cache_contains(ctx->file_cache, ctx->file_rel_path, &ctx->f_stats);
+}
+
+/*
+ * Checks if writing the response would block on the disk: the response
+ * must read the file, rather than a cached copy, and the first bytes it
+ * reads must be missing from the page cache.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns:
+ * - 1 if the response belongs to the disk pool.
+ * - 0 otherwise.
+ */
+static
+int body_cold(RequestCtx *ctx) {
+    if (ctx->err != OK || ctx->not_modified || ctx->n_ranges == RANGE_UNSATISFIABLE || body_cached(ctx))
+        return 0;
+
+    off_t offset = ctx->n_ranges > 0 ? ctx->ranges[0].start : 0;
+
+    return disk_pool_probe(ctx->disk_pool, ctx->file, ctx->body_offset + offset,
+                           ctx->body_offset + ctx->f_stats.st_size);
+}
+
+/*
+ * Checks if the body of the response falls under the rate limits, so it
+ * must be sent by the shaping pool.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns:
+ * - 1 if the response belongs to the shaping pool.
+ * - 0 otherwise.
+ */
+static
+int body_shaped(RequestCtx *ctx) {
+    if (ctx->err != OK || ctx->not_modified || ctx->n_ranges == RANGE_UNSATISFIABLE)
+        return 0;
+
+    size_t len = ctx->f_stats.st_size;
+
+    if (ctx->n_ranges > 0) {
+        len = 0;
+
+        for (int i = 0; i < ctx->n_ranges; ++i)
+            len += ctx->ranges[i].end - ctx->ranges[i].start + 1;
+    }
+
+    return rate_limiter_shapes(ctx->limiter, len);
+}
+
+/*
+ * Writes a response handed to the disk pool or the shaping pool, and drops
+ * the reference of the pool to the request.
+ *
+ * Params:
+ * - void *arg : The RequestCtx.
+ *
+ * Returns: -
+ */
+static
+void respond_deferred(void *arg) {
+    RequestCtx *ctx = (RequestCtx*) arg;
+
+    write_response(ctx);
+    close(ctx->fd);
+
+    request_ctx_free(ctx);
+}
+
+/*
+ * Hands the response over to the disk pool, which takes its own reference
+ * to the request, so the caller frees it as usual.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns:
+ * -  0 if the disk pool will write the response.
+ * - -1 otherwise.
+ */
+static
+int defer_to_disk(RequestCtx *ctx) {
+    __atomic_add_fetch(&ctx->refs, 1, __ATOMIC_RELAXED);
+
+    if (disk_pool_submit(ctx->disk_pool, respond_deferred, ctx) < 0) {
+        __atomic_sub_fetch(&ctx->refs, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Hands the response over to the shaping pool, which takes its own
+ * reference to the request, so the caller frees it as usual.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are responding to.
+ *
+ * Returns:
+ * -  0 if the shaping pool will write the response.
+ * - -1 otherwise.
+ */
+static
+int defer_to_shaper(RequestCtx *ctx) {
+    __atomic_add_fetch(&ctx->refs, 1, __ATOMIC_RELAXED);
+
+    if (rate_limiter_submit(ctx->limiter, respond_deferred, ctx) < 0) {
+        __atomic_sub_fetch(&ctx->refs, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the response that corresponds to the outcome of the previous
+ * steps, and closes the connection. Responses under the rate limits are
+ * handed to the shaping pool, and refused with 503 if it is full, since
+ * shaping them here would hold the worker. Responses that would block on
+ * the disk are handed to the disk pool.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request we are working on.
+ *
+ * Returns: -
+ */
+void request_respond(RequestCtx *ctx) {
+    if (ctx->limiter != NULL && body_shaped(ctx)) {
+        if (defer_to_shaper(ctx) == 0)
+            return;
+
+        ctx->err = SERVICE_UNAVAILABLE;
+    }
+
+    // The limits may change meanwhile, a body sent from here is never shaped
+    ctx->limiter = NULL;
+
+    if (ctx->disk_pool != NULL && body_cold(ctx) && defer_to_disk(ctx) == 0)
+        return;
+
+    write_response(ctx);
+    close(ctx->fd);
+}
+
+/*
+ * Frees all memory occupied by the request context, once the last
+ * reference to it is dropped.
+ *
+ * Params:
+ * - RequestCtx *ctx : The request context to be freed.
+ *
+ * Returns: -
+ */
+void request_ctx_free(RequestCtx *ctx) {
+    if (ctx == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&ctx->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    // The open file, its path and its header belong to the pack or to the
+    // fd cache entry, if there is one
+    if (ctx->pack != NULL)
+        pack_release(ctx->pack);
+    else if (ctx->fd_entry != NULL)
+        fd_cache_release(ctx->fd_entry);
+    else {
+        if (ctx->file >= 0)
+            close(ctx->file);
+
+        free(ctx->file_full_path);
+        free(ctx->header);
+    }
+
+    root_version_release(ctx->root);
+
+    free_request(ctx->request);
+    free(ctx);
+}
+
+/*
+ * Turns a connection away with 503, when the server is too busy to take
+ * it, and closes it. The response fits in an empty socket buffer, so this
+ * does not wait on the client.
+ *
+ * Params:
+ * - int fd : The connection.
+ *
+ * Returns: -
+ */
+void request_reject(int fd) {
+    write_err_response(fd, SERVICE_UNAVAILABLE);
+    close(fd);
+}
+
+/*
+ * The fucnction that the worker threads run, so they can accept
+ * server requests. All the steps of the request are run by the
+ * calling thread.
+ *
+ * Params:
+ * - void *arg : The arguments passed to the function. This void pointer
+ *               will ALWAYS point to a struct of type AcceptArgs.
+ *
+ * Returns: -
+ */
+void accept_http(void *arg) {
+    RequestCtx *ctx = request_ctx_create((AcceptArgs*)arg);
+
+    if (ctx == NULL) {
+        close(((AcceptArgs*)arg)->fd);
+        return;
+    }
+
+    request_parse(ctx);
+    request_resolve(ctx);
+    request_respond(ctx);
+
+    request_ctx_free(ctx);
+}
+
+/*
+ * Warms a path the way a request for it would: the path is resolved,
+ * which fills the index and the fd cache, and the file is loaded into
+ * the file cache if it fits, or read ahead into the page cache.
+ *
+ * Params:
+ * - void *arg        : The AcceptArgs of the warming requests, with no
+ *                      connection.
+ * - const char *path : The requested path.
+ *
+ * Returns:
+ * - The size of the file warmed.
+ * - -1 if the path cannot be served.
+ */
+long request_prewarm(void *arg, const char *path) {
+    RequestCtx *ctx = request_ctx_create((AcceptArgs*) arg);
+
+    if (ctx == NULL)
+        return -1;
+
+    long warmed = -1;
+
+    // The path stands in for a parsed request
+    if (ctx->err != OK || (ctx->request->header = strdup(path)) == NULL)
+        goto EXIT;
+
+    ctx->request->requested_file = ctx->request->header;
+
+    request_resolve(ctx);
+
+    if (ctx->err != OK)
+        goto EXIT;
+
+    warmed = ctx->f_stats.st_size;
+
+    if (ctx->file_cache != NULL && file_cache_cacheable(ctx->file_cache, &ctx->f_stats)) {
+        CacheEntry *entry = get_cache_entry(ctx);
+
+        if (entry != NULL) {
+            file_cache_release(entry);
+            goto EXIT;
+        }
+    }
+
+    readahead(ctx->file, ctx->body_offset, ctx->f_stats.st_size);
+
+EXIT:
+    request_ctx_free(ctx);
+
+    return warmed;
 }
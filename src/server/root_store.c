@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "root_store.h"
+#include "utils.h"
+
+/*
+ * Opens a version of the root directory, and builds its index and its
+ * negative cache, if enabled.
+ *
+ * Params:
+ * - RootStore *store  : The store, holding the settings.
+ * - char *dir         : The resolved root directory. The version takes
+ *                       ownership of it, even on failure.
+ * - unsigned long gen : The number of the version.
+ *
+ * Returns:
+ * - A new version, holding one reference, if no error occurred.
+ * - NULL otherwise.
+ */
+static
+RootVersion *version_open(RootStore *store, char *dir, unsigned long gen) {
+    struct timeval t_start, t_end;
+    gettimeofday(&t_start, NULL);
+
+    RootVersion *root = (RootVersion*) calloc(1, sizeof(RootVersion));
+
+    if (root == NULL) {
+        ERR("Memory allocation during root version creation failed");
+        free(dir);
+        return NULL;
+    }
+
+    root->dir  = dir;
+    root->fd   = -1;
+    root->gen  = gen;
+    root->refs = 1;
+
+    // Check if directory exists and is readable
+    if (check_dir_access(dir) < 0) {
+        P_ERR("Could not access provided root directory", errno);
+        goto FAIL;
+    }
+
+    // Requested files are resolved relative to this fd
+    if ((root->fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        P_ERR("Could not open provided root directory", errno);
+        goto FAIL;
+    }
+
+    if (store->neg_cache_entries > 0)
+        if ((root->neg_cache = neg_cache_create(store->neg_cache_entries, dir, root->fd)) == NULL)
+            goto FAIL;
+
+    // Scanned with the thread pool, once there is one
+    if (store->pool != NULL && store->index)
+        if ((root->ns_index = ns_index_create(store->pool, dir, root->fd, store->bloom)) == NULL)
+            ERR("Failed to build the index, resolving paths on the filesystem");
+
+    gettimeofday(&t_end, NULL);
+
+    root->load_ms = (t_end.tv_sec - t_start.tv_sec) * 1000.0 + (t_end.tv_usec - t_start.tv_usec) / 1000.0;
+
+    return root;
+
+FAIL:
+    if (root->fd >= 0)
+        close(root->fd);
+
+    free(root->dir);
+    free(root);
+    return NULL;
+}
+
+/*
+ * Drops a reference to a version. The last one closes the root and frees
+ * its index and its negative cache.
+ *
+ * Params:
+ * - RootVersion *root : The version.
+ *
+ * Returns: -
+ */
+void root_version_release(RootVersion *root) {
+    if (root == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&root->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    ns_index_destroy(root->ns_index);
+    neg_cache_destroy(root->neg_cache);
+
+    close(root->fd);
+
+    free(root->dir);
+    free(root);
+}
+
+/*
+ * Resolves the root path and opens the first version.
+ *
+ * Params:
+ * - const char *path      : The root path. It is resolved again on every
+ *                           reload, so it may be a symlink that is flipped.
+ * - int neg_cache_entries : The size of the negative cache of every
+ *                           version (0 disables it).
+ *
+ * Returns:
+ * - A new store if no error occurred.
+ * - NULL otherwise.
+ */
+RootStore *root_store_create(const char *path, int neg_cache_entries) {
+    RootStore *store = (RootStore*) calloc(1, sizeof(RootStore));
+
+    if (store == NULL) {
+        ERR("Memory allocation during root store creation failed");
+        return NULL;
+    }
+
+    store->neg_cache_entries = neg_cache_entries;
+
+    char *dir = realpath(path, NULL);
+
+    if (dir == NULL) {
+        P_ERR("Failed to expand root directory path", errno);
+        free(store);
+        return NULL;
+    }
+
+    if ((store->path = strdup(path)) == NULL || (store->current = version_open(store, dir, 1)) == NULL) {
+        free(store->path);
+        free(store);
+        return NULL;
+    }
+
+    int err;
+    if ((err = pthread_mutex_init(&store->lock, NULL))) {
+        P_ERR("Failed to initialize root store mutex", err);
+        root_version_release(store->current);
+        free(store->path);
+        free(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+/*
+ * Indexes the current version, and every version loaded from now on.
+ * Must be called before any request is served.
+ *
+ * Params:
+ * - RootStore *store  : The store.
+ * - thread_pool *pool : The pool scanning the directories.
+ * - int bloom         : Also keep Bloom filters of the paths.
+ *
+ * Returns:
+ * -  0 if the current version is indexed.
+ * - -1 otherwise.
+ */
+int root_store_index(RootStore *store, thread_pool *pool, int bloom) {
+    RootVersion *root = store->current;
+
+    store->pool  = pool;
+    store->index = 1;
+    store->bloom = bloom;
+
+    root->ns_index = ns_index_create(pool, root->dir, root->fd, bloom);
+
+    return root->ns_index != NULL ? 0 : -1;
+}
+
+/*
+ * Takes a reference to the version currently served.
+ *
+ * Params:
+ * - RootStore *store : The store.
+ *
+ * Returns: The version. The caller must release it.
+ */
+RootVersion *root_store_acquire(RootStore *store) {
+    pthread_mutex_lock(&store->lock);
+
+    RootVersion *root = store->current;
+    __atomic_add_fetch(&root->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&store->lock);
+
+    return root;
+}
+
+/*
+ * Resolves the root path again and, if it now leads to another directory,
+ * switches to it. The new version is indexed before the switch. Requests
+ * that already hold the previous version finish with it, new requests get
+ * the new one. The previous version is kept if the new one cannot be
+ * opened.
+ *
+ * Params:
+ * - RootStore *store : The store.
+ *
+ * Returns:
+ * -  1 if a new version is served.
+ * -  0 if the root path still leads to the same directory.
+ * - -1 otherwise.
+ */
+int root_store_reload(RootStore *store) {
+    char *dir = realpath(store->path, NULL);
+
+    if (dir == NULL) {
+        P_ERR("Failed to expand root directory path", errno);
+        return -1;
+    }
+
+    // Only reloads replace the current version, and they are not run
+    // concurrently
+    RootVersion *old = store->current;
+
+    if (!strcmp(dir, old->dir)) {
+        free(dir);
+        return 0;
+    }
+
+    RootVersion *root = version_open(store, dir, old->gen + 1);
+
+    if (root == NULL)
+        return -1;
+
+    pthread_mutex_lock(&store->lock);
+
+    store->current = root;
+
+    pthread_mutex_unlock(&store->lock);
+
+    __atomic_add_fetch(&store->reloads, 1, __ATOMIC_RELAXED);
+
+    root_version_release(old);
+
+    return 1;
+}
+
+/*
+ * Destructor for the store. Must only be called once no request holds a
+ * version.
+ *
+ * Params:
+ * - RootStore *store : The store we want to free.
+ *
+ * Returns: -
+ */
+void root_store_destroy(RootStore *store) {
+    if (store == NULL)
+        return;
+
+    root_version_release(store->current);
+    pthread_mutex_destroy(&store->lock);
+
+    free(store->path);
+    free(store);
+}
@@ -8,7 +8,9 @@
 
 #include "command_manager.h"
 #include "request_manager.h"
+#include "server_manager.h"
 #include "server_types.h"
+#include "pipeline.h"
 #include "utils.h"
 
 #define HTTP 0
@@ -49,6 +51,116 @@ void setup_server_signals() {
     signal(SIGALRM, alarm_handler);
 }
 
+/*
+ * Sets the optional server settings to their defaults.
+ *
+ * Params:
+ * - ServerOptions *options : The options to be initialized.
+ *
+ * Returns: -
+ */
+void init_server_options(ServerOptions *options) {
+    for (int i = 0; i < N_STAGES; ++i)
+        options->stage_threads[i] = 0;
+
+    options->stage_queue_sz = DEFAULT_STAGE_QUEUE_SZ;
+
+    options->cache_bytes      = 0;
+    options->cache_max_object = DEFAULT_CACHE_MAX_OBJECT;
+    options->dedup            = 0;
+
+    options->fd_cache_entries = 0;
+    options->fd_cache_ttl_ms  = DEFAULT_FD_CACHE_TTL_MS;
+
+    options->etag_hash = 0;
+
+    options->sidecars    = 0;
+    options->precompress = 0;
+
+    options->compress             = 0;
+    options->compress_min         = DEFAULT_COMPRESS_MIN;
+    options->compress_cache_bytes = DEFAULT_COMPRESS_CACHE;
+
+    options->disk_threads = 0;
+
+    options->drop_behind_min = 0;
+    options->mmap_send       = 0;
+
+    options->zerocopy_min = 0;
+
+    options->index = 0;
+
+    options->neg_cache_entries = 0;
+    options->bloom             = 0;
+
+    options->state_dir     = NULL;
+    options->warm_interval = DEFAULT_WARM_INTERVAL;
+    options->warm_threads  = DEFAULT_WARM_THREADS;
+
+    options->local_cache_dir    = NULL;
+    options->local_cache_bytes  = DEFAULT_LOCAL_CACHE;
+    options->local_cache_ttl_ms = DEFAULT_LOCAL_CACHE_TTL_MS;
+
+    options->conn_rate    = 0;
+    options->global_rate  = 0;
+    options->rate_burst   = DEFAULT_RATE_BURST;
+    options->rate_threads = DEFAULT_RATE_THREADS;
+
+    options->cache_policy = NULL;
+}
+
+/*
+ * Checks if the options ask for the staged pipeline.
+ *
+ * Returns:
+ * - 1 if every stage has at least one thread.
+ * - 0 otherwise.
+ */
+static
+int pipeline_enabled(ServerOptions *options) {
+    for (int i = 0; i < N_STAGES; ++i)
+        if (options->stage_threads[i] <= 0)
+            return 0;
+
+    return 1;
+}
+
+/*
+ * Fills the arguments of a request with the resources of the server it
+ * needs.
+ *
+ * Params:
+ * - ServerResources *server : The server.
+ * - AcceptArgs *args        : The arguments to fill.
+ * - int fd                  : The connection fd (-1 for a warming request).
+ *
+ * Returns: -
+ */
+static
+void fill_accept_args(ServerResources *server, AcceptArgs *args, int fd) {
+    args->fd         = fd;
+    args->roots      = server->roots;
+    args->stats      = &server->stats;
+    args->file_cache = server->file_cache;
+    args->fd_cache   = server->fd_cache;
+    args->hash_cache = server->hash_cache;
+    args->sidecars   = server->options.sidecars;
+
+    args->compress_cache = server->compress_cache;
+    args->compress_min   = server->options.compress_min;
+    args->disk_pool      = server->disk_pool;
+
+    args->drop_behind_min = server->options.drop_behind_min;
+    args->mmap_send       = server->options.mmap_send;
+    args->zerocopy_min    = server->options.zerocopy_min;
+    args->flights         = server->flights;
+    args->packs           = server->packs;
+    args->hot_set         = server->hot_set;
+    args->local_cache     = server->local_cache;
+    args->limiter         = server->limiter;
+    args->cache_policy    = server->cache_policy;
+}
+
 /*
  * Create a new server and initialize it.
  *
@@ -57,12 +169,13 @@ void setup_server_signals() {
  * - char *c_port  : The command port.
  * - int n_threads : The number of threads we want to have.
  * - char *r_dir   : The root directory.
+ * - ServerOptions *options : Optional settings (see server_types.h).
  *
  * Returns:
  * - A new server if no error occurred.
  * - NULL otherwise.
  */
-ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_dir) {
+ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_dir, ServerOptions *options) {
     ServerResources *server = (ServerResources*) malloc(sizeof(ServerResources));
 
     if (server == NULL) {
@@ -78,6 +191,24 @@ ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_di
     server->serving_port = s_port; 
     server->command_port = c_port; 
 
+    server->options    = *options;
+    server->pipeline   = NULL;
+    server->disk_pool  = NULL;
+    server->roots      = NULL;
+    server->flights    = NULL;
+    server->packs      = NULL;
+    server->file_cache = NULL;
+    server->fd_cache   = NULL;
+    server->hash_cache = NULL;
+
+    server->compress_cache = NULL;
+    server->precompressor  = NULL;
+    server->hot_set        = NULL;
+    server->warm_args      = NULL;
+    server->local_cache    = NULL;
+    server->cache_policy   = NULL;
+    server->limiter        = NULL;
+
     // Set root_dir
     server->root_dir = realpath(r_dir, NULL);
 
@@ -87,17 +218,58 @@ ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_di
         return NULL;
     }
 
-    // Check if directory exists and is readable
-    if (check_dir_access(server->root_dir) < 0) {
-        P_ERR("Could not access provided root directory", errno);
-        free(server->root_dir);
-        free(server);
-        return NULL;
+    struct stat r_stats;
+
+    // A regular file is a pack built by mkpack, served in place of a
+    // directory
+    if (stat(server->root_dir, &r_stats) == 0 && S_ISREG(r_stats.st_mode)) {
+        if ((server->packs = pack_store_create(server->root_dir)) == NULL) {
+            ERR("Could not open provided pack");
+            free(server->root_dir);
+            free(server);
+            return NULL;
+        }
+
+        // Files are looked up, compressed and cached in the pack itself
+        server->options.cache_bytes       = 0;
+        server->options.fd_cache_entries  = 0;
+        server->options.etag_hash         = 0;
+        server->options.sidecars          = 0;
+        server->options.precompress       = 0;
+        server->options.compress          = 0;
+        server->options.index             = 0;
+        server->options.bloom             = 0;
+        server->options.neg_cache_entries = 0;
+        server->options.local_cache_dir   = NULL;
+        server->options.cache_policy      = NULL;
+
+        options = &server->options;
+    }
+    else {
+        // The root path is resolved again on every reload, so a symlink to
+        // the current release can be flipped
+        if ((server->roots = root_store_create(r_dir, options->neg_cache_entries)) == NULL) {
+            free(server->root_dir);
+            free(server);
+            return NULL;
+        }
+
+        // Compiled once, the caching fields are rendered into the headers
+        if (options->cache_policy != NULL && (server->cache_policy = cache_policy_load(options->cache_policy)) == NULL) {
+            root_store_destroy(server->roots);
+            free(server->root_dir);
+            free(server);
+            return NULL;
+        }
     }
 
     // Read current time
     if (gettimeofday(&server->t_start, NULL) < 0) {
         P_ERR("Failed to get startup time", errno);
+        pack_store_destroy(server->packs);
+        root_store_destroy(server->roots);
+        cache_policy_free(server->cache_policy);
+        free(server->root_dir);
         free(server);
         return NULL;
     }
@@ -106,13 +278,98 @@ ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_di
     server->stats.page_count = 0;
     server->stats.byte_count = 0;
 
+    server->stats.dropped_bytes = 0;
+
+    server->stats.zc_sends       = 0;
+    server->stats.zc_bytes       = 0;
+    server->stats.zc_copied      = 0;
+    server->stats.zc_small       = 0;
+    server->stats.zc_unsupported = 0;
+
     int err;
     if ((err = pthread_mutex_init(&server->stats.lock, NULL))) {
         P_ERR("Failed to initialize server stats mutex", err);
+        pack_store_destroy(server->packs);
+        root_store_destroy(server->roots);
+        cache_policy_free(server->cache_policy);
+        free(server->root_dir);
         free(server);
         return NULL;
     }
 
+    // Create the file cache
+    if (options->cache_bytes > 0) {
+        server->file_cache = file_cache_create(options->cache_bytes, options->cache_max_object, options->dedup);
+        server->flights    = single_flight_create();
+
+        if (server->file_cache == NULL || server->flights == NULL) {
+            file_cache_destroy(server->file_cache);
+            single_flight_destroy(server->flights);
+            pack_store_destroy(server->packs);
+            root_store_destroy(server->roots);
+            cache_policy_free(server->cache_policy);
+            pthread_mutex_destroy(&server->stats.lock);
+            free(server->root_dir);
+            free(server);
+            return NULL;
+        }
+    }
+
+    // Create the open file cache
+    if (options->fd_cache_entries > 0) {
+        server->fd_cache = fd_cache_create(options->fd_cache_entries, options->fd_cache_ttl_ms);
+
+        if (server->fd_cache == NULL) {
+            file_cache_destroy(server->file_cache);
+            single_flight_destroy(server->flights);
+            pack_store_destroy(server->packs);
+            root_store_destroy(server->roots);
+            cache_policy_free(server->cache_policy);
+            pthread_mutex_destroy(&server->stats.lock);
+            free(server->root_dir);
+            free(server);
+            return NULL;
+        }
+    }
+
+    // Create the content hash cache
+    if (options->etag_hash) {
+        server->hash_cache = hash_cache_create();
+
+        if (server->hash_cache == NULL) {
+            fd_cache_destroy(server->fd_cache);
+            file_cache_destroy(server->file_cache);
+            single_flight_destroy(server->flights);
+            pack_store_destroy(server->packs);
+            root_store_destroy(server->roots);
+            cache_policy_free(server->cache_policy);
+            pthread_mutex_destroy(&server->stats.lock);
+            free(server->root_dir);
+            free(server);
+            return NULL;
+        }
+    }
+
+    // Create the cache of the files compressed on the fly
+    if (options->compress) {
+        server->compress_cache = file_cache_create(options->compress_cache_bytes, options->cache_max_object,
+                                                   options->dedup);
+
+        if (server->compress_cache == NULL) {
+            hash_cache_destroy(server->hash_cache);
+            fd_cache_destroy(server->fd_cache);
+            file_cache_destroy(server->file_cache);
+            single_flight_destroy(server->flights);
+            pack_store_destroy(server->packs);
+            root_store_destroy(server->roots);
+            cache_policy_free(server->cache_policy);
+            pthread_mutex_destroy(&server->stats.lock);
+            free(server->root_dir);
+            free(server);
+            return NULL;
+        }
+    }
+
     sigset_t sig_set;
 
     setup_server_signals();
@@ -121,11 +378,79 @@ ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_di
     // Create thread pool
     server->thread_pool = thread_pool_create(n_threads, NULL);
 
+    // Create the stage pools, if staged mode was requested
+    if (server->thread_pool != NULL && pipeline_enabled(options))
+        if ((server->pipeline = pipeline_create(options)) == NULL) {
+            thread_pool_destroy(server->thread_pool);
+            server->thread_pool = NULL;
+        }
+
+    // Create the disk I/O pool
+    if (server->thread_pool != NULL && options->disk_threads > 0)
+        if ((server->disk_pool = disk_pool_create(options->disk_threads, options->stage_queue_sz)) == NULL) {
+            pipeline_destroy(server->pipeline);
+            server->pipeline = NULL;
+            thread_pool_destroy(server->thread_pool);
+            server->thread_pool = NULL;
+        }
+
+    // Index the root directory, scanning it with the thread pool
+    if (server->thread_pool != NULL && server->roots != NULL && options->index)
+        if (root_store_index(server->roots, server->thread_pool, options->bloom) < 0)
+            ERR("Failed to build the index, resolving paths on the filesystem");
+
+    // Copy the files of the root to local disk in the background
+    if (server->thread_pool != NULL && options->local_cache_dir != NULL)
+        if ((server->local_cache = local_cache_create(options->local_cache_dir, options->local_cache_bytes,
+                                                      options->local_cache_ttl_ms)) == NULL)
+            ERR("Failed to create the local cache, serving from the root only");
+
+    // Shape the response bodies, with limits the command port may change
+    if ((server->limiter = rate_limiter_create(options->conn_rate, options->global_rate, options->rate_burst,
+                                               options->rate_threads, options->stage_queue_sz)) == NULL)
+        ERR("Failed to create the rate limiter, bodies are not shaped");
+
+    // Warm the paths that were hot before the restart, while serving
+    if (server->thread_pool != NULL && options->state_dir != NULL) {
+        server->hot_set   = hot_set_create(options->state_dir, options->warm_interval);
+        server->warm_args = (AcceptArgs*) malloc(sizeof(AcceptArgs));
+
+        // Warming requests are not counted as hits
+        if (server->warm_args != NULL) {
+            fill_accept_args(server, server->warm_args, -1);
+            server->warm_args->hot_set = NULL;
+        }
+
+        if (server->hot_set == NULL || server->warm_args == NULL ||
+            hot_set_start(server->hot_set, options->warm_threads, request_prewarm, server->warm_args) < 0) {
+            ERR("Failed to load the hot set, starting cold");
+            hot_set_destroy(server->hot_set);
+            free(server->warm_args);
+            server->hot_set   = NULL;
+            server->warm_args = NULL;
+        }
+    }
+
+    // Compress the root directory in the background
+    if (server->thread_pool != NULL && options->precompress)
+        if ((server->precompressor = precompress_start(server->thread_pool, server->root_dir)) == NULL)
+            ERR("Failed to start precompressing, serving the existing copies only");
+
     unblock_thread_signals(&sig_set);
 
     if (server->thread_pool == NULL) {
         ERR("Thread pool creation failed");
+        rate_limiter_destroy(server->limiter);
+        pack_store_destroy(server->packs);
+        root_store_destroy(server->roots);
+        cache_policy_free(server->cache_policy);
+        file_cache_destroy(server->compress_cache);
+        hash_cache_destroy(server->hash_cache);
+        fd_cache_destroy(server->fd_cache);
+        file_cache_destroy(server->file_cache);
+        single_flight_destroy(server->flights);
         pthread_mutex_destroy(&server->stats.lock);
+        free(server->root_dir);
         free(server);
         return NULL;
     }
@@ -133,8 +458,78 @@ ServerResources *server_create(int s_port, int c_port, int n_threads, char *r_di
     fprintf(stderr, "Server parameters and thread pool intialized\n");
     fprintf(stderr, "Root Directory : %s\n", server->root_dir);
 
+    if (server->packs != NULL)
+        fprintf(stderr, "Pack : %u bodies, %u paths, %zu bytes\n", server->packs->current->header->n_records,
+                                                                   server->packs->current->header->n_keys,
+                                                                   server->packs->current->size);
+
     fprintf(stderr, "HTTP port : %d   CMD port : %d\n", server->serving_port, server->command_port);
 
+    if (server->file_cache != NULL)
+        fprintf(stderr, "File cache : %zu bytes, objects up to %zu bytes%s\n", options->cache_bytes, options->cache_max_object,
+                                                                            options->dedup ? ", deduplicated" : "");
+
+    if (server->fd_cache != NULL)
+        fprintf(stderr, "Fd cache : %d files, %ld ms ttl\n", options->fd_cache_entries, options->fd_cache_ttl_ms);
+
+    if (server->hash_cache != NULL)
+        fprintf(stderr, "ETags : content hash\n");
+
+    if (options->sidecars)
+        fprintf(stderr, "Precompressed copies : served%s\n", server->precompressor != NULL ? ", creating .gz" : "");
+
+    if (server->compress_cache != NULL)
+        fprintf(stderr, "Compression : files from %ld bytes, %zu bytes of compressed copies\n", options->compress_min,
+                                                                                           options->compress_cache_bytes);
+
+    if (options->drop_behind_min > 0)
+        fprintf(stderr, "Drop behind : files from %ld bytes\n", options->drop_behind_min);
+
+    if (options->mmap_send)
+        fprintf(stderr, "Large files : sent from a mapping\n");
+
+    if (options->zerocopy_min > 0)
+        fprintf(stderr, "Zero copy : bodies in memory from %ld bytes\n", options->zerocopy_min);
+
+    NsIndex *ns_index = server->roots != NULL ? server->roots->current->ns_index : NULL;
+
+    if (ns_index != NULL)
+        fprintf(stderr, "Index : %zu files, %zu dirs, %zu bytes, scanned in %.3f ms\n", ns_index->n_files,
+                                                                                   ns_index->n_dirs,
+                                                                                   ns_index->bytes,
+                                                                                   ns_index->scan_ms);
+
+    if (ns_index != NULL && ns_index->bloom != NULL)
+        fprintf(stderr, "Index Bloom filters : %zu bits each\n", ns_index->bloom_bits);
+
+    if (server->roots != NULL && server->roots->current->neg_cache != NULL)
+        fprintf(stderr, "Negative cache : %d paths\n", options->neg_cache_entries);
+
+    if (server->local_cache != NULL)
+        fprintf(stderr, "Local cache : %s, %zu bytes, originals checked every %ld ms\n", options->local_cache_dir,
+                                                                                       options->local_cache_bytes,
+                                                                                       options->local_cache_ttl_ms);
+
+    if (options->conn_rate > 0 || options->global_rate > 0)
+        fprintf(stderr, "Rate limits : %ld bytes/s per connection, %ld bytes/s in total, after %ld bytes, "
+                        "%d shaping threads\n",
+                options->conn_rate, options->global_rate, options->rate_burst, options->rate_threads);
+
+    if (server->cache_policy != NULL)
+        fprintf(stderr, "Cache policy : %s, %d rules\n", options->cache_policy, server->cache_policy->n_rules);
+
+    if (server->hot_set != NULL)
+        fprintf(stderr, "Hot set : %s, saved every %d s, warming %d paths with %d idle threads\n",
+                server->hot_set->state_path, options->warm_interval, server->hot_set->n_warm, options->warm_threads);
+
+    if (server->disk_pool != NULL)
+        fprintf(stderr, "Disk pool : %d threads\n", options->disk_threads);
+
+    if (server->pipeline != NULL)
+        fprintf(stderr, "Staged mode : parse %d, resolve %d, send %d threads\n", options->stage_threads[STAGE_PARSE],
+                                                                                 options->stage_threads[STAGE_RESOLVE],
+                                                                                 options->stage_threads[STAGE_SEND]);
+
     return server;
 }
 
@@ -159,9 +554,44 @@ void free_server(ServerResources *server) {
     if (server->root_dir != NULL)
         free(server->root_dir);
 
+    // Drop the compression tasks that did not start yet, and stop warming
+    precompress_cancel(server->precompressor);
+    hot_set_stop_warming(server->hot_set);
+
+    // Drain and destroy the stage pools
+    pipeline_destroy(server->pipeline);
+
     // Destroy thread pool
     thread_pool_destroy(server->thread_pool);
 
+    // The network workers are gone, write the responses left to the disk pool
+    disk_pool_destroy(server->disk_pool);
+
+    // And those left to the shaping pool, at full speed
+    rate_limiter_destroy(server->limiter);
+
+    // No request is counted anymore, save the hot set one last time
+    hot_set_destroy(server->hot_set);
+    free(server->warm_args);
+
+    // Stop copying, and remove the local copies
+    local_cache_destroy(server->local_cache);
+
+    // No response is sent from the pack anymore
+    pack_store_destroy(server->packs);
+
+    // Stop following the root directory
+    root_store_destroy(server->roots);
+
+    // No request is running anymore, drop the cached files
+    file_cache_destroy(server->file_cache);
+    single_flight_destroy(server->flights);
+    fd_cache_destroy(server->fd_cache);
+    hash_cache_destroy(server->hash_cache);
+    file_cache_destroy(server->compress_cache);
+    precompress_free(server->precompressor);
+    cache_policy_free(server->cache_policy);
+
     // Free stats mutex
     pthread_mutex_destroy(&server->stats.lock);
 
@@ -338,6 +768,18 @@ char server_run(ServerResources *server) {
             if ((fd = accept(sockets[HTTP].fd, NULL, NULL)) < 0) {
                 P_ERR("Error accepting connection", errno);
             }
+            else if (server->pipeline != NULL) {
+                P_DEBUG("Incoming fd : %d\n", fd);
+
+                AcceptArgs params;
+                fill_accept_args(server, &params, fd);
+
+                // Never wait for room here, it would stall the command port
+                if (pipeline_submit(server->pipeline, &params) < 0) {
+                    P_DEBUG("Pipeline busy, refusing fd : %d\n", fd);
+                    request_reject(fd);
+                }
+            }
             else {
                 P_DEBUG("Incoming fd : %d\n", fd);
                 // Allocate int to pass to thread
@@ -348,9 +790,7 @@ char server_run(ServerResources *server) {
                 }
                 else {
                     // Prepare parameters to be passed to handler function
-                    params->fd       = fd;
-                    params->root_dir = server->root_dir;
-                    params->stats    = &server->stats;
+                    fill_accept_args(server, params, fd);
 
                     if (thread_pool_add(server->thread_pool, accept_http, NULL, params) < 0) {
                         free(params);
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "single_flight.h"
+#include "utils.h"
+
+// Checks if a flight loads the given version of the file.
+static
+int same_version(Flight *flight, struct stat *f_stats) {
+    return flight->dev == f_stats->st_dev &&
+           flight->ino == f_stats->st_ino &&
+           flight->size == f_stats->st_size &&
+           flight->mtime.tv_sec == f_stats->st_mtim.tv_sec &&
+           flight->mtime.tv_nsec == f_stats->st_mtim.tv_nsec;
+}
+
+/*
+ * Drops a reference to the flight, and frees it once no references are
+ * left, along with the reference it holds on the loaded entry. The lock
+ * must be held.
+ */
+static
+void flight_release(Flight *flight) {
+    if (--flight->refs > 0)
+        return;
+
+    file_cache_release(flight->entry);
+    pthread_cond_destroy(&flight->landed);
+
+    free(flight->key);
+    free(flight);
+}
+
+/*
+ * Creates the table of the loads in flight.
+ *
+ * Returns:
+ * - A new table if no error occurred.
+ * - NULL otherwise.
+ */
+SingleFlight *single_flight_create(void) {
+    SingleFlight *sf = (SingleFlight*) calloc(1, sizeof(SingleFlight));
+
+    if (sf == NULL) {
+        ERR("Memory allocation during single flight creation failed");
+        return NULL;
+    }
+
+    int err;
+    if ((err = pthread_mutex_init(&sf->lock, NULL))) {
+        P_ERR("Failed to initialize single flight mutex", err);
+        free(sf);
+        return NULL;
+    }
+
+    return sf;
+}
+
+/*
+ * Joins the load of a file version, or starts it if none is in flight.
+ * The leader must land the flight, and every follower must wait on it.
+ *
+ * Params:
+ * - SingleFlight *sf     : The table of the loads in flight.
+ * - char *key            : The canonical path of the file.
+ * - struct stat *f_stats : The version of the file.
+ * - int *leader          : Set to 1 if the caller must load the file,
+ *                          0 if it must wait for the load.
+ *
+ * Returns:
+ * - The flight.
+ * - NULL if no flight could be created; the caller loads the file alone.
+ */
+Flight *single_flight_join(SingleFlight *sf, char *key, struct stat *f_stats, int *leader) {
+    uint64_t hash = hash_string(key);
+
+    *leader = 1;
+
+    pthread_mutex_lock(&sf->lock);
+
+    Flight *flight = sf->buckets[hash % SF_BUCKETS];
+
+    while (flight != NULL && !(flight->hash == hash && !strcmp(flight->key, key) && same_version(flight, f_stats)))
+        flight = flight->h_next;
+
+    if (flight != NULL) {
+        *leader = 0;
+
+        flight->refs++;
+        flight->followers++;
+        sf->followers++;
+
+        if (flight->followers > sf->max_followers)
+            sf->max_followers = flight->followers;
+
+        pthread_mutex_unlock(&sf->lock);
+        return flight;
+    }
+
+    // The flight is created under the lock, so a single load starts
+    if ((flight = (Flight*) calloc(1, sizeof(Flight))) == NULL || (flight->key = strdup(key)) == NULL) {
+        P_ERR("Malloc failed for single flight", errno);
+        pthread_mutex_unlock(&sf->lock);
+        free(flight);
+        return NULL;
+    }
+
+    pthread_cond_init(&flight->landed, NULL);
+
+    flight->hash  = hash;
+    flight->dev   = f_stats->st_dev;
+    flight->ino   = f_stats->st_ino;
+    flight->size  = f_stats->st_size;
+    flight->mtime = f_stats->st_mtim;
+    flight->refs  = 1;
+
+    flight->h_next = sf->buckets[hash % SF_BUCKETS];
+    sf->buckets[hash % SF_BUCKETS] = flight;
+
+    sf->loads++;
+    sf->in_flight++;
+
+    pthread_mutex_unlock(&sf->lock);
+
+    return flight;
+}
+
+/*
+ * Waits for the leader to load the file, and drops the reference to the
+ * flight.
+ *
+ * Params:
+ * - SingleFlight *sf : The table of the loads in flight.
+ * - Flight *flight   : The flight joined as a follower.
+ *
+ * Returns:
+ * - The loaded entry, with a reference taken for the caller.
+ * - NULL if the load failed.
+ */
+CacheEntry *single_flight_wait(SingleFlight *sf, Flight *flight) {
+    pthread_mutex_lock(&sf->lock);
+
+    while (!flight->done)
+        pthread_cond_wait(&flight->landed, &sf->lock);
+
+    CacheEntry *entry = flight->entry;
+
+    if (entry != NULL)
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+
+    flight_release(flight);
+
+    pthread_mutex_unlock(&sf->lock);
+
+    return entry;
+}
+
+/*
+ * Publishes the result of a load to the followers, and drops the
+ * reference of the leader to the flight.
+ *
+ * Params:
+ * - SingleFlight *sf  : The table of the loads in flight.
+ * - Flight *flight    : The flight started as the leader.
+ * - CacheEntry *entry : The loaded entry, or NULL if the load failed. The
+ *                       caller keeps its own reference.
+ *
+ * Returns: -
+ */
+void single_flight_land(SingleFlight *sf, Flight *flight, CacheEntry *entry) {
+    pthread_mutex_lock(&sf->lock);
+
+    Flight **link = &sf->buckets[flight->hash % SF_BUCKETS];
+
+    while (*link != flight)
+        link = &(*link)->h_next;
+
+    *link = flight->h_next;
+
+    sf->in_flight--;
+
+    if (entry == NULL)
+        sf->failures++;
+    else
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+
+    flight->entry = entry;
+    flight->done  = 1;
+
+    pthread_cond_broadcast(&flight->landed);
+
+    flight_release(flight);
+
+    pthread_mutex_unlock(&sf->lock);
+}
+
+/*
+ * Synchronized getter for the single flight statistics.
+ *
+ * Params:
+ * - SingleFlight *sf        : The table of the loads in flight.
+ * - SingleFlightStats *dest : The struct we want to copy to.
+ *
+ * Returns: -
+ */
+void get_single_flight_stats(SingleFlight *sf, SingleFlightStats *dest) {
+    pthread_mutex_lock(&sf->lock);
+
+    dest->loads         = sf->loads;
+    dest->followers     = sf->followers;
+    dest->failures      = sf->failures;
+    dest->max_followers = sf->max_followers;
+    dest->in_flight     = sf->in_flight;
+
+    pthread_mutex_unlock(&sf->lock);
+}
+
+/*
+ * Destructor for the table. No load may be in flight.
+ *
+ * Params:
+ * - SingleFlight *sf : The table we want to free.
+ *
+ * Returns: -
+ */
+void single_flight_destroy(SingleFlight *sf) {
+    if (sf == NULL)
+        return;
+
+    pthread_mutex_destroy(&sf->lock);
+
+    free(sf);
+}
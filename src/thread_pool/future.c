@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "future.h"
+
+/*
+ * Allocates and initializes a new future. The future starts with two
+ * references, one for the caller and one for the task that will complete it.
+ *
+ * Returns:
+ * - A pointer to the new future, if no error occured.
+ * - NULL otherwise.
+ */
+static
+task_future *future_create(void) {
+    task_future *future = (task_future*) malloc(sizeof(task_future));
+
+    if (future == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&future->lock, NULL)) {
+        fprintf(stderr, "Failed to intialize future mutex\n");
+        free(future);
+        return NULL;
+    }
+
+    if (pthread_cond_init(&future->completed, NULL)) {
+        fprintf(stderr, "Failed to intialize future condition variable\n");
+        pthread_mutex_destroy(&future->lock);
+        free(future);
+        return NULL;
+    }
+
+    future->done       = 0;
+    future->refs       = 2;
+    future->conts_head = NULL;
+    future->conts_tail = NULL;
+
+    return future;
+}
+
+static void future_dispatch(future_cont *cont);
+
+/*
+ * Marks a future as completed, wakes up any waiters and delivers all
+ * the continuations that were attached to it.
+ *
+ * Params:
+ * - task_future *future : The future that completed.
+ *
+ * Returns: -
+ */
+static
+void future_complete(task_future *future) {
+    pthread_mutex_lock(&future->lock);
+
+    future->done = 1;
+
+    // Detach the continuation list, no more continuations will be appended
+    future_cont *cont = future->conts_head;
+    future->conts_head = NULL;
+    future->conts_tail = NULL;
+
+    pthread_cond_broadcast(&future->completed);
+
+    pthread_mutex_unlock(&future->lock);
+
+    // Deliver continuations in the order they were attached
+    while (cont != NULL) {
+        future_cont *next = cont->next;
+        future_dispatch(cont);
+        cont = next;
+    }
+}
+
+/*
+ * The handler that runs every future-backed task. It runs the user handler,
+ * frees its arguments the same way the thread pool would, and then completes
+ * the future of the task.
+ *
+ * Params:
+ * - void *arg : A pointer to the future_cont describing the task.
+ *
+ * Returns: -
+ */
+static
+void future_run(void *arg) {
+    future_cont *cont = (future_cont*) arg;
+
+    cont->task.handler(cont->task.args);
+
+    if (cont->task.destructor == NULL)
+        free(cont->task.args);
+    else
+        cont->task.destructor(cont->task.args);
+
+    future_complete(cont->future);
+    future_release(cont->future);
+}
+
+/*
+ * Delivers a continuation to its target queue. If there is no target, or
+ * the target queue could not accept the task, the continuation is run
+ * inline by the calling thread.
+ *
+ * Params:
+ * - future_cont *cont : The continuation to deliver.
+ *
+ * Returns: -
+ */
+static
+void future_dispatch(future_cont *cont) {
+    if (cont->target != NULL) {
+        task wrapper;
+        wrapper.handler    = future_run;
+        wrapper.destructor = NULL;
+        wrapper.args       = cont;
+
+        if (task_queue_put(cont->target, &wrapper) == 0)
+            return;
+
+        fprintf(stderr, "Failed to deliver continuation, running it inline\n");
+    }
+
+    future_run(cont);
+    free(cont);
+}
+
+/*
+ * Allocates a continuation node for the specified task.
+ *
+ * Returns:
+ * - A pointer to the new node, if no error occured.
+ * - NULL otherwise.
+ */
+static
+future_cont *future_cont_create(task_queue *target, void (*handler)(void*), void (*destructor)(void*), void *args) {
+    future_cont *cont = (future_cont*) malloc(sizeof(future_cont));
+
+    if (cont == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    cont->future = future_create();
+
+    if (cont->future == NULL) {
+        free(cont);
+        return NULL;
+    }
+
+    cont->task.handler    = handler;
+    cont->task.destructor = destructor;
+    cont->task.args       = args;
+    cont->target          = target;
+    cont->next            = NULL;
+
+    return cont;
+}
+
+/*
+ * Adds a new task into the thread pool, and returns a future that
+ * completes once the task has finished. The arguments are freed exactly
+ * like in thread_pool_add.
+ *
+ * Params:
+ * - thread_pool *pool         : The thread pool that will run the task.
+ * - void (*handler)(void*)    : The function that we want the thread pool to run.
+ * - void (*destructor)(void*) : The function that will be called to free the arguments.
+ * - void *args                : The arguments that will be passed to the handler.
+ *
+ * Returns:
+ * - A future for the task, that must be released with future_release.
+ * - NULL if an error occured; the arguments are left untouched.
+ */
+task_future *thread_pool_submit(thread_pool *pool, void (*handler)(void*), void (*destructor)(void*), void *args) {
+    future_cont *cont = future_cont_create(&pool->task_queue, handler, destructor, args);
+
+    if (cont == NULL)
+        return NULL;
+
+    task_future *future = cont->future;
+
+    task wrapper;
+    wrapper.handler    = future_run;
+    wrapper.destructor = NULL;
+    wrapper.args       = cont;
+
+    if (task_queue_put(&pool->task_queue, &wrapper) < 0) {
+        fprintf(stderr, "Failed to add task\n");
+        future_release(future);
+        future_release(future);
+        free(cont);
+        return NULL;
+    }
+
+    return future;
+}
+
+/*
+ * Attaches a continuation to a future. When the future completes, the
+ * continuation is delivered to the specified queue. If the queue is NULL,
+ * the continuation runs inline, on the thread that completed the future.
+ * If the future has already completed, the continuation is delivered
+ * immediately.
+ *
+ * Params:
+ * - task_future *future       : The future we want to chain onto.
+ * - task_queue *queue         : The queue the continuation will be delivered to.
+ * - void (*handler)(void*)    : The continuation function.
+ * - void (*destructor)(void*) : The function that will be called to free the arguments.
+ * - void *args                : The arguments that will be passed to the handler.
+ *
+ * Returns:
+ * - A future for the continuation, that must be released with future_release.
+ * - NULL if an error occured; the arguments are left untouched.
+ */
+task_future *future_then_queue(task_future *future, task_queue *queue, void (*handler)(void*), void (*destructor)(void*), void *args) {
+    future_cont *cont = future_cont_create(queue, handler, destructor, args);
+
+    if (cont == NULL)
+        return NULL;
+
+    task_future *next = cont->future;
+
+    pthread_mutex_lock(&future->lock);
+
+    if (!future->done) {
+        if (future->conts_tail == NULL)
+            future->conts_head = cont;
+        else
+            future->conts_tail->next = cont;
+
+        future->conts_tail = cont;
+
+        pthread_mutex_unlock(&future->lock);
+        return next;
+    }
+
+    pthread_mutex_unlock(&future->lock);
+
+    // Already completed, deliver right away
+    future_dispatch(cont);
+
+    return next;
+}
+
+/*
+ * Same as future_then_queue, but the continuation is delivered to the
+ * queue of a thread pool.
+ *
+ * Params:
+ * - task_future *future       : The future we want to chain onto.
+ * - thread_pool *pool         : The pool that will run the continuation (NULL
+ *                               runs it inline).
+ * - void (*handler)(void*)    : The continuation function.
+ * - void (*destructor)(void*) : The function that will be called to free the arguments.
+ * - void *args                : The arguments that will be passed to the handler.
+ *
+ * Returns:
+ * - A future for the continuation, that must be released with future_release.
+ * - NULL if an error occured; the arguments are left untouched.
+ */
+task_future *future_then(task_future *future, thread_pool *pool, void (*handler)(void*), void (*destructor)(void*), void *args) {
+    return future_then_queue(future, pool == NULL ? NULL : &pool->task_queue, handler, destructor, args);
+}
+
+/*
+ * Checks if a future has completed, without blocking.
+ *
+ * Returns:
+ * - 1 if the future has completed.
+ * - 0 otherwise.
+ */
+int future_is_done(task_future *future) {
+    pthread_mutex_lock(&future->lock);
+    int done = future->done;
+    pthread_mutex_unlock(&future->lock);
+
+    return done;
+}
+
+/*
+ * Blocks until the future completes.
+ *
+ * A worker must never wait on a future whose task is queued on its own
+ * pool, since all the workers may end up waiting.
+ *
+ * Params:
+ * - task_future *future : The future we are waiting on.
+ *
+ * Returns: -
+ */
+void future_wait(task_future *future) {
+    pthread_mutex_lock(&future->lock);
+
+    while (!future->done)
+        pthread_cond_wait(&future->completed, &future->lock);
+
+    pthread_mutex_unlock(&future->lock);
+}
+
+/*
+ * Drops a reference to the future, and frees it once no references
+ * are left. Releasing a future does not cancel its task.
+ *
+ * Params:
+ * - task_future *future : The future we want to release.
+ *
+ * Returns: -
+ */
+void future_release(task_future *future) {
+    if (future == NULL)
+        return;
+
+    pthread_mutex_lock(&future->lock);
+    int refs = --future->refs;
+    pthread_mutex_unlock(&future->lock);
+
+    if (refs > 0)
+        return;
+
+    pthread_mutex_destroy(&future->lock);
+    pthread_cond_destroy(&future->completed);
+    free(future);
+}
@@ -8,16 +8,20 @@
  *
  * Params:
  * - task_queue *task_queue : The task queue to be initialized.
+ * - int max_tasks          : The maximum number of queued tasks. Producers
+ *                            block while the queue is full. If it is zero,
+ *                            the queue is unbounded.
  *
  * Returns:
  *  0 if no error occured.
  * -1 otherwise.
  */
-int task_queue_init(task_queue *task_queue) {
+int task_queue_init(task_queue *task_queue, int max_tasks) {
     // Initialize basic fields
-    task_queue->n_tasks = 0;
-    task_queue->head    = NULL;
-    task_queue->tail    = NULL;
+    task_queue->n_tasks   = 0;
+    task_queue->max_tasks = max_tasks;
+    task_queue->head      = NULL;
+    task_queue->tail      = NULL;
 
     // Initialize locks and condition variables
     int err;
@@ -26,9 +30,16 @@ int task_queue_init(task_queue *task_queue) {
         return -1;
     }
 
+    if ((err = pthread_cond_init(&task_queue->queue_not_full, NULL))){
+        fprintf(stderr, "Failed to intialize condition variable\n");
+        pthread_cond_destroy(&task_queue->queue_available);
+        return -1;
+    }
+
     if ((err = pthread_mutex_init(&task_queue->queue_rwlock, NULL))){ 
         fprintf(stderr, "Failed to intialize rw mutex\n");
         pthread_cond_destroy(&task_queue->queue_available);
+        pthread_cond_destroy(&task_queue->queue_not_full);
         return -1;
     }
 
@@ -63,6 +74,10 @@ task_q_node *task_queue_get(task_queue *task_queue) {
         task_queue->n_tasks--;
     }
 
+    // Wake up a producer waiting for space in a bounded queue
+    if (task_queue->max_tasks > 0)
+        pthread_cond_signal(&task_queue->queue_not_full);
+
     return ret;
 }
 
@@ -72,12 +87,15 @@ task_q_node *task_queue_get(task_queue *task_queue) {
  * Params:
  * - task_queue *task_queue : The task queue we want to insert into.
  * - task *task             : The task we want to insert.
+ * - int wait               : Wait for room if the queue is bounded and full.
  *
  * Returns:
  * -  0 if no error occured.
+ * -  1 if the queue is full, and we did not wait.
  * - -1 otherwise.
  */
-int task_queue_put(task_queue *task_queue, task *task) {
+static
+int task_queue_insert(task_queue *task_queue, task *task, int wait) {
     // Allocate memory for the new queue node.
     task_q_node *new_node = (task_q_node*) malloc(sizeof(task_q_node));
 
@@ -95,6 +113,17 @@ int task_queue_put(task_queue *task_queue, task *task) {
     // Lock queue
     pthread_mutex_lock(&task_queue->queue_rwlock);
 
+    // Wait for room in a bounded queue
+    while (task_queue->max_tasks > 0 && task_queue->n_tasks >= task_queue->max_tasks) {
+        if (!wait) {
+            pthread_mutex_unlock(&task_queue->queue_rwlock);
+            free(new_node);
+            return 1;
+        }
+
+        pthread_cond_wait(&task_queue->queue_not_full, &task_queue->queue_rwlock);
+    }
+
     // Insert into queue
     if (task_queue->n_tasks == 0) {
         task_queue->head = new_node;
@@ -117,6 +146,39 @@ int task_queue_put(task_queue *task_queue, task *task) {
     return 0;
 }
 
+/*
+ * Inserts a new task in the task queue. If the queue is bounded and
+ * full, the caller blocks until a consumer makes room.
+ *
+ * Params:
+ * - task_queue *task_queue : The task queue we want to insert into.
+ * - task *task             : The task we want to insert.
+ *
+ * Returns:
+ * -  0 if no error occured.
+ * - -1 otherwise.
+ */
+int task_queue_put(task_queue *task_queue, task *task) {
+    return task_queue_insert(task_queue, task, 1);
+}
+
+/*
+ * Inserts a new task in the task queue, without ever blocking. Used by
+ * callers that must not stall, such as the accept loop.
+ *
+ * Params:
+ * - task_queue *task_queue : The task queue we want to insert into.
+ * - task *task             : The task we want to insert.
+ *
+ * Returns:
+ * -  0 if no error occured.
+ * -  1 if the queue is bounded and full.
+ * - -1 otherwise.
+ */
+int task_queue_try_put(task_queue *task_queue, task *task) {
+    return task_queue_insert(task_queue, task, 0);
+}
+
 /*
  * Frees all resources associated with a task queue.
  *
@@ -128,4 +190,5 @@ int task_queue_put(task_queue *task_queue, task *task) {
 void task_queue_free(task_queue *queue) {
     pthread_mutex_destroy(&queue->queue_rwlock);
     pthread_cond_destroy(&queue->queue_available);
+    pthread_cond_destroy(&queue->queue_not_full);
 }
@@ -14,11 +14,28 @@ static void* thread_run(void *t_pool);
 static int test_kill = 1;
 #endif
 
+/*
+ * Allocates memory and intializes a thread_pool with an unbounded task queue.
+ *
+ * Params:
+ * - int n_workers                   : The number of workers threads we want to have.
+ * - void (*inactive_callback)(void) : See thread_pool_create_bounded.
+ *
+ * Returns:
+ * - A pointer to the new thread pool we created, if no error occured.
+ * - NULL otherwise.
+ */
+thread_pool *thread_pool_create(int n_workers, void (*inactive_callback)(void)) {
+    return thread_pool_create_bounded(n_workers, 0, inactive_callback);
+}
+
 /*
  * Allocates memory and intializes a thread_pool.
  *
  * Params:
  * - int n_workers                   : The number of workers threads we want to have.
+ * - int max_tasks                   : The capacity of the task queue. Adding a task to
+ *                                     a full queue blocks. Zero means unbounded.
  * - void (*inactive_callback)(void) : The function that will be called when the thread
  *                                     pool becomes in active. 
  *                                     The thread pool is said to be inactive, when the 
@@ -28,7 +45,7 @@ static int test_kill = 1;
  * - A pointer to the new thread pool we created, if no error occured.
  * - NULL otherwise.
  */
-thread_pool *thread_pool_create(int n_workers, void (*inactive_callback)(void)) {
+thread_pool *thread_pool_create_bounded(int n_workers, int max_tasks, void (*inactive_callback)(void)) {
     int err;
 
     thread_pool *threadpool = (thread_pool*) malloc(sizeof(thread_pool));
@@ -38,7 +55,7 @@ thread_pool *thread_pool_create(int n_workers, void (*inactive_callback)(void))
         return NULL;
     }
 
-    if (task_queue_init(&threadpool->task_queue) < 0) {
+    if (task_queue_init(&threadpool->task_queue, max_tasks) < 0) {
         fprintf(stderr, "Task queue init failed\n");
         return NULL;
     }
@@ -104,6 +121,35 @@ int thread_pool_add(thread_pool *threadpool, void (*handler)(void*), void (*dest
     return 0;
 }
 
+/*
+ * Add a new task into the thread pool, unless its queue is full. Never
+ * blocks.
+ *
+ * Params:
+ * - void (*handler)(void*)    : The function that we want the thread pool to run.
+ * - void (*destructor)(void*) : The function that the thread pool will call, to free the arguments.
+ * - void *args                : The arguments that will be passed to the handler.
+ *
+ * Returns:
+ * -  0 if no error occured.
+ * -  1 if the queue is full; the arguments are left untouched.
+ * - -1 otherwise.
+ */
+int thread_pool_try_add(thread_pool *threadpool, void (*handler)(void*), void (*destructor)(void*), void *args){
+    // Prepare task struct
+    task wrapper;
+    wrapper.handler = handler;
+    wrapper.args    = args;
+    wrapper.destructor = destructor;
+
+    int status = task_queue_try_put(&threadpool->task_queue, &wrapper);
+
+    if (status < 0)
+        fprintf(stderr, "Failed to add task\n");
+
+    return status;
+}
+
 /*
  * Looping function that all worker threads run.
  *
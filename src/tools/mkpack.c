@@ -0,0 +1,778 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "pack.h"
+#include "encoding.h"
+#include "http_date.h"
+#include "http_types.h"
+#include "mime_types.h"
+#include "response_messages.h"
+#include "cache_policy.h"
+#include "hash.h"
+
+// Files smaller than this are not worth a gzip copy
+#define GZIP_MIN_SZ 256
+
+// Average number of paths per bucket of the perfect hash, and the largest
+// displacement tried before the slot table is grown
+#define KEYS_PER_BUCKET  4
+#define MAX_DISPLACEMENT (1 << 20)
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+// A path of the pack, and the record it points at.
+typedef struct {
+    uint64_t key_off;
+    uint32_t key_len;
+    uint32_t record;
+    uint64_t hash;
+} Key;
+
+typedef struct {
+    int out;
+    off_t offset;
+
+    // Strings, with offsets relative to the start of the buffer until the
+    // pack is written out
+    Buffer strings;
+
+    PackRecord *records;
+    uint32_t n_records;
+
+    Key *keys;
+    uint32_t n_keys;
+
+    unsigned long long n_gzip;
+    unsigned long long body_bytes;
+
+    // Caching fields of the headers (NULL if none)
+    CachePolicy *policy;
+} Packer;
+
+void print_usage() {
+    fprintf(stderr, "Usage : ./mkpack <root_dir> <pack_file> [cache_policy]\n");
+    fprintf(stderr, "Packs every regular file under root_dir, symbolic links excluded.\n");
+    fprintf(stderr, "The headers carry the caching fields of cache_policy, as with --cache-policy.\n");
+    fprintf(stderr, "The pack is written next to pack_file, and renamed over it once complete.\n");
+}
+
+// Grows an array of n elements of size sz, so it holds at least n + 1 of
+// them. Capacities are powers of two, starting at 16.
+static
+int reserve(void **array, uint32_t n, size_t sz) {
+    if (n != 0 && (n < 16 || (n & (n - 1))))
+        return 0;
+
+    void *grown = realloc(*array, (n == 0 ? 16 : (size_t) n * 2) * sz);
+
+    if (grown == NULL)
+        return -1;
+
+    *array = grown;
+    return 0;
+}
+
+/*
+ * Appends bytes to a buffer.
+ *
+ * Returns:
+ * - The offset of the bytes in the buffer.
+ * - -1 if the buffer could not grow.
+ */
+static
+long long buffer_add(Buffer *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap == 0 ? 4096 : buf->cap;
+
+        while (cap < buf->len + len)
+            cap *= 2;
+
+        char *grown = realloc(buf->data, cap);
+
+        if (grown == NULL)
+            return -1;
+
+        buf->data = grown;
+        buf->cap  = cap;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return buf->len - len;
+}
+
+// Rounds an offset up to a multiple of align.
+static
+off_t align_up(off_t offset, off_t align) {
+    return (offset + align - 1) / align * align;
+}
+
+/*
+ * Appends a body to the pack. Bodies of a page or more start on a page
+ * boundary, so they can be mapped and sent page by page.
+ *
+ * Returns:
+ * - The offset of the body.
+ * - -1 if it could not be written.
+ */
+static
+off_t write_body(Packer *packer, const char *data, size_t len) {
+    off_t offset = align_up(packer->offset, len >= PACK_ALIGN ? PACK_ALIGN : 8);
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pwrite(packer->out, data + done, len - done, offset + done);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        done += n;
+    }
+
+    packer->offset      = offset + len;
+    packer->body_bytes += len;
+
+    return offset;
+}
+
+/*
+ * Deflates a body into a new buffer, in gzip format.
+ *
+ * Returns:
+ * - The compressed copy, and its length in out_len.
+ * - NULL if it could not be compressed.
+ */
+static
+char *gzip_body(const char *data, size_t len, size_t *out_len) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    // 15 bits of window, plus 16 for a gzip header and trailer
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    // Room for the gzip header and trailer on top of the deflate bound
+    size_t cap = deflateBound(&stream, len) + 32;
+    char *out  = malloc(cap);
+
+    if (out == NULL) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+
+    stream.next_in   = (Bytef*) data;
+    stream.avail_in  = len;
+    stream.next_out  = (Bytef*) out;
+    stream.avail_out = cap;
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        free(out);
+        return NULL;
+    }
+
+    *out_len = stream.total_out;
+
+    deflateEnd(&stream);
+    return out;
+}
+
+/*
+ * Adds a record for a body already in the pack, with its rendered OK
+ * header.
+ *
+ * Returns:
+ * - The index of the record.
+ * - PACK_NONE if an allocation failed.
+ */
+static
+uint32_t add_record(Packer *packer, off_t body_off, size_t body_len, uint64_t path_off, const char *type,
+                    struct stat *f_stats, const char *etag, int encoding, int vary) {
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_http_date(f_stats->st_mtim.tv_sec, last_modified);
+
+    const char *extra = encoding == ENC_GZIP ? encoding_headers[ENC_GZIP] :
+                        vary                 ? encoding_headers[ENC_IDENTITY] : "";
+
+    const char *caching = "";
+
+    if (packer->policy != NULL) {
+        char path[PATH_MAX + 1];
+        snprintf(path, sizeof(path), "/%s", packer->strings.data + path_off);
+
+        caching = cache_rule_fields(cache_policy_match(packer->policy, path));
+    }
+
+    // The date slot is left empty, it is filled in as the header is sent
+    const char *format = response_messages[OK];
+
+    int n = snprintf(NULL, 0, format, "", (long) body_len, type, last_modified, etag, extra, caching);
+    char *header = n < 0 ? NULL : malloc(n + 1);
+
+    if (header == NULL || reserve((void**) &packer->records, packer->n_records, sizeof(PackRecord)) < 0) {
+        free(header);
+        return PACK_NONE;
+    }
+
+    snprintf(header, n + 1, format, "", (long) body_len, type, last_modified, etag, extra, caching);
+
+    // Taken before the header is copied out and freed
+    char *date         = strstr(header, "Date: ");
+    size_t date_offset = date == NULL ? 0 : (size_t) (date - header) + strlen("Date: ");
+
+    long long header_off = buffer_add(&packer->strings, header, n + 1);
+    long long etag_off   = buffer_add(&packer->strings, etag, strlen(etag) + 1);
+
+    free(header);
+
+    if (header_off < 0 || etag_off < 0)
+        return PACK_NONE;
+
+    PackRecord *record = &packer->records[packer->n_records];
+    memset(record, 0, sizeof(PackRecord));
+
+    record->body_off    = body_off;
+    record->body_len    = body_len;
+    record->header_off  = header_off;
+    record->header_len  = n;
+    record->date_offset = date_offset;
+    record->path_off    = path_off;
+    record->etag_off    = etag_off;
+    record->mtime       = f_stats->st_mtim.tv_sec;
+    record->encoding    = encoding;
+    record->vary        = vary;
+    record->gzip        = PACK_NONE;
+
+    return packer->n_records++;
+}
+
+/*
+ * Adds a path of the pack, pointing at a record.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int add_key(Packer *packer, const char *path, uint32_t record) {
+    if (reserve((void**) &packer->keys, packer->n_keys, sizeof(Key)) < 0)
+        return -1;
+
+    long long off = buffer_add(&packer->strings, path, strlen(path) + 1);
+
+    if (off < 0)
+        return -1;
+
+    Key *key = &packer->keys[packer->n_keys++];
+
+    key->key_off = off;
+    key->key_len = strlen(path);
+    key->record  = record;
+    key->hash    = pack_hash(path, key->key_len);
+
+    return 0;
+}
+
+/*
+ * Packs a single file: its body, a gzip copy if the file is compressible
+ * and the copy is smaller, their records and its path. An index.html also
+ * gets the path of its directory.
+ *
+ * Params:
+ * - Packer *packer       : The pack being built.
+ * - int dir_fd           : The directory of the file.
+ * - const char *name     : The name of the file.
+ * - const char *rel      : The root relative path of the file.
+ * - const char *dir_rel  : The root relative path of its directory.
+ * - struct stat *f_stats : The metadata of the file.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int pack_file(Packer *packer, int dir_fd, const char *name, const char *rel, const char *dir_rel,
+              struct stat *f_stats) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd < 0) {
+        fprintf(stderr, "Skipping %s : %s\n", rel, strerror(errno));
+        return 0;
+    }
+
+    size_t len = f_stats->st_size;
+    char *data = malloc(len + 1);
+
+    if (data == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pread(fd, data + done, len - done, done);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            fprintf(stderr, "Skipping %s : short read\n", rel);
+            close(fd);
+            free(data);
+            return 0;
+        }
+
+        done += n;
+    }
+
+    close(fd);
+
+    const char *type = mime_type(rel);
+    int vary         = mime_compressible(type);
+
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long) xxh64(data, len, 0));
+
+    long long path_off = buffer_add(&packer->strings, rel, strlen(rel) + 1);
+    off_t body_off     = write_body(packer, data, len);
+
+    if (path_off < 0 || body_off < 0) {
+        free(data);
+        return -1;
+    }
+
+    uint32_t record = add_record(packer, body_off, len, path_off, type, f_stats, etag, ENC_IDENTITY, vary);
+
+    if (record == PACK_NONE) {
+        free(data);
+        return -1;
+    }
+
+    size_t gz_len;
+    char *gz = vary && len >= GZIP_MIN_SZ ? gzip_body(data, len, &gz_len) : NULL;
+
+    free(data);
+
+    if (gz != NULL && gz_len < len) {
+        // A different representation of the same file
+        char gz_etag[64];
+        snprintf(gz_etag, sizeof(gz_etag), "%.*s-gzip\"", (int) strlen(etag) - 1, etag);
+
+        off_t gz_off = write_body(packer, gz, gz_len);
+        uint32_t gz_record = gz_off < 0 ? PACK_NONE :
+                             add_record(packer, gz_off, gz_len, path_off, type, f_stats, gz_etag, ENC_GZIP, vary);
+
+        if (gz_record == PACK_NONE) {
+            free(gz);
+            return -1;
+        }
+
+        packer->records[record].gzip = gz_record;
+        packer->n_gzip++;
+    }
+
+    free(gz);
+
+    if (add_key(packer, rel, record) < 0)
+        return -1;
+
+    if (!strcmp(name, "index.html") && add_key(packer, dir_rel, record) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Packs every regular file beneath a directory.
+ *
+ * Params:
+ * - Packer *packer : The pack being built.
+ * - int dir_fd     : The open directory.
+ * - const char *rel : Its root relative path ("." for the root).
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int pack_dir(Packer *packer, int dir_fd, const char *rel) {
+    DIR *dir = fdopendir(dir_fd);
+
+    if (dir == NULL) {
+        close(dir_fd);
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *entry;
+
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        char child[PATH_MAX];
+        int n = !strcmp(rel, ".") ? snprintf(child, PATH_MAX, "%s", entry->d_name) :
+                                    snprintf(child, PATH_MAX, "%s/%s", rel, entry->d_name);
+
+        struct stat f_stats;
+
+        if (n >= PATH_MAX || fstatat(dirfd(dir), entry->d_name, &f_stats, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        if (S_ISDIR(f_stats.st_mode)) {
+            int child_fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            if (child_fd < 0) {
+                fprintf(stderr, "Skipping %s : %s\n", child, strerror(errno));
+                continue;
+            }
+
+            ret = pack_dir(packer, child_fd, child);
+        }
+        else if (S_ISREG(f_stats.st_mode))
+            ret = pack_file(packer, dirfd(dir), entry->d_name, child, rel, &f_stats);
+    }
+
+    closedir(dir);
+
+    return ret;
+}
+
+// Smallest prime of at least n.
+static
+uint32_t next_prime(uint32_t n) {
+    for (;; ++n) {
+        int prime = n >= 2;
+
+        for (uint32_t d = 2; prime && (uint64_t) d * d <= n; ++d)
+            prime = n % d != 0;
+
+        if (prime)
+            return n;
+    }
+}
+
+// Orders buckets by decreasing number of paths.
+static uint32_t *bucket_sizes;
+
+static
+int by_size(const void *a, const void *b) {
+    uint32_t size_a = bucket_sizes[*(const uint32_t*) a];
+    uint32_t size_b = bucket_sizes[*(const uint32_t*) b];
+
+    return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+/*
+ * Builds the perfect hash of the paths: every bucket gets the smallest
+ * displacement that places all its paths in free slots, the largest
+ * buckets first.
+ *
+ * Params:
+ * - Packer *packer         : The pack being built, with all its paths.
+ * - uint32_t n_slots       : The size of the slot table, a prime.
+ * - uint32_t n_buckets     : The number of buckets.
+ * - PackSlot *slots        : The slot table to fill.
+ * - uint32_t *displacements : The displacement of every bucket.
+ *
+ * Returns:
+ * -  0 if every path was placed.
+ * - -1 if some bucket could not be placed, and the table must grow.
+ */
+static
+int build_hash(Packer *packer, uint32_t n_slots, uint32_t n_buckets, PackSlot *slots, uint32_t *displacements) {
+    uint32_t *sizes  = calloc(n_buckets, sizeof(uint32_t));
+    uint32_t *starts = calloc(n_buckets + 1, sizeof(uint32_t));
+    uint32_t *order  = malloc(n_buckets * sizeof(uint32_t));
+    uint32_t *keys   = malloc((packer->n_keys + 1) * sizeof(uint32_t));
+    uint32_t *placed = malloc((packer->n_keys + 1) * sizeof(uint32_t));
+
+    int ret = -1;
+
+    if (sizes == NULL || starts == NULL || order == NULL || keys == NULL || placed == NULL)
+        goto EXIT;
+
+    // Group the paths by bucket
+    for (uint32_t i = 0; i < packer->n_keys; ++i)
+        sizes[pack_bucket(packer->keys[i].hash, n_buckets)]++;
+
+    for (uint32_t b = 0; b < n_buckets; ++b)
+        starts[b + 1] = starts[b] + sizes[b];
+
+    uint32_t *fill = order;
+    memcpy(fill, starts, n_buckets * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < packer->n_keys; ++i)
+        keys[fill[pack_bucket(packer->keys[i].hash, n_buckets)]++] = i;
+
+    for (uint32_t b = 0; b < n_buckets; ++b)
+        order[b] = b;
+
+    bucket_sizes = sizes;
+    qsort(order, n_buckets, sizeof(uint32_t), by_size);
+
+    for (uint32_t s = 0; s < n_slots; ++s)
+        slots[s].record = PACK_NONE;
+
+    for (uint32_t i = 0; i < n_buckets; ++i) {
+        uint32_t b = order[i];
+
+        displacements[b] = 0;
+
+        if (sizes[b] == 0)
+            continue;
+
+        uint32_t d;
+
+        for (d = 0; d < MAX_DISPLACEMENT; ++d) {
+            uint32_t n_placed = 0;
+
+            for (uint32_t k = starts[b]; k < starts[b + 1]; ++k) {
+                uint32_t s = pack_slot(packer->keys[keys[k]].hash, d, n_slots);
+
+                int taken = slots[s].record != PACK_NONE;
+
+                for (uint32_t p = 0; !taken && p < n_placed; ++p)
+                    taken = placed[p] == s;
+
+                if (taken)
+                    break;
+
+                placed[n_placed++] = s;
+            }
+
+            if (n_placed == sizes[b])
+                break;
+        }
+
+        if (d == MAX_DISPLACEMENT)
+            goto EXIT;
+
+        displacements[b] = d;
+
+        for (uint32_t k = starts[b], p = 0; k < starts[b + 1]; ++k, ++p) {
+            Key *key = &packer->keys[keys[k]];
+
+            slots[placed[p]].key_off = key->key_off;
+            slots[placed[p]].key_len = key->key_len;
+            slots[placed[p]].record  = key->record;
+        }
+    }
+
+    ret = 0;
+
+EXIT:
+    free(sizes);
+    free(starts);
+    free(order);
+    free(keys);
+    free(placed);
+
+    return ret;
+}
+
+/*
+ * Writes a section of the pack at the current offset, aligned to 8 bytes.
+ *
+ * Returns:
+ * - The offset of the section.
+ * - -1 if it could not be written.
+ */
+static
+off_t write_section(Packer *packer, const void *data, size_t len) {
+    off_t offset = align_up(packer->offset, 8);
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pwrite(packer->out, (const char*) data + done, len - done, offset + done);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        done += n;
+    }
+
+    packer->offset = offset + len;
+
+    return offset;
+}
+
+/*
+ * Writes the strings, records and perfect hash after the bodies, then the
+ * header in the first page.
+ *
+ * Returns:
+ * -  0 if no error occurred.
+ * - -1 otherwise.
+ */
+static
+int write_index(Packer *packer) {
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version   = PACK_VERSION;
+    header.n_records = packer->n_records;
+    header.n_keys    = packer->n_keys;
+    header.n_buckets = packer->n_keys / KEYS_PER_BUCKET + 1;
+    header.n_slots   = next_prime(packer->n_keys + packer->n_keys / 4 + 2);
+
+    PackSlot *slots         = NULL;
+    uint32_t *displacements = NULL;
+
+    for (;;) {
+        free(slots);
+        free(displacements);
+
+        slots         = malloc(header.n_slots * sizeof(PackSlot));
+        displacements = malloc(header.n_buckets * sizeof(uint32_t));
+
+        if (slots == NULL || displacements == NULL)
+            goto FAIL;
+
+        if (build_hash(packer, header.n_slots, header.n_buckets, slots, displacements) == 0)
+            break;
+
+        header.n_slots = next_prime(header.n_slots + header.n_slots / 2);
+    }
+
+    off_t strings_off = write_section(packer, packer->strings.data, packer->strings.len);
+
+    if (strings_off < 0)
+        goto FAIL;
+
+    // Strings were placed relative to the start of their section
+    for (uint32_t i = 0; i < packer->n_records; ++i) {
+        packer->records[i].header_off += strings_off;
+        packer->records[i].path_off   += strings_off;
+        packer->records[i].etag_off   += strings_off;
+    }
+
+    for (uint32_t s = 0; s < header.n_slots; ++s)
+        if (slots[s].record != PACK_NONE)
+            slots[s].key_off += strings_off;
+
+    header.strings_off = strings_off;
+    header.records_off = write_section(packer, packer->records, packer->n_records * sizeof(PackRecord));
+    header.slots_off   = write_section(packer, slots, header.n_slots * sizeof(PackSlot));
+    header.buckets_off = write_section(packer, displacements, header.n_buckets * sizeof(uint32_t));
+    header.size        = packer->offset;
+
+    if ((off_t) header.records_off < 0 || (off_t) header.slots_off < 0 || (off_t) header.buckets_off < 0)
+        goto FAIL;
+
+    if (pwrite(packer->out, &header, sizeof(header), 0) != sizeof(header))
+        goto FAIL;
+
+    free(slots);
+    free(displacements);
+    return 0;
+
+FAIL:
+    free(slots);
+    free(displacements);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3 && argc != 4) {
+        print_usage();
+        return 1;
+    }
+
+    char *root_dir  = argv[1];
+    char *pack_path = argv[2];
+
+    int root_fd = open(root_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (root_fd < 0) {
+        fprintf(stderr, "Error : could not open %s : %s\n", root_dir, strerror(errno));
+        return 1;
+    }
+
+    // The pack is built next to its final path, and renamed over it
+    char *tmp_path = malloc(strlen(pack_path) + sizeof(".XXXXXX"));
+
+    if (tmp_path == NULL) {
+        close(root_fd);
+        return 1;
+    }
+
+    sprintf(tmp_path, "%s.XXXXXX", pack_path);
+
+    Packer packer;
+    memset(&packer, 0, sizeof(packer));
+
+    if (argc == 4 && (packer.policy = cache_policy_load(argv[3])) == NULL) {
+        close(root_fd);
+        free(tmp_path);
+        return 1;
+    }
+
+    packer.out    = mkstemp(tmp_path);
+    packer.offset = PACK_ALIGN;
+
+    if (packer.out < 0) {
+        fprintf(stderr, "Error : could not create %s : %s\n", tmp_path, strerror(errno));
+        close(root_fd);
+        free(tmp_path);
+        return 1;
+    }
+
+    int ret = 1;
+
+    if (pack_dir(&packer, root_fd, ".") < 0) {
+        fprintf(stderr, "Error : failed to pack %s : %s\n", root_dir, strerror(errno));
+        goto EXIT;
+    }
+
+    if (write_index(&packer) < 0 || fchmod(packer.out, 0644) < 0 || fsync(packer.out) < 0) {
+        fprintf(stderr, "Error : failed to write the pack : %s\n", strerror(errno));
+        goto EXIT;
+    }
+
+    if (rename(tmp_path, pack_path) < 0) {
+        fprintf(stderr, "Error : could not rename the pack to %s : %s\n", pack_path, strerror(errno));
+        goto EXIT;
+    }
+
+    fprintf(stderr, "Packed %u files (%llu gzip copies), %u paths, %llu body bytes, %lld bytes total\n",
+            packer.n_records - (uint32_t) packer.n_gzip, packer.n_gzip, packer.n_keys,
+            packer.body_bytes, (long long) packer.offset);
+
+    ret = 0;
+
+EXIT:
+    if (ret != 0)
+        unlink(tmp_path);
+
+    close(packer.out);
+    free(tmp_path);
+    free(packer.strings.data);
+    free(packer.records);
+    free(packer.keys);
+    cache_policy_free(packer.policy);
+
+    return ret;
+}